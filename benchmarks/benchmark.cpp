@@ -0,0 +1,390 @@
+#include <QtTest/QtTest>
+#include <QTemporaryDir>
+
+#include <cstdarg>
+
+#include "bintreenodereader.h"
+#include "bintreenodewriter.h"
+#include "protocoldictionary.h"
+#include "stanzacapture.h"
+#include "stanzareplay.h"
+#include "connection.h"
+#include "keystream.h"
+#include "rc4.h"
+#include "util/qthmacsha1.h"
+
+/**
+    Micro-benchmarks of the stanza codec, the stream crypto and the
+    dispatch of each stanza type.
+
+    Stanzas are the ones the servers send most.  Setting LIBQTWA_BENCH_CAPTURE
+    to a StanzaCapture file adds rows that decode and dispatch its inbound
+    frames, to measure against real traffic.
+*/
+
+class Benchmark : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+
+    void decodeTree_data();
+    void decodeTree();
+
+    void encodeTree_data();
+    void encodeTree();
+
+    void rc4Cipher_data();
+    void rc4Cipher();
+
+    void hmacSha1_data();
+    void hmacSha1();
+
+    void keyStreamEncode_data();
+    void keyStreamEncode();
+
+    void keyStreamDecode_data();
+    void keyStreamDecode();
+
+    void dispatch_data();
+    void dispatch();
+
+private:
+    QTemporaryDir tempDir;
+    QStringList dictionary;
+    QList<QPair<QString, ProtocolTreeNode> > stanzas;
+    QHash<QString, QByteArray> frames;
+    QList<StanzaCapture::Record> captured;
+
+    void addStanza(const QString &name, const QString &tag, const AttributeList &attrs,
+                   const QList<ProtocolTreeNode> &children = QList<ProtocolTreeNode>(),
+                   const QByteArray &data = QByteArray());
+    void addStanzaRows();
+    void addSizeRows();
+    QByteArray payload(int size);
+};
+
+static AttributeList attributes(const char *first, ...)
+{
+    AttributeList attrs;
+
+    va_list args;
+    va_start(args, first);
+    for (const char *key = first; key; key = va_arg(args, const char *))
+        attrs.insert(key, va_arg(args, const char *));
+    va_end(args);
+
+    return attrs;
+}
+
+void Benchmark::addStanza(const QString &name, const QString &tag, const AttributeList &attrs,
+                          const QList<ProtocolTreeNode> &children, const QByteArray &data)
+{
+    ProtocolTreeNode node(tag, data);
+    node.setAttributes(attrs);
+    foreach (const ProtocolTreeNode &child, children)
+        node.addChild(child);
+
+    stanzas.append(qMakePair(name, node));
+}
+
+void Benchmark::initTestCase()
+{
+    QVERIFY(tempDir.isValid());
+
+    dictionary = ProtocolDictionary::tokens();
+
+    QList<ProtocolTreeNode> children;
+
+    children << ProtocolTreeNode("body", QByteArray("Are we still on for tonight?"));
+    addStanza("message", "message",
+              attributes("from", "15550000001@s.whatsapp.net", "id", "1419110000-12",
+                         "type", "text", "t", "1419110000", "notify", "Alice", (char *) 0),
+              children);
+    addStanza("message offline", "message",
+              attributes("from", "15550000002@s.whatsapp.net", "id", "1419110000-13",
+                         "type", "text", "t", "1419110000", "notify", "Bob",
+                         "offline", "1", (char *) 0),
+              children);
+
+    addStanza("receipt", "receipt",
+              attributes("from", "15550000001@s.whatsapp.net", "id", "1419110000-1",
+                         "t", "1419110005", (char *) 0));
+
+    addStanza("ack", "ack",
+              attributes("class", "message", "from", "15550000001@s.whatsapp.net",
+                         "id", "1419110000-1", "t", "1419110001", (char *) 0));
+
+    addStanza("presence", "presence",
+              attributes("from", "15550000003@s.whatsapp.net", "type", "available", (char *) 0));
+
+    children.clear();
+    children << ProtocolTreeNode("composing");
+    addStanza("chatstate", "chatstate",
+              attributes("from", "15550000004@s.whatsapp.net", (char *) 0), children);
+
+    addStanza("iq ping", "iq",
+              attributes("from", "s.whatsapp.net", "id", "ping_1", "type", "get",
+                         "xmlns", "urn:xmpp:ping", (char *) 0));
+
+    children.clear();
+    for (int i = 0; i < 5; i++)
+    {
+        ProtocolTreeNode group("group");
+        group.setAttributes(attributes("id", qPrintable(QString("1555000000%1-1400000000").arg(i)),
+                                       "owner", "15550000001@s.whatsapp.net",
+                                       "subject", "Weekend plans", "creation", "1400000000",
+                                       "s_o", "15550000001@s.whatsapp.net", "s_t", "1400000000",
+                                       (char *) 0));
+        children << group;
+    }
+    addStanza("iq groups", "iq",
+              attributes("from", "g.us", "id", "get_groups_1", "type", "result", (char *) 0),
+              children);
+
+    children.clear();
+    ProtocolTreeNode set("set");
+    set.setAttributes(attributes("id", "1419110100", "author", "15550000005@s.whatsapp.net", (char *) 0));
+    children << set;
+    addStanza("notification", "notification",
+              attributes("from", "15550000005@s.whatsapp.net", "id", "2001", "type", "picture",
+                         "t", "1419110100", "notify", "Eve", (char *) 0),
+              children);
+
+    // Encode them once with a capture attached to get the plain frames
+    QString fileName = tempDir.path() + "/stanzas.cap";
+    StanzaCapture capture;
+    QVERIFY(capture.open(fileName));
+
+    BinTreeNodeWriter writer(0, dictionary);
+    writer.setCapture(&capture);
+    for (int i = 0; i < stanzas.size(); i++)
+        writer.write(stanzas[i].second);
+    writer.setCapture(0);
+    capture.close();
+
+    QList<StanzaCapture::Record> records;
+    QVERIFY(StanzaCapture::load(fileName, records));
+    QCOMPARE(records.size(), stanzas.size());
+    for (int i = 0; i < stanzas.size(); i++)
+        frames.insert(stanzas.at(i).first, records.at(i).payload);
+
+    QByteArray captureFile = qgetenv("LIBQTWA_BENCH_CAPTURE");
+    if (!captureFile.isEmpty())
+    {
+        QVERIFY(StanzaCapture::load(QString::fromLocal8Bit(captureFile), captured));
+        for (int i = captured.size() - 1; i >= 0; i--)
+            if (captured.at(i).direction != StanzaCapture::Inbound)
+                captured.removeAt(i);
+    }
+}
+
+void Benchmark::addStanzaRows()
+{
+    QTest::addColumn<QString>("name");
+
+    for (int i = 0; i < stanzas.size(); i++)
+        QTest::newRow(qPrintable(stanzas.at(i).first)) << stanzas.at(i).first;
+}
+
+void Benchmark::addSizeRows()
+{
+    QTest::addColumn<int>("size");
+
+    QTest::newRow("64") << 64;
+    QTest::newRow("1024") << 1024;
+    QTest::newRow("16384") << 16384;
+}
+
+QByteArray Benchmark::payload(int size)
+{
+    QByteArray data(size, 0);
+    for (int i = 0; i < size; i++)
+        data[i] = (char) (i * 31);
+    return data;
+}
+
+/*
+ * Codec
+ */
+
+void Benchmark::decodeTree_data()
+{
+    addStanzaRows();
+    if (!captured.isEmpty())
+        QTest::newRow("capture") << QString("capture");
+}
+
+void Benchmark::decodeTree()
+{
+    QFETCH(QString, name);
+
+    BinTreeNodeReader reader(0, dictionary);
+
+    if (name == "capture")
+    {
+        QBENCHMARK {
+            foreach (const StanzaCapture::Record &record, captured)
+            {
+                ProtocolTreeNode node;
+                reader.decodeTree(record.payload, node);
+            }
+        }
+        return;
+    }
+
+    QByteArray frame = frames.value(name);
+
+    ProtocolTreeNode node;
+    QVERIFY(reader.decodeTree(frame, node));
+
+    QBENCHMARK {
+        ProtocolTreeNode node;
+        reader.decodeTree(frame, node);
+    }
+}
+
+void Benchmark::encodeTree_data()
+{
+    addStanzaRows();
+}
+
+void Benchmark::encodeTree()
+{
+    QFETCH(QString, name);
+
+    ProtocolTreeNode node;
+    for (int i = 0; i < stanzas.size(); i++)
+        if (stanzas.at(i).first == name)
+            node = stanzas.at(i).second;
+
+    // Offline writer: frames are encoded and dropped
+    BinTreeNodeWriter writer(0, dictionary);
+
+    QBENCHMARK {
+        writer.write(node);
+    }
+}
+
+/*
+ * Crypto
+ */
+
+void Benchmark::rc4Cipher_data()
+{
+    addSizeRows();
+}
+
+void Benchmark::rc4Cipher()
+{
+    QFETCH(int, size);
+
+    RC4 rc4(payload(20), 0x300);
+    QByteArray data = payload(size);
+
+    QBENCHMARK {
+        rc4.Cipher(data.data(), 0, data.size());
+    }
+}
+
+void Benchmark::hmacSha1_data()
+{
+    addSizeRows();
+}
+
+void Benchmark::hmacSha1()
+{
+    QFETCH(int, size);
+
+    QtHmacSha1 mac(payload(20));
+    QByteArray data = payload(size);
+
+    QBENCHMARK {
+        mac.hmacSha1(data);
+    }
+}
+
+void Benchmark::keyStreamEncode_data()
+{
+    addSizeRows();
+}
+
+void Benchmark::keyStreamEncode()
+{
+    QFETCH(int, size);
+
+    KeyStream key(payload(20), payload(20));
+    QByteArray frame = payload(size + 4);
+
+    QBENCHMARK {
+        key.encodeMessage(frame, size, 0, size);
+    }
+}
+
+void Benchmark::keyStreamDecode_data()
+{
+    addSizeRows();
+}
+
+void Benchmark::keyStreamDecode()
+{
+    QFETCH(int, size);
+
+    // The sequence numbers stop matching after the first iteration, which
+    // doesn't change the work done: the MAC is always computed in full.
+    KeyStream key(payload(20), payload(20));
+    QByteArray frame = payload(size + 4);
+
+    QBENCHMARK {
+        QByteArray buffer = frame;
+        key.decodeMessage(buffer, 0, 0, size);
+    }
+}
+
+/*
+ * Dispatch
+ */
+
+void Benchmark::dispatch_data()
+{
+    decodeTree_data();
+}
+
+void Benchmark::dispatch()
+{
+    QFETCH(QString, name);
+
+    DataCounters counters;
+
+    Connection connection("127.0.0.1", 5222, "s.whatsapp.net", "Android-2.11.453-443",
+                          "15550000000", "Benchmark", payload(20), QByteArray(),
+                          "en", "US", "000", "000", "2.11.453", &counters);
+    connection.initOffline();
+
+    // A capture with the frame(s) to replay
+    QString fileName = tempDir.path() + "/dispatch.cap";
+    StanzaCapture capture;
+    QVERIFY(capture.open(fileName));
+    if (name == "capture")
+    {
+        foreach (const StanzaCapture::Record &record, captured)
+            capture.record(StanzaCapture::Inbound, record.payload);
+    }
+    else
+        capture.record(StanzaCapture::Inbound, frames.value(name));
+    capture.close();
+
+    // Decoded here so that only the dispatch is timed
+    StanzaReplay replay(&connection);
+    replay.setPredecoded(true);
+    QVERIFY(replay.load(fileName));
+
+    QBENCHMARK {
+        replay.start();
+    }
+}
+
+QTEST_GUILESS_MAIN(Benchmark)
+
+#include "benchmark.moc"
@@ -0,0 +1,29 @@
+# Codec, crypto and dispatch micro-benchmarks.
+# Links against the library built in the parent directory, or in the one
+# given to qmake for a shadow build:
+#
+#   qmake LIBQTWA_LIBDIR=/path/to/libqtwa-build
+#
+#   ./libqtwa-benchmark -csv          machine-readable results
+#   ./libqtwa-benchmark -o out.xml,xml
+
+TEMPLATE = app
+TARGET = libqtwa-benchmark
+
+QT += network testlib
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+INCLUDEPATH += $$PWD/../src
+
+isEmpty(LIBQTWA_LIBDIR): LIBQTWA_LIBDIR = $$OUT_PWD/..
+
+!exists($$LIBQTWA_LIBDIR/liblibqtwa.*) {
+    warning("libqtwa not found in $$LIBQTWA_LIBDIR, build it first or set LIBQTWA_LIBDIR")
+}
+
+LIBS += -L$$LIBQTWA_LIBDIR -llibqtwa
+QMAKE_RPATHDIR += $$LIBQTWA_LIBDIR
+
+SOURCES += \
+    benchmark.cpp
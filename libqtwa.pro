@@ -2,6 +2,14 @@ TEMPLATE = lib
 
 DEFINES += LIBQTWA_LIBRARY
 
+CONFIG += c++11
+
+# USDT tracepoints (src/util/tracepoints.h), needs <sys/sdt.h>:
+#   qmake CONFIG+=usdt
+usdt {
+    DEFINES += LIBQTWA_USDT
+}
+
 SOURCES += \
     src/util/utilities.cpp \
     src/util/messagedigest.cpp \
@@ -34,7 +42,29 @@ SOURCES += \
     src/httprequestv2.cpp \
     src/mediadownload.cpp \
     src/util/datacounters.cpp \
-    src/maprequest.cpp
+    src/maprequest.cpp \
+    src/connectionpipeline.cpp \
+    src/protocoltrace.cpp \
+    src/stanzacapture.cpp \
+    src/stanzareplay.cpp \
+    src/protocoldictionary.cpp \
+    src/pendingjournal.cpp \
+    src/messageidallocator.cpp \
+    src/util/metricsregistry.cpp \
+    src/util/latencyhistogram.cpp \
+    src/util/stageaccounting.cpp \
+    src/util/tracepoints.cpp \
+    src/multipartdevice.cpp \
+    src/httpconnectionpool.cpp \
+    src/httpresponseparser.cpp \
+    src/rangeddownload.cpp \
+    src/mediacache.cpp \
+    src/thumbnailservice.cpp \
+    src/util/tokenbucket.cpp \
+    src/transferscheduler.cpp \
+    src/mediafilewriter.cpp \
+    src/util/base64.cpp \
+    src/mappreviewcache.cpp
 
 HEADERS += \
     src/util/utilities.h \
@@ -69,4 +99,27 @@ HEADERS += \
     src/mediadownload.h \
     src/util/datacounters.h \
     src/maprequest.h \
-    src/libqtwa.h
+    src/libqtwa.h \
+    src/connectionpipeline.h \
+    src/util/spscqueue.h \
+    src/protocoltrace.h \
+    src/stanzacapture.h \
+    src/stanzareplay.h \
+    src/protocoldictionary.h \
+    src/pendingjournal.h \
+    src/messageidallocator.h \
+    src/util/metricsregistry.h \
+    src/util/latencyhistogram.h \
+    src/util/stageaccounting.h \
+    src/util/tracepoints.h \
+    src/multipartdevice.h \
+    src/httpconnectionpool.h \
+    src/httpresponseparser.h \
+    src/rangeddownload.h \
+    src/mediacache.h \
+    src/thumbnailservice.h \
+    src/util/tokenbucket.h \
+    src/transferscheduler.h \
+    src/mediafilewriter.h \
+    src/util/base64.h \
+    src/mappreviewcache.h
@@ -28,10 +28,16 @@
 
 #include <QGuiApplication>
 #include <QDataStream>
+#include <QThread>
 
 #include "ioexception.h"
 #include "attributelist.h"
 #include "util/utilities.h"
+#include "protocoltrace.h"
+#include "stanzacapture.h"
+#include "util/stageaccounting.h"
+#include "util/latencyhistogram.h"
+#include "util/tracepoints.h"
 #include "bintreenodereader.h"
 
 #define READ_TIMEOUT 30000
@@ -41,41 +47,157 @@ BinTreeNodeReader::BinTreeNodeReader(QTcpSocket *socket, QStringList& dictionary
 {
     this->dictionary = dictionary;
     this->socket = socket;
+    this->capture = 0;
+    this->readArrival = 0;
+    this->stages.storeRelease(0);
 }
 
 int BinTreeNodeReader::getOneToplevelStream()
 {
-    qint32 bufferSize = readInt24();
-    qint8 flags = (bufferSize & 0xff0000) >> 20;
-    bufferSize &= 0xffff;
+    qint32 bufferSize;
+    qint8 flags;
 
-    fillBuffer(bufferSize);
+    {
+        StageTimer timer(stages.loadAcquire(), StageAccounting::Read);
+
+        bufferSize = readInt24();
+        flags = (bufferSize & 0xff0000) >> 20;
+        bufferSize &= 0xffff;
+
+        fillBuffer(bufferSize);
+    }
+
+    // Taken before decrypting so that a capture keeps the network timing
+    readArrival = LatencyHistogram::now();
+
+    WA_PROBE2(frame_received, bufferSize, flags);
 
     //qDebug() << "[[ " + readBuffer.toHex();
-    decodeStream(flags, 0, bufferSize);
+    decodeStream(flags);
 
     return bufferSize + 3;
 }
 
-void BinTreeNodeReader::decodeStream(qint8 flags, qint32 offset, qint32 length)
+void BinTreeNodeReader::decodeStream(qint8 flags)
 {
-    if ((flags & 8) != 0)
-    {
-        if (length < 4) {
-            qDebug() << "Invalid length 0x" << QString::number(length,16);
-            harakiri();
-        }
+    if (!decryptFrame(flags, readBuffer))
+        harakiri();
+}
 
-        offset += 4;
-        length -= 4;
-        if (!inputKey->decodeMessage(readBuffer, offset-4, offset, length)) {
-            qDebug() << "error decoding message";
-            harakiri();
-        }
+/**
+    Reads a whole frame from the socket without blocking.
+
+    @param frame    Buffer to be filled with the (still encrypted) frame payload.
+    @param flags    Frame flags from the frame header.
+    @return         true if a complete frame was available.
+*/
+bool BinTreeNodeReader::nextFrame(QByteArray& frame, qint8& flags)
+{
+    if (socket->bytesAvailable() < 3)
+        return false;
+
+    StageTimer timer(stages.loadAcquire(), StageAccounting::Read);
+
+    QByteArray header = socket->peek(3);
+    if (header.size() < 3)
+        return false;
+
+    qint32 frameSize = (((quint8)header.at(0)) << 16) + (((quint8)header.at(1)) << 8) +
+                       ((quint8)header.at(2));
+    flags = (frameSize & 0xff0000) >> 20;
+    frameSize &= 0xffff;
+
+    if (socket->bytesAvailable() < frameSize + 3)
+        return false;
+
+    socket->read(3);
+    frame = socket->read(frameSize);
+
+    WA_PROBE2(frame_received, frameSize, flags);
+
+    return true;
+}
+
+/**
+    Verifies and decrypts a frame in place.
+
+    This method doesn't touch the socket so it can be called from any thread,
+    as long as frames are decrypted in the order they were received.
+
+    @param flags    Frame flags from the frame header.
+    @param buffer   Frame payload.  On success it contains the plain payload.
+    @return         false if the frame is invalid or the MAC doesn't match.
+*/
+bool BinTreeNodeReader::decryptFrame(qint8 flags, QByteArray& buffer)
+{
+    if ((flags & 8) == 0)
+        return true;
+
+    StageTimer timer(stages.loadAcquire(), StageAccounting::Decrypt);
+
+    int length = buffer.size();
+    if (length < 4) {
+        qDebug() << "Invalid length 0x" << QString::number(length,16);
+        WA_PROBE1(decrypt_failed, length);
+        return false;
+    }
+
+    length -= 4;
+    if (!inputKey->decodeMessage(buffer, 0, 4, length)) {
+        qDebug() << "error decoding message";
+        WA_PROBE1(decrypt_failed, length + 4);
+        return false;
+    }
+
+    buffer = buffer.right(length);
+    //qDebug() << "<< " + buffer.toHex();
+
+    return true;
+}
 
-        readBuffer = readBuffer.right(length);
-        //qDebug() << "<< " + readBuffer.toHex();
+/**
+    Decodes a tree from a plain frame payload.
+
+    @param buffer   Plain frame payload.
+    @param node     ProtocolTreeNode to be filled.
+    @param arrival  LatencyHistogram::now() when the frame was read from the
+                    socket, or 0 for now.  Used as the capture time.
+    @return         true if a node was decoded.
+*/
+bool BinTreeNodeReader::decodeTree(const QByteArray& buffer, ProtocolTreeNode& node,
+                                   qint64 arrival)
+{
+    StageTimer timer(stages.loadAcquire(), StageAccounting::Decode);
+
+    if (capture)
+        capture->record(StanzaCapture::Inbound, buffer, arrival);
+
+    WA_TRACE_STANZA(ProtocolTrace::Stanza, ProtocolTrace::Debug, "read", buffer);
+
+    bool result = parseTree(buffer, node);
+
+    if (WA_PROBE_ENABLED(stanza_decoded))
+    {
+        QByteArray tag = node.getTag().toUtf8();
+        WA_PROBE2(stanza_decoded, tag.constData(), buffer.size());
     }
+
+    return result;
+}
+
+/**
+    Decodes a tree from a plain frame payload without capturing, tracing
+    or accounting it.  ProtocolTrace uses it to format its records.
+
+    @param buffer   Plain frame payload.
+    @param node     ProtocolTreeNode to be filled.
+    @return         true if a node was decoded.
+*/
+bool BinTreeNodeReader::parseTree(const QByteArray& buffer, ProtocolTreeNode& node)
+{
+    QDataStream in(buffer);
+
+    return nextTreeInternal(node, in);
 }
 
 int BinTreeNodeReader::readStreamStart()
@@ -106,10 +228,8 @@ bool BinTreeNodeReader::nextTree(ProtocolTreeNode& node)
     bool result;
 
     node.setSize(getOneToplevelStream());
-    QDataStream in(readBuffer);
 
-    result = nextTreeInternal(node, in);
-    qDebug() << "read" << node.toString();
+    result = decodeTree(readBuffer, node, readArrival);
     return result;
 }
 
@@ -441,8 +561,34 @@ void BinTreeNodeReader::setInputKey(KeyStream *inputKey)
     this->inputKey = inputKey;
 }
 
+void BinTreeNodeReader::setCapture(StanzaCapture *capture)
+{
+    this->capture = capture;
+}
+
+void BinTreeNodeReader::setStageAccounting(StageAccounting *stages)
+{
+    this->stages.storeRelease(stages);
+}
+
 void BinTreeNodeReader::harakiri()
 {
+    // Offline readers (StanzaReplay) have no socket
+    if (!socket)
+    {
+        readBuffer.clear();
+        Q_EMIT socketBroken();
+        return;
+    }
+
+    // The pipelined mode decodes in another thread; the socket
+    // can only be touched from the thread it lives in.
+    if (QThread::currentThread() != socket->thread())
+    {
+        QMetaObject::invokeMethod(this, "harakiri", Qt::QueuedConnection);
+        return;
+    }
+
     QObject::disconnect(socket, 0, 0, 0);
     socket->disconnectFromHost();
     readBuffer.clear();
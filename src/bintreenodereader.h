@@ -32,12 +32,16 @@
 #include <QDataStream>
 #include <QStringList>
 #include <QTcpSocket>
+#include <QAtomicPointer>
 
 #include "keystream.h"
 #include "attributelist.h"
 #include "protocoltreenode.h"
 #include "protocoltreenodelist.h"
 
+class StanzaCapture;
+class StageAccounting;
+
 class BinTreeNodeReader : public QObject
 {
     Q_OBJECT
@@ -53,19 +57,38 @@ public:
     bool nextTree(ProtocolTreeNode& node);
     QString lastStanza();
 
+    // Non blocking reader methods used by the pipelined mode
+    bool nextFrame(QByteArray& frame, qint8& flags);
+    bool decryptFrame(qint8 flags, QByteArray& buffer);
+    bool decodeTree(const QByteArray& buffer, ProtocolTreeNode& node,
+                    qint64 arrival = 0);
+    bool parseTree(const QByteArray& buffer, ProtocolTreeNode& node);
+
     void setInputKey(KeyStream *inputKey);
 
+    // Records every plain frame read
+    void setCapture(StanzaCapture *capture);
+
+    // Charges the time spent reading, decrypting and decoding
+    void setStageAccounting(StageAccounting *stages);
+
+private slots:
+    void harakiri();
+
 private:
     QStringList dictionary;
     QTcpSocket *socket;
     QByteArray readBuffer;
     KeyStream *inputKey;
-
-    void harakiri();
+    StanzaCapture *capture;
+    // When the frame in readBuffer was read from the socket
+    qint64 readArrival;
+    // Set from the socket thread, read by the pipeline threads
+    QAtomicPointer<StageAccounting> stages;
 
     // Reader methods
     int getOneToplevelStream();
-    void decodeStream(qint8 flags, qint32 offset, qint32 length);
+    void decodeStream(qint8 flags);
     bool nextTreeInternal(ProtocolTreeNode& node, QDataStream &in);
     quint32 readListSize(qint32 token, QDataStream& in);
     void readList(qint32 token,ProtocolTreeNode& node,QDataStream& in);
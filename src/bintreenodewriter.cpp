@@ -29,8 +29,16 @@
 #include "util/utilities.h"
 #include "attributelistiterator.h"
 #include "protocoltreenodelistiterator.h"
+#include "connectionpipeline.h"
+#include "protocoltreenode.h"
+#include "protocoltrace.h"
+#include "stanzacapture.h"
+#include "util/stageaccounting.h"
+#include "util/tracepoints.h"
 #include "bintreenodewriter.h"
 
+#include <QThread>
+
 
 BinTreeNodeWriter::BinTreeNodeWriter(QTcpSocket *socket, QStringList& dictionary,
                                      QObject *parent) : QObject(parent)
@@ -41,6 +49,9 @@ BinTreeNodeWriter::BinTreeNodeWriter(QTcpSocket *socket, QStringList& dictionary
 
     this->socket = socket;
     this->crypto = false;
+    this->pipeline = 0;
+    this->capture = 0;
+    this->stages.storeRelease(0);
 }
 
 /*
@@ -53,18 +64,41 @@ int BinTreeNodeWriter::streamStart(QString& domain, QString& resource)
 {
     //qDebug() << domain;
     //qDebug() << resource;
-    startBuffer();
-    QDataStream out(&writeBuffer,QIODevice::WriteOnly);
-
-    writeInt8(0x57, out);
-    writeInt8(0x41, out);
-    writeInt8(1, out);
-    writeInt8(4, out);
-
     AttributeList streamOpenAttributes;
     streamOpenAttributes.insert("resource",resource);
     streamOpenAttributes.insert("to",domain);
 
+    return writeStreamStart(streamOpenAttributes, true);
+}
+
+/**
+    Writes the stream start a server sends back.  It goes without the
+    protocol header.
+
+    @param from     Server domain.
+    @return         number of bytes written.
+*/
+int BinTreeNodeWriter::streamStartReply(const QString& from)
+{
+    AttributeList streamOpenAttributes;
+    streamOpenAttributes.insert("from",from);
+
+    return writeStreamStart(streamOpenAttributes, false);
+}
+
+int BinTreeNodeWriter::writeStreamStart(AttributeList& streamOpenAttributes, bool header)
+{
+    startBuffer();
+    QDataStream out(&writeBuffer,QIODevice::WriteOnly);
+
+    if (header)
+    {
+        writeInt8(0x57, out);
+        writeInt8(0x41, out);
+        writeInt8(1, out);
+        writeInt8(4, out);
+    }
+
     writeDummyHeader(out);
     writeListStart(streamOpenAttributes.size() * 2 + 1, out);
     writeInt8(1, out);
@@ -90,10 +124,22 @@ void BinTreeNodeWriter::writeDummyHeader(QDataStream& out)
 void BinTreeNodeWriter::startBuffer()
 {
     writeBuffer.clear();
+    bufferedFrames.clear();
     dataBegin = 0;
 }
 
 void BinTreeNodeWriter::processBuffer()
+{
+    writeFrameHeader();
+
+    if (crypto)
+        encryptFrame(writeBuffer, dataBegin);
+
+    if (WA_PROBE_ENABLED(frame_written))
+        bufferedFrames.append(writeBuffer.size() - dataBegin);
+}
+
+void BinTreeNodeWriter::writeFrameHeader()
 {
     int num = 0;
 
@@ -110,34 +156,52 @@ void BinTreeNodeWriter::processBuffer()
         harakiri();
     }
 
-    if (crypto)
-    {
-        int length = ((int) num3) - 4;
-        outputKey->encodeMessage(writeBuffer,(dataBegin + 3) + length, dataBegin + 3, length);
-    }
-
     char *buffer = writeBuffer.data();
     buffer[dataBegin] = ((num << 4) | (num3 & 0xff0000) >> 0x10);
     buffer[dataBegin+1] = ((num3 & 0xff00) >> 8);
     buffer[dataBegin+2] = (num3 & 0xff);
 }
 
+void BinTreeNodeWriter::encryptFrame(QByteArray& buffer, qint32 dataBegin)
+{
+    StageTimer timer(stages.loadAcquire(), StageAccounting::Encrypt);
+
+    int length = buffer.size() - 3 - dataBegin - 4;
+    outputKey->encodeMessage(buffer, (dataBegin + 3) + length, dataBegin + 3, length);
+}
+
 
 void BinTreeNodeWriter::flushBuffer(bool flushNetwork)
 {
     processBuffer();
+    sendBuffer(flushNetwork);
+}
+
+void BinTreeNodeWriter::sendBuffer(bool flushNetwork)
+{
+    StageTimer timer(stages.loadAcquire(), StageAccounting::Write);
 
     // Write buffer
     //qDebug() << ">> " + QString(writeBuffer.toHex());
-    if ((socket->write(writeBuffer)) == -1) {
-        qDebug() << "error writing buffer";
-        harakiri();
-    }
+    // Offline writers (StanzaReplay) just drop the frames
+    if (socket)
+    {
+        if ((socket->write(writeBuffer)) == -1) {
+            qDebug() << "error writing buffer";
+            harakiri();
+        }
+        else
+        {
+            for (int i = 0; i < bufferedFrames.size(); i++)
+                WA_PROBE2(frame_written, bufferedFrames.at(i), crypto ? 1 : 0);
+        }
 
-    if (flushNetwork)
-        socket->flush();
+        if (flushNetwork)
+            socket->flush();
+    }
 
     writeBuffer.clear();
+    bufferedFrames.clear();
 }
 
 /*
@@ -168,27 +232,108 @@ int BinTreeNodeWriter::write(ProtocolTreeNode& node, bool needsFlush)
 {
     writeMutex.lock();
     startBuffer();
-    QDataStream out(&writeBuffer,QIODevice::WriteOnly);
+
+    int bytes = encodeFrame(node);
+
+    if (pipeline && crypto)
+    {
+        // Encryption and the socket write are done by the pipeline stages.
+        // Frames are queued with the mutex held so they keep the order
+        // the key stream sequence expects.
+        writeFrameHeader();
+        pipeline->queueOutbound(writeBuffer, dataBegin, needsFlush);
+        writeBuffer.clear();
+    }
+    else
+        flushBuffer(needsFlush);
+
+    writeMutex.unlock();
+
+    return bytes;
+}
+
+/*
+ * Writes several nodes, one frame each, with a single socket write and
+ * flush.  Returns the total bytes written; the bytes of each node are
+ * appended to sizes if it's not null.
+ */
+int BinTreeNodeWriter::writeBatch(QList<ProtocolTreeNode>& nodes, QList<int> *sizes)
+{
+    if (nodes.isEmpty())
+        return 0;
+
+    writeMutex.lock();
+    startBuffer();
+
+    int bytes = 0;
+    bool pipelined = pipeline && crypto;
+
+    for (int i = 0; i < nodes.size(); i++)
+    {
+        if (pipelined)
+            startBuffer();
+
+        int frameBytes = encodeFrame(nodes[i]);
+        bytes += frameBytes;
+        if (sizes)
+            sizes->append(frameBytes);
+
+        if (pipelined)
+        {
+            writeFrameHeader();
+            pipeline->queueOutbound(writeBuffer, dataBegin, i == nodes.size() - 1);
+            writeBuffer.clear();
+        }
+        else
+            processBuffer();
+    }
+
+    if (!pipelined)
+        sendBuffer(true);
+
+    writeMutex.unlock();
+
+    return bytes;
+}
+
+/*
+ * Appends the frame of a node to the write buffer, without the frame
+ * header values.  Returns the bytes of the frame.
+ */
+int BinTreeNodeWriter::encodeFrame(ProtocolTreeNode& node)
+{
+    StageTimer timer(stages.loadAcquire(), StageAccounting::Encode);
+
+    QDataStream out(&writeBuffer, QIODevice::WriteOnly | QIODevice::Append);
 
     writeDummyHeader(out);
 
+    bool traced = false;
+
     if (node.getTag() == "")
     {
-        qDebug() << "<noop>";
+        WA_TRACE(ProtocolTrace::Stanza, ProtocolTrace::Verbose, "write <noop>", 0);
         writeInt8(0, out);
     }
     else
     {
-        qDebug() << "write" << node.toString();
+        traced = WA_TRACE_ON(ProtocolTrace::Stanza, ProtocolTrace::Debug);
         writeInternal(node, out);
     }
 
-    int bytes = writeBuffer.size();
+    // The payload is only copied out of the write buffer when it's kept
+    if (capture || traced)
+    {
+        QByteArray payload = writeBuffer.mid(dataBegin + 3);
 
-    flushBuffer(needsFlush);
-    writeMutex.unlock();
+        if (traced)
+            ProtocolTrace::recordStanza(ProtocolTrace::Stanza, ProtocolTrace::Debug,
+                                        "write", payload);
+        if (capture)
+            capture->record(StanzaCapture::Outbound, payload);
+    }
 
-    return bytes;
+    return writeBuffer.size() - dataBegin;
 }
 
 void BinTreeNodeWriter::writeInternal(ProtocolTreeNode& node, QDataStream& out)
@@ -348,8 +493,40 @@ void BinTreeNodeWriter::setCrypto(bool crypto)
     this->crypto = crypto;
 }
 
+void BinTreeNodeWriter::setPipeline(ConnectionPipeline *pipeline)
+{
+    writeMutex.lock();
+    this->pipeline = pipeline;
+    writeMutex.unlock();
+}
+
+void BinTreeNodeWriter::setCapture(StanzaCapture *capture)
+{
+    writeMutex.lock();
+    this->capture = capture;
+    writeMutex.unlock();
+}
+
+void BinTreeNodeWriter::setStageAccounting(StageAccounting *stages)
+{
+    this->stages.storeRelease(stages);
+}
+
 void BinTreeNodeWriter::harakiri()
 {
+    if (!socket)
+    {
+        writeBuffer.clear();
+        Q_EMIT socketBroken();
+        return;
+    }
+
+    if (QThread::currentThread() != socket->thread())
+    {
+        QMetaObject::invokeMethod(this, "harakiri", Qt::QueuedConnection);
+        return;
+    }
+
     QObject::disconnect(socket, 0, 0, 0);
     socket->disconnectFromHost();
     writeBuffer.clear();
@@ -32,6 +32,7 @@
 #include <QDataStream>
 #include <QStringList>
 #include <QTcpSocket>
+#include <QAtomicPointer>
 #include <QMutex>
 
 #include "keystream.h"
@@ -39,6 +40,10 @@
 #include "attributelist.h"
 #include "protocoltreenodelist.h"
 
+class ConnectionPipeline;
+class StanzaCapture;
+class StageAccounting;
+
 class BinTreeNodeWriter : public QObject
 {
     Q_OBJECT
@@ -50,10 +55,27 @@ public:
 
     // Writer methods
     int write(ProtocolTreeNode& node, bool needsFlush = true);
+    int writeBatch(QList<ProtocolTreeNode>& nodes, QList<int> *sizes = 0);
     int streamStart(QString& domain, QString& resource);
 
+    // Server side stream start, used by the local test server
+    int streamStartReply(const QString& from);
+
     void setOutputKey(KeyStream *outputKey);
     void setCrypto(bool crypto);
+    void setPipeline(ConnectionPipeline *pipeline);
+
+    // Records every frame written, before encryption
+    void setCapture(StanzaCapture *capture);
+
+    // Charges the time spent encoding, encrypting and writing
+    void setStageAccounting(StageAccounting *stages);
+
+    // Encrypts a frame built by this writer. Used by the pipelined mode.
+    void encryptFrame(QByteArray& buffer, qint32 dataBegin);
+
+private slots:
+    void harakiri();
 
 private:
     QHash<QString, int> tokenMap;
@@ -63,13 +85,23 @@ private:
     qint32 dataBegin;
     KeyStream *outputKey;
     bool crypto;
+    ConnectionPipeline *pipeline;
+    StanzaCapture *capture;
+    // Set from the socket thread, read by the pipeline threads
+    QAtomicPointer<StageAccounting> stages;
 
-    void harakiri();
+    // Sizes of the frames in writeBuffer, for the frame_written probe
+    // once they reach the socket
+    QList<int> bufferedFrames;
 
     // Writer methods
+    int writeStreamStart(AttributeList& streamOpenAttributes, bool header);
     void startBuffer();
     void processBuffer();
+    void writeFrameHeader();
     void flushBuffer(bool flushNetwork);
+    void sendBuffer(bool flushNetwork);
+    int encodeFrame(ProtocolTreeNode& node);
     void realWrite8(quint8 c);
     void realWrite16(quint16 data);
     void writeDummyHeader(QDataStream& out);
@@ -39,11 +39,89 @@
 #include "util/utilities.h"
 #include "util/datetimeutilities.h"
 #include "protocoltreenodelistiterator.h"
+#include "connectionpipeline.h"
+#include "protocoldictionary.h"
+#include "stanzacapture.h"
+#include "pendingjournal.h"
+#include "util/metricsregistry.h"
+#include "util/latencyhistogram.h"
+#include "util/stageaccounting.h"
+#include "util/tracepoints.h"
+#include "httpconnectionpool.h"
+#include "mediacache.h"
 
 #include "globalconstants.h"
 
 #include "connection.h"
 
+// Journaled messages resent per event loop iteration after login
+#define JOURNAL_RESEND_BATCH    50
+
+// Labels of the traffic metrics, in DataCounters::CounterType order
+static const char *counterNames[TOTAL_COUNTERS] = {
+    "messages", "message_bytes", "image_bytes", "video_bytes", "audio_bytes",
+    "profile_bytes", "sync_bytes", "protocol_bytes", "total_bytes"
+};
+
+// Stanzas counted by type, anything else is counted as "other"
+static const char *stanzaTypes[] = {
+    "iq", "message", "presence", "receipt", "ack", "notification",
+    "chatstate", "ib", "stream:error", "success", "other"
+};
+
+#define TOTAL_STANZA_TYPES  (int) (sizeof(stanzaTypes) / sizeof(stanzaTypes[0]))
+
+// Sent messages and requests without an answer are forgotten after an hour
+#define LATENCY_TRACK_TIMEOUT   (3600LL * 1000000)
+
+/**
+    Latencies of all the connections.
+*/
+struct LatencyAggregate
+{
+    LatencyHistogram types[Connection::TotalLatencyTypes];
+
+    // <iq> round trip by request type
+    QMutex mutex;
+    QMap<QString, LatencyHistogram *> iq;
+
+    ~LatencyAggregate()
+    {
+        qDeleteAll(iq);
+    }
+};
+
+Q_GLOBAL_STATIC(LatencyAggregate, aggregateLatency)
+
+/**
+    Fires the dispatch_start and dispatch_end tracepoints around the
+    dispatch of a node.
+*/
+class DispatchProbe
+{
+public:
+    DispatchProbe(const QString &tag) : tag(tag)
+    {
+        if (WA_PROBE_ENABLED(dispatch_start))
+        {
+            QByteArray name = tag.toUtf8();
+            WA_PROBE1(dispatch_start, name.constData());
+        }
+    }
+
+    ~DispatchProbe()
+    {
+        if (WA_PROBE_ENABLED(dispatch_end))
+        {
+            QByteArray name = tag.toUtf8();
+            WA_PROBE1(dispatch_end, name.constData());
+        }
+    }
+
+private:
+    const QString &tag;
+};
+
 FunStore Connection::store;
 
 /**
@@ -63,7 +141,7 @@ Connection::Connection(const QString &server, int port, const QString &domain, c
                        const QByteArray &challenge, const QString &language, const QString &country,
                        const QString &mcc, const QString &mnc, const QString version,
                        DataCounters *counters, QObject *parent)
-    : QObject(parent)
+    : QObject(parent), stages(user)
 {
 
     /*
@@ -71,11 +149,7 @@ Connection::Connection(const QString &server, int port, const QString &domain, c
      * so the packets are really tiny
      */
 
-    dictionary
-        << NULL << NULL << NULL
-        << "account" << "ack" << "action" << "active" << "add" << "after" << "all" << "allow" << "apple" << "auth" << "author" << "available" << "bad-protocol" << "bad-request" << "before" << "body" << "broadcast" << "cancel" << "category" << "challenge" << "chat" << "clean" << "code" << "composing" << "config" << "contacts" << "count" << "create" << "creation" << "debug" << "default" << "delete" << "delivery" << "delta" << "deny" << "digest" << "dirty" << "duplicate" << "elapsed" << "enable" << "encoding" << "error" << "event" << "expiration" << "expired" << "fail" << "failure" << "false" << "favorites" << "feature" << "features" << "feature-not-implemented" << "field" << "first" << "free" << "from" << "g.us" << "get" << "google" << "group" << "groups" << "http://etherx.jabber.org/streams" << "http://jabber.org/protocol/chatstates" << "ib" << "id" << "image" << "img" << "index" << "internal-server-error" << "ip" << "iq" << "item-not-found" << "item" << "jabber:iq:last" << "jabber:iq:privacy" << "jabber:x:event" << "jid" << "kind" << "last" << "leave" << "list" << "max" << "mechanism" << "media" << "message_acks" << "message" << "method" << "microsoft" << "missing" << "modify" << "mute" << "name" << "nokia" << "none" << "not-acceptable" << "not-allowed" << "not-authorized" << "notification" << "notify" << "off" << "offline" << "order" << "owner" << "owning" << "p_o" << "p_t" << "paid" << "participant" << "participants" << "participating" << "paused" << "picture" << "pin" << "ping" << "platform" << "port" << "presence" << "preview" << "probe" << "prop" << "props" << "query" << "raw" << "read" << "reason" << "receipt" << "received" << "relay" << "remote-server-timeout" << "remove" << "request" << "required" << "resource-constraint" << "resource" << "response" << "result" << "retry" << "rim" << "s_o" << "s_t" << "s.us" << "s.whatsapp.net" << "seconds" << "server-error" << "server" << "service-unavailable" << "set" << "show" << "silent" << "stat" << "status" << "stream:error" << "stream:features" << "subject" << "subscribe" << "success" << "sync" << "t" << "text" << "timeout" << "timestamp" << "to" << "true" << "type" << "unavailable" << "unsubscribe" << "uri" << "url" << "urn:ietf:params:xml:ns:xmpp-sasl" << "urn:ietf:params:xml:ns:xmpp-stanzas" << "urn:ietf:params:xml:ns:xmpp-streams" << "urn:xmpp:ping" << "urn:xmpp:receipts" << "urn:xmpp:whatsapp:account" << "urn:xmpp:whatsapp:dirty" << "urn:xmpp:whatsapp:mms" << "urn:xmpp:whatsapp:push" << "urn:xmpp:whatsapp" << "user" << "user-not-found" << "value" << "version" << "w:g" << "w:p:r" << "w:p" << "w:profile:picture" << "w" << "wait" << "WAUTH-2" << "x" << "xmlns:stream" << "xmlns" << "1" << "chatstate" << "crypto" << "enc" << "class" << "off_cnt" << "w:g2" << "promote" << "demote" << "creator"
-        << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL << NULL
-        << "Bell.caf" << "Boing.caf" << "Glass.caf" << "Harp.caf" << "TimePassing.caf" << "Tri-tone.caf" << "Xylophone.caf" << "background" << "backoff" << "chunked" << "context" << "full" << "in" << "interactive" << "out" << "registration" <<  "sid" << "urn:xmpp:whatsapp:sync" << "flt" << "s16" << "u8" << "adpcm" << "amrnb" << "amrwb" << "mp3" << "pcm" << "qcelp" << "wma" << "h263" << "h264" << "jpeg" << "mpeg4" <<  "wmv" << "audio/3gpp" << "audio/aac" << "audio/amr" << "audio/mp4" << "audio/mpeg" << "audio/ogg" << "audio/qcelp" << "audio/wav" << "audio/webm" << "audio/x-caf" << "audio/x-ms-wma" << "image/gif" << "image/jpeg" << "image/png" << "video/3gpp" <<  "video/avi" << "video/mp4" << "video/mpeg" << "video/quicktime" << "video/x-flv" << "video/x-ms-asf" << "302" << "400" << "401" << "402" << "403" << "404" << "405" << "406" << "407" << "409" <<  "500" << "501" << "503" << "504" << "abitrate" << "acodec" << "app_uptime" << "asampfmt" << "asampfreq" << "audio" << "bb_db" << "clear" << "conflict" << "conn_no_nna" << "cost" << "currency" <<  "duration" << "extend" << "file" << "fps" << "g_notify" << "g_sound" << "gcm" << "google_play" << "hash" << "height" << "invalid" << "jid-malformed" << "latitude" << "lc" << "lg" << "live" <<  "location" << "log" << "longitude" << "max_groups" << "max_participants" << "max_subject" << "mimetype" << "mode" << "napi_version" << "normalize" << "orighash" << "origin" << "passive" << "password" << "played" << "policy-violation" <<  "pop_mean_time" << "pop_plus_minus" << "price" << "pricing" << "redeem" << "Replaced by new connection" << "resume" << "signature" << "size" << "sound" << "source" << "system-shutdown" << "username" << "vbitrate" << "vcard" << "vcodec" <<  "video" << "width" << "xml-not-well-formed" << "checkmarks" << "image_max_edge" << "image_max_kbytes" << "image_quality" << "ka" << "ka_grow" << "ka_shrink" << "newmedia" << "library" << "caption" << "forward" << "c0" << "c1" <<  "c2" << "c3" << "clock_skew" << "cts" << "k0" << "k1" << "login_rtt" << "m_id" << "nna_msg_rtt" << "nna_no_off_count" << "nna_offline_ratio" << "nna_push_rtt" << "no_nna_con_count" << "off_msg_rtt" << "on_msg_rtt" << "stat_name" <<  "sts" << "suspect_conn" << "lists" << "self" << "qr" << "web" << "w:b" << "recipient" << "w:stats" << "forbidden" << "aurora.m4r" << "bamboo.m4r" << "chord.m4r" << "circles.m4r" << "complete.m4r" << "hello.m4r" <<  "input.m4r" << "keys.m4r" << "note.m4r" << "popcorn.m4r" << "pulse.m4r" << "synth.m4r" << "filehash";
+    dictionary = ProtocolDictionary::tokens();
 
     this->user = user;
     this->domain = domain;
@@ -94,9 +168,19 @@ Connection::Connection(const QString &server, int port, const QString &domain, c
     this->mnc = mnc;
     while (this->mnc.length() < 3)
         this->mnc.prepend("0");
-    this->iqid = 0;
     this->counters = counters;
     this->myJid = user + "@" + JID_DOMAIN;
+    this->pipelined = false;
+    this->pipeline = 0;
+    this->capture = 0;
+    this->journal = 0;
+    this->socket = 0;
+    this->in = 0;
+    this->out = 0;
+    this->frameArrival = 0;
+    this->stageAccounting.storeRelease(0);
+
+    registerMetrics();
 }
 
 void Connection::init()
@@ -104,6 +188,10 @@ void Connection::init()
     this->socket = new QTcpSocket(this);
     this->out = new BinTreeNodeWriter(socket, dictionary, this);
     this->in = new BinTreeNodeReader(socket, dictionary, this);
+    out->setCapture(capture);
+    in->setCapture(capture);
+    out->setStageAccounting(stageAccounting.loadAcquire());
+    in->setStageAccounting(stageAccounting.loadAcquire());
 
     QObject::connect(this->out, SIGNAL(socketBroken()), this, SLOT(finalCleanup()));
     QObject::connect(this->in, SIGNAL(socketBroken()), this, SLOT(finalCleanup()));
@@ -141,6 +229,111 @@ Connection::~Connection()
         @todo Clean disconnect to the WhatsApp servers
      */
     qDebug() << "Connection destructor";
+
+    // Stage threads must be gone before this object is
+    if (pipeline)
+        pipeline->stop();
+
+    if (journal)
+        store.removeListener(journal);
+
+    unregisterMetrics();
+}
+
+/**
+    Enables or disables the pipelined mode.
+
+    In pipelined mode frame decryption, tree decoding and dispatch (including
+    signal emission) run in their own threads, and outbound frames are encrypted
+    in another one.  It takes effect on the next successful login.
+
+    @param enabled      true to enable the pipelined mode.
+*/
+void Connection::setPipelined(bool enabled)
+{
+    pipelined = enabled;
+}
+
+/**
+    Records the plain frames sent and received by this connection.
+
+    Frames are recorded after decryption and before encryption, so the
+    capture holds message contents in clear.
+
+    @param capture      Open StanzaCapture, or 0 to stop recording.
+                        It must outlive the connection.
+*/
+void Connection::setCapture(StanzaCapture *capture)
+{
+    this->capture = capture;
+
+    if (in)
+        in->setCapture(capture);
+    if (out)
+        out->setCapture(capture);
+}
+
+/**
+    Sets up the connection to dispatch nodes that don't come from the
+    network, like the ones of a StanzaReplay.
+
+    Nodes written in reply are encoded and dropped.  It must be called
+    instead of init().
+*/
+void Connection::initOffline()
+{
+    this->out = new BinTreeNodeWriter(0, dictionary, this);
+    this->in = new BinTreeNodeReader(0, dictionary, this);
+    out->setStageAccounting(stageAccounting.loadAcquire());
+    in->setStageAccounting(stageAccounting.loadAcquire());
+}
+
+/**
+    Enables or disables the accounting of the CPU and wall time spent in
+    each stage of this connection.  It costs a few clock reads per stage,
+    so it's disabled by default.
+
+    @param enabled      true to start accounting.
+*/
+void Connection::setStageAccounting(bool enabled)
+{
+    // Read by the pipeline threads while they run
+    stageAccounting.storeRelease(enabled ? &stages : 0);
+
+    if (in)
+        in->setStageAccounting(enabled ? &stages : 0);
+    if (out)
+        out->setStageAccounting(enabled ? &stages : 0);
+}
+
+/**
+    Returns the cumulative stage times of this connection.
+*/
+const StageAccounting *Connection::getStageAccounting() const
+{
+    return &stages;
+}
+
+/**
+    Sets the journal where sent messages are kept until they are acked.
+
+    Messages still pending in the journal are resent in batches after
+    every successful login, so they survive restarts and reconnections.
+
+    @param journal      Open PendingJournal, or 0 to disable it.
+                        It must outlive the connection.
+*/
+void Connection::setJournal(PendingJournal *journal)
+{
+    if (this->journal)
+        store.removeListener(this->journal);
+
+    this->journal = journal;
+
+    // Messages the store gives up on are acked, or they would be resent
+    // after every restart
+    if (journal)
+        store.addListener(journal);
 }
 
 /**
@@ -155,18 +348,22 @@ void Connection::login(const QByteArray &nextChallenge)
 
     int outBytes, inBytes;
     outBytes = inBytes = 0;
+    WA_PROBE1(login_phase, WA_LOGIN_STREAM_START);
     outBytes = out->streamStart(domain,resource);
     outBytes += sendFeatures();
     outBytes += sendAuth();
+    WA_PROBE1(login_phase, WA_LOGIN_AUTH_SENT);
     inBytes += in->readStreamStart();
     QByteArray challengeData = readFeaturesUntilChallengeOrSuccess(&inBytes);
     if (challengeData.size() > 0)
     {
+        WA_PROBE1(login_phase, WA_LOGIN_CHALLENGE);
         outBytes += sendResponse(challengeData);
+        WA_PROBE1(login_phase, WA_LOGIN_RESPONSE_SENT);
         inBytes += readSuccess();
     }
 
-    counters->increaseCounter(DataCounters::ProtocolBytes, inBytes, outBytes);
+    increaseCounter(DataCounters::ProtocolBytes, inBytes, outBytes);
 }
 
 /**
@@ -177,9 +374,9 @@ void Connection::login(const QByteArray &nextChallenge)
 bool Connection::read()
 {
     lastActivity = QDateTime::currentDateTime().toTime_t();
+    frameArrival = LatencyHistogram::now();
 
     ProtocolTreeNode node;
-    bool pictureReceived = false;
 
     bool haveTree = false;
 
@@ -199,518 +396,589 @@ bool Connection::read()
 
     if (haveTree)
     {
-        lastTreeRead = QDateTime::currentMSecsSinceEpoch();
-        QString tag = node.getTag();
+        processNode(node);
+        return true;
+    }
 
-        if (tag == "stream:error") {
-            ProtocolTreeNodeListIterator i(node.getChildren());
-            while (i.hasNext())
-            {
-                ProtocolTreeNode child = i.next().value();
-                qDebug() << child.getTag();
-                if (child.getTag() == "text") {
-                    qDebug() << child.getDataString();
-                }
+    return false;
+}
+
+/**
+    Dispatches a node already read from the stream.
+
+    In pipelined mode this is called from the decode stage thread.
+
+    @param node     ProtocolTreeNode object read.
+*/
+void Connection::processNode(ProtocolTreeNode &node)
+{
+    StageTimer timer(stageAccounting.loadAcquire(), StageAccounting::Dispatch);
+
+    bool pictureReceived = false;
+
+    lastTreeRead = QDateTime::currentMSecsSinceEpoch();
+    QString tag = node.getTag();
+    DispatchProbe probe(tag);
+
+    countStanza(tag);
+
+    if (tag == "stream:error") {
+        ProtocolTreeNodeListIterator i(node.getChildren());
+        while (i.hasNext())
+        {
+            ProtocolTreeNode child = i.next().value();
+            qDebug() << child.getTag();
+            if (child.getTag() == "text") {
+                qDebug() << child.getDataString();
             }
-            Q_EMIT streamError();
         }
-        if (tag == "iq")
+        Q_EMIT streamError();
+    }
+    if (tag == "iq")
+    {
+        QString type = node.getAttributeValue("type");
+        QString id = node.getAttributeValue("id");
+        QString from = node.getAttributeValue("from");
+        QString xmlns = node.getAttributeValue("xmlns");
+
+        if (type == "result" || type == "error")
+            trackIqAnswered(id);
+
+        if (xmlns == "urn:xmpp:ping")
         {
-            QString type = node.getAttributeValue("type");
-            QString id = node.getAttributeValue("id");
-            QString from = node.getAttributeValue("from");
-            QString xmlns = node.getAttributeValue("xmlns");
+            sendPong(id);
+        }
+        else if (type == "result")
+        {
+            QStringList groupParticipants;
 
-            if (xmlns == "urn:xmpp:ping")
-            {
-                sendPong(id);
-            }
-            else if (type == "result")
+            ProtocolTreeNodeListIterator i(node.getChildren());
+            while (i.hasNext())
             {
-                QStringList groupParticipants;
-
-                ProtocolTreeNodeListIterator i(node.getChildren());
-                while (i.hasNext())
+                ProtocolTreeNode child = i.next().value();
+                if (child.getTag() == "group")
                 {
-                    ProtocolTreeNode child = i.next().value();
-                    if (child.getTag() == "group")
-                    {
-                        QString childId = child.getAttributeValue("id");
-                        if (id.startsWith("create_group_")) {
-                            QString jid = childId + "@g.us";
-                            Q_EMIT groupCreated(jid);
-                            sendGetGroupInfo(jid);
-                        }
-                        else /*if (id.startsWith("get_groups_"))*/ {
-                            QString subject = child.getAttributeValue("subject");
-                            QString author = child.getAttributeValue("owner");
-                            QString creation = child.getAttributeValue("creation");
-                            QString subject_o = child.getAttributeValue("s_o");
-                            QString subject_t = child.getAttributeValue("s_t");
-                            emit groupInfoFromList(id, childId + "@g.us", author,
-                                                   subject, creation,
-                                                   subject_o, subject_t);
-                        }
+                    QString childId = child.getAttributeValue("id");
+                    if (id.startsWith("create_group_")) {
+                        QString jid = childId + "@g.us";
+                        Q_EMIT groupCreated(jid);
+                        sendGetGroupInfo(jid);
+                    }
+                    else /*if (id.startsWith("get_groups_"))*/ {
+                        QString subject = child.getAttributeValue("subject");
+                        QString author = child.getAttributeValue("owner");
+                        QString creation = child.getAttributeValue("creation");
+                        QString subject_o = child.getAttributeValue("s_o");
+                        QString subject_t = child.getAttributeValue("s_t");
+                        StageTimer emitTimer(stageAccounting.loadAcquire(), StageAccounting::Emit);
+                        emit groupInfoFromList(id, childId + "@g.us", author,
+                                               subject, creation,
+                                               subject_o, subject_t);
                     }
+                }
 
-                    else if (child.getTag() == "leave")
+                else if (child.getTag() == "leave")
+                {
+                    ProtocolTreeNodeListIterator j(child.getChildren());
+                    while (j.hasNext())
                     {
-                        ProtocolTreeNodeListIterator j(child.getChildren());
-                        while (j.hasNext())
+                        ProtocolTreeNode group = j.next().value();
+                        if (group.getTag() == "group")
                         {
-                            ProtocolTreeNode group = j.next().value();
-                            if (group.getTag() == "group")
+                            QString groupId = group.getAttributeValue("id");
                             {
-                                QString groupId = group.getAttributeValue("id");
+                                StageTimer emitTimer(stageAccounting.loadAcquire(), StageAccounting::Emit);
                                 emit groupLeft(groupId);
-                                qDebug() << "Leaving group:" << groupId;
                             }
+                            qDebug() << "Leaving group:" << groupId;
                         }
                     }
+                }
 
-                    else if (child.getTag() == "query")
+                else if (child.getTag() == "query")
+                {
+                    if (id.startsWith("last_"))
                     {
-                        if (id.startsWith("last_"))
-                        {
-                            qint64 timestamp = QDateTime::currentDateTime().toTime_t() -
-                                    child.getAttributeValue("seconds").toLongLong();
+                        qint64 timestamp = QDateTime::currentDateTime().toTime_t() -
+                                child.getAttributeValue("seconds").toLongLong();
 
-                            emit lastOnline(from, timestamp);
-                        }
-                        else if (id.startsWith("privacylist_")) {
-                            QStringList privacyList;
-                            ProtocolTreeNodeListIterator j(child.getChildren());
-                            while (j.hasNext())
-                            {
-                                ProtocolTreeNode group = j.next().value();
-                                if (group.getTag() == "list") {
-                                    ProtocolTreeNodeListIterator k(group.getChildren());
-                                    while (k.hasNext())
+                        StageTimer emitTimer(stageAccounting.loadAcquire(), StageAccounting::Emit);
+                        emit lastOnline(from, timestamp);
+                    }
+                    else if (id.startsWith("privacylist_")) {
+                        QStringList privacyList;
+                        ProtocolTreeNodeListIterator j(child.getChildren());
+                        while (j.hasNext())
+                        {
+                            ProtocolTreeNode group = j.next().value();
+                            if (group.getTag() == "list") {
+                                ProtocolTreeNodeListIterator k(group.getChildren());
+                                while (k.hasNext())
+                                {
+                                    ProtocolTreeNode list = k.next().value();
+                                    if (list.getTag() == "item")
                                     {
-                                        ProtocolTreeNode list = k.next().value();
-                                        if (list.getTag() == "item")
-                                        {
-                                            QString jid = list.getAttributeValue("value");
-                                            if (!jid.isEmpty()) {
-                                                privacyList.append(jid);
-                                            }
+                                        QString jid = list.getAttributeValue("value");
+                                        if (!jid.isEmpty()) {
+                                            privacyList.append(jid);
                                         }
                                     }
                                 }
                             }
-                            if (!privacyList.isEmpty()) {
-                                emit privacyListReceived(privacyList);
-                            }
                         }
-                        else {
-                            qDebug() << "xmlns type:" << xmlns;
+                        if (!privacyList.isEmpty()) {
+                            StageTimer emitTimer(stageAccounting.loadAcquire(), StageAccounting::Emit);
+                            emit privacyListReceived(privacyList);
                         }
                     }
+                    else {
+                        qDebug() << "xmlns type:" << xmlns;
+                    }
+                }
 
-                    else if (child.getTag() == "privacy" && id.startsWith("privacysettings_")) {
-                        QVariantMap values;
-                        ProtocolTreeNodeListIterator j(child.getChildren());
-                        while (j.hasNext())
-                        {
-                            ProtocolTreeNode group = j.next().value();
-                            if (group.getTag() == "category") {
-                                values[group.getAttributeValue("name")] = group.getAttributeValue("value");
-                            }
+                else if (child.getTag() == "privacy" && id.startsWith("privacysettings_")) {
+                    QVariantMap values;
+                    ProtocolTreeNodeListIterator j(child.getChildren());
+                    while (j.hasNext())
+                    {
+                        ProtocolTreeNode group = j.next().value();
+                        if (group.getTag() == "category") {
+                            values[group.getAttributeValue("name")] = group.getAttributeValue("value");
                         }
-                        Q_EMIT privacySettingsReceived(values);
                     }
+                    Q_EMIT privacySettingsReceived(values);
+                }
 
-                    else if (child.getTag() == "media" || child.getTag() == "duplicate")
-                    {
-                        Key k(JID_DOMAIN,true,id);
-                        FMessage message = store.value(k);
+                else if (child.getTag() == "media" || child.getTag() == "duplicate")
+                {
+                    // Media results only carry the message id
+                    FMessage message = store.takeById(id);
 
-                        if (message.key.id == id)
-                        {
-                            message.status = (child.getTag() == "media")
-                                        ? FMessage::Uploading
-                                        : FMessage::Uploaded;
-                            message.media_url = child.getAttributeValue("url");
-                            if (child.getTag() == "duplicate") {
-                                message.media_mime_type = child.getAttributeValue("mimetype");
-                                if (message.media_wa_type == FMessage::Video ||
-                                    message.media_wa_type == FMessage::Audio)
-                                {
-                                    QString duration = child.getAttributeValue("duration");
-                                    message.media_duration_seconds =
-                                            (duration.isEmpty()) ? 0 : duration.toInt();
-                                }
-                                if (message.media_wa_type == FMessage::Image ||
-                                    message.media_wa_type == FMessage::Audio)
-                                {
-                                    QString width = child.getAttributeValue("width");
-                                    QString height = child.getAttributeValue("height");
-                                    if (!width.isEmpty() && !height.isEmpty()) {
-                                        message.media_width = width.toInt();
-                                        message.media_height = height.toInt();
-                                    }
+                    if (message.key.getId() == id)
+                    {
+                        // Answered, it's not sent again after a restart
+                        ackPending(message.key);
+
+                        message.status = (child.getTag() == "media")
+                                    ? FMessage::Uploading
+                                    : FMessage::Uploaded;
+                        message.mutableMedia().media_url = child.getAttributeValue("url");
+                        if (child.getTag() == "duplicate") {
+                            message.mutableMedia().media_mime_type = child.getAttributeValue("mimetype");
+                            if (message.media_wa_type == FMessage::Video ||
+                                message.media_wa_type == FMessage::Audio)
+                            {
+                                QString duration = child.getAttributeValue("duration");
+                                message.mutableMedia().media_duration_seconds =
+                                        (duration.isEmpty()) ? 0 : duration.toInt();
+                            }
+                            if (message.media_wa_type == FMessage::Image ||
+                                message.media_wa_type == FMessage::Audio)
+                            {
+                                QString width = child.getAttributeValue("width");
+                                QString height = child.getAttributeValue("height");
+                                if (!width.isEmpty() && !height.isEmpty()) {
+                                    message.mutableMedia().media_width = width.toInt();
+                                    message.mutableMedia().media_height = height.toInt();
                                 }
                             }
 
-                            store.remove(k);
+                            // Next time it won't be asked
+                            MediaCacheEntry entry;
+                            entry.hash = message.data;
+                            entry.url = message.media().media_url;
+                            entry.mimeType = message.media().media_mime_type;
+                            entry.size = message.media().media_size;
+                            entry.width = message.media().media_width;
+                            entry.height = message.media().media_height;
+                            entry.duration = message.media().media_duration_seconds;
+                            MediaCache::instance()->insert(entry);
+                        }
+
+                        // The upload will follow, start the handshake now.  This
+                        // can run in the decode thread, the pool is queued to.
+                        if (message.status == FMessage::Uploading)
+                            QMetaObject::invokeMethod(HttpConnectionPool::instance(), "preconnect",
+                                                      Qt::QueuedConnection,
+                                                      Q_ARG(QUrl, QUrl(message.media().media_url)));
 
-                            emit mediaUploadAccepted(message);
+                        StageTimer emitTimer(stageAccounting.loadAcquire(), StageAccounting::Emit);
+                        emit mediaUploadAccepted(message);
 
-                        }
                     }
+                }
 
-                    // This is the result of the sendGetPhotoIds()
-                    // That method is not used anymore
+                // This is the result of the sendGetPhotoIds()
+                // That method is not used anymore
 
-                    else if (child.getTag() == "picture")
-                    {
-                        QString imageType = child.getAttributeValue("type");
-                        QString photoId = child.getAttributeValue("id");
-                        QByteArray bytes = child.getData();
+                else if (child.getTag() == "picture")
+                {
+                    QString imageType = child.getAttributeValue("type");
+                    QString photoId = child.getAttributeValue("id");
+                    QByteArray bytes = child.getData();
 
-                        if (bytes.size() > 0)
-                            emit photoReceived(from, bytes, photoId, (imageType == "image"));
-                        else
-                            sendGetPhoto(from, QString(), true);
+                    if (bytes.size() > 0)
+                    {
+                        StageTimer emitTimer(stageAccounting.loadAcquire(), StageAccounting::Emit);
+                        emit photoReceived(from, bytes, photoId, (imageType == "image"));
+                    }
+                    else
+                        sendGetPhoto(from, QString(), true);
 
 
-                        pictureReceived = true;
-                        counters->increaseCounter(DataCounters::ProfileBytes, node.getSize(), 0);
-                    }
+                    pictureReceived = true;
+                    increaseCounter(DataCounters::ProfileBytes, node.getSize(), 0);
+                }
 
-                    else if (child.getTag() == "sync")
+                else if (child.getTag() == "sync")
+                {
+                    qDebug() << "sync response";
+                    ProtocolTreeNodeListIterator j(child.getChildren());
+                    while (j.hasNext())
                     {
-                        qDebug() << "sync response";
-                        ProtocolTreeNodeListIterator j(child.getChildren());
-                        while (j.hasNext())
-                        {
-                            ProtocolTreeNode group = j.next().value();
-                            if (group.getTag() == "full" || group.getTag() == "in") {
-                                QStringList jids;
-                                QVariantList contacts;
-                                ProtocolTreeNodeListIterator k(group.getChildren());
-                                while (k.hasNext())
+                        ProtocolTreeNode group = j.next().value();
+                        if (group.getTag() == "full" || group.getTag() == "in") {
+                            QStringList jids;
+                            QVariantList contacts;
+                            ProtocolTreeNodeListIterator k(group.getChildren());
+                            while (k.hasNext())
+                            {
+                                ProtocolTreeNode list = k.next().value();
+                                if (list.getTag() == "user")
                                 {
-                                    ProtocolTreeNode list = k.next().value();
-                                    if (list.getTag() == "user")
-                                    {
-                                        QString jid = list.getAttributeValue("jid");
-                                        jids.append(jid);
-                                        QVariantMap contact;
-                                        contact["jid"] = jid;
-                                        contact["phone"] = list.getDataString();
-                                        contacts.append(contact);
-                                    }
+                                    QString jid = list.getAttributeValue("jid");
+                                    jids.append(jid);
+                                    QVariantMap contact;
+                                    contact["jid"] = jid;
+                                    contact["phone"] = list.getDataString();
+                                    contacts.append(contact);
                                 }
-                                sendGetStatus(jids);
-                                Q_EMIT contactsSynced(contacts);
                             }
+                            sendGetStatus(jids);
+                            Q_EMIT contactsSynced(contacts);
                         }
-                        Q_EMIT syncFinished();
                     }
+                    Q_EMIT syncFinished();
+                }
 
-                    else if (child.getTag() == "status")
+                else if (child.getTag() == "status")
+                {
+                    qDebug() << "status response";
+                    QVariantList contacts;
+                    ProtocolTreeNodeListIterator j(child.getChildren());
+                    while (j.hasNext())
                     {
-                        qDebug() << "status response";
-                        QVariantList contacts;
-                        ProtocolTreeNodeListIterator j(child.getChildren());
-                        while (j.hasNext())
+                        ProtocolTreeNode list = j.next().value();
+                        if (list.getTag() == "user")
                         {
-                            ProtocolTreeNode list = j.next().value();
-                            if (list.getTag() == "user")
-                            {
-                                QString jid = list.getAttributeValue("jid");
-                                QString t = list.getAttributeValue("t");
-                                QVariantMap contact;
-                                contact["jid"] = jid;
-                                contact["timestamp"] = t;
-                                QString message = list.getDataString();
-                                if (message.isEmpty()) {
-                                    QString code = list.getAttributeValue("code");
-                                    if (code == "401") {
-                                        contact["hidden"] = true;
-                                    }
+                            QString jid = list.getAttributeValue("jid");
+                            QString t = list.getAttributeValue("t");
+                            QVariantMap contact;
+                            contact["jid"] = jid;
+                            contact["timestamp"] = t;
+                            QString message = list.getDataString();
+                            if (message.isEmpty()) {
+                                QString code = list.getAttributeValue("code");
+                                if (code == "401") {
+                                    contact["hidden"] = true;
                                 }
-                                contact["message"] = message;
-                                contacts.append(contact);
                             }
+                            contact["message"] = message;
+                            contacts.append(contact);
                         }
-                        Q_EMIT contactsStatus(contacts);
-                    }
-
-                    else if (child.getTag() == "participant" && id.startsWith("get_participants_")) {
-                        QString jid = child.getAttributeValue("jid");
-                        groupParticipants.append(jid);
-                        //Q_EMIT groupUser(from, jid);
                     }
+                    Q_EMIT contactsStatus(contacts);
                 }
 
-                if (!groupParticipants.isEmpty()) {
-                    Q_EMIT groupUsers(from, groupParticipants);
+                else if (child.getTag() == "participant" && id.startsWith("get_participants_")) {
+                    QString jid = child.getAttributeValue("jid");
+                    groupParticipants.append(jid);
+                    //Q_EMIT groupUser(from, jid);
                 }
+            }
 
-                if (id.startsWith("privacy_")) {
-                    sendGetPrivacyList();
-                }
+            if (!groupParticipants.isEmpty()) {
+                Q_EMIT groupUsers(from, groupParticipants);
             }
-            else if (type == "error")
-            {
-                QString id = node.getAttributeValue("id");
-                if (id.startsWith("privacylist"))
-                   emit privacyListReceived(QStringList());
-                else if (id.startsWith("get_picture_")) {
-                   ProtocolTreeNodeListIterator i(node.getChildren());
-                   while (i.hasNext())
+
+            if (id.startsWith("privacy_")) {
+                sendGetPrivacyList();
+            }
+        }
+        else if (type == "error")
+        {
+            QString id = node.getAttributeValue("id");
+
+            // Only media requests are sent as iqs with the message id, a
+            // refused one would fail again if resent
+            FMessage request = store.takeById(id);
+            if (request.key.getId() == id)
+                ackPending(request.key);
+
+            if (id.startsWith("privacylist")) {
+               StageTimer emitTimer(stageAccounting.loadAcquire(), StageAccounting::Emit);
+               emit privacyListReceived(QStringList());
+            }
+            else if (id.startsWith("get_picture_")) {
+               ProtocolTreeNodeListIterator i(node.getChildren());
+               while (i.hasNext())
+               {
+                   ProtocolTreeNode child = i.next().value();
+                   if (child.getTag() == "error")
                    {
-                       ProtocolTreeNode child = i.next().value();
-                       if (child.getTag() == "error")
-                       {
-                           QString code = child.getAttributeValue("code");
-                           if (code == "401") {
-                               Q_EMIT photoReceived(from, QByteArray(), "hidden", true);
-                           }
-                           else if (code == "404") {
-                               Q_EMIT photoReceived(from, QByteArray(), "empty", true);
-                           }
+                       QString code = child.getAttributeValue("code");
+                       if (code == "401") {
+                           Q_EMIT photoReceived(from, QByteArray(), "hidden", true);
+                       }
+                       else if (code == "404") {
+                           Q_EMIT photoReceived(from, QByteArray(), "empty", true);
                        }
                    }
-                }
-                else if (id.startsWith("last_")) {
-                    ProtocolTreeNodeListIterator i(node.getChildren());
-                    while (i.hasNext())
+               }
+            }
+            else if (id.startsWith("last_")) {
+                ProtocolTreeNodeListIterator i(node.getChildren());
+                while (i.hasNext())
+                {
+                    ProtocolTreeNode child = i.next().value();
+                    if (child.getTag() == "error")
                     {
-                        ProtocolTreeNode child = i.next().value();
-                        if (child.getTag() == "error")
-                        {
-                            QString code = child.getAttributeValue("code");
-                            if (code == "405") { //privacy
-                                Q_EMIT lastOnline(from, -1);
-                            }
-                            if (code == "401") { //blocked
-                                Q_EMIT lastOnline(from, -2);
-                            }
+                        QString code = child.getAttributeValue("code");
+                        if (code == "405") { //privacy
+                            Q_EMIT lastOnline(from, -1);
+                        }
+                        if (code == "401") { //blocked
+                            Q_EMIT lastOnline(from, -2);
                         }
                     }
                 }
             }
         }
+    }
 
-        else if (tag == "ib")
-        {
-            ProtocolTreeNodeListIterator i(node.getChildren());
-            while (i.hasNext()) {
-                ProtocolTreeNode child = i.next().value();
-                if (child.getTag() == "dirty") {
-                    sendCleanDirty(QStringList() << child.getAttributeValue("type"));
-                }
-                else if (child.getTag() == "offline") {
-                    Q_EMIT notifyOfflineMessages(child.getAttributeValue("count").toInt());
-                }
+    else if (tag == "ib")
+    {
+        ProtocolTreeNodeListIterator i(node.getChildren());
+        while (i.hasNext()) {
+            ProtocolTreeNode child = i.next().value();
+            if (child.getTag() == "dirty") {
+                sendCleanDirty(QStringList() << child.getAttributeValue("type"));
+            }
+            else if (child.getTag() == "offline") {
+                Q_EMIT notifyOfflineMessages(child.getAttributeValue("count").toInt());
             }
         }
+    }
 
-        else if (tag == "presence")
+    else if (tag == "presence")
+    {
+        QString from = node.getAttributeValue("from");
+        if (!from.isEmpty() && !from.contains("-"))
         {
-            QString from = node.getAttributeValue("from");
-            if (!from.isEmpty() && !from.contains("-"))
+            QString type = node.getAttributeValue("type");
+            if (type.isEmpty() || type == "available" || type == "unavailable")
             {
-                QString type = node.getAttributeValue("type");
-                if (type.isEmpty() || type == "available")
-                    emit available(from, true);
-                else if (type == "unavailable")
-                    emit available(from, false);
-            }
-        }
-
-        else if (tag == "chatstate") {
-            QString from = node.getAttributeValue("from");
-            ProtocolTreeNodeListIterator i(node.getChildren());
-            while (i.hasNext()) {
-                ProtocolTreeNode child = i.next().value();
-                if (child.getTag() == "composing") {
-                    emit composing(from, "");
-                }
-                else if (child.getTag() == "paused") {
-                    emit paused(from);
-                }
+                StageTimer emitTimer(stageAccounting.loadAcquire(), StageAccounting::Emit);
+                emit available(from, type != "unavailable");
             }
         }
+    }
 
-        else if (tag == "ack") {
-            QString aclass = node.getAttributeValue("class");
-            if (aclass == "message") {
-                QString from = node.getAttributeValue("from");
-                QString id = node.getAttributeValue("id");
-                emit messageStatusUpdate(from, id, FMessage::ReceivedByServer);
+    else if (tag == "chatstate") {
+        QString from = node.getAttributeValue("from");
+        ProtocolTreeNodeListIterator i(node.getChildren());
+        while (i.hasNext()) {
+            ProtocolTreeNode child = i.next().value();
+            if (child.getTag() == "composing") {
+                StageTimer emitTimer(stageAccounting.loadAcquire(), StageAccounting::Emit);
+                emit composing(from, "");
             }
-            else if (aclass == "receipt") {
-                qDebug() << "TODO:" << "ack message receipt class";
+            else if (child.getTag() == "paused") {
+                StageTimer emitTimer(stageAccounting.loadAcquire(), StageAccounting::Emit);
+                emit paused(from);
             }
         }
+    }
 
-        else if (tag == "receipt") {
+    else if (tag == "ack") {
+        QString aclass = node.getAttributeValue("class");
+        if (aclass == "message") {
             QString from = node.getAttributeValue("from");
             QString id = node.getAttributeValue("id");
-            QString type = node.getAttributeValue("type");
-            QString participant = node.getAttributeValue("participant");
-            if (from.contains("broadcast")) {
-                emit messageStatusUpdate(participant, id, (type == "played")
-                                                     ? FMessage::Played
-                                                     : FMessage::ReceivedByTarget);
-            }
-            else if (!from.contains("s.us")) {
-                emit messageStatusUpdate(from, id, (type == "played")
-                                                     ? FMessage::Played
-                                                     : FMessage::ReceivedByTarget);
+            ackPending(Key(from, true, id));
+            trackMessageAnswered(id, false);
+            StageTimer emitTimer(stageAccounting.loadAcquire(), StageAccounting::Emit);
+            emit messageStatusUpdate(from, id, FMessage::ReceivedByServer);
+        }
+        else if (aclass == "receipt") {
+            qDebug() << "TODO:" << "ack message receipt class";
+        }
+    }
+
+    else if (tag == "receipt") {
+        QString from = node.getAttributeValue("from");
+        QString id = node.getAttributeValue("id");
+        QString type = node.getAttributeValue("type");
+        QString participant = node.getAttributeValue("participant");
+        if (type != "played")
+            trackMessageAnswered(id, true);
+        if (from.contains("broadcast")) {
+            StageTimer emitTimer(stageAccounting.loadAcquire(), StageAccounting::Emit);
+            emit messageStatusUpdate(participant, id, (type == "played")
+                                                 ? FMessage::Played
+                                                 : FMessage::ReceivedByTarget);
+        }
+        else if (!from.contains("s.us")) {
+            StageTimer emitTimer(stageAccounting.loadAcquire(), StageAccounting::Emit);
+            emit messageStatusUpdate(from, id, (type == "played")
+                                                 ? FMessage::Played
+                                                 : FMessage::ReceivedByTarget);
+        }
+        if (type == "delivered" || type == "played" || type.isEmpty())
+        {
+            // Delivery Receipt received
+            sendReceiptAck(id, type);
+        }
+    }
+    else if (tag == "notification")
+    {
+        QString notificationType = node.getAttributeValue("type");
+        QString from = node.getAttributeValue("from");
+        QString to = node.getAttributeValue("to");
+        QString participant = node.getAttributeValue("participant");
+        QString id = node.getAttributeValue("id");
+        QString notify = node.getAttributeValue("notify");
+        bool offline = !node.getAttributeValue("offline").isEmpty();
+        if (!notify.isEmpty()) {
+            if (from.contains("-")) {
+                if (!participant.isEmpty())
+                    Q_EMIT updatePushname(participant, notify);
             }
-            if (type == "delivered" || type == "played" || type.isEmpty())
-            {
-                // Delivery Receipt received
-                sendReceiptAck(id, type);
+            else {
+                Q_EMIT updatePushname(from, notify);
             }
         }
-        else if (tag == "notification")
+
+        if (notificationType == "picture")
         {
-            QString notificationType = node.getAttributeValue("type");
-            QString from = node.getAttributeValue("from");
-            QString to = node.getAttributeValue("to");
-            QString participant = node.getAttributeValue("participant");
-            QString id = node.getAttributeValue("id");
-            QString notify = node.getAttributeValue("notify");
-            bool offline = !node.getAttributeValue("offline").isEmpty();
-            if (!notify.isEmpty()) {
-                if (from.contains("-")) {
-                    if (!participant.isEmpty())
-                        Q_EMIT updatePushname(participant, notify);
-                }
-                else {
-                    Q_EMIT updatePushname(from, notify);
-                }
-            }
+            QString timestamp = node.getAttributeValue("t");
 
-            if (notificationType == "picture")
-            {
-                QString timestamp = node.getAttributeValue("t");
+            ProtocolTreeNodeListIterator i(node.getChildren());
 
-                ProtocolTreeNodeListIterator i(node.getChildren());
+            while (i.hasNext())
+            {
+                ProtocolTreeNode child = i.next().value();
 
-                while (i.hasNext())
+                if (child.getTag() == "set")
                 {
-                    ProtocolTreeNode child = i.next().value();
-
-                    if (child.getTag() == "set")
-                    {
-                        QString photoId = child.getAttributeValue("id");
-                        if (!photoId.isEmpty()) {
-                            QString author = child.getAttributeValue("author");
-                            emit photoIdReceived(from, notify, author, timestamp, photoId, id, offline);
-                        }
-                    }
-                    else if (child.getTag() == "delete") {
+                    QString photoId = child.getAttributeValue("id");
+                    if (!photoId.isEmpty()) {
                         QString author = child.getAttributeValue("author");
-                        emit photoDeleted(from, notify, author, timestamp, id, offline);
+                        StageTimer emitTimer(stageAccounting.loadAcquire(), StageAccounting::Emit);
+                        emit photoIdReceived(from, notify, author, timestamp, photoId, id, offline);
                     }
                 }
-
-                sendNotificationReceived(from, id, to, participant, notificationType, ProtocolTreeNode());
+                else if (child.getTag() == "delete") {
+                    QString author = child.getAttributeValue("author");
+                    StageTimer emitTimer(stageAccounting.loadAcquire(), StageAccounting::Emit);
+                    emit photoDeleted(from, notify, author, timestamp, id, offline);
+                }
             }
 
-            else if (notificationType == "contacts") {
-                ProtocolTreeNodeListIterator i(node.getChildren());
-                while (i.hasNext())
-                {
-                    ProtocolTreeNode child = i.next().value();
+            sendNotificationReceived(from, id, to, participant, notificationType, ProtocolTreeNode());
+        }
 
-                    if (child.getTag() == "add")
-                    {
-                        QString jid = child.getAttributeValue("jid");
-                        if (!jid.isEmpty())
-                            Q_EMIT contactAdded(jid);
-                    }
-                }
+        else if (notificationType == "contacts") {
+            ProtocolTreeNodeListIterator i(node.getChildren());
+            while (i.hasNext())
+            {
+                ProtocolTreeNode child = i.next().value();
 
-                ProtocolTreeNode sync("sync");
-                AttributeList syncattrs;
-                syncattrs.insert("contacts", "out");
-                sync.setAttributes(syncattrs);
-                sendNotificationReceived(from, id, to, participant, notificationType, sync);
+                if (child.getTag() == "add")
+                {
+                    QString jid = child.getAttributeValue("jid");
+                    if (!jid.isEmpty())
+                        Q_EMIT contactAdded(jid);
+                }
             }
 
-            else if (notificationType == "subject") {
-                sendNotificationReceived(from, id, to, participant, notificationType, ProtocolTreeNode());
-                QString timestamp = node.getAttributeValue("t");
-                ProtocolTreeNodeListIterator i(node.getChildren());
-                while (i.hasNext())
+            ProtocolTreeNode sync("sync");
+            AttributeList syncattrs;
+            syncattrs.insert("contacts", "out");
+            sync.setAttributes(syncattrs);
+            sendNotificationReceived(from, id, to, participant, notificationType, sync);
+        }
+
+        else if (notificationType == "subject") {
+            sendNotificationReceived(from, id, to, participant, notificationType, ProtocolTreeNode());
+            QString timestamp = node.getAttributeValue("t");
+            ProtocolTreeNodeListIterator i(node.getChildren());
+            while (i.hasNext())
+            {
+                ProtocolTreeNode child = i.next().value();
+                if (child.getTag() == "body")
                 {
-                    ProtocolTreeNode child = i.next().value();
-                    if (child.getTag() == "body")
-                    {
-                        //QString event = child.getAttributeValue("event");
-                        //if (event == "add") {
-                            QString subject = child.getDataString();
-                            Q_EMIT groupNewSubject(from, participant, notify, subject, timestamp, id, offline);
-                        //}
-                    }
+                    //QString event = child.getAttributeValue("event");
+                    //if (event == "add") {
+                        QString subject = child.getDataString();
+                        Q_EMIT groupNewSubject(from, participant, notify, subject, timestamp, id, offline);
+                    //}
                 }
             }
+        }
 
-            else if (notificationType == "status") {
-                sendNotificationReceived(from, id, to, participant, notificationType, ProtocolTreeNode());
-                QString timestamp = node.getAttributeValue("t");
-                ProtocolTreeNodeListIterator i(node.getChildren());
-                while (i.hasNext())
+        else if (notificationType == "status") {
+            sendNotificationReceived(from, id, to, participant, notificationType, ProtocolTreeNode());
+            QString timestamp = node.getAttributeValue("t");
+            ProtocolTreeNodeListIterator i(node.getChildren());
+            while (i.hasNext())
+            {
+                ProtocolTreeNode child = i.next().value();
+                if (child.getTag() == "set")
                 {
-                    ProtocolTreeNode child = i.next().value();
-                    if (child.getTag() == "set")
-                    {
-                        QString message = child.getDataString();
-                        Q_EMIT userStatusUpdated(from, message, timestamp.toInt());
-                    }
+                    QString message = child.getDataString();
+                    Q_EMIT userStatusUpdated(from, message, timestamp.toInt());
                 }
             }
+        }
 
-            else if (notificationType == "web") {
-                sendNotificationReceived(from, id, to, participant, notificationType, ProtocolTreeNode());
-            }
+        else if (notificationType == "web") {
+            sendNotificationReceived(from, id, to, participant, notificationType, ProtocolTreeNode());
+        }
 
-            else if (notificationType == "participant") {
-                sendNotificationReceived(from, id, to, participant, notificationType, ProtocolTreeNode());
-                QString timestamp = node.getAttributeValue("t");
-                ProtocolTreeNodeListIterator i(node.getChildren());
-                while (i.hasNext())
+        else if (notificationType == "participant") {
+            sendNotificationReceived(from, id, to, participant, notificationType, ProtocolTreeNode());
+            QString timestamp = node.getAttributeValue("t");
+            ProtocolTreeNodeListIterator i(node.getChildren());
+            while (i.hasNext())
+            {
+                ProtocolTreeNode child = i.next().value();
+                if (child.getTag() == "add")
                 {
-                    ProtocolTreeNode child = i.next().value();
-                    if (child.getTag() == "add")
-                    {
-                        QString jid = child.getAttributeValue("jid");
-                        if (jid == myJid) {
-                            sendGetGroupInfo(from);
-                        }
-                        else if (!jid.isEmpty()) {
-                            Q_EMIT groupAddUser(from, jid, timestamp, id, offline);
-                        }
+                    QString jid = child.getAttributeValue("jid");
+                    if (jid == myJid) {
+                        sendGetGroupInfo(from);
                     }
-                    else if (child.getTag() == "remove")
-                    {
-                        QString jid = child.getAttributeValue("jid");
-                        if (!jid.isEmpty())
-                            Q_EMIT groupRemoveUser(from, jid, timestamp, id, offline);
+                    else if (!jid.isEmpty()) {
+                        Q_EMIT groupAddUser(from, jid, timestamp, id, offline);
                     }
                 }
+                else if (child.getTag() == "remove")
+                {
+                    QString jid = child.getAttributeValue("jid");
+                    if (!jid.isEmpty())
+                        Q_EMIT groupRemoveUser(from, jid, timestamp, id, offline);
+                }
             }
         }
-
-        else if (tag == "message")
-            parseMessageInitialTagAlreadyChecked(node);
-
-        // Update counters
-        if (tag != "message" && !pictureReceived)
-            counters->increaseCounter(DataCounters::ProtocolBytes, node.getSize(), 0);
-
-        return true;
     }
 
-    return false;
+    else if (tag == "message")
+        parseMessageInitialTagAlreadyChecked(node);
+
+    // Update counters
+    if (tag != "message" && !pictureReceived)
+        increaseCounter(DataCounters::ProtocolBytes, node.getSize(), 0);
 }
 
 /**
@@ -752,142 +1020,451 @@ void Connection::parseMessageInitialTagAlreadyChecked(ProtocolTreeNode &messageN
             {
                 // New message received
 
-                Key k(from, false, id);
-                message.setKey(k);
-                message.setData(child.getData());
-                message.remote_resource = author;
-                message.setThumbImage("");
-                message.type = FMessage::BodyMessage;
-                message.notify_name = messageNode.getAttributeValue("notify");
+                Key k(from, false, id);
+                message.setKey(k);
+                message.setData(child.getData());
+                message.remote_resource = author;
+                message.setThumbImage("");
+                message.type = FMessage::BodyMessage;
+                message.notify_name = messageNode.getAttributeValue("notify");
+
+                msgType = MessageReceived;
+                sendMessageReceived(message);
+
+            }
+            else if (child.getTag() == "media")
+            {
+                // New mms received
+
+                Key k(from, false, id);
+                message.setKey(k);
+                message.remote_resource = author;
+                message.type = FMessage::MediaMessage;
+
+                message.setMediaWAType(child.getAttributeValue("type"));
+
+                if (message.media_wa_type == FMessage::Contact) {
+                    ProtocolTreeNodeListIterator ci(child.getChildren());
+
+                    while (ci.hasNext())
+                    {
+                        ProtocolTreeNode cc = ci.next().value();
+
+                        if (cc.getTag() == "vcard")
+                        {
+                            message.mutableMedia().media_name = cc.getAttributeValue("name");
+                            message.setData(QString::fromUtf8(cc.getData().data()));
+                        }
+                    }
+                }
+                else {
+                    FMessageMedia &media = message.mutableMedia();
+                    media.media_url = child.getAttributeValue("url");
+
+                    if (message.media_wa_type == FMessage::Location)
+                    {
+                        media.media_name = child.getAttributeValue("name");
+                        media.latitude = child.getAttributeValue("latitude").toDouble();
+                        media.longitude = child.getAttributeValue("longitude").toDouble();
+                    }
+                    else
+                        media.media_name = child.getAttributeValue("file");
+
+                    media.media_size = child.getAttributeValue("size").toLongLong();
+                    media.media_mime_type = child.getAttributeValue("mimetype");
+
+                    if (message.media_wa_type == FMessage::Video ||
+                        message.media_wa_type == FMessage::Audio) {
+                        media.media_duration_seconds = child.getAttributeValue("duration").toInt();
+                    }
+                    if (message.media_wa_type == FMessage::Image ||
+                        message.media_wa_type == FMessage::Video) {
+                        media.media_width = child.getAttributeValue("width").toInt();
+                        media.media_height = child.getAttributeValue("height").toInt();
+                    }
+
+                    message.live = (child.getAttributeValue("origin") == "live");
+
+                    // Raw thumbnails stay binary, getDataBase64() encodes
+                    // them if the application needs text
+                    message.setData(child.getData());
+                }
+
+                msgType = MessageReceived;
+                sendMessageReceived(message);
+            }
+            else if (child.getTag() == "received")
+            {
+                QString receipt_type = child.getAttributeValue("type");
+                Key k(from,true,id);
+                message = store.value(k);
+                if (message.key.getId() == id)
+                {
+                    message.status = (receipt_type == "played")
+                            ? FMessage::Played
+                            : FMessage::ReceivedByTarget;
+                    msgType = (from == "s.us") ? Unknown : MessageStatusUpdate;
+
+                    // Remove it from the store if it's not a voice message
+                    // Or if it's a voice message already played
+                    if ((message.live && receipt_type == "played") || !message.live)
+                        store.remove(k);
+
+                    ackPending(k);
+                }
+                if (receipt_type == "delivered" || receipt_type == "played" ||
+                    receipt_type.isEmpty())
+                {
+                    // Delivery Receipt received
+                    sendDeliveredReceiptAck(from,id,
+                                            (receipt_type.isEmpty()
+                                             ? "delivered"
+                                             : receipt_type));
+                }
+            }
+        }
+        message.broadcast = broadcast;
+        message.offline = offline;
+
+        switch (msgType)
+        {
+            case MessageReceived:
+            {
+                StageTimer emitTimer(stageAccounting.loadAcquire(), StageAccounting::Emit);
+                emit messageReceived(message);
+
+                if (frameArrival)
+                    recordLatency(InboundDispatchLatency, LatencyHistogram::now() - frameArrival);
+                break;
+            }
+
+            case MessageStatusUpdate:
+            {
+                StageTimer emitTimer(stageAccounting.loadAcquire(), StageAccounting::Emit);
+                emit messageStatusUpdate(message.key.getRemoteJid(), message.key.getId(), message.status);
+                break;
+            }
+
+            default:
+                break;
+        }
+
+        // Increase data counters
+        if (msgType == MessageReceived)
+        {
+            increaseCounter(DataCounters::Messages, 1, 0);
+            increaseCounter(DataCounters::MessageBytes, messageNode.getSize(), 0);
+        }
+    }
+    else if (typeAttribute == "error")
+    {
+        if (from.right(5) == "@g.us")
+        {
+            StageTimer emitTimer(stageAccounting.loadAcquire(), StageAccounting::Emit);
+            emit groupError(from);
+        }
+    }
+
+    increaseCounter(DataCounters::ProtocolBytes, messageNode.getSize(), 0);
+
+}
+
+/**
+    Registers the metrics series of this connection, labeled with the
+    user.  Connections of the same user share the series.
+*/
+void Connection::registerMetrics()
+{
+    MetricsRegistry *registry = MetricsRegistry::instance();
+
+    for (int i = 0; i < TOTAL_COUNTERS; i++)
+    {
+        MetricLabels labels;
+        labels.append(qMakePair(QString("connection"), user));
+        labels.append(qMakePair(QString("counter"), QString(counterNames[i])));
+
+        receivedMetrics[i] = registry->counter("libqtwa_traffic_received_total",
+                                               "Messages and bytes received", labels);
+        sentMetrics[i] = registry->counter("libqtwa_traffic_sent_total",
+                                           "Messages and bytes sent", labels);
+    }
+
+    for (int i = 0; i < TOTAL_STANZA_TYPES; i++)
+    {
+        MetricLabels labels;
+        labels.append(qMakePair(QString("connection"), user));
+        labels.append(qMakePair(QString("type"), QString(stanzaTypes[i])));
+
+        stanzaMetrics.append(registry->counter("libqtwa_stanzas_received_total",
+                                               "Stanzas received by type", labels));
+    }
+
+    stages.setMetricsEnabled(true);
+}
+
+/**
+    Releases the metrics series of this connection, the registry has a
+    limited number of them.
+*/
+void Connection::unregisterMetrics()
+{
+    MetricsRegistry *registry = MetricsRegistry::instance();
+
+    for (int i = 0; i < TOTAL_COUNTERS; i++)
+    {
+        registry->release(receivedMetrics[i]);
+        registry->release(sentMetrics[i]);
+    }
+
+    foreach (int id, stanzaMetrics)
+        registry->release(id);
+    stanzaMetrics.clear();
+
+    stages.setMetricsEnabled(false);
+}
+
+/**
+    Increases the shared data counters and the metrics of this connection.
+
+    @param counter          DataCounters::CounterType.
+    @param receivedBytes    Bytes (or messages) received.
+    @param sentBytes        Bytes (or messages) sent.
+*/
+void Connection::increaseCounter(int counter, qint64 receivedBytes, qint64 sentBytes)
+{
+    counters->increaseCounter(counter, receivedBytes, sentBytes);
+
+    MetricsRegistry *registry = MetricsRegistry::instance();
+    if (receivedBytes)
+        registry->add(receivedMetrics[counter], receivedBytes);
+    if (sentBytes)
+        registry->add(sentMetrics[counter], sentBytes);
+
+    if (counter != DataCounters::Messages)
+    {
+        if (receivedBytes)
+            registry->add(receivedMetrics[DataCounters::Total], receivedBytes);
+        if (sentBytes)
+            registry->add(sentMetrics[DataCounters::Total], sentBytes);
+    }
+}
+
+void Connection::countStanza(const QString &tag)
+{
+    int type = 0;
+    while (type < TOTAL_STANZA_TYPES - 1 && tag != QLatin1String(stanzaTypes[type]))
+        type++;
+
+    MetricsRegistry::instance()->add(stanzaMetrics.at(type));
+}
+
+/**
+    Returns a snapshot of a latency histogram of this connection.
+
+    @param type         LatencyType to return.
+*/
+LatencyHistogram Connection::getLatency(LatencyType type)
+{
+    return latency[type];
+}
+
+/**
+    Returns a snapshot of a latency histogram of all the connections.
+
+    @param type         LatencyType to return.
+*/
+LatencyHistogram Connection::getAggregateLatency(LatencyType type)
+{
+    return aggregateLatency()->types[type];
+}
+
+/**
+    Returns the round trip histogram of one type of <iq> request, across
+    all the connections.
+
+    @param requestType  Prefix of the request ids, like "get_picture_".
+*/
+LatencyHistogram Connection::getIqLatency(const QString &requestType)
+{
+    LatencyAggregate *aggregate = aggregateLatency();
+    QMutexLocker locker(&aggregate->mutex);
+
+    LatencyHistogram *histogram = aggregate->iq.value(requestType);
+    return histogram ? *histogram : LatencyHistogram();
+}
+
+/**
+    Returns the types of <iq> request with a round trip recorded.
+*/
+QStringList Connection::getIqRequestTypes()
+{
+    LatencyAggregate *aggregate = aggregateLatency();
+    QMutexLocker locker(&aggregate->mutex);
+
+    return aggregate->iq.keys();
+}
+
+void Connection::recordLatency(LatencyType type, qint64 us)
+{
+    latency[type].record(us);
+    aggregateLatency()->types[type].record(us);
+}
+
+void Connection::trackMessageSent(const QString &id)
+{
+    QMutexLocker locker(&latencyMutex);
+
+    // Resent messages keep the time of the first attempt
+    if (!messageSendTimes.contains(id))
+        messageSendTimes.insert(id, LatencyHistogram::now());
+}
+
+/**
+    Records the latency of a sent message being acked.
+
+    @param id           Id of the message.
+    @param receipt      true for the receipt of the target, which is the
+                        last answer expected, false for the server ack.
+*/
+void Connection::trackMessageAnswered(const QString &id, bool receipt)
+{
+    qint64 sent;
+
+    {
+        QMutexLocker locker(&latencyMutex);
+
+        QHash<QString, qint64>::iterator i = messageSendTimes.find(id);
+        if (i == messageSendTimes.end())
+            return;
+
+        sent = i.value();
+        if (receipt)
+            messageSendTimes.erase(i);
+    }
 
-                msgType = MessageReceived;
-                sendMessageReceived(message);
+    recordLatency(receipt ? TargetReceiptLatency : ServerAckLatency,
+                  LatencyHistogram::now() - sent);
+}
 
-            }
-            else if (child.getTag() == "media")
-            {
-                // New mms received
+void Connection::trackIqAnswered(const QString &id)
+{
+    QPair<QString, qint64> sent;
 
-                Key k(from, false, id);
-                message.setKey(k);
-                message.remote_resource = author;
-                message.type = FMessage::MediaMessage;
+    {
+        QMutexLocker locker(&latencyMutex);
 
-                message.setMediaWAType(child.getAttributeValue("type"));
+        QHash<QString, QPair<QString, qint64> >::iterator i = iqSendTimes.find(id);
+        if (i == iqSendTimes.end())
+            return;
 
-                if (message.media_wa_type == FMessage::Contact) {
-                    ProtocolTreeNodeListIterator ci(child.getChildren());
+        sent = i.value();
+        iqSendTimes.erase(i);
+    }
 
-                    while (ci.hasNext())
-                    {
-                        ProtocolTreeNode cc = ci.next().value();
+    qint64 us = LatencyHistogram::now() - sent.second;
+    recordLatency(IqRoundTripLatency, us);
 
-                        if (cc.getTag() == "vcard")
-                        {
-                            message.media_name = cc.getAttributeValue("name");
-                            message.setData(QString::fromUtf8(cc.getData().data()));
-                        }
-                    }
-                }
-                else {
-                    message.media_url = child.getAttributeValue("url");
+    LatencyAggregate *aggregate = aggregateLatency();
+    QMutexLocker locker(&aggregate->mutex);
 
-                    if (message.media_wa_type == FMessage::Location)
-                    {
-                        message.media_name = child.getAttributeValue("name");
-                        message.latitude = child.getAttributeValue("latitude").toDouble();
-                        message.longitude = child.getAttributeValue("longitude").toDouble();
-                    }
-                    else
-                        message.media_name = child.getAttributeValue("file");
+    LatencyHistogram *&histogram = aggregate->iq[sent.first];
+    if (!histogram)
+        histogram = new LatencyHistogram();
+    histogram->record(us);
+}
 
-                    message.media_size = child.getAttributeValue("size").toLongLong();
-                    message.media_mime_type = child.getAttributeValue("mimetype");
+/**
+    Forgets the messages and requests that never got an answer.
+*/
+void Connection::expireLatencyTracking()
+{
+    qint64 limit = LatencyHistogram::now() - LATENCY_TRACK_TIMEOUT;
 
-                    if (message.media_wa_type == FMessage::Video ||
-                        message.media_wa_type == FMessage::Audio) {
-                        message.media_duration_seconds = child.getAttributeValue("duration").toInt();
-                    }
-                    if (message.media_wa_type == FMessage::Image ||
-                        message.media_wa_type == FMessage::Video) {
-                        message.media_width = child.getAttributeValue("width").toInt();
-                        message.media_height = child.getAttributeValue("height").toInt();
-                    }
+    QMutexLocker locker(&latencyMutex);
 
-                    message.live = (child.getAttributeValue("origin") == "live");
+    QHash<QString, qint64>::iterator i = messageSendTimes.begin();
+    while (i != messageSendTimes.end())
+    {
+        if (i.value() < limit)
+            i = messageSendTimes.erase(i);
+        else
+            ++i;
+    }
 
-                    QString encoding = child.getAttributeValue("encoding");
-                    if (encoding == "raw") {
-                        message.setData(QString::fromUtf8(child.getData().toBase64().constData()));
-                    }
-                    else {
-                        message.setData(QString::fromUtf8(child.getData().data()));
-                    }
-                }
+    QHash<QString, QPair<QString, qint64> >::iterator j = iqSendTimes.begin();
+    while (j != iqSendTimes.end())
+    {
+        if (j.value().second < limit)
+            j = iqSendTimes.erase(j);
+        else
+            ++j;
+    }
+}
 
-                msgType = MessageReceived;
-                sendMessageReceived(message);
-            }
-            else if (child.getTag() == "received")
-            {
-                QString receipt_type = child.getAttributeValue("type");
-                Key k(from,true,id);
-                message = store.value(k);
-                if (message.key.id == id)
-                {
-                    message.status = (receipt_type == "played")
-                            ? FMessage::Played
-                            : FMessage::ReceivedByTarget;
-                    msgType = (from == "s.us") ? Unknown : MessageStatusUpdate;
+/**
+    Adds a message being sent to the store and the journal.
 
-                    // Remove it from the store if it's not a voice message
-                    // Or if it's a voice message already played
-                    if ((message.live && receipt_type == "played") || !message.live)
-                        store.remove(k);
-                }
-                if (receipt_type == "delivered" || receipt_type == "played" ||
-                    receipt_type.isEmpty())
-                {
-                    // Delivery Receipt received
-                    sendDeliveredReceiptAck(from,id,
-                                            (receipt_type.isEmpty()
-                                             ? "delivered"
-                                             : receipt_type));
-                }
-            }
-        }
-        message.broadcast = broadcast;
-        message.offline = offline;
+    @param message      FMessage being sent.
+*/
+void Connection::storePending(const FMessage &message)
+{
+    store.put(message);
+    trackMessageSent(message.key.getId());
 
-        switch (msgType)
-        {
-            case MessageReceived:
-                emit messageReceived(message);
-                break;
+    if (journal)
+        journal->put(message);
+}
 
-            case MessageStatusUpdate:
-                emit messageStatusUpdate(message.key.remote_jid, message.key.id, message.status);
-                break;
+/**
+    Adds several messages being sent to the store and the journal.
 
-            default:
-                break;
-        }
+    @param messages     FMessage objects being sent.
+*/
+void Connection::storePending(const QList<FMessage> &messages)
+{
+    store.putAll(messages);
+    foreach (const FMessage &message, messages)
+        trackMessageSent(message.key.getId());
 
-        // Increase data counters
-        if (msgType == MessageReceived)
-        {
-            counters->increaseCounter(DataCounters::Messages, 1, 0);
-            counters->increaseCounter(DataCounters::MessageBytes, messageNode.getSize(), 0);
-        }
-    }
-    else if (typeAttribute == "error")
+    if (journal)
     {
-        if (from.right(5) == "@g.us")
-            emit groupError(from);
+        foreach (const FMessage &message, messages)
+            journal->put(message);
     }
+}
+
+/**
+    Marks a sent message as acked in the journal.
+
+    @param key          Key of the message.
+*/
+void Connection::ackPending(const Key &key)
+{
+    if (journal)
+        journal->ack(key);
+}
+
+/**
+    Resends a batch of the messages recovered from the journal and
+    schedules the next one, so a long backlog doesn't stall the event loop.
+*/
+void Connection::resendPending()
+{
+    int count = qMin(resendQueue.size(), JOURNAL_RESEND_BATCH);
+    if (count == 0)
+        return;
+
+    qDebug() << "Resending" << count << "of" << resendQueue.size() << "pending messages";
 
-    counters->increaseCounter(DataCounters::ProtocolBytes, messageNode.getSize(), 0);
+    QList<FMessage> batch = resendQueue.mid(0, count);
+    resendQueue.erase(resendQueue.begin(), resendQueue.begin() + count);
+    sendMessages(batch);
 
+    if (journal)
+        journal->sync();
+
+    if (!resendQueue.isEmpty())
+        QTimer::singleShot(0, this, SLOT(resendPending()));
 }
 
 /**
@@ -926,6 +1503,17 @@ void Connection::checkActivity()
 {
     uint now = QDateTime::currentDateTime().toTime_t();
     qDebug() << "wakeup check activity. now:" << now << "last:" << lastActivity;
+
+    // Drop the messages that never got a receipt
+    int expired = store.expire();
+    if (expired > 0)
+        qDebug() << "expired" << expired << "messages from the store";
+
+    if (journal)
+        journal->sync();
+
+    expireLatencyTracking();
+
     if ((now - lastActivity) > 905) {
         qDebug() << "should reconnect";
         disconnectAndDelete();
@@ -1131,6 +1719,8 @@ int Connection::readSuccess()
 void Connection::parseSuccessNode(const ProtocolTreeNode &node)
 {
     if (node.getTag() == "success") {
+        WA_PROBE1(login_phase, WA_LOGIN_SUCCESS);
+
         // This has to be converted to a date object
         accountstatus = node.getAttributeValue("status");
         expiration = node.getAttributeValue("expiration");
@@ -1147,16 +1737,31 @@ void Connection::parseSuccessNode(const ProtocolTreeNode &node)
 
         nextChallenge = node.getData();
 
-        connect(socket,SIGNAL(readyRead()),this,SLOT(readNode()));
+        if (pipelined)
+        {
+            pipeline = new ConnectionPipeline(this, socket, in, out, this);
+            connect(pipeline, SIGNAL(socketBroken()), this, SLOT(finalCleanup()));
+            pipeline->start();
+        }
+        else
+            connect(socket,SIGNAL(readyRead()),this,SLOT(readNode()));
 
         //sendClientConfig("android");
         sendClientConfig("none");
 
         Q_EMIT authSuccess(creation, expiration, kind, accountstatus, nextChallenge);
 
+        if (journal)
+        {
+            resendQueue = journal->pending();
+            if (!resendQueue.isEmpty())
+                QTimer::singleShot(0, this, SLOT(resendPending()));
+        }
+
         lastActivity = QDateTime::currentDateTime().toTime_t();
     }
     else {
+        WA_PROBE1(login_phase, WA_LOGIN_FAILED);
         Q_EMIT authFailed();
 
         connectionClosed();
@@ -1181,8 +1786,8 @@ void Connection::sendCleanDirty(const QStringList &categories)
         iqNode.addChild(catNode);
     }
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 void Connection::sendGetDirty()
@@ -1201,8 +1806,8 @@ void Connection::sendGetDirty()
     iqNode.setAttributes(attrs);
     iqNode.addChild(statusNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 QString Connection::getMediaWAType(int type)
@@ -1260,6 +1865,84 @@ void Connection::sendMessage(const FMessage &message)
     }
 }
 
+/**
+    Sends several messages at once.
+
+    The messages are stored in one go and encoded into a single buffer
+    that is written and flushed once, which is much cheaper than calling
+    sendMessage() for each one when a backlog is drained.
+
+    @param messages     FMessage objects to send, in order.
+*/
+void Connection::sendMessages(const QList<FMessage> &messages)
+{
+    QList<FMessage> stored;
+    QList<ProtocolTreeNode> nodes;
+    QList<bool> isMessage;
+
+    foreach (const FMessage &message, messages)
+    {
+        ProtocolTreeNode node;
+
+        switch (message.type)
+        {
+            case FMessage::BodyMessage:
+                stored.append(message);
+                nodes.append(getBodyMessageNode(message));
+                isMessage.append(true);
+                break;
+
+            case FMessage::MediaMessage:
+                stored.append(message);
+                if (getMediaMessageNode(message, node))
+                {
+                    nodes.append(node);
+                    isMessage.append(true);
+                }
+                break;
+
+            case FMessage::RequestMediaMessage:
+                if (acceptCachedMedia(message))
+                    break;
+                stored.append(message);
+                nodes.append(getRequestMediaNode(message));
+                isMessage.append(false);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    // Add them to the store
+    storePending(stored);
+
+    QList<int> sizes;
+    out->writeBatch(nodes, &sizes);
+
+    int messageCount = 0;
+    qint64 messageBytes = 0;
+    qint64 protocolBytes = 0;
+    for (int i = 0; i < sizes.size(); i++)
+    {
+        if (isMessage.at(i))
+        {
+            messageCount++;
+            messageBytes += sizes.at(i);
+        }
+        else
+            protocolBytes += sizes.at(i);
+    }
+
+    if (messageCount > 0)
+    {
+        increaseCounter(DataCounters::Messages, 0, messageCount);
+        increaseCounter(DataCounters::MessageBytes, 0, messageBytes);
+    }
+    if (protocolBytes > 0)
+        increaseCounter(DataCounters::ProtocolBytes, 0, protocolBytes);
+}
+
 void Connection::sendSyncContacts(const QStringList &numbers)
 {
     qDebug() << "numbers:" << numbers;
@@ -1297,8 +1980,8 @@ void Connection::sendSyncContacts(const QStringList &numbers)
     iqNode.setAttributes(attrs);
     iqNode.addChild(syncNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /**
@@ -1307,6 +1990,24 @@ void Connection::sendSyncContacts(const QStringList &numbers)
     @param message      FMessage object containing the text message.
 */
 void Connection::sendMessageWithBody(const FMessage &message)
+{
+    // Add it to the store
+    storePending(message);
+
+    ProtocolTreeNode messageNode = getBodyMessageNode(message);
+
+    int bytes = out->write(messageNode);
+    increaseCounter(DataCounters::Messages, 0, 1);
+    increaseCounter(DataCounters::MessageBytes, 0, bytes);
+}
+
+/**
+    Constructs the node of a text message.
+
+    @param message      FMessage object containing the text message.
+    @return             ProtocolTreeNode object containing the message node.
+*/
+ProtocolTreeNode Connection::getBodyMessageNode(const FMessage &message)
 {
     QString text = QString::fromUtf8(message.data.data());
     text = text.replace("<br />", "\n")
@@ -1315,17 +2016,9 @@ void Connection::sendMessageWithBody(const FMessage &message)
                .replace("&gt;", ">")
                .replace("&amp;", "&");
 
-    // Add it to the store
-    store.put(message);
-
     ProtocolTreeNode bodyNode("body", text.toUtf8());
-    ProtocolTreeNode messageNode;
 
-    messageNode = getMessageNode(message, bodyNode);
-
-    int bytes = out->write(messageNode);
-    counters->increaseCounter(DataCounters::Messages, 0, 1);
-    counters->increaseCounter(DataCounters::MessageBytes, 0, bytes);
+    return getMessageNode(message, bodyNode);
 }
 
 /**
@@ -1338,17 +2031,68 @@ void Connection::sendMessageWithBody(const FMessage &message)
 */
 void Connection::requestMessageWithMedia(const FMessage &message)
 {
-    qDebug() << "key:" << message.key.remote_jid << ":" << message.key.id;
+    qDebug() << "key:" << message.key.getRemoteJid() << ":" << message.key.getId();
+
+    if (acceptCachedMedia(message))
+        return;
 
     // Add it to the store
-    store.put(message);
+    storePending(message);
+
+    ProtocolTreeNode iqNode = getRequestMediaNode(message);
+
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+}
+
+/**
+    Accepts an upload request locally if the media was already uploaded.
+    The message is completed as if the server answered "duplicate".
+
+    @param message      FMessage object whose data is the media hash.
+    @return             True if mediaUploadAccepted() was emitted.
+*/
+bool Connection::acceptCachedMedia(const FMessage &message)
+{
+    MediaCacheEntry entry;
+    if (!MediaCache::instance()->lookup(message.data, &entry))
+        return false;
+
+    qDebug() << "Media already uploaded:" << entry.url;
+
+    FMessage accepted = message;
+    FMessageMedia &media = accepted.mutableMedia();
+    media.media_url = entry.url;
+    if (!entry.mimeType.isEmpty())
+        media.media_mime_type = entry.mimeType;
+    if (entry.duration > 0)
+        media.media_duration_seconds = entry.duration;
+    if (entry.width > 0 && entry.height > 0)
+    {
+        media.media_width = entry.width;
+        media.media_height = entry.height;
+    }
+    accepted.status = FMessage::Uploaded;
 
+    emit mediaUploadAccepted(accepted);
+
+    return true;
+}
+
+/**
+    Constructs the upload request node of a multimedia message.
+
+    @param message      FMessage object containing the multimedia message.
+    @return             ProtocolTreeNode object containing the iq node.
+*/
+ProtocolTreeNode Connection::getRequestMediaNode(const FMessage &message)
+{
     AttributeList attrs;
 
     ProtocolTreeNode mediaNode("media");
     attrs.insert("hash", message.data);
     attrs.insert("type", getMediaWAType(message.media_wa_type));
-    attrs.insert("size", QString::number(message.media_size));
+    attrs.insert("size", QString::number(message.media().media_size));
     if (message.live)
         attrs.insert("origin","live");
 
@@ -1357,15 +2101,14 @@ void Connection::requestMessageWithMedia(const FMessage &message)
     ProtocolTreeNode iqNode("iq");
 
     attrs.clear();
-    attrs.insert("id", message.key.id);
+    attrs.insert("id", message.key.getId());
     attrs.insert("type","set");
     attrs.insert("to",domain);
     attrs.insert("xmlns","w:m");
     iqNode.setAttributes(attrs);
     iqNode.addChild(mediaNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    return iqNode;
 }
 
 /**
@@ -1377,58 +2120,70 @@ void Connection::sendMessageWithMedia(const FMessage& message)
 {
     qDebug() << "send media message";
     // Add it to the store
-    store.put(message);
+    storePending(message);
+
+    ProtocolTreeNode messageNode;
+    if (getMediaMessageNode(message, messageNode))
+    {
+        int bytes = out->write(messageNode);
+        increaseCounter(DataCounters::Messages, 0, 1);
+        increaseCounter(DataCounters::MessageBytes, 0, bytes);
+    }
+}
+
+/**
+    Constructs the node of a multimedia message.
 
+    @param message      FMessage object containing the multimedia message.
+    @param messageNode  ProtocolTreeNode object where the message node is stored.
+    @return             false if the message lacks the details to be sent.
+*/
+bool Connection::getMediaMessageNode(const FMessage &message, ProtocolTreeNode &messageNode)
+{
     // Global multimedia messages attributes
     AttributeList attrs;
     attrs.insert("type", getMediaWAType(message.media_wa_type));
 
-    if (message.media_wa_type == FMessage::Contact && !message.media_name.isEmpty())
+    if (message.media_wa_type == FMessage::Contact && !message.media().media_name.isEmpty())
     {
         ProtocolTreeNode cardNode("vcard", message.data);
         AttributeList cardattrs;
-        cardattrs.insert("name", message.media_name);
+        cardattrs.insert("name", message.media().media_name);
         cardNode.setAttributes(cardattrs);
 
         ProtocolTreeNode mediaNode("media");
         mediaNode.setAttributes(attrs);
         mediaNode.addChild(cardNode);
 
-        ProtocolTreeNode messageNode = getMessageNode(message, mediaNode);
-
-        int bytes = out->write(messageNode);
-        counters->increaseCounter(DataCounters::Messages, 0, 1);
-        counters->increaseCounter(DataCounters::MessageBytes, 0, bytes);
+        messageNode = getMessageNode(message, mediaNode);
+        return true;
     }
     else
-    if (message.media_wa_type == FMessage::Location && message.latitude != 0 && message.longitude != 0)
+    if (message.media_wa_type == FMessage::Location && message.media().latitude != 0 && message.media().longitude != 0)
     {
         ProtocolTreeNode mediaNode("media", message.data);
-        attrs.insert("latitude", QString::number(message.latitude));
-        attrs.insert("longitude", QString::number(message.longitude));
+        attrs.insert("latitude", QString::number(message.media().latitude));
+        attrs.insert("longitude", QString::number(message.media().longitude));
         mediaNode.setAttributes(attrs);
 
-        ProtocolTreeNode messageNode = getMessageNode(message, mediaNode);
-
-        int bytes = out->write(messageNode);
-        counters->increaseCounter(DataCounters::Messages, 0, 1);
-        counters->increaseCounter(DataCounters::MessageBytes, 0, bytes);
+        messageNode = getMessageNode(message, mediaNode);
+        return true;
     }
     else
-    if (!message.media_name.isEmpty() && !message.media_url.isEmpty() &&
-        message.media_size > 0)
+    if (!message.media().media_name.isEmpty() && !message.media().media_url.isEmpty() &&
+        message.media().media_size > 0)
     {
-        attrs.insert("file", message.media_name);
-        attrs.insert("size", QString::number(message.media_size));
-        attrs.insert("url", message.media_url);
+        attrs.insert("file", message.media().media_name);
+        attrs.insert("size", QString::number(message.media().media_size));
+        attrs.insert("url", message.media().media_url);
         if (message.live)
             attrs.insert("origin","live");
 
         if (message.media_wa_type == FMessage::Audio ||
             message.media_wa_type == FMessage::Video)
         {
-            attrs.insert("duration", QString::number(message.media_duration_seconds));
-            attrs.insert("seconds", QString::number(message.media_duration_seconds));
+            attrs.insert("duration", QString::number(message.media().media_duration_seconds));
+            attrs.insert("seconds", QString::number(message.media().media_duration_seconds));
         }
         if (message.data.size() > 0)
             attrs.insert("encoding","raw");
@@ -1436,12 +2191,11 @@ void Connection::sendMessageWithMedia(const FMessage& message)
         ProtocolTreeNode mediaNode("media", message.data);
         mediaNode.setAttributes(attrs);
 
-        ProtocolTreeNode messageNode = getMessageNode(message, mediaNode);
-
-        int bytes = out->write(messageNode);
-        counters->increaseCounter(DataCounters::Messages, 0, 1);
-        counters->increaseCounter(DataCounters::MessageBytes, 0, bytes);
+        messageNode = getMessageNode(message, mediaNode);
+        return true;
     }
+
+    return false;
 }
 
 /**
@@ -1462,16 +2216,16 @@ ProtocolTreeNode Connection::getMessageNode(const FMessage &message, const Proto
     xNode.addChild(serverNode);
 
     attrs.clear();
-    attrs.insert("id",message.key.id);
+    attrs.insert("id",message.key.getId());
     attrs.insert("type",child.getTag() == "body" ? "text" : "media");
-    attrs.insert("to",message.key.remote_jid);
+    attrs.insert("to",message.key.getRemoteJid());
 
-    qDebug() << "Message ID" << message.key.id;
+    qDebug() << "Message ID" << message.key.getId();
 
     ProtocolTreeNode messageNode("message");
 
     messageNode.setAttributes(attrs);
-    if (message.key.remote_jid == "broadcast") {
+    if (message.key.getRemoteJid() == "broadcast") {
         ProtocolTreeNode broadcast("broadcast");
         foreach (QString jid, message.broadcastJids) {
             ProtocolTreeNode broadcastChild("to");
@@ -1499,9 +2253,9 @@ void Connection::sendMessageReceived(const FMessage &message, const QString &typ
 
     ProtocolTreeNode messageNode("receipt");
     attrs.clear();
-    QString resource = message.broadcast ? message.remote_resource : message.key.remote_jid;
+    QString resource = message.broadcast ? message.remote_resource : message.key.getRemoteJid();
     attrs.insert("to",resource);
-    attrs.insert("id",message.key.id);
+    attrs.insert("id",message.key.getId());
     if (!type.isEmpty()) {
         attrs.insert("type", type);
     }
@@ -1509,7 +2263,7 @@ void Connection::sendMessageReceived(const FMessage &message, const QString &typ
     messageNode.setAttributes(attrs);
 
     int bytes = out->write(messageNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /**
@@ -1541,7 +2295,7 @@ void Connection::sendNotificationReceived(const QString &to, const QString &id,
     }
 
     int bytes = out->write(ackNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /**
@@ -1568,7 +2322,7 @@ void Connection::sendDeliveredReceiptAck(const QString &to, const QString &id, c
     node.setAttributes(attrs);
 
     int bytes = out->write(node);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 void Connection::sendReceiptAck(QString id, QString type)
@@ -1581,7 +2335,7 @@ void Connection::sendReceiptAck(QString id, QString type)
     ackNode.setAttributes(attrs);
 
     int bytes = out->write(ackNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /** ***********************************************************************
@@ -1612,8 +2366,8 @@ void Connection::sendQueryLastOnline(const QString &jid)
     iqNode.setAttributes(attrs);
     iqNode.addChild(queryNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /**
@@ -1650,8 +2404,8 @@ void Connection::sendGetStatus(const QStringList &jids)
     iqNode.setAttributes(attrs);
     iqNode.addChild(statusNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 void Connection::sendSetStatus(const QString &status)
@@ -1671,8 +2425,8 @@ void Connection::sendSetStatus(const QString &status)
 
     iqNode.addChild(statusNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /**
@@ -1693,7 +2447,7 @@ void Connection::sendPresenceSubscriptionRequest(const QString &jid)
     presenceNode.setAttributes(attrs);
 
     int bytes = out->write(presenceNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /**
@@ -1714,7 +2468,7 @@ void Connection::sendUnsubscribeHim(const QString &jid)
     presenceNode.setAttributes(attrs);
 
     int bytes = out->write(presenceNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 void Connection::sendDeleteFromRoster(const QString &jid)
@@ -1738,8 +2492,8 @@ void Connection::sendDeleteFromRoster(const QString &jid)
     iqNode.setAttributes(attrs);
     iqNode.addChild(child);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /** ***********************************************************************
@@ -1786,8 +2540,8 @@ void Connection::sendGetPhoto(const QString &jid, const QString &expectedPhotoId
     iqNode.setAttributes(attrs);
     iqNode.addChild(pictureNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /**
@@ -1834,8 +2588,8 @@ void Connection::sendSetPhoto(const QString &jid, const QByteArray &imageBytes,
         iqNode.addChild(thumbNode);
     }
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProfileBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProfileBytes, 0, bytes);
 }
 
 /**
@@ -1869,8 +2623,8 @@ void Connection::sendGetPhotoIds(const QStringList &jids)
     iqNode.setAttributes(attrs);
     iqNode.addChild(listNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /**
@@ -1890,7 +2644,7 @@ void Connection::sendVoiceNotePlayed(const FMessage &message)
     ProtocolTreeNode messageNode = getMessageNode(message, receivedNode);
 
     int bytes = out->write(messageNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 
@@ -1919,7 +2673,7 @@ void Connection::sendComposing(const QString &jid, const QString &media)
     messageNode.addChild(composingNode);
 
     int bytes = out->write(messageNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /**
@@ -1943,7 +2697,7 @@ void Connection::sendPaused(const QString &jid, const QString &media)
     messageNode.addChild(pausedNode);
 
     int bytes = out->write(messageNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 
@@ -1978,8 +2732,8 @@ void Connection::sendCreateGroupChat(const QString &subject)
     iqNode.setAttributes(attrs);
     iqNode.addChild(groupNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /**
@@ -2048,8 +2802,8 @@ void Connection::sendVerbParticipants(const QString &gjid, const QStringList &pa
     iqNode.setAttributes(attrs);
     iqNode.addChild(innerNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /**
@@ -2076,8 +2830,8 @@ void Connection::sendGetParticipants(const QString &gjid)
     iqNode.setAttributes(attrs);
     iqNode.addChild(listNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 void Connection::sendGetGroupInfo(const QString &gjid)
@@ -2099,8 +2853,8 @@ void Connection::sendGetGroupInfo(const QString &gjid)
     iqNode.setAttributes(attrs);
     iqNode.addChild(listNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /**
@@ -2140,8 +2894,8 @@ void Connection::sendGetGroups(const QString &id, const QString &type)
     iqNode.setAttributes(attrs);
     iqNode.addChild(listNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /**
@@ -2170,8 +2924,8 @@ void Connection::sendSetGroupSubject(const QString &gjid, const QString &subject
     iqNode.setAttributes(attrs);
     iqNode.addChild(subjectNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /**
@@ -2201,8 +2955,8 @@ void Connection::sendLeaveGroup(const QString &gjid)
     iqNode.setAttributes(attrs);
     iqNode.addChild(leaveNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 void Connection::sendRemoveGroup(const QString &gjid)
@@ -2223,8 +2977,8 @@ void Connection::sendRemoveGroup(const QString &gjid)
     iqNode.setAttributes(attrs);
     iqNode.addChild(groupNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /** ***********************************************************************
@@ -2258,8 +3012,8 @@ void Connection::sendGetPrivacyList()
     iqNode.setAttributes(attrs);
     iqNode.addChild(queryNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /**
@@ -2303,8 +3057,8 @@ void Connection::sendSetPrivacyBlockedList(const QStringList &jidList)
     iqNode.setAttributes(attrs);
     iqNode.addChild(queryNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 void Connection::sendGetPrivacySettings()
@@ -2324,8 +3078,8 @@ void Connection::sendGetPrivacySettings()
     ProtocolTreeNode privacyNode("privacy");
     iqNode.addChild(privacyNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 void Connection::sendSetPrivacySettings(const QString &name, const QString &value)
@@ -2351,8 +3105,8 @@ void Connection::sendSetPrivacySettings(const QString &name, const QString &valu
     privacyNode.addChild(categoryNode);
     iqNode.addChild(privacyNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /** ***********************************************************************
@@ -2368,7 +3122,7 @@ void Connection::sendNop()
     ProtocolTreeNode empty;
 
     int bytes = out->write(empty);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /**
@@ -2390,8 +3144,8 @@ void Connection::sendPing()
     iqNode.setAttributes(attrs);
     iqNode.addChild(pingNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /**
@@ -2409,8 +3163,19 @@ void Connection::sendPong(const QString &id)
     attrs.insert("to",domain);
     iqNode.setAttributes(attrs);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+}
+
+/**
+    Returns the id allocator of this connection.
+
+    Messages created with FMessage(jid, true, connection->getIdAllocator())
+    take their ids from it without contending with other connections.
+*/
+MessageIdAllocator *Connection::getIdAllocator()
+{
+    return &ids;
 }
 
 /**
@@ -2420,7 +3185,31 @@ void Connection::sendPong(const QString &id)
 */
 QString Connection::makeId(const QString &prefix)
 {
-    return prefix + QString::number(++iqid,16);
+    return ids.nextId(prefix);
+}
+
+/**
+    Writes an iq.  Requests (get and set) are tracked until their result
+    or error arrives, for the round trip latency by id prefix.
+
+    @param iqNode   Iq with an id made by makeId().
+    @return         Bytes written.
+*/
+int Connection::writeIq(ProtocolTreeNode &iqNode)
+{
+    QString type = iqNode.getAttributeValue("type");
+    QString id = iqNode.getAttributeValue("id");
+
+    if ((type == "get" || type == "set") && !id.isEmpty())
+    {
+        // Ids are the prefix given to makeId() and a hex sequence
+        QString prefix = id.left(id.lastIndexOf('_') + 1);
+
+        QMutexLocker locker(&latencyMutex);
+        iqSendTimes.insert(id, qMakePair(prefix, LatencyHistogram::now()));
+    }
+
+    return out->write(iqNode);
 }
 
 /**
@@ -2466,8 +3255,8 @@ void Connection::sendClientConfig(const QString &platform)
     iqNode.setAttributes(attrs);
     iqNode.addChild(configNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 void Connection::getClientConfig()
@@ -2487,8 +3276,8 @@ void Connection::getClientConfig()
     iqNode.setAttributes(attrs);
     iqNode.addChild(configNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 void Connection::sendGetServerProperties()
@@ -2508,8 +3297,8 @@ void Connection::sendGetServerProperties()
     iqNode.setAttributes(attrs);
     iqNode.addChild(propsNode);
 
-    int bytes = out->write(iqNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    int bytes = writeIq(iqNode);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 /**
@@ -2525,7 +3314,7 @@ void Connection::sendAvailableForChat(bool hide)
     presenceNode.setAttributes(attrs);
 
     int bytes = out->write(presenceNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 void Connection::sendAvailable()
@@ -2537,7 +3326,7 @@ void Connection::sendAvailable()
     presenceNode.setAttributes(attrs);
 
     int bytes = out->write(presenceNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 void Connection::sendUnavailable()
@@ -2549,7 +3338,7 @@ void Connection::sendUnavailable()
     presenceNode.setAttributes(attrs);
 
     int bytes = out->write(presenceNode);
-    counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+    increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
 
 void Connection::sendDeleteAccount()
@@ -2569,6 +3358,6 @@ void Connection::sendDeleteAccount()
      iqNode.setAttributes(attrs);
      iqNode.addChild(removeNode);
 
-     int bytes = out->write(iqNode);
-     counters->increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
+     int bytes = writeIq(iqNode);
+     increaseCounter(DataCounters::ProtocolBytes, 0, bytes);
 }
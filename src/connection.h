@@ -38,6 +38,9 @@
 #include <QList>
 #include <QMap>
 #include <QHash>
+#include <QMutex>
+#include <QPair>
+#include <QAtomicPointer>
 
 #include "util/messagedigest.h"
 #include "util/datacounters.h"
@@ -50,9 +53,16 @@
 #include "keystream.h"
 #include "fmessage.h"
 #include "funstore.h"
+#include "messageidallocator.h"
+#include "util/latencyhistogram.h"
+#include "util/stageaccounting.h"
 
 #include "libqtwa.h"
 
+class ConnectionPipeline;
+class StanzaCapture;
+class PendingJournal;
+
 /**
     @class      Connection
 
@@ -65,6 +75,9 @@ class LIBQTWA Connection : public QObject
 {
     Q_OBJECT
 
+    friend class ConnectionPipeline;
+    friend class StanzaReplay;
+
 public:
 
     /** ***********************************************************************
@@ -78,6 +91,15 @@ public:
         MessageStatusUpdate
     };
 
+    // Latencies measured
+    enum LatencyType {
+        ServerAckLatency = 0,       // message sent -> server ack
+        TargetReceiptLatency,       // message sent -> target receipt
+        InboundDispatchLatency,     // frame read -> messageReceived emitted
+        IqRoundTripLatency,         // <iq> sent -> result or error
+        TotalLatencyTypes
+    };
+
     /** ***********************************************************************
      ** Public members
      **/
@@ -120,6 +142,34 @@ public:
     // Login to the WhatsApp servers
     void login(const QByteArray &nextChallenge);
 
+    // Runs decryption, decoding and dispatch in their own threads after login
+    void setPipelined(bool enabled);
+
+    // Records the plain frames sent and received to a capture file
+    void setCapture(StanzaCapture *capture);
+
+    // Sets up the reader and writer without a socket, for StanzaReplay
+    void initOffline();
+
+    // Journal of the sent messages not acked yet.  Pending messages are
+    // resent after every successful login.
+    void setJournal(PendingJournal *journal);
+
+    // Allocator for the ids of the messages sent through this connection
+    MessageIdAllocator *getIdAllocator();
+
+    // Latencies measured by this connection, and by all of them
+    LatencyHistogram getLatency(LatencyType type);
+    static LatencyHistogram getAggregateLatency(LatencyType type);
+
+    // Round trip of <iq> requests by type (id prefix, e.g. "get_picture_")
+    static LatencyHistogram getIqLatency(const QString &requestType);
+    static QStringList getIqRequestTypes();
+
+    // CPU and wall time spent in each stage, off by default
+    void setStageAccounting(bool enabled);
+    const StageAccounting *getStageAccounting() const;
+
 private slots:
     void connectedToServer();
     void connectionClosed();
@@ -129,6 +179,9 @@ private slots:
     // Read next node
     void readNode();
 
+    // Resend the next batch of journaled messages
+    void resendPending();
+
 public slots:
 
     /** ***********************************************************************
@@ -149,6 +202,9 @@ public slots:
     // Sends a FMessage
     void sendMessage(const FMessage &message);
 
+    // Sends several FMessages with a single write and flush
+    void sendMessages(const QList<FMessage> &messages);
+
 
     /** ***********************************************************************
      ** User handling
@@ -338,12 +394,30 @@ private:
     // Timestamp of the last successfully node read
     qint64 lastTreeRead;
 
-    // Unique identifier for <iq> nodes
-    int iqid;
+    // Allocator of the ids of <iq> nodes and of messages
+    MessageIdAllocator ids;
 
     // Pointer to the DataCounters where network counters are being kept
     DataCounters *counters;
 
+    // Latency histograms and the send times of what awaits an answer
+    LatencyHistogram latency[TotalLatencyTypes];
+    QMutex latencyMutex;
+    QHash<QString, qint64> messageSendTimes;
+    QHash<QString, QPair<QString, qint64> > iqSendTimes;
+
+    // Arrival of the frame being dispatched
+    qint64 frameArrival;
+
+    // Stage times, stageAccounting is 0 while disabled
+    StageAccounting stages;
+    QAtomicPointer<StageAccounting> stageAccounting;
+
+    // Metrics series of this connection
+    int receivedMetrics[TOTAL_COUNTERS];
+    int sentMetrics[TOTAL_COUNTERS];
+    QList<int> stanzaMetrics;
+
     // Writer stream to send nodes
     BinTreeNodeWriter *out;
 
@@ -356,6 +430,21 @@ private:
     // Reader crypto stream
     KeyStream *inputKey;
 
+    // Use the multi-threaded pipeline after login
+    bool pipelined;
+
+    // Pipeline stages when running in pipelined mode
+    ConnectionPipeline *pipeline;
+
+    // Capture of the plain frames, if any
+    StanzaCapture *capture;
+
+    // Journal of the messages waiting for acks, if any
+    PendingJournal *journal;
+
+    // Journaled messages still to be resent after login
+    QList<FMessage> resendQueue;
+
     /** ***********************************************************************
      ** Private methods
      **/
@@ -363,6 +452,27 @@ private:
     // Reading socket data
     bool read();
 
+    // Dispatch a node read from the stream
+    void processNode(ProtocolTreeNode &node);
+
+    // Counters of the traffic of this connection
+    void registerMetrics();
+    void unregisterMetrics();
+    void increaseCounter(int counter, qint64 receivedBytes, qint64 sentBytes);
+    void countStanza(const QString &tag);
+
+    // Latency measurements
+    void recordLatency(LatencyType type, qint64 us);
+    void trackMessageSent(const QString &id);
+    void trackMessageAnswered(const QString &id, bool receipt);
+    void trackIqAnswered(const QString &id);
+    void expireLatencyTracking();
+
+    // Keep track of sent messages until they are acked
+    void storePending(const FMessage &message);
+    void storePending(const QList<FMessage> &messages);
+    void ackPending(const Key &key);
+
     // Parse a <message> node
     void parseMessageInitialTagAlreadyChecked(ProtocolTreeNode &messageNode);
 
@@ -413,6 +523,12 @@ private:
     // Sends a multimedia message
     void sendMessageWithMedia(const FMessage &message);
 
+    // Constructs the nodes sent by the methods above
+    ProtocolTreeNode getBodyMessageNode(const FMessage &message);
+    ProtocolTreeNode getRequestMediaNode(const FMessage &message);
+    bool acceptCachedMedia(const FMessage &message);
+    bool getMediaMessageNode(const FMessage &message, ProtocolTreeNode &messageNode);
+
     // Constructs a message node
     ProtocolTreeNode getMessageNode(const FMessage &message, const ProtocolTreeNode &child);
 
@@ -450,6 +566,7 @@ private:
 
     // Constructs an id
     QString makeId(const QString &prefix);
+    int writeIq(ProtocolTreeNode &iqNode);
 
 signals:
     // Connected to server
@@ -0,0 +1,309 @@
+#include <QDateTime>
+#include <QDebug>
+
+#include "connection.h"
+#include "bintreenodereader.h"
+#include "bintreenodewriter.h"
+#include "connectionpipeline.h"
+#include "util/latencyhistogram.h"
+#include "util/stageaccounting.h"
+#include "util/tracepoints.h"
+
+#define PIPELINE_QUEUE_SIZE     256
+
+/**
+    Thread running one of the pipeline stage loops.
+*/
+class PipelineStage : public QThread
+{
+public:
+    typedef void (ConnectionPipeline::*Loop)();
+
+    PipelineStage(ConnectionPipeline *pipeline, Loop loop, const QString &name)
+        : QThread(), pipeline(pipeline), loop(loop)
+    {
+        setObjectName(name);
+    }
+
+protected:
+    void run()
+    {
+        (pipeline->*loop)();
+    }
+
+private:
+    ConnectionPipeline *pipeline;
+    Loop loop;
+};
+
+ConnectionPipeline::ConnectionPipeline(Connection *connection, QTcpSocket *socket,
+                                       BinTreeNodeReader *in, BinTreeNodeWriter *out,
+                                       QObject *parent) :
+    QObject(parent),
+    rawQueue(PIPELINE_QUEUE_SIZE),
+    plainQueue(PIPELINE_QUEUE_SIZE),
+    encryptQueue(PIPELINE_QUEUE_SIZE),
+    sendQueue(PIPELINE_QUEUE_SIZE)
+{
+    this->connection = connection;
+    this->socket = socket;
+    this->in = in;
+    this->out = out;
+    this->hasPendingFrame = false;
+    this->running = false;
+
+    decryptStage = new PipelineStage(this, &ConnectionPipeline::runDecrypt, "wa-decrypt");
+    decodeStage = new PipelineStage(this, &ConnectionPipeline::runDecode, "wa-decode");
+    encryptStage = new PipelineStage(this, &ConnectionPipeline::runEncrypt, "wa-encrypt");
+}
+
+ConnectionPipeline::~ConnectionPipeline()
+{
+    stop();
+
+    delete decryptStage;
+    delete decodeStage;
+    delete encryptStage;
+}
+
+/**
+    Starts the stage threads and takes over the socket reads and the
+    writer output.
+
+    It has to be called from the socket thread once the session is encrypted.
+*/
+void ConnectionPipeline::start()
+{
+    if (running)
+        return;
+
+    running = true;
+
+    decryptStage->start();
+    decodeStage->start();
+    encryptStage->start();
+
+    out->setPipeline(this);
+
+    connect(socket, SIGNAL(readyRead()), this, SLOT(readFrames()));
+
+    // Frames could have arrived along with the authentication success
+    QMetaObject::invokeMethod(this, "readFrames", Qt::QueuedConnection);
+}
+
+/**
+    Stops the stage threads.  Frames still in the queues are discarded.
+*/
+void ConnectionPipeline::stop()
+{
+    if (!running)
+        return;
+
+    running = false;
+
+    disconnect(socket, SIGNAL(readyRead()), this, SLOT(readFrames()));
+
+    rawQueue.close();
+    plainQueue.close();
+    encryptQueue.close();
+    sendQueue.close();
+
+    decryptStage->wait();
+    decodeStage->wait();
+    encryptStage->wait();
+
+    sendOverflow.clear();
+
+    out->setPipeline(0);
+}
+
+void ConnectionPipeline::queueOutbound(const QByteArray &frame, qint32 dataBegin, bool needsFlush)
+{
+    Frame f;
+    f.data = frame;
+    f.dataBegin = dataBegin;
+    f.flush = needsFlush;
+
+    if (!encryptQueue.push(f))
+        qDebug() << "ConnectionPipeline: outbound frame dropped, pipeline stopped";
+}
+
+void ConnectionPipeline::readFrames()
+{
+    if (!running)
+        return;
+
+    connection->lastActivity = QDateTime::currentDateTime().toTime_t();
+
+    if (hasPendingFrame)
+    {
+        if (!pushRawFrame(pendingFrame))
+            return;
+
+        hasPendingFrame = false;
+        pendingFrame = Frame();
+    }
+
+    Frame frame;
+    while (in->nextFrame(frame.data, frame.flags))
+    {
+        frame.size = frame.data.size() + 3;
+        frame.arrival = LatencyHistogram::now();
+
+        if (!pushRawFrame(frame))
+        {
+            // Keep it until the decrypt stage makes room
+            pendingFrame = frame;
+            hasPendingFrame = true;
+            return;
+        }
+    }
+}
+
+bool ConnectionPipeline::pushRawFrame(const Frame &frame)
+{
+    if (rawQueue.tryPush(frame))
+        return true;
+
+    readBlocked.fetchAndStoreOrdered(1);
+
+    // The decrypt stage could have made room before seeing the flag
+    if (rawQueue.tryPush(frame))
+    {
+        readBlocked.testAndSetOrdered(1, 0);
+        return true;
+    }
+
+    return false;
+}
+
+void ConnectionPipeline::flushOutbound()
+{
+    flushScheduled.fetchAndStoreOrdered(0);
+
+    StageTimer timer(connection->stageAccounting.loadAcquire(), StageAccounting::Write);
+
+    bool needsFlush = false;
+    Frame frame;
+    while (sendQueue.tryPop(frame))
+    {
+        if (!writeFrame(frame))
+            return;
+        needsFlush |= frame.flush;
+    }
+
+    // The overflow follows the frames of the queue
+    QList<Frame> overflow;
+    overflowMutex.lock();
+    overflow.swap(sendOverflow);
+    overflowMutex.unlock();
+
+    foreach (const Frame &pending, overflow)
+    {
+        if (!writeFrame(pending))
+            return;
+        needsFlush |= pending.flush;
+    }
+
+    if (needsFlush)
+        socket->flush();
+}
+
+bool ConnectionPipeline::writeFrame(const Frame &frame)
+{
+    if (socket->write(frame.data) == -1)
+    {
+        qDebug() << "error writing buffer";
+        stageFailed();
+        return false;
+    }
+
+    // Frames only reach the pipeline once the session is encrypted
+    WA_PROBE2(frame_written, frame.data.size() - frame.dataBegin, 1);
+
+    return true;
+}
+
+/**
+    Hands an encrypted frame to the socket thread without waiting for it.
+    Once a frame overflows, the next ones follow it in the overflow list so
+    the order is kept.
+*/
+void ConnectionPipeline::pushSendFrame(const Frame &frame)
+{
+    QMutexLocker locker(&overflowMutex);
+
+    if (sendOverflow.isEmpty() && sendQueue.tryPush(frame))
+        return;
+
+    sendOverflow.append(frame);
+}
+
+void ConnectionPipeline::stageFailed()
+{
+    if (!running)
+        return;
+
+    qDebug() << "ConnectionPipeline: stage failed, closing connection";
+
+    QObject::disconnect(socket, 0, 0, 0);
+    socket->disconnectFromHost();
+    Q_EMIT socketBroken();
+}
+
+/*
+ * Stage loops
+ */
+
+void ConnectionPipeline::runDecrypt()
+{
+    Frame frame;
+    while (rawQueue.pop(frame))
+    {
+        if (readBlocked.testAndSetOrdered(1, 0))
+            QMetaObject::invokeMethod(this, "readFrames", Qt::QueuedConnection);
+
+        if (!in->decryptFrame(frame.flags, frame.data))
+        {
+            QMetaObject::invokeMethod(this, "stageFailed", Qt::QueuedConnection);
+            return;
+        }
+
+        if (!plainQueue.push(frame))
+            return;
+    }
+}
+
+void ConnectionPipeline::runDecode()
+{
+    Frame frame;
+    while (plainQueue.pop(frame))
+    {
+        ProtocolTreeNode node;
+        node.setSize(frame.size);
+
+        if (in->decodeTree(frame.data, node, frame.arrival))
+        {
+            connection->frameArrival = frame.arrival;
+            connection->processNode(node);
+        }
+        else
+            qDebug() << "Error reading tree";
+    }
+}
+
+void ConnectionPipeline::runEncrypt()
+{
+    Frame frame;
+    while (encryptQueue.pop(frame))
+    {
+        out->encryptFrame(frame.data, frame.dataBegin);
+
+        // The socket thread may be busy sending these frames, waiting for
+        // it here would deadlock
+        pushSendFrame(frame);
+
+        if (flushScheduled.testAndSetOrdered(0, 1))
+            QMetaObject::invokeMethod(this, "flushOutbound", Qt::QueuedConnection);
+    }
+}
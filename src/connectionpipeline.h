@@ -0,0 +1,124 @@
+#ifndef CONNECTIONPIPELINE_H
+#define CONNECTIONPIPELINE_H
+
+#include <QObject>
+#include <QThread>
+#include <QTcpSocket>
+#include <QByteArray>
+#include <QAtomicInt>
+#include <QMutex>
+#include <QList>
+
+#include "util/spscqueue.h"
+
+class Connection;
+class BinTreeNodeReader;
+class BinTreeNodeWriter;
+class PipelineStage;
+
+/**
+    @class      ConnectionPipeline
+
+    @brief      Splits the work of a busy Connection across several threads.
+
+                Inbound: the socket thread reads whole frames, a decrypt stage
+                verifies and decrypts them in sequence order and a decode stage
+                builds the trees and dispatches them to the Connection.
+
+                Outbound: nodes are encoded by the calling thread, an encrypt
+                stage encrypts them in sequence order and the socket thread
+                writes them.
+
+                Stages are connected by bounded SPSC queues.  The socket thread
+                never blocks: when the inbound queue is full the bytes are left
+                in the socket buffer until the decrypt stage makes room.
+
+                The encrypt stage never blocks either.  Frames that don't fit
+                in the send queue wait in an overflow list until the socket
+                thread returns to its event loop, so a caller sending many
+                nodes at once only waits for the encryption.
+*/
+
+class ConnectionPipeline : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Frame
+    {
+        Frame() : arrival(0), dataBegin(0), size(0), flags(0), flush(false) {}
+
+        QByteArray data;
+        qint64 arrival;
+        qint32 dataBegin;
+        qint32 size;
+        qint8 flags;
+        bool flush;
+    };
+
+    explicit ConnectionPipeline(Connection *connection, QTcpSocket *socket,
+                                BinTreeNodeReader *in, BinTreeNodeWriter *out,
+                                QObject *parent = 0);
+    ~ConnectionPipeline();
+
+    void start();
+    void stop();
+
+    // Queues an encoded frame to be encrypted and written.
+    // Callers must be serialized (BinTreeNodeWriter holds its write mutex).
+    void queueOutbound(const QByteArray &frame, qint32 dataBegin, bool needsFlush);
+
+public slots:
+    // Reads all the complete frames available in the socket
+    void readFrames();
+
+private slots:
+    void flushOutbound();
+    void stageFailed();
+
+signals:
+    void socketBroken();
+
+private:
+    friend class PipelineStage;
+
+    Connection *connection;
+    QTcpSocket *socket;
+    BinTreeNodeReader *in;
+    BinTreeNodeWriter *out;
+
+    // Inbound queues
+    SpscQueue<Frame> rawQueue;
+    SpscQueue<Frame> plainQueue;
+
+    // Outbound queues
+    SpscQueue<Frame> encryptQueue;
+    SpscQueue<Frame> sendQueue;
+
+    // Encrypted frames that didn't fit in sendQueue, newer than its frames
+    QMutex overflowMutex;
+    QList<Frame> sendOverflow;
+
+    PipelineStage *decryptStage;
+    PipelineStage *decodeStage;
+    PipelineStage *encryptStage;
+
+    // Frame read from the socket that didn't fit in the raw queue
+    Frame pendingFrame;
+    bool hasPendingFrame;
+
+    QAtomicInt readBlocked;
+    QAtomicInt flushScheduled;
+    bool running;
+
+    bool pushRawFrame(const Frame &frame);
+    void pushSendFrame(const Frame &frame);
+    bool writeFrame(const Frame &frame);
+
+    // Stage loops
+    void runDecrypt();
+    void runDecode();
+    void runEncrypt();
+};
+
+#endif // CONNECTIONPIPELINE_H
@@ -28,67 +28,52 @@
 
 #include <QDateTime>
 
-#include "src/client.h"
 #include "funstore.h"
 #include "key.h"
 #include "fmessage.h"
+#include "messageidallocator.h"
 #include "util/utilities.h"
+#include "util/base64.h"
 
-QMutex FMessage::mutex;
+Q_GLOBAL_STATIC(FMessageMedia, emptyMedia)
 
+FMessageMedia::FMessageMedia()
+{
+    latitude = 0.0;
+    longitude = 0.0;
+    media_duration_seconds = 0;
+    media_width = 0;
+    media_height = 0;
+    media_size = 0;
+}
+
+/**
+    Constructs an empty message.  Used for inbound messages, so no id or
+    timestamp is generated: the reader sets both.
+*/
 FMessage::FMessage()
 {
     initialize();
-    generateTimestamp();
     this->status = Unsent;
     this->type = UndefinedMessage;
 }
 
-/*FMessage::FMessage(const FMessage &msg)
-{
-    this->data = msg.data;
-    this->thumb_image = msg.thumb_image;
-    this->timestamp = msg.timestamp;
-    this->key = msg.key;
-    this->status = msg.status;
-    this->notify_name = msg.notify_name;
-    this->remote_resource = msg.remote_resource;
-    this->type = msg.type;
-
-    this->latitude = msg.latitude;
-    this->longitude = msg.longitude;
-
-    this->live = msg.live;
-    this->broadcast = msg.broadcast;
-    this->offline = msg.offline;
-    this->broadcastJids = msg.broadcastJids;
-
-    this->media_duration_seconds = msg.media_duration_seconds;
-    this->media_mime_type = msg.media_mime_type;
-    this->media_name = msg.media_name;
-    this->media_size = msg.media_size;
-    this->media_url = msg.media_url;
-    this->media_wa_type = msg.media_wa_type;
-
-    this->local_file_uri = msg.local_file_uri;
-}*/
-
-FMessage::FMessage(QString remote_jid, QByteArray data, QString thumb_image)
+FMessage::FMessage(QString remote_jid, QByteArray data, QByteArray thumb_image)
 {
     initialize();
     generateTimestamp();
-    generateID();
+    generateID(MessageIdAllocator::global());
     init(remote_jid, true);
     this->data = data;
     this->thumb_image = thumb_image;
     this->type = UndefinedMessage;
 }
 
-FMessage::FMessage(QString remote_jid, QString data, QString thumb_image)
+FMessage::FMessage(QString remote_jid, QString data, QByteArray thumb_image)
 {
     initialize();
     generateTimestamp();
-    generateID();
+    generateID(MessageIdAllocator::global());
     init(remote_jid, true);
     this->data = data.toUtf8();
     this->thumb_image = thumb_image;
@@ -100,7 +85,7 @@ FMessage::FMessage(QString remote_jid, bool from_me, QString id)
     initialize();
     generateTimestamp();
     init(remote_jid, from_me);
-    this->key.id = id;
+    this->key.setId(id);
     this->type = UndefinedMessage;
 }
 
@@ -108,33 +93,36 @@ FMessage::FMessage(QString remote_jid, bool from_me)
 {
     initialize();
     generateTimestamp();
-    generateID();
+    generateID(MessageIdAllocator::global());
     init(remote_jid,from_me);
 }
 
-void FMessage::init(QString remote_jid, bool from_me)
+/**
+    Constructs an outbound message with an id from the allocator of a
+    connection.
+*/
+FMessage::FMessage(QString remote_jid, bool from_me, MessageIdAllocator *ids)
 {
-    // this should be synchronized, I dunno why
-    // to not create two messages with the same ID
+    initialize();
+    generateTimestamp();
+    generateID(ids);
+    init(remote_jid, from_me);
+}
 
-    this->key.remote_jid = remote_jid;
-    this->key.from_me = from_me;
+void FMessage::init(QString remote_jid, bool from_me)
+{
+    this->key = Key(remote_jid, from_me, key.getId());
     this->status = Unsent;
 }
 
 void FMessage::generateTimestamp()
 {
-    mutex.lock();
-    timestamp = QDateTime::currentDateTime().toTime_t();
-    mutex.unlock();
+    timestamp = QDateTime::currentMSecsSinceEpoch() / 1000;
 }
 
-void FMessage::generateID()
+void FMessage::generateID(MessageIdAllocator *ids)
 {
-    this->key.id = QString::number(timestamp) + "-" +
-                   QString::number(Client::seq);
-
-    Client::seq++;
+    this->key.setId(ids->nextMessageId(timestamp));
 }
 
 void FMessage::setData(QByteArray data)
@@ -152,11 +140,21 @@ void FMessage::setTimestamp(qint64 timestamp)
     this->timestamp = timestamp;
 }
 
-void FMessage::setThumbImage(QString thumb_image)
+void FMessage::setThumbImage(QByteArray thumb_image)
 {
     this->thumb_image = thumb_image;
 }
 
+QString FMessage::getDataBase64() const
+{
+    return Base64::toString(data);
+}
+
+QString FMessage::getThumbImageBase64() const
+{
+    return Base64::toString(thumb_image);
+}
+
 void FMessage::setKey(Key k)
 {
     this->key = k;
@@ -209,34 +207,99 @@ QString FMessage::getMediaWAType()
 void FMessage::initialize()
 {
     this->data = QByteArray();
-    this->thumb_image = QString();
+    this->thumb_image = QByteArray();
     this->timestamp = 0;
-    this->key.from_me = false;
-    this->key.id = QString();
-    this->key.remote_jid = QString();
+    this->key = Key();
     this->status = Unsent;
     this->notify_name = QString();
     this->remote_resource = QString();
     this->type = UndefinedMessage;
 
-    this->latitude = 0.0;
-    this->longitude = 0.0;
-
     this->live = false;
     this->broadcast = false;
     this->offline = false;
     QList<QString> jids;
     this->broadcastJids = jids;
-
-    this->media_duration_seconds = 0;
-    this->media_mime_type = QString();
-    this->media_name = QString();
-    this->media_size = 0;
-    this->media_url = QString();
     this->media_wa_type = Text;
-    this->media_width = 0;
-    this->media_height = 0;
 
-    this->local_file_uri = QString();
+    this->mediaData = 0;
+}
+
+bool FMessage::hasMedia() const
+{
+    return mediaData.constData() != 0;
+}
+
+const FMessageMedia &FMessage::media() const
+{
+    if (mediaData.constData())
+        return *mediaData.constData();
+
+    return *emptyMedia();
+}
+
+FMessageMedia &FMessage::mutableMedia()
+{
+    if (!mediaData.constData())
+        mediaData = new FMessageMedia;
+
+    return *mediaData.data();
 }
 
+QDataStream &operator<<(QDataStream &out, const FMessageMedia &media)
+{
+    out << media.latitude << media.longitude << media.media_duration_seconds
+        << (qint32) media.media_width << (qint32) media.media_height
+        << media.media_mime_type << media.media_name << media.media_size
+        << media.media_url << media.local_file_uri;
+
+    return out;
+}
+
+QDataStream &operator>>(QDataStream &in, FMessageMedia &media)
+{
+    qint32 width, height;
+
+    in >> media.latitude >> media.longitude >> media.media_duration_seconds
+       >> width >> height
+       >> media.media_mime_type >> media.media_name >> media.media_size
+       >> media.media_url >> media.local_file_uri;
+
+    media.media_width = width;
+    media.media_height = height;
+
+    return in;
+}
+
+QDataStream &operator<<(QDataStream &out, const FMessage &message)
+{
+    out << message.key << message.data << message.thumb_image << message.timestamp
+        << (qint32) message.status << message.notify_name << message.remote_resource
+        << (qint32) message.type << message.live << message.broadcast << message.offline
+        << (qint32) message.media_wa_type << message.broadcastJids << message.hasMedia();
+
+    if (message.hasMedia())
+        out << message.media();
+
+    return out;
+}
+
+QDataStream &operator>>(QDataStream &in, FMessage &message)
+{
+    qint32 status, type, waType;
+    bool hasMedia;
+
+    in >> message.key >> message.data >> message.thumb_image >> message.timestamp
+       >> status >> message.notify_name >> message.remote_resource
+       >> type >> message.live >> message.broadcast >> message.offline
+       >> waType >> message.broadcastJids >> hasMedia;
+
+    if (hasMedia)
+        in >> message.mutableMedia();
+
+    message.status = (FMessage::Status) status;
+    message.type = (FMessage::ContentType) type;
+    message.media_wa_type = waType;
+
+    return in;
+}
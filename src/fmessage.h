@@ -31,10 +31,37 @@
 
 #include <QObject>
 #include <QString>
-#include <QMutex>
+#include <QDataStream>
+#include <QSharedData>
+#include <QSharedDataPointer>
 
 #include "key.h"
 
+class MessageIdAllocator;
+
+/**
+    Media and location details of a message.  Only media messages carry
+    one, shared between copies until one of them changes it.
+*/
+class FMessageMedia : public QSharedData
+{
+public:
+    FMessageMedia();
+
+    double latitude;
+    double longitude;
+
+    qint32 media_duration_seconds;
+    int media_width;
+    int media_height;
+    QString media_mime_type;
+    QString media_name;
+    qint64 media_size;
+    QString media_url;
+
+    QString local_file_uri;
+};
+
 class FMessage
 {
 public:
@@ -73,20 +100,39 @@ public:
     FMessage();
     FMessage(QString remote_jid, bool from_me);
     FMessage(QString remote_jid, bool from_me, QString id);
-    FMessage(QString remote_jid, QByteArray data, QString thumb_image);
-    FMessage(QString remote_jid, QString data, QString thumb_image);
+    FMessage(QString remote_jid, bool from_me, MessageIdAllocator *ids);
+    FMessage(QString remote_jid, QByteArray data, QByteArray thumb_image);
+    FMessage(QString remote_jid, QString data, QByteArray thumb_image);
+
+    FMessage(const FMessage &other) = default;
+    FMessage(FMessage &&other) = default;
+    FMessage &operator=(const FMessage &other) = default;
+    FMessage &operator=(FMessage &&other) = default;
 
     void setKey(Key k);
     void setRemoteJid(QString remote_jid);
     void setData(QByteArray data);
     void setData(QString data);
     void setTimestamp(qint64 timestamp);
-    void setThumbImage(QString thumb_image);
+    void setThumbImage(QByteArray thumb_image);
+
+    // Base64 of data and thumb_image, encoded on every call.  Use them only
+    // where text is needed, the blobs themselves are binary.
+    QString getDataBase64() const;
+    QString getThumbImageBase64() const;
     void setMediaWAType(QString type);
     QString getMediaWAType();
 
+    // Media and location details.  media() returns empty details for
+    // messages without them; mutableMedia() creates or detaches them.
+    bool hasMedia() const;
+    const FMessageMedia &media() const;
+    FMessageMedia &mutableMedia();
+
+    // Text of body messages.  For media messages the binary thumbnail, or
+    // the vcard or location data.
     QByteArray data;
-    QString thumb_image;
+    QByteArray thumb_image;
     qint64 timestamp;
     Key key;
     Status status;
@@ -94,33 +140,27 @@ public:
     QString remote_resource;
     ContentType type;
 
-    double latitude;
-    double longitude;
-
     bool live;
     bool broadcast;
     bool offline;
-    QList<QString> broadcastJids;
-
-    qint32 media_duration_seconds;
-    int media_width;
-    int media_height;
-    QString media_mime_type;
-    QString media_name;
-    qint64 media_size;
-    QString media_url;
     int media_wa_type;
-
-    QString local_file_uri;
-
+    QList<QString> broadcastJids;
 
 private:
-    static QMutex mutex;
+    QSharedDataPointer<FMessageMedia> mediaData;
 
     void initialize();
     void init(QString remote_jid, bool from_me);
     void generateTimestamp();
-    void generateID();
+    void generateID(MessageIdAllocator *ids);
 };
 
+Q_DECLARE_TYPEINFO(FMessage, Q_MOVABLE_TYPE);
+
+// Serialization, used by the pending messages journal
+QDataStream &operator<<(QDataStream &out, const FMessage &message);
+QDataStream &operator>>(QDataStream &in, FMessage &message);
+QDataStream &operator<<(QDataStream &out, const FMessageMedia &media);
+QDataStream &operator>>(QDataStream &in, FMessageMedia &media);
+
 #endif // FMESSAGE_H
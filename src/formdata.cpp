@@ -26,19 +26,65 @@
  * official policies, either expressed or implied, of the copyright holder.
  */
 
+#include <QFileInfo>
+
 #include "formdata.h"
 
 #include "util/utilities.h"
 
-#define  BUFFER_SIZE    0x1000
-
 FormData::FormData()
 {
 }
 
-void FormData::write(QBuffer& out)
+FormData::~FormData()
+{
+}
+
+QByteArray FormData::header(const QString &boundary)
+{
+    QByteArray header;
+
+    header.append("--");
+    header.append(boundary.toUtf8());
+    header.append("\r\n");
+    header.append("Content-Disposition: form-data; name=\"");
+    header.append(name.toUtf8());
+    header.append("\"");
+
+    if (!fileName.isEmpty())
+    {
+        header.append("; filename=\"");
+        header.append(fileName.toUtf8());
+        header.append("\"");
+    }
+    header.append("\r\n");
+
+    if (!contentType.isEmpty())
+    {
+        header.append("Content-Type: ");
+        header.append(contentType.toUtf8());
+        header.append("\r\n");
+    }
+    header.append("\r\n");
+
+    return header;
+}
+
+bool FormData::open()
+{
+    return true;
+}
+
+qint64 FormData::read(char *data, qint64 maxSize)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(maxSize);
+
+    return 0;
+}
+
+void FormData::close()
 {
-    Q_UNUSED(out);
 }
 
 qint64 FormData::length()
@@ -54,16 +100,36 @@ qint64 FormData::length()
 
 FormDataString::FormDataString() : FormData()
 {
+    pos = 0;
 }
 
-void FormDataString::write(QBuffer& out)
+bool FormDataString::open()
 {
-    out.write(content.toUtf8());
+    utf8 = content.toUtf8();
+    pos = 0;
+
+    return true;
+}
+
+qint64 FormDataString::read(char *data, qint64 maxSize)
+{
+    qint64 size = qMin(maxSize, utf8.size() - pos);
+
+    memcpy(data, utf8.constData() + pos, size);
+    pos += size;
+
+    return size;
+}
+
+void FormDataString::close()
+{
+    utf8.clear();
 }
 
 qint64 FormDataString::length()
 {
-    return content.length();
+    // Bytes, not characters
+    return content.toUtf8().size();
 }
 
 /*
@@ -76,31 +142,32 @@ FormDataFile::FormDataFile() : FormData()
 {
 }
 
-void FormDataFile::write(QBuffer& out)
+bool FormDataFile::open()
 {
-    QFile file(uri);
+    file.setFileName(uri);
 
-    qDebug() << "Filename:" << fileName;
+    // The reads are already done in large chunks
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Unbuffered))
+    {
+        qDebug() << "FormDataFile: can't open" << uri << file.errorString();
+        return false;
+    }
 
-    if (!file.open(QIODevice::ReadOnly))
-        return;
+    return true;
+}
 
-    while (file.bytesAvailable() > 0)
-        out.write(file.read(BUFFER_SIZE));
+qint64 FormDataFile::read(char *data, qint64 maxSize)
+{
+    return file.read(data, maxSize);
+}
 
+void FormDataFile::close()
+{
     file.close();
 }
 
 qint64 FormDataFile::length()
 {
-    QFile file(fileName);
-
-    if (!file.open(QIODevice::ReadOnly))
-        return 0;
-
-    qint64 size = file.size();
-
-    file.close();
-
-    return size;
+    return QFileInfo(uri).size();
 }
+
@@ -30,10 +30,13 @@
 #define FORMDATA_H
 
 #include <QByteArray>
-#include <QBuffer>
 #include <QString>
 #include <QFile>
 
+// Parts are streamed: open() before the first read(), read() until length()
+// bytes are returned and close() at the end.  Nothing is loaded in memory
+// except by FormDataString.
+
 class FormData
 {
 public:
@@ -42,8 +45,16 @@ public:
     QString name;
 
     FormData();
+    virtual ~FormData();
+
+    // Part headers, including the boundary line before them
+    QByteArray header(const QString &boundary);
+
+    virtual bool open();
+    virtual qint64 read(char *data, qint64 maxSize);
+    virtual void close();
 
-    virtual void write(QBuffer& out);
+    // Bytes of the content, without the part headers
     virtual qint64 length();
 };
 
@@ -54,9 +65,14 @@ public:
 
     FormDataString();
 
-    void write(QBuffer& out);
+    bool open();
+    qint64 read(char *data, qint64 maxSize);
+    void close();
     qint64 length();
 
+private:
+    QByteArray utf8;
+    qint64 pos;
 };
 
 
@@ -67,9 +83,13 @@ public:
 
     FormDataFile();
 
-    void write(QBuffer& out);
+    bool open();
+    qint64 read(char *data, qint64 maxSize);
+    void close();
     qint64 length();
 
+private:
+    QFile file;
 };
 
 #endif
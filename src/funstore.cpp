@@ -26,13 +26,383 @@
  * official policies, either expressed or implied, of the copyright holder.
  */
 
+#include <QDateTime>
+#include <QMutexLocker>
+
+#include <climits>
+
 #include "funstore.h"
 
-FunStore::FunStore() : QHash<Key,FMessage>()
+FunStore::FunStore()
+{
+    ttl.store(FUNSTORE_TTL);
+    maxEntries.store(FUNSTORE_MAX_ENTRIES);
+    maxBytes.store(FUNSTORE_MAX_BYTES);
+}
+
+FunStore::Shard &FunStore::shardFor(const Key &key)
+{
+    return shards[key.getJidHash() % FUNSTORE_SHARDS];
+}
+
+const FunStore::Shard &FunStore::shardFor(const Key &key) const
 {
+    return shards[key.getJidHash() % FUNSTORE_SHARDS];
 }
 
+/**
+    Approximate memory used by a message, to enforce the byte limit.
+*/
+int FunStore::messageSize(const FMessage &message)
+{
+    int size = sizeof(FMessage) + message.data.size() + message.thumb_image.size() +
+            (message.key.getId().size() +
+             message.key.getRemoteJid().size()) * 2;
+
+    if (message.hasMedia())
+    {
+        const FMessageMedia &media = message.media();
+        size += sizeof(FMessageMedia) + (media.media_url.size() + media.media_name.size() +
+                media.media_mime_type.size() + media.local_file_uri.size()) * 2;
+    }
+
+    return size;
+}
+
+/**
+    Adds a message to the store, replacing any message with the same key.
+
+    @param message      FMessage to add.
+*/
 void FunStore::put(const FMessage &message)
 {
-    insert(message.key,message);
+    insert(message);
+    enforceLimits();
+}
+
+/**
+    Adds several messages to the store.  Limits are only enforced once.
+
+    @param messages     List of FMessage to add.
+*/
+void FunStore::putAll(const QList<FMessage> &messages)
+{
+    foreach (const FMessage &message, messages)
+        insert(message);
+
+    enforceLimits();
+}
+
+void FunStore::insert(const FMessage &message)
+{
+    Entry entry;
+    entry.message = message;
+    entry.sequence = nextSequence.fetchAndAddRelaxed(1);
+    entry.inserted = QDateTime::currentMSecsSinceEpoch();
+    entry.bytes = messageSize(message);
+
+    Shard &shard = shardFor(message.key);
+    {
+        QMutexLocker locker(&shard.mutex);
+
+        removeEntry(shard, message.key);
+
+        shard.entries.insert(message.key, entry);
+        shard.order.insert(entry.sequence, message.key);
+        entryCount.fetchAndAddRelaxed(1);
+        totalBytes.fetchAndAddRelaxed(entry.bytes);
+    }
+
+    QMutexLocker locker(&indexMutex);
+    idIndex.insert(message.key.getId(), message.key);
+}
+
+/*
+ * Removes an entry from a shard.  The shard must be locked.
+ * The id index is left alone, lookups through it check the shard anyway.
+ */
+bool FunStore::removeEntry(Shard &shard, const Key &key, FMessage *message)
+{
+    QHash<Key, Entry>::iterator i = shard.entries.find(key);
+    if (i == shard.entries.end())
+        return false;
+
+    if (message)
+        *message = i.value().message;
+
+    shard.order.remove(i.value().sequence);
+    entryCount.fetchAndAddRelaxed(-1);
+    totalBytes.fetchAndAddRelaxed(-i.value().bytes);
+    shard.entries.erase(i);
+
+    return true;
+}
+
+/*
+ * Removes the id index entry of a key, if it still points to it
+ */
+void FunStore::unindex(const Key &key)
+{
+    QMutexLocker locker(&indexMutex);
+
+    QHash<QString, Key>::iterator i = idIndex.find(key.getId());
+    if (i != idIndex.end() && i.value() == key)
+        idIndex.erase(i);
+}
+
+FMessage FunStore::value(const Key &key) const
+{
+    const Shard &shard = shardFor(key);
+    QMutexLocker locker(&shard.mutex);
+
+    QHash<Key, Entry>::const_iterator i = shard.entries.constFind(key);
+    if (i == shard.entries.constEnd())
+        return FMessage();
+
+    return i.value().message;
+}
+
+FMessage FunStore::take(const Key &key)
+{
+    FMessage message;
+    bool found;
+
+    {
+        Shard &shard = shardFor(key);
+        QMutexLocker locker(&shard.mutex);
+        found = removeEntry(shard, key, &message);
+    }
+
+    if (found)
+        unindex(key);
+
+    return message;
+}
+
+bool FunStore::contains(const Key &key) const
+{
+    const Shard &shard = shardFor(key);
+    QMutexLocker locker(&shard.mutex);
+
+    return shard.entries.contains(key);
+}
+
+void FunStore::remove(const Key &key)
+{
+    take(key);
+}
+
+/**
+    Looks up a message by id only.
+
+    Used by the media upload results, which only carry the message id.
+
+    @param id       Message id.
+    @return         The message, or a default FMessage if not found.
+*/
+FMessage FunStore::valueById(const QString &id) const
+{
+    Key key;
+    {
+        QMutexLocker locker(&indexMutex);
+        QHash<QString, Key>::const_iterator i = idIndex.constFind(id);
+        if (i == idIndex.constEnd())
+            return FMessage();
+        key = i.value();
+    }
+
+    return value(key);
+}
+
+FMessage FunStore::takeById(const QString &id)
+{
+    Key key;
+    {
+        QMutexLocker locker(&indexMutex);
+        QHash<QString, Key>::iterator i = idIndex.find(id);
+        if (i == idIndex.end())
+            return FMessage();
+        key = i.value();
+        idIndex.erase(i);
+    }
+
+    FMessage message;
+    Shard &shard = shardFor(key);
+    QMutexLocker locker(&shard.mutex);
+    removeEntry(shard, key, &message);
+
+    return message;
+}
+
+/**
+    Drops the messages that have been waiting longer than the time to live.
+
+    @return     Number of messages dropped.
+*/
+int FunStore::expire()
+{
+    int seconds = ttl.load();
+    if (seconds <= 0)
+        return 0;
+
+    qint64 limit = QDateTime::currentMSecsSinceEpoch() - (qint64) seconds * 1000;
+    QList<Key> expired;
+
+    for (int s = 0; s < FUNSTORE_SHARDS; s++)
+    {
+        Shard &shard = shards[s];
+        QMutexLocker locker(&shard.mutex);
+
+        // Insertion order is also time order
+        while (!shard.order.isEmpty())
+        {
+            Key key = shard.order.first();
+            if (shard.entries.constFind(key).value().inserted > limit)
+                break;
+
+            removeEntry(shard, key);
+            expired.append(key);
+        }
+    }
+
+    foreach (const Key &key, expired)
+        unindex(key);
+
+    notifyEvicted(expired);
+
+    return expired.size();
+}
+
+void FunStore::enforceLimits()
+{
+    QList<Key> evicted;
+
+    for (;;)
+    {
+        int entries = maxEntries.load();
+        int max = maxBytes.load();
+
+        if ((entries <= 0 || entryCount.load() <= entries) &&
+            (max <= 0 || totalBytes.load() <= max))
+            break;
+
+        Key key;
+        if (!evictOldest(&key))
+            break;
+
+        if (!key.getId().isEmpty())
+            evicted.append(key);
+    }
+
+    notifyEvicted(evicted);
+}
+
+/*
+ * Drops the oldest entry of the whole store
+ */
+bool FunStore::evictOldest(Key *evicted)
+{
+    int oldestShard = -1;
+    quint64 oldest = 0;
+
+    for (int s = 0; s < FUNSTORE_SHARDS; s++)
+    {
+        QMutexLocker locker(&shards[s].mutex);
+        if (shards[s].order.isEmpty())
+            continue;
+
+        quint64 sequence = shards[s].order.firstKey();
+        if (oldestShard < 0 || sequence < oldest)
+        {
+            oldestShard = s;
+            oldest = sequence;
+        }
+    }
+
+    if (oldestShard < 0)
+        return false;
+
+    Key key;
+    {
+        Shard &shard = shards[oldestShard];
+        QMutexLocker locker(&shard.mutex);
+
+        // Somebody else could have removed it meanwhile
+        if (shard.order.isEmpty())
+            return true;
+
+        key = shard.order.first();
+        removeEntry(shard, key);
+    }
+
+    unindex(key);
+    *evicted = key;
+
+    return true;
+}
+
+void FunStore::addListener(FunStoreListener *listener)
+{
+    QMutexLocker locker(&listenersMutex);
+    if (!listeners.contains(listener))
+        listeners.append(listener);
+}
+
+void FunStore::removeListener(FunStoreListener *listener)
+{
+    QMutexLocker locker(&listenersMutex);
+    listeners.removeAll(listener);
+}
+
+void FunStore::notifyEvicted(const QList<Key> &keys)
+{
+    if (keys.isEmpty())
+        return;
+
+    QMutexLocker locker(&listenersMutex);
+    foreach (FunStoreListener *listener, listeners)
+        foreach (const Key &key, keys)
+            listener->messageEvicted(key);
+}
+
+void FunStore::clear()
+{
+    for (int s = 0; s < FUNSTORE_SHARDS; s++)
+    {
+        Shard &shard = shards[s];
+        QMutexLocker locker(&shard.mutex);
+
+        while (!shard.order.isEmpty())
+            removeEntry(shard, shard.order.first());
+    }
+
+    QMutexLocker locker(&indexMutex);
+    idIndex.clear();
+}
+
+int FunStore::size() const
+{
+    return entryCount.load();
+}
+
+qint64 FunStore::bytes() const
+{
+    return totalBytes.load();
+}
+
+void FunStore::setTimeToLive(int seconds)
+{
+    ttl.store(seconds);
+}
+
+void FunStore::setMaxEntries(int entries)
+{
+    maxEntries.store(entries);
+    enforceLimits();
+}
+
+void FunStore::setMaxBytes(qint64 bytes)
+{
+    maxBytes.store((int) qMin(bytes, (qint64) INT_MAX));
+    enforceLimits();
 }
@@ -30,15 +30,126 @@
 #define FUNSTORE_H
 
 #include <QHash>
+#include <QMap>
+#include <QList>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QAtomicInteger>
 
 #include "fmessage.h"
 
-class FunStore : public QHash<Key,FMessage>
+#define FUNSTORE_SHARDS             16
+
+// Defaults for the eviction limits
+#define FUNSTORE_TTL                (7 * 24 * 3600)
+#define FUNSTORE_MAX_ENTRIES        10000
+#define FUNSTORE_MAX_BYTES          (32 * 1024 * 1024)
+
+/**
+    Told about the messages the store drops by itself (time to live and
+    limits), which will never get an answer.
+*/
+class FunStoreListener
+{
+public:
+    virtual ~FunStoreListener() {}
+
+    virtual void messageEvicted(const Key &key) = 0;
+};
+
+/**
+    @class      FunStore
+
+    @brief      Messages sent and waiting for a receipt or a media result.
+
+                Entries are sharded by remote jid, each shard with its own
+                lock, so it can be shared by all the connections and their
+                threads.  A secondary index finds entries by bare message id.
+
+                Entries older than the time to live are dropped by expire(),
+                and the oldest ones are dropped as soon as the store goes over
+                its entry or byte limits.
+*/
+
+class FunStore
 {
 public:
     FunStore();
 
     void put(const FMessage &message);
+    void putAll(const QList<FMessage> &messages);
+
+    // Returns a default FMessage if the key is not found
+    FMessage value(const Key &key) const;
+    FMessage take(const Key &key);
+    bool contains(const Key &key) const;
+    void remove(const Key &key);
+
+    // Lookup by bare message id, regardless of the remote jid
+    FMessage valueById(const QString &id) const;
+    FMessage takeById(const QString &id);
+
+    // Drops the entries older than the time to live.
+    // Returns the number of entries dropped.
+    int expire();
+
+    void clear();
+    int size() const;
+    qint64 bytes() const;
+
+    // Limits.  0 means no limit.
+    void setTimeToLive(int seconds);
+    void setMaxEntries(int entries);
+    void setMaxBytes(qint64 bytes);
+
+    // Listeners are called from the thread that evicts, with no store lock
+    // held except the listeners one
+    void addListener(FunStoreListener *listener);
+    void removeListener(FunStoreListener *listener);
+
+private:
+    struct Entry
+    {
+        FMessage message;
+        quint64 sequence;
+        qint64 inserted;
+        int bytes;
+    };
+
+    struct Shard
+    {
+        mutable QMutex mutex;
+        QHash<Key, Entry> entries;
+
+        // Insertion order, oldest first
+        QMap<quint64, Key> order;
+    };
+
+    Shard shards[FUNSTORE_SHARDS];
+
+    mutable QMutex indexMutex;
+    QHash<QString, Key> idIndex;
+
+    QAtomicInt entryCount;
+    QAtomicInt totalBytes;
+    QAtomicInteger<quint64> nextSequence;
+
+    QAtomicInt ttl;
+    QAtomicInt maxEntries;
+    QAtomicInt maxBytes;
+
+    QMutex listenersMutex;
+    QList<FunStoreListener *> listeners;
+
+    Shard &shardFor(const Key &key);
+    const Shard &shardFor(const Key &key) const;
+    bool removeEntry(Shard &shard, const Key &key, FMessage *message = 0);
+    void insert(const FMessage &message);
+    void unindex(const Key &key);
+    void enforceLimits();
+    bool evictOldest(Key *evicted);
+    void notifyEvicted(const QList<Key> &keys);
+    static int messageSize(const FMessage &message);
 };
 
 #endif // FUNSTORE_H
@@ -0,0 +1,307 @@
+#include <QCoreApplication>
+#include <QMutex>
+#include <QSslConfiguration>
+#include <QDateTime>
+#include <QDebug>
+
+#include "httpconnectionpool.h"
+
+#include "util/metricsregistry.h"
+
+// Servers drop idle keep-alive connections after 30 seconds or more
+#define DEFAULT_IDLE_TIMEOUT        20000
+#define DEFAULT_MAX_IDLE_PER_HOST   4
+
+#define POOL_KEY_PROPERTY           "httpPoolKey"
+
+HttpConnectionPool::HttpConnectionPool(QObject *parent) : QObject(parent),
+    timer(this)
+{
+    preconnectEnabled = true;
+    maxIdlePerHost = DEFAULT_MAX_IDLE_PER_HOST;
+    idleTimeout = DEFAULT_IDLE_TIMEOUT;
+
+    MetricsRegistry *registry = MetricsRegistry::instance();
+    openedMetric = registry->counter("libqtwa_http_connections_opened_total",
+                                     "HTTPS connections opened");
+    reusedMetric = registry->counter("libqtwa_http_connections_reused_total",
+                                     "HTTP requests sent on a kept-alive connection");
+
+    connect(&timer, SIGNAL(timeout()), this, SLOT(expireIdle()));
+}
+
+HttpConnectionPool *HttpConnectionPool::instance()
+{
+    static HttpConnectionPool *pool = 0;
+    static QBasicMutex mutex;
+
+    QMutexLocker locker(&mutex);
+    if (!pool)
+    {
+        pool = new HttpConnectionPool();
+
+        // Its sockets belong to the main thread even if another thread
+        // asks for it first
+        if (QCoreApplication::instance())
+            pool->moveToThread(QCoreApplication::instance()->thread());
+    }
+
+    return pool;
+}
+
+QString HttpConnectionPool::hostKey(const QString &host, quint16 port)
+{
+    return host.toLower() + ':' + QString::number(port);
+}
+
+/**
+    Returns a socket connected or connecting to a host.
+
+    @param host     Host name.
+    @param port     Port.
+    @param reuse    If false a new connection is always opened.
+    @return         Socket owned by the pool until it's released.
+*/
+QSslSocket *HttpConnectionPool::acquire(const QString &host, quint16 port, bool reuse)
+{
+    QString key = hostKey(host, port);
+
+    if (reuse)
+    {
+        // The most recently used first, it's the least likely to be closed
+        QList<IdleSocket> &sockets = idle[key];
+        while (!sockets.isEmpty())
+        {
+            QSslSocket *socket = sockets.takeLast().socket;
+            disconnect(socket, 0, this, 0);
+
+            if (socket->state() == QAbstractSocket::ConnectedState &&
+                socket->bytesAvailable() == 0)
+            {
+                MetricsRegistry::instance()->add(reusedMetric);
+                return socket;
+            }
+
+            drop(socket);
+        }
+        idle.remove(key);
+
+        // A preconnect still in the handshake is better than a new one
+        if (connecting.contains(key))
+        {
+            QSslSocket *socket = connecting.take(key);
+            disconnect(socket, SIGNAL(encrypted()), this, SLOT(preconnectDone()));
+            disconnect(socket, SIGNAL(error(QAbstractSocket::SocketError)),
+                       this, SLOT(preconnectFailed()));
+
+            return socket;
+        }
+    }
+
+    return createSocket(host, port);
+}
+
+/**
+    Gives back a socket acquired from the pool.  The caller must have
+    disconnected its own slots.
+
+    @param socket       Socket.
+    @param reusable     True if the response was read completely and the
+                        server didn't ask to close the connection.
+*/
+void HttpConnectionPool::release(QSslSocket *socket, bool reusable)
+{
+    if (!socket)
+        return;
+
+    QString key = socket->property(POOL_KEY_PROPERTY).toString();
+
+    if (reusable &&
+        socket->state() == QAbstractSocket::ConnectedState &&
+        socket->isEncrypted() &&
+        socket->bytesAvailable() == 0 &&
+        idle.value(key).size() < maxIdlePerHost)
+    {
+        addIdle(socket);
+    }
+    else
+        drop(socket);
+}
+
+void HttpConnectionPool::preconnect(const QUrl &url)
+{
+    if (!preconnectEnabled || url.host().isEmpty())
+        return;
+
+    quint16 port = url.port(443);
+    QString key = hostKey(url.host(), port);
+
+    if (!idle.value(key).isEmpty() || connecting.contains(key))
+        return;
+
+    qDebug() << "HttpConnectionPool: preconnecting to" << key;
+
+    QSslSocket *socket = createSocket(url.host(), port);
+    connect(socket, SIGNAL(encrypted()), this, SLOT(preconnectDone()));
+    connect(socket, SIGNAL(error(QAbstractSocket::SocketError)),
+            this, SLOT(preconnectFailed()));
+
+    connecting.insert(key, socket);
+}
+
+void HttpConnectionPool::setPreconnect(bool enabled)
+{
+    preconnectEnabled = enabled;
+}
+
+void HttpConnectionPool::setMaxIdlePerHost(int count)
+{
+    maxIdlePerHost = count;
+}
+
+void HttpConnectionPool::setIdleTimeout(int msecs)
+{
+    idleTimeout = msecs;
+}
+
+void HttpConnectionPool::clear()
+{
+    foreach (const QList<IdleSocket> &sockets, idle)
+        foreach (const IdleSocket &entry, sockets)
+            drop(entry.socket);
+    idle.clear();
+
+    foreach (QSslSocket *socket, connecting)
+        drop(socket);
+    connecting.clear();
+
+    sessions.clear();
+    timer.stop();
+}
+
+QSslSocket *HttpConnectionPool::createSocket(const QString &host, quint16 port)
+{
+    QString key = hostKey(host, port);
+
+    QSslSocket *socket = new QSslSocket(this);
+    socket->setProperty(POOL_KEY_PROPERTY, key);
+
+    // Resume the last TLS session with this host
+    QSslConfiguration config = socket->sslConfiguration();
+    config.setSslOption(QSsl::SslOptionDisableSessionPersistence, false);
+    if (sessions.contains(key))
+        config.setSessionTicket(sessions.value(key));
+    socket->setSslConfiguration(config);
+
+    connect(socket, SIGNAL(encrypted()), this, SLOT(saveSession()));
+
+    MetricsRegistry::instance()->add(openedMetric);
+
+    socket->connectToHostEncrypted(host, port);
+    qDebug() << "HttpConnectionPool: Connecting to" << key;
+
+    return socket;
+}
+
+void HttpConnectionPool::addIdle(QSslSocket *socket)
+{
+    // Any data or state change of an idle socket means it can't be used
+    connect(socket, SIGNAL(disconnected()), this, SLOT(idleClosed()));
+    connect(socket, SIGNAL(readyRead()), this, SLOT(idleClosed()));
+    connect(socket, SIGNAL(error(QAbstractSocket::SocketError)),
+            this, SLOT(idleClosed()));
+
+    IdleSocket entry;
+    entry.socket = socket;
+    entry.since = QDateTime::currentMSecsSinceEpoch();
+
+    idle[socket->property(POOL_KEY_PROPERTY).toString()].append(entry);
+
+    if (!timer.isActive())
+        timer.start(idleTimeout / 2);
+}
+
+void HttpConnectionPool::drop(QSslSocket *socket)
+{
+    disconnect(socket, 0, this, 0);
+    socket->abort();
+    socket->deleteLater();
+}
+
+void HttpConnectionPool::saveSession()
+{
+    QSslSocket *socket = qobject_cast<QSslSocket *>(sender());
+    if (!socket)
+        return;
+
+    QByteArray ticket = socket->sslConfiguration().sessionTicket();
+    if (!ticket.isEmpty())
+        sessions.insert(socket->property(POOL_KEY_PROPERTY).toString(), ticket);
+}
+
+void HttpConnectionPool::idleClosed()
+{
+    QSslSocket *socket = qobject_cast<QSslSocket *>(sender());
+    if (!socket)
+        return;
+
+    QString key = socket->property(POOL_KEY_PROPERTY).toString();
+    QList<IdleSocket> &sockets = idle[key];
+    for (int i = 0; i < sockets.size(); i++)
+    {
+        if (sockets.at(i).socket == socket)
+        {
+            sockets.removeAt(i);
+            break;
+        }
+    }
+    if (sockets.isEmpty())
+        idle.remove(key);
+
+    drop(socket);
+}
+
+void HttpConnectionPool::preconnectDone()
+{
+    QSslSocket *socket = qobject_cast<QSslSocket *>(sender());
+    if (!socket)
+        return;
+
+    disconnect(socket, SIGNAL(encrypted()), this, SLOT(preconnectDone()));
+    disconnect(socket, SIGNAL(error(QAbstractSocket::SocketError)),
+               this, SLOT(preconnectFailed()));
+
+    connecting.remove(socket->property(POOL_KEY_PROPERTY).toString());
+    addIdle(socket);
+}
+
+void HttpConnectionPool::preconnectFailed()
+{
+    QSslSocket *socket = qobject_cast<QSslSocket *>(sender());
+    if (!socket)
+        return;
+
+    qDebug() << "HttpConnectionPool: preconnect failed:" << socket->errorString();
+
+    connecting.remove(socket->property(POOL_KEY_PROPERTY).toString());
+    drop(socket);
+}
+
+void HttpConnectionPool::expireIdle()
+{
+    qint64 oldest = QDateTime::currentMSecsSinceEpoch() - idleTimeout;
+
+    QMutableHashIterator<QString, QList<IdleSocket> > i(idle);
+    while (i.hasNext())
+    {
+        QList<IdleSocket> &sockets = i.next().value();
+        while (!sockets.isEmpty() && sockets.first().since < oldest)
+            drop(sockets.takeFirst().socket);
+
+        if (sockets.isEmpty())
+            i.remove();
+    }
+
+    if (idle.isEmpty())
+        timer.stop();
+}
@@ -0,0 +1,91 @@
+#ifndef HTTPCONNECTIONPOOL_H
+#define HTTPCONNECTIONPOOL_H
+
+#include <QObject>
+#include <QSslSocket>
+#include <QHash>
+#include <QList>
+#include <QUrl>
+#include <QTimer>
+
+/**
+    @class      HttpConnectionPool
+
+    @brief      Keep-alive HTTPS connections shared by the HTTP requests.
+
+                A request acquires a socket for its host and releases it when
+                the response was read completely.  Sockets still connected are
+                kept idle for the next request to the same host, so it doesn't
+                pay the TCP and TLS handshakes again.
+
+                The TLS session ticket of every host is kept too, so the new
+                connections to a known host resume the session instead of
+                doing a full handshake.
+
+                preconnect() starts a connection that is expected to be used
+                soon, like the upload of a media accepted by the server.
+
+                It lives in the thread of the requests, usually the main one.
+*/
+
+class HttpConnectionPool : public QObject
+{
+    Q_OBJECT
+
+public:
+    static HttpConnectionPool *instance();
+
+    // An idle connection to the host, or a new one (reuse false forces it).
+    // If it's not isEncrypted() yet, wait for encrypted().
+    QSslSocket *acquire(const QString &host, quint16 port, bool reuse = true);
+
+    // Gives back a socket.  Reusable ones are kept, the others closed.
+    void release(QSslSocket *socket, bool reusable);
+
+    void setPreconnect(bool enabled);
+    void setMaxIdlePerHost(int count);
+    void setIdleTimeout(int msecs);
+
+    // Closes all the idle connections and forgets the TLS sessions
+    void clear();
+
+public slots:
+    // Connects in advance to the host of the URL, if enabled.  Other
+    // threads must call it queued, the pool lives in the main thread.
+    void preconnect(const QUrl &url);
+
+private slots:
+    void saveSession();
+    void idleClosed();
+    void preconnectDone();
+    void preconnectFailed();
+    void expireIdle();
+
+private:
+    struct IdleSocket
+    {
+        QSslSocket *socket;
+        qint64 since;
+    };
+
+    QHash<QString, QList<IdleSocket> > idle;
+    QHash<QString, QSslSocket *> connecting;
+    QHash<QString, QByteArray> sessions;
+    QTimer timer;           // child, so it moves with the pool
+
+    bool preconnectEnabled;
+    int maxIdlePerHost;
+    int idleTimeout;
+
+    int openedMetric;
+    int reusedMetric;
+
+    explicit HttpConnectionPool(QObject *parent = 0);
+
+    static QString hostKey(const QString &host, quint16 port);
+    QSslSocket *createSocket(const QString &host, quint16 port);
+    void addIdle(QSslSocket *socket);
+    void drop(QSslSocket *socket);
+};
+
+#endif // HTTPCONNECTIONPOOL_H
@@ -34,20 +34,45 @@
 #include <QNetworkReply>
 
 #include "httprequestv2.h"
+#include "httpconnectionpool.h"
+#include "transferscheduler.h"
 
 #include "util/utilities.h"
+#include "protocoltrace.h"
 
 #include "globalconstants.h"
 
-#define MAX_BUFFER      5120
+// Bytes read from the socket at once
+#define READ_CHUNK      0x4000
+
+// A POST body is read in chunks of SEND_CHUNK bytes, and only while less than
+// SEND_WINDOW bytes wait to be written to the socket
+#define SEND_CHUNK      0x4000
+#define SEND_WINDOW     0x10000
 
 HttpRequestv2::HttpRequestv2(const QString &useragent, QObject *parent) :
     QObject(parent)
 {
     // Add default headers
     setHeader("User-Agent", useragent.toUtf8());
-    setHeader("Connection", "closed");
+    setHeader("Connection", "keep-alive");
+
+    socket = 0;
+    method = GET;
+    body = 0;
+    length = 0;
+    sendingBody = false;
+    responseStarted = false;
+    priority = TransferScheduler::Normal;
+    sizeHint = -1;
+
+    throttleTimer.setSingleShot(true);
+    connect(&throttleTimer, SIGNAL(timeout()), this, SLOT(resumeTransfer()));
+}
 
+HttpRequestv2::~HttpRequestv2()
+{
+    releaseConnection(false);
 }
 
 void HttpRequestv2::setHeader(QString header, QString value)
@@ -57,7 +82,10 @@ void HttpRequestv2::setHeader(QString header, QString value)
 
 QByteArray HttpRequestv2::readAll()
 {
-    return socket->readAll();
+    QByteArray data = responseBody;
+    responseBody.clear();
+
+    return data;
 }
 
 QString HttpRequestv2::getHeader(QString header)
@@ -65,40 +93,134 @@ QString HttpRequestv2::getHeader(QString header)
     return headers.value(header);
 }
 
+QUrl HttpRequestv2::getUrl() const
+{
+    return url;
+}
+
+void HttpRequestv2::setPriority(int priority)
+{
+    this->priority = priority;
+}
+
+int HttpRequestv2::getPriority() const
+{
+    return priority;
+}
+
+void HttpRequestv2::setSizeHint(qint64 bytes)
+{
+    sizeHint = bytes;
+}
+
+qint64 HttpRequestv2::getSizeHint() const
+{
+    return (sizeHint < 0 && method == POST) ? length : sizeHint;
+}
+
 
 void HttpRequestv2::get(QUrl url)
 {
     // Configure the GET connection
     this->url = url;
     this->method = GET;
+    this->body = 0;
+    this->length = 0;
 
-    connectToHost();
+    TransferScheduler::instance()->schedule(this);
 }
 
 void HttpRequestv2::post(QUrl url, const char *data, int length)
+{
+    // The data is not copied, it must be valid until the request is sent
+    rawBuffer.close();
+    rawData = QByteArray::fromRawData(data, length);
+    rawBuffer.setBuffer(&rawData);
+    rawBuffer.open(QIODevice::ReadOnly);
+
+    post(url, &rawBuffer, length);
+}
+
+/**
+    Sends a POST request whose body is read from a device while it's sent.
+
+    @param url      Request URL.
+    @param body     Open device, must be valid until the request is sent.
+    @param length   Content-Length, the bytes read from the device.
+*/
+void HttpRequestv2::post(QUrl url, QIODevice *body, qint64 length)
 {
     // Configure the POST connection
     this->url = url;
-    this->data = data;
+    this->body = body;
     this->length = length;
     this->method = POST;
 
-    qDebug() << "posting data:" << data << "length:" << QString::number(length);
+    WA_TRACE(ProtocolTrace::Http, ProtocolTrace::Debug, "post length:", length);
 
+    TransferScheduler::instance()->schedule(this);
+}
+
+/**
+    Called by the scheduler when it's the turn of this request.
+*/
+void HttpRequestv2::start()
+{
     connectToHost();
 }
 
-void HttpRequestv2::connectToHost() {
+void HttpRequestv2::connectToHost(bool reuse) {
 
-    // Connect the socket
-    socket = new QSslSocket(this);
+    // Get a kept-alive connection or a new one
+    socket = HttpConnectionPool::instance()->acquire(url.host(), url.port(443), reuse);
+    reused = socket->isEncrypted();
+    responseStarted = false;
+    keepAlive = true;
 
-    connect(socket, SIGNAL(encrypted()), this, SLOT(sendRequest()));
     connect(socket, SIGNAL(error(QAbstractSocket::SocketError)),
             this, SLOT(socketErrorHandler(QAbstractSocket::SocketError)));
 
-    socket->connectToHostEncrypted(url.host(), url.port(443));
-    qDebug() << "HttpRequest(): Connecting to" << url.host() << ":" << QString::number(url.port(443));
+    // With a download limit the socket buffers little, so the server is
+    // slowed down by TCP instead of filling the memory
+    if (TransferScheduler::instance()->getDownloadBucket()->getRate() > 0)
+        socket->setReadBufferSize(4 * READ_CHUNK);
+
+    if (reused)
+    {
+        qDebug() << "HttpRequest(): Reusing connection to" << url.host() << ":" << QString::number(url.port(443));
+        QMetaObject::invokeMethod(this, "sendRequest", Qt::QueuedConnection);
+    }
+    else
+        connect(socket, SIGNAL(encrypted()), this, SLOT(sendRequest()));
+}
+
+/**
+    Gives the connection back to the pool and ends the transfer.  Subclasses
+    call it as soon as they read the whole response body, so the next
+    request to the host can use the connection.
+
+    @param complete     True if the whole response was read.
+*/
+void HttpRequestv2::releaseConnection(bool complete)
+{
+    releaseSocket(complete);
+    TransferScheduler::instance()->finished(this);
+}
+
+void HttpRequestv2::releaseSocket(bool complete)
+{
+    throttleTimer.stop();
+
+    if (!socket)
+        return;
+
+    bool reusable = complete && keepAlive && !sendingBody && parser.isKeepAlive();
+
+    disconnect(socket, 0, this, 0);
+    socket->setReadBufferSize(0);
+    HttpConnectionPool::instance()->release(socket, reusable);
+    socket = 0;
+    sendingBody = false;
 }
 
 void HttpRequestv2::sendRequest() {
@@ -106,53 +228,96 @@ void HttpRequestv2::sendRequest() {
     qDebug() << "HttpRequest(): Sending request...";
 
     // Send the request
-    QByteArray *request = new QByteArray();
+    QByteArray request;
 
-    request->append((method == GET) ? "GET" : "POST");
-    request->append(' ');
-    request->append(url.toEncoded());
+    request.append((method == GET) ? "GET" : "POST");
+    request.append(' ');
+    request.append(url.toEncoded());
     if (method == GET)
-        request->append("?" + url.query());
-    request->append(" HTTP/1.1\r\n");
-    request->append("Host: " + url.host() + "\r\n");
+        request.append("?" + url.query());
+    request.append(" HTTP/1.1\r\n");
+    request.append("Host: " + url.host() + "\r\n");
 
     // Add all the headers
     QList<QString> keys = headers.keys();
 
     foreach (QString key, keys)
-        request->append(key.toUtf8() + ": " + headers.value(key).toUtf8() + "\r\n");
+        request.append(key.toUtf8() + ": " + headers.value(key).toUtf8() + "\r\n");
 
     if (method == POST)
-        request->append("Content-Length: " + QString::number(length) + "\r\n");
+        request.append("Content-Length: " + QString::number(length) + "\r\n");
 
-    request->append("\r\n");
+    request.append("\r\n");
 
-    if (method == POST)
-        request->append(data,length);
-    qDebug() << request->data();
+    WA_TRACE(ProtocolTrace::Http, ProtocolTrace::Debug, "request:", request);
 
-    // Write data
+    // Write the headers, the body follows as the socket drains
     connect(socket, SIGNAL(encryptedBytesWritten(qint64)),
             this, SLOT(encryptedBytesWritten(qint64)));
 
     bytesWritten = 0;
-    qint64 length = request->size();
-    qint64 pos = 0;
-    const char *constData = request->constData();
-    while (pos < length)
+    bodyWritten = 0;
+    requestLength = request.size() + ((method == POST) ? length : 0);
+    socket->write(request);
+
+    qDebug() << "HttpRequest(): Waiting for response...";
+    connect(socket,SIGNAL(readyRead()),this,SLOT(readResponse()));
+
+    if (method == POST)
     {
-        int size = ((pos + MAX_BUFFER) < length ? MAX_BUFFER : length-pos);
-        socket->write(constData, size);
-        constData += size;
-        pos += size;
+        chunk.resize(SEND_CHUNK);
+        sendingBody = true;
+        writeBody();
     }
+    else
+        emit requestSent(requestLength);
+}
 
-    delete request;
+/**
+    Queues body chunks until SEND_WINDOW bytes are waiting in the socket.
+    Called again every time the socket writes, so only a few chunks of the
+    body are in memory at any time.
+*/
+void HttpRequestv2::writeBody()
+{
+    if (!sendingBody || throttleTimer.isActive())
+        return;
 
-    emit requestSent(length);
+    TokenBucket *bucket = TransferScheduler::instance()->getUploadBucket();
 
-    qDebug() << "HttpRequest(): Waiting for response...";
-    connect(socket,SIGNAL(readyRead()),this,SLOT(readResponse()));
+    while (bodyWritten < length &&
+           socket->bytesToWrite() + socket->encryptedBytesToWrite() < SEND_WINDOW)
+    {
+        qint64 wanted = qMin((qint64) chunk.size(), length - bodyWritten);
+
+        // Over the upload limit, continue when there are tokens
+        qint64 allowed = bucket->take(wanted);
+        if (allowed == 0)
+        {
+            throttleTimer.start(bucket->delay(wanted));
+            return;
+        }
+
+        qint64 size = body->read(chunk.data(), allowed);
+        if (size <= 0)
+        {
+            qDebug() << "HttpRequest(): Error reading body:" << body->errorString();
+
+            releaseConnection(false);
+            emit socketError(QString("Error reading body"));
+            return;
+        }
+
+        socket->write(chunk.constData(), size);
+        bodyWritten += size;
+    }
+
+    if (bodyWritten >= length)
+    {
+        sendingBody = false;
+        chunk.clear();
+        emit requestSent(requestLength);
+    }
 }
 
 void HttpRequestv2::workerFinished()
@@ -160,92 +325,192 @@ void HttpRequestv2::workerFinished()
     emit requestSent(length);
 }
 
-void HttpRequestv2::readResponse() {
+/**
+    Reads what arrived of the response.  Called on readyRead, it parses what
+    is available and returns, the rest of the response is read as it comes.
+*/
+void HttpRequestv2::readResponse()
+{
+    readAvailable(true);
+}
 
-    qDebug() << "HttpRequest(): Got response";
+void HttpRequestv2::resumeTransfer()
+{
+    if (sendingBody)
+        writeBody();
+    if (responseStarted)
+        readAvailable(true);
+}
 
-    // This function is only called once
-    disconnect(socket,SIGNAL(readyRead()),this,SLOT(readResponse()));
+/**
+    Reads and parses the bytes available.
 
-    // Prepare the buffer
-    QByteArray buffer;
-    buffer.resize(MAX_BUFFER);
+    @param throttle     Respect the download limit.  When the connection
+                        was closed everything left must be read.
+*/
+void HttpRequestv2::readAvailable(bool throttle)
+{
+    if (!responseStarted)
+    {
+        qDebug() << "HttpRequest(): Got response";
 
-    // Read response
-    qint64 length = socket->readLine(buffer.data(), MAX_BUFFER);
-    qint64 totalLength = length;
-    QString response = QString::fromUtf8(buffer.data());
-    qDebug() << response.trimmed();
+        // The server answered, stop sending the body if it didn't end.  The
+        // connection can't be reused then.
+        responseStarted = true;
+        if (sendingBody)
+        {
+            sendingBody = false;
+            keepAlive = false;
+        }
 
-    errorCode = 0;
-    if (response.left(8) != "HTTP/1.1")
-    {
-        emit headersReceived(totalLength);
-        emit finished();
-        return;
+        parser.reset();
+        responseBody.clear();
+        readBuffer.resize(READ_CHUNK);
     }
 
-    int space = response.indexOf(' ', 9);
-    if (space < 0)
-    {
-        emit headersReceived(totalLength);
-        emit finished();
+    if (throttle && throttleTimer.isActive())
         return;
-    }
 
-    errorCode = response.mid(9,(space-9)).toInt();
-    if (errorCode != 200)
-    {
-        emit headersReceived(totalLength);
-        emit finished();
-        return;
-    }
+    TokenBucket *bucket = TransferScheduler::instance()->getDownloadBucket();
 
-    // Read all headers
-    headers.clear();
-    bool end = false;
-    while (socket->bytesAvailable() >= 0 && end == false)
+    while (socket && socket->bytesAvailable() > 0)
     {
-        if (socket->bytesAvailable() == 0)
-            socket->waitForReadyRead();
+        qint64 wanted = qMin(socket->bytesAvailable(), (qint64) readBuffer.size());
 
-        if (socket->bytesAvailable() > 0)
+        // Over the download limit, the rest waits in the socket
+        qint64 allowed = throttle ? bucket->take(wanted) : wanted;
+        if (allowed == 0)
         {
-            length = socket->readLine(buffer.data(), MAX_BUFFER);
-            totalLength += length;
-            QString header = QString::fromUtf8(buffer.data());
-
-            qDebug() << header.trimmed();
-
-            // A blank line means the end of headers and beginning of data
-            if (header == "\r\n")
-            {
-                qDebug() << "HttpRequest(): All headers read.  Available bytes:" << QString::number(socket->bytesAvailable());
-                end = true;
-            }
-            else
-            {
-                QStringList list = header.trimmed().split(": ");
-                setHeader(list[0],list[1]);
-            }
+            throttleTimer.start(bucket->delay(wanted));
+            return;
         }
+
+        qint64 size = socket->read(readBuffer.data(), allowed);
+        if (size <= 0)
+            break;
+
+        parseResponse(readBuffer.constData(), size);
     }
+}
+
+/**
+    Feeds bytes to the parser and handles the headers, body and end of the
+    response.  Stops if the connection was released meanwhile.
+*/
+void HttpRequestv2::parseResponse(const char *data, qint64 size)
+{
+    qint64 pos = 0;
 
-    if (end)
+    while (socket && pos < size)
     {
-        emit headersReceived(totalLength);
-        emit finished();
+        const char *bodyData;
+        qint64 bodySize;
+        bool hadHeaders = parser.headersComplete();
+
+        pos += parser.parse(data + pos, size - pos, &bodyData, &bodySize);
+
+        if (parser.hasError())
+        {
+            qDebug() << "HttpRequest(): Invalid response";
+
+            errorCode = 0;
+            releaseConnection(false);
+            emit finished();
+            return;
+        }
+
+        if (!hadHeaders && parser.headersComplete())
+        {
+            errorCode = parser.getStatusCode();
+            qDebug() << "HttpRequest(): Status" << errorCode << parser.getReasonPhrase();
+
+            // The response headers replace the request ones
+            headers.clear();
+            foreach (const HttpHeader &header, parser.getHeaders())
+                setHeader(QString::fromUtf8(header.first), QString::fromUtf8(header.second));
+
+            emit headersReceived(parser.getHeaderBytes());
+        }
+
+        if (bodySize > 0 && socket)
+            bodyDataReceived(bodyData, bodySize);
+
+        if (parser.isComplete() && socket)
+        {
+            // Nothing should follow the response
+            if (pos < size || socket->bytesAvailable() > 0)
+                keepAlive = false;
+
+            readBuffer.clear();
+            responseComplete();
+            return;
+        }
     }
 }
 
+const HttpResponseParser &HttpRequestv2::getResponse() const
+{
+    return parser;
+}
+
+/**
+    Receives the body as it arrives.  By default it's kept for readAll().
+
+    @param data     Body bytes, only valid during the call.
+    @param size     Number of bytes.
+*/
+void HttpRequestv2::bodyDataReceived(const char *data, qint64 size)
+{
+    responseBody.append(data, size);
+}
+
+/**
+    Called when the whole response was received.  The connection goes back
+    to the pool and finished() is emitted.
+*/
+void HttpRequestv2::responseComplete()
+{
+    releaseConnection(true);
+    emit finished();
+}
+
 void HttpRequestv2::socketErrorHandler(QAbstractSocket::SocketError err)
 {
-    qDebug() << "HttpRequestv2() Socket Error" << QString::number(err) << socket->errorString();
+    // A body without length ends when the server closes the connection
+    if (err == QAbstractSocket::RemoteHostClosedError && responseStarted)
+    {
+        readAvailable(false);
+        if (!socket)
+            return;
+
+        if (parser.finish())
+        {
+            keepAlive = false;
+            readBuffer.clear();
+            responseComplete();
+            return;
+        }
+    }
+
+    QString errorString = socket->errorString();
+    qDebug() << "HttpRequestv2() Socket Error" << QString::number(err) << errorString;
+
+    // The server may have closed a kept-alive connection just before it
+    // was used.  Send the request again on a new one.
+    bool retry = reused && !responseStarted && (method == GET || body->reset());
 
-    if (socket->isOpen())
-        socket->close();
+    if (retry)
+    {
+        // Still the same transfer for the scheduler
+        releaseSocket(false);
+
+        qDebug() << "HttpRequestv2() Retrying on a new connection";
+        connectToHost(false);
+        return;
+    }
 
-    emit socketError(socket->errorString());
+    releaseConnection(false);
+    emit socketError(errorString);
 }
 
 void HttpRequestv2::clearHeaders()
@@ -256,9 +521,15 @@ void HttpRequestv2::clearHeaders()
 void HttpRequestv2::encryptedBytesWritten(qint64 written)
 {
     bytesWritten += written;
-    qDebug() << "Written" << QString::number(written) << "bytes. Progress:" << QString::number(bytesWritten) << "Total:" << QString::number(length);
-    float p = ((float) bytesWritten * 100.0) / ((float)length);
 
-    emit progress(p);
+    if (progressThrottle.ready(bytesWritten >= requestLength))
+    {
+        qDebug() << "Written" << QString::number(written) << "bytes. Progress:" << QString::number(bytesWritten) << "Total:" << QString::number(length);
+        float p = ((float) bytesWritten * 100.0) / ((float)length);
+
+        emit progress(p);
+    }
+
+    writeBody();
 }
 
@@ -32,8 +32,13 @@
 
 #include <QSslSocket>
 #include <QByteArray>
+#include <QBuffer>
 #include <QHash>
 #include <QUrl>
+#include <QTimer>
+
+#include "httpresponseparser.h"
+#include "transferscheduler.h"
 
 class HttpRequestv2 : public QObject
 {
@@ -46,15 +51,33 @@ public:
     };
 
     explicit HttpRequestv2(const QString &useragent, QObject *parent = 0);
+    ~HttpRequestv2();
 
     void get(QUrl url);
     void post(QUrl url, const char *data, int length);
+
+    // Streams the body from an open device, length bytes are sent
+    void post(QUrl url, QIODevice *body, qint64 length);
     void setHeader(QString header, QString value);
+
+    // Response body received so far, unless a subclass consumes it
     QByteArray readAll();
     QString getHeader(QString header);
     void clearHeaders();
 
+    QUrl getUrl() const;
+
+    // TransferScheduler::Priority, Normal by default
+    void setPriority(int priority);
+    int getPriority() const;
+
+    // Expected bytes of the transfer, -1 if unknown.  Defaults to the
+    // length of a POST body.
+    void setSizeHint(qint64 bytes);
+    qint64 getSizeHint() const;
+
 signals:
+    // The whole response was read, or it was invalid (error code 0)
     void finished();
     void socketError(const QString &errorString);
     void progress(float p);
@@ -67,20 +90,62 @@ public slots:
     void socketErrorHandler(QAbstractSocket::SocketError err);
     void workerFinished();
     void encryptedBytesWritten(qint64 bytesWritten);
+    void writeBody();
+    void resumeTransfer();
 
 private:
     QUrl url;
     Method method;
     QHash<QString,QString> headers;
-    const char *data;
+    QIODevice *body;
+    QByteArray rawData;
+    QBuffer rawBuffer;
+    QByteArray chunk;
     qint64 length;
+    qint64 bodyWritten;
+    qint64 requestLength;
     qint64 bytesWritten;
+    bool sendingBody;
+    bool reused;
+    bool responseStarted;
+    bool keepAlive;
+    int priority;
+    qint64 sizeHint;
+
+    // Waits for bandwidth tokens
+    QTimer throttleTimer;
 
-    void connectToHost();
+    HttpResponseParser parser;
+    QByteArray readBuffer;
+    QByteArray responseBody;
+
+    void start();
+    void connectToHost(bool reuse = true);
+    void releaseSocket(bool complete);
+    void readAvailable(bool throttle);
+    void parseResponse(const char *data, qint64 size);
+
+    friend class TransferScheduler;
 
 protected:
     QSslSocket *socket;
     int errorCode;
+    ProgressThrottle progressThrottle;
+
+    // Gives the socket back to the pool and the transfer slot back to the
+    // scheduler, socket is 0 after this
+    void releaseConnection(bool complete);
+
+    // Status, headers and framing of the response
+    const HttpResponseParser &getResponse() const;
+
+    // Pieces of the response body as they arrive.  The default keeps them
+    // for readAll().
+    virtual void bodyDataReceived(const char *data, qint64 size);
+
+    // The whole response arrived.  The default releases the connection
+    // and emits finished().
+    virtual void responseComplete();
 
 };
 
@@ -0,0 +1,341 @@
+#include <string.h>
+
+#include "httpresponseparser.h"
+
+// Longest status, header or chunk size line accepted
+#define MAX_LINE_LENGTH     8192
+
+#define MAX_HEADERS         100
+
+HttpResponseParser::HttpResponseParser()
+{
+    reset();
+}
+
+void HttpResponseParser::reset(bool headRequest)
+{
+    this->headRequest = headRequest;
+
+    state = StatusLine;
+    line.clear();
+    statusCode = 0;
+    minorVersion = 0;
+    reasonPhrase.clear();
+    headers.clear();
+    headerBytes = 0;
+
+    contentLength = -1;
+    remaining = 0;
+    chunked = false;
+    keepAlive = false;
+}
+
+/**
+    Parses the next bytes of the response.
+
+    @param data         Bytes received.
+    @param size         Number of bytes.
+    @param body         Set to the start of the body bytes found, or 0.
+    @param bodySize     Set to the number of body bytes found.
+    @return             Bytes consumed.  Less than size if it returned early,
+                        call it again with the rest.
+*/
+qint64 HttpResponseParser::parse(const char *data, qint64 size, const char **body, qint64 *bodySize)
+{
+    *body = 0;
+    *bodySize = 0;
+
+    qint64 pos = 0;
+    while (pos < size)
+    {
+        if (state == Complete || state == Error)
+            return pos;
+
+        if (state == Body || state == ChunkData || state == BodyUntilClose)
+        {
+            qint64 n = size - pos;
+            if (state != BodyUntilClose)
+                n = qMin(n, remaining);
+
+            *body = data + pos;
+            *bodySize = n;
+            pos += n;
+
+            if (state != BodyUntilClose)
+            {
+                remaining -= n;
+                if (remaining == 0)
+                    state = (state == Body) ? Complete : ChunkEnd;
+            }
+
+            return pos;
+        }
+
+        // Line based states
+        qint64 used;
+        bool inHeaders = (state == StatusLine || state == Headers);
+        bool complete = readLine(data + pos, size - pos, &used);
+
+        pos += used;
+        if (inHeaders)
+            headerBytes += used;
+
+        if (!complete)
+            continue;
+
+        if (state == StatusLine)
+        {
+            if (parseStatusLine())
+                state = Headers;
+        }
+        else if (state == Headers)
+        {
+            if (line.isEmpty())
+            {
+                endHeaders();
+
+                // An interim 1xx response is followed by the real one
+                if (state != StatusLine)
+                    return pos;
+            }
+            else
+                parseHeaderLine();
+        }
+        else if (state == ChunkSize)
+            parseChunkSize();
+        else if (state == ChunkEnd)
+            state = line.isEmpty() ? ChunkSize : Error;
+        else if (state == Trailers)
+        {
+            // Trailer fields are ignored
+            if (line.isEmpty())
+            {
+                state = Complete;
+                line.clear();
+                return pos;
+            }
+        }
+
+        line.clear();
+    }
+
+    return pos;
+}
+
+bool HttpResponseParser::finish()
+{
+    if (state == BodyUntilClose)
+    {
+        state = Complete;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+    Adds bytes to the current line until a LF.
+
+    @param used     Set to the bytes consumed.
+    @return         True if the line is complete, without the CRLF.
+*/
+bool HttpResponseParser::readLine(const char *data, qint64 size, qint64 *used)
+{
+    const char *end = (const char *) memchr(data, '\n', size);
+    qint64 length = end ? (end - data) + 1 : size;
+
+    *used = length;
+
+    if (line.size() + length > MAX_LINE_LENGTH)
+    {
+        state = Error;
+        return false;
+    }
+
+    line.append(data, (int) length);
+
+    if (!end)
+        return false;
+
+    line.chop(1);
+    if (line.endsWith('\r'))
+        line.chop(1);
+
+    return true;
+}
+
+bool HttpResponseParser::parseStatusLine()
+{
+    // HTTP/1.x 200 OK
+    if (line.size() < 12 || !line.startsWith("HTTP/1.") || line.at(8) != ' ')
+    {
+        state = Error;
+        return false;
+    }
+
+    minorVersion = line.at(7) - '0';
+
+    bool ok;
+    statusCode = line.mid(9, 3).toInt(&ok);
+    if (!ok || statusCode < 100)
+    {
+        state = Error;
+        return false;
+    }
+
+    reasonPhrase = line.mid(13);
+
+    return true;
+}
+
+bool HttpResponseParser::parseHeaderLine()
+{
+    // Obsolete line folding continues the previous value
+    if ((line.at(0) == ' ' || line.at(0) == '\t') && !headers.isEmpty())
+    {
+        headers.last().second.append(' ');
+        headers.last().second.append(line.trimmed());
+        return true;
+    }
+
+    int colon = line.indexOf(':');
+    if (colon <= 0 || headers.size() >= MAX_HEADERS)
+    {
+        state = Error;
+        return false;
+    }
+
+    headers.append(qMakePair(line.left(colon).trimmed(), line.mid(colon + 1).trimmed()));
+
+    return true;
+}
+
+void HttpResponseParser::endHeaders()
+{
+    if (statusCode < 200 && statusCode != 101)
+    {
+        headers.clear();
+        state = StatusLine;
+        return;
+    }
+
+    QByteArray connection = getHeader("Connection").toLower();
+    keepAlive = (minorVersion >= 1) ? !connection.contains("close")
+                                    : connection.contains("keep-alive");
+
+    chunked = getHeader("Transfer-Encoding").toLower().contains("chunked");
+
+    QByteArray length = getHeader("Content-Length");
+    if (!length.isEmpty())
+    {
+        bool ok;
+        contentLength = length.toLongLong(&ok);
+        if (!ok || contentLength < 0)
+        {
+            state = Error;
+            return;
+        }
+    }
+
+    if (headRequest || statusCode == 204 || statusCode == 304)
+        state = Complete;
+    else if (chunked)
+        state = ChunkSize;
+    else if (contentLength >= 0)
+    {
+        remaining = contentLength;
+        state = (remaining > 0) ? Body : Complete;
+    }
+    else
+    {
+        state = BodyUntilClose;
+        keepAlive = false;
+    }
+}
+
+bool HttpResponseParser::parseChunkSize()
+{
+    // Chunk extensions are ignored
+    QByteArray size = line;
+    int semicolon = size.indexOf(';');
+    if (semicolon >= 0)
+        size.truncate(semicolon);
+
+    bool ok;
+    remaining = size.trimmed().toLongLong(&ok, 16);
+    if (!ok || remaining < 0)
+    {
+        state = Error;
+        return false;
+    }
+
+    state = (remaining > 0) ? ChunkData : Trailers;
+
+    return true;
+}
+
+HttpResponseParser::State HttpResponseParser::getState() const
+{
+    return state;
+}
+
+bool HttpResponseParser::isComplete() const
+{
+    return state == Complete;
+}
+
+bool HttpResponseParser::hasError() const
+{
+    return state == Error;
+}
+
+bool HttpResponseParser::headersComplete() const
+{
+    return state > Headers && state != Error;
+}
+
+int HttpResponseParser::getStatusCode() const
+{
+    return statusCode;
+}
+
+QByteArray HttpResponseParser::getReasonPhrase() const
+{
+    return reasonPhrase;
+}
+
+const HttpHeaders &HttpResponseParser::getHeaders() const
+{
+    return headers;
+}
+
+QByteArray HttpResponseParser::getHeader(const QByteArray &name) const
+{
+    for (int i = 0; i < headers.size(); i++)
+    {
+        if (qstricmp(headers.at(i).first.constData(), name.constData()) == 0)
+            return headers.at(i).second;
+    }
+
+    return QByteArray();
+}
+
+qint64 HttpResponseParser::getContentLength() const
+{
+    return contentLength;
+}
+
+bool HttpResponseParser::isChunked() const
+{
+    return chunked;
+}
+
+bool HttpResponseParser::isKeepAlive() const
+{
+    return state == Complete && keepAlive;
+}
+
+qint64 HttpResponseParser::getHeaderBytes() const
+{
+    return headerBytes;
+}
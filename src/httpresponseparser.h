@@ -0,0 +1,102 @@
+#ifndef HTTPRESPONSEPARSER_H
+#define HTTPRESPONSEPARSER_H
+
+#include <QByteArray>
+#include <QList>
+#include <QPair>
+
+// Name and value
+typedef QPair<QByteArray, QByteArray> HttpHeader;
+typedef QList<HttpHeader> HttpHeaders;
+
+/**
+    @class      HttpResponseParser
+
+    @brief      Incremental HTTP/1.1 response parser.
+
+                Bytes are fed as they arrive, in pieces of any size, and the
+                parser keeps its state between calls, so it never waits for
+                more data.  Bodies with a Content-Length, chunked bodies and
+                bodies ended by closing the connection are supported.
+
+                Body data is not copied: parse() returns the range of the
+                input that belongs to the body.  Only the status line, the
+                header lines and the chunk size lines are buffered.
+*/
+
+class HttpResponseParser
+{
+public:
+    enum State {
+        StatusLine = 0,
+        Headers,
+        Body,               // Content-Length bytes
+        ChunkSize,
+        ChunkData,
+        ChunkEnd,           // CRLF after the chunk data
+        Trailers,
+        BodyUntilClose,     // no length, the body ends with the connection
+        Complete,
+        Error
+    };
+
+    HttpResponseParser();
+
+    // Starts a new response.  Responses to HEAD requests have no body.
+    void reset(bool headRequest = false);
+
+    // Parses up to size bytes and returns the number consumed.  It returns
+    // early when the headers end, and after each piece of body, which is
+    // returned in body and bodySize (0 if none).
+    qint64 parse(const char *data, qint64 size, const char **body, qint64 *bodySize);
+
+    // The connection was closed.  Returns true if that completed the response.
+    bool finish();
+
+    State getState() const;
+    bool isComplete() const;
+    bool hasError() const;
+    bool headersComplete() const;
+
+    int getStatusCode() const;
+    QByteArray getReasonPhrase() const;
+    const HttpHeaders &getHeaders() const;
+
+    // Value of a header, case insensitive name.  Empty if it's not there.
+    QByteArray getHeader(const QByteArray &name) const;
+
+    // -1 if unknown
+    qint64 getContentLength() const;
+
+    bool isChunked() const;
+
+    // The connection can be used for another request after this response
+    bool isKeepAlive() const;
+
+    // Bytes of the status line and headers
+    qint64 getHeaderBytes() const;
+
+private:
+    State state;
+    bool headRequest;
+
+    QByteArray line;
+    int statusCode;
+    int minorVersion;
+    QByteArray reasonPhrase;
+    HttpHeaders headers;
+    qint64 headerBytes;
+
+    qint64 contentLength;
+    qint64 remaining;
+    bool chunked;
+    bool keepAlive;
+
+    bool readLine(const char *data, qint64 size, qint64 *used);
+    bool parseStatusLine();
+    bool parseHeaderLine();
+    void endHeaders();
+    bool parseChunkSize();
+};
+
+#endif // HTTPRESPONSEPARSER_H
@@ -28,37 +28,79 @@
 
 #include "key.h"
 
-#include <QDateTime>
 #include <QString>
 #include <QHash>
 
 Key::Key()
 {
+    this->from_me = false;
+    updateHash();
 }
 
-Key::Key(QString remote_jid, bool from_me, QString id)
+Key::Key(const QString &remote_jid, bool from_me, const QString &id)
 {
     this->remote_jid = remote_jid;
     this->from_me = from_me;
     this->id = id;
+    updateHash();
 }
 
+void Key::setRemoteJid(const QString &remote_jid)
+{
+    this->remote_jid = remote_jid;
+    updateHash();
+}
 
-bool Key::operator==(const Key& other) const
+void Key::setFromMe(bool from_me)
+{
+    this->from_me = from_me;
+    updateHash();
+}
+
+void Key::setId(const QString &id)
 {
-    return (other.id == id && other.from_me == from_me && other.remote_jid == remote_jid);
+    this->id = id;
+    updateHash();
 }
 
-uint qHash(const Key& key)
+void Key::updateHash()
 {
     int prime = 31;
-    int result = 1;
-    result = prime * result + (key.from_me ? 1231 : 1237);
-    result = prime * result + qHash(key.id);
-    result = prime * result + qHash(key.remote_jid);
+    uint result = 1;
+    remoteJidHash = qHash(remote_jid);
+    result = prime * result + (from_me ? 1231 : 1237);
+    result = prime * result + qHash(id);
+    result = prime * result + remoteJidHash;
+
+    keyHash = result;
+}
+
+bool Key::operator==(const Key& other) const
+{
+    if (keyHash != other.keyHash || from_me != other.from_me)
+        return false;
+
+    // Copies of the same jid share their data
+    if (remote_jid.constData() != other.remote_jid.constData() &&
+        remote_jid != other.remote_jid)
+        return false;
 
+    return id == other.id;
+}
 
-    return result;
+QDataStream &operator<<(QDataStream &out, const Key &key)
+{
+    out << key.getRemoteJid() << key.isFromMe() << key.getId();
+    return out;
 }
 
+QDataStream &operator>>(QDataStream &in, Key &key)
+{
+    QString remote_jid, id;
+    bool from_me;
 
+    in >> remote_jid >> from_me >> id;
+    key = Key(remote_jid, from_me, id);
+
+    return in;
+}
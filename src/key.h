@@ -30,21 +30,56 @@
 #define KEY_H
 
 #include <QString>
+#include <QDataStream>
 
+/**
+    Identifies a message: remote jid, direction and id.
+
+    The hash is computed when the key changes instead of on every lookup.
+    To keep it valid the fields are private: code that used key.remote_jid,
+    key.from_me or key.id directly must use the getters and setters.
+*/
 class Key
 {
 public:
-    QString remote_jid;
-    bool from_me;
-    QString id;
-
     Key();
-    Key(QString remote_jid, bool from_me, QString id);
+    Key(const QString &remote_jid, bool from_me, const QString &id);
+
+    const QString &getRemoteJid() const { return remote_jid; }
+    bool isFromMe() const { return from_me; }
+    const QString &getId() const { return id; }
+
+    void setRemoteJid(const QString &remote_jid);
+    void setFromMe(bool from_me);
+    void setId(const QString &id);
+
+    // Cached hashes of the whole key and of the remote jid only
+    uint getHash() const { return keyHash; }
+    uint getJidHash() const { return remoteJidHash; }
 
     // Operators
     bool operator== (const Key& other) const;
+    bool operator!= (const Key& other) const { return !(*this == other); }
+
+private:
+    QString remote_jid;
+    QString id;
+    uint keyHash;
+    uint remoteJidHash;
+    bool from_me;
+
+    void updateHash();
 };
 
-uint qHash(const Key& key);
+Q_DECLARE_TYPEINFO(Key, Q_MOVABLE_TYPE);
+
+inline uint qHash(const Key& key)
+{
+    return key.getHash();
+}
+
+// Serialization, used by the pending messages journal
+QDataStream &operator<<(QDataStream &out, const Key &key);
+QDataStream &operator>>(QDataStream &in, Key &key);
 
 #endif // KEY_H
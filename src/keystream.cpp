@@ -30,6 +30,7 @@
 
 #include "util/utilities.h"
 #include "util/qtrfc2898.h"
+#include "util/tracepoints.h"
 
 KeyStream::KeyStream(QByteArray rc4key, QByteArray mackey, QObject *parent) : QObject(parent)
 {
@@ -55,6 +56,7 @@ bool KeyStream::decodeMessage(QByteArray& buffer, int macOffset, int offset, int
     {
         if (buffer2[macOffset + i] != hmac[i])
         {
+            WA_PROBE1(mac_failed, seq - 1);
             return false;
         }
     }
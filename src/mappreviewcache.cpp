@@ -0,0 +1,275 @@
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QNetworkReply>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QThreadPool>
+#include <QDebug>
+
+#include "mappreviewcache.h"
+#include "util/utilities.h"
+
+#define DEFAULT_MEMORY_CACHE_SIZE   (2 * 1024 * 1024)
+#define DEFAULT_MAX_AGE             (7 * 24 * 3600)
+#define DEFAULT_MAX_DISK_SIZE       (16 * 1024 * 1024)
+
+// Requests per second to each provider, and how many can go at once
+#define DEFAULT_PROVIDER_RATE       2
+#define DEFAULT_PROVIDER_BURST      4
+
+// Tiles are 256 pixels wide, the coordinates are rounded to half a pixel
+#define TILE_SIZE                   256
+#define MAX_ZOOM                    22
+
+/*
+ * Prunes the disk cache in a worker
+ */
+
+class MapPreviewPruneTask : public QRunnable
+{
+public:
+    MapPreviewPruneTask(const QString &dir, int maxAge)
+    {
+        this->dir = dir;
+        this->maxAge = maxAge;
+    }
+
+    void run()
+    {
+        Utilities::pruneCacheDir(dir, maxAge, DEFAULT_MAX_DISK_SIZE);
+    }
+
+private:
+    QString dir;
+    int maxAge;
+};
+
+MapPreviewCache::MapPreviewCache(QObject *parent) :
+    QObject(parent), network(this), pendingTimer(this)
+{
+    memory.setMaxCost(DEFAULT_MEMORY_CACHE_SIZE);
+    maxAge = DEFAULT_MAX_AGE;
+
+    cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/maps";
+    QDir().mkpath(cacheDir);
+
+    pendingTimer.setSingleShot(true);
+    connect(&pendingTimer, SIGNAL(timeout()), this, SLOT(fetchPending()));
+
+    // Later, so a setMaxAge() right after instance() applies
+    QMetaObject::invokeMethod(this, "pruneDisk", Qt::QueuedConnection);
+}
+
+MapPreviewCache::~MapPreviewCache()
+{
+    qDeleteAll(buckets);
+}
+
+MapPreviewCache *MapPreviewCache::instance()
+{
+    static MapPreviewCache *cache = 0;
+    static QBasicMutex mutex;
+
+    QMutexLocker locker(&mutex);
+    if (!cache)
+    {
+        cache = new MapPreviewCache();
+
+        // Replies and timers belong to the main thread even if another
+        // thread asks for it first
+        if (QCoreApplication::instance())
+            cache->moveToThread(QCoreApplication::instance()->thread());
+    }
+
+    return cache;
+}
+
+QString MapPreviewCache::keyFor(const QString &provider, double latitude, double longitude,
+                                int zoom, const QSize &size)
+{
+    zoom = qBound(0, zoom, MAX_ZOOM);
+    double quantum = 180.0 / ((double) TILE_SIZE * (1 << zoom));
+
+    return QString("%1/%2/%3x%4/%5/%6")
+            .arg(provider).arg(zoom)
+            .arg(size.width()).arg(size.height())
+            .arg(qRound64(latitude / quantum))
+            .arg(qRound64(longitude / quantum));
+}
+
+/**
+    Requests a map preview.
+
+    @param provider     Name of the map provider, rate limits apply to it.
+    @param request      Request of the provider's static map.
+    @param latitude     Center of the map.
+    @param longitude    Center of the map.
+    @param zoom         Zoom level of the map.
+    @param size         Size of the map in pixels.
+    @return             Key that previewReady() or previewError() will carry.
+*/
+QString MapPreviewCache::request(const QString &provider, const QNetworkRequest &request,
+                                 double latitude, double longitude, int zoom, const QSize &size)
+{
+    QString key = keyFor(provider, latitude, longitude, zoom, size);
+
+    QByteArray *image = memory.object(key);
+    if (image)
+    {
+        QMetaObject::invokeMethod(this, "emitCached", Qt::QueuedConnection,
+                                  Q_ARG(QString, key), Q_ARG(QByteArray, *image));
+        return key;
+    }
+
+    // Requests of the same preview share its fetch
+    if (running.contains(key))
+        return key;
+
+    QFileInfo info(cacheFile(key));
+    if (info.exists())
+    {
+        QFile file(info.filePath());
+        if (info.lastModified().secsTo(QDateTime::currentDateTime()) >= maxAge)
+            file.remove();
+        else if (file.open(QIODevice::ReadOnly))
+        {
+            QByteArray data = file.readAll();
+            memory.insert(key, new QByteArray(data), data.size());
+
+            QMetaObject::invokeMethod(this, "emitCached", Qt::QueuedConnection,
+                                      Q_ARG(QString, key), Q_ARG(QByteArray, data));
+            return key;
+        }
+    }
+
+    Fetch fetch;
+    fetch.key = key;
+    fetch.provider = provider;
+    fetch.request = request;
+
+    running.insert(key, 0);
+    pending.append(fetch);
+    fetchPending();
+
+    return key;
+}
+
+void MapPreviewCache::setProviderRate(const QString &provider, int rate)
+{
+    TokenBucket *bucket = bucketFor(provider);
+    bucket->setRate(rate);
+    bucket->setBurst(qMax(rate, DEFAULT_PROVIDER_BURST));
+}
+
+void MapPreviewCache::setMemoryCacheSize(int bytes)
+{
+    memory.setMaxCost(bytes);
+}
+
+void MapPreviewCache::setMaxAge(int seconds)
+{
+    maxAge = seconds;
+}
+
+void MapPreviewCache::pruneDisk()
+{
+    QThreadPool::globalInstance()->start(new MapPreviewPruneTask(cacheDir, maxAge));
+}
+
+void MapPreviewCache::emitCached(const QString &key, const QByteArray &image)
+{
+    emit previewReady(key, image);
+}
+
+/**
+    Starts the waiting fetches of the providers under their rate, and
+    comes back when the next one can go.
+*/
+void MapPreviewCache::fetchPending()
+{
+    int wait = -1;
+
+    for (int i = 0; i < pending.size(); )
+    {
+        TokenBucket *bucket = bucketFor(pending.at(i).provider);
+        if (bucket->take(1) == 0)
+        {
+            int delay = bucket->delay(1);
+            wait = (wait < 0) ? delay : qMin(wait, delay);
+            i++;
+            continue;
+        }
+
+        Fetch fetch = pending.takeAt(i);
+
+        QNetworkReply *reply = network.get(fetch.request);
+        reply->setProperty("mapPreviewKey", fetch.key);
+        connect(reply, SIGNAL(finished()), this, SLOT(replyFinished()));
+
+        running.insert(fetch.key, reply);
+    }
+
+    if (wait >= 0 && !pendingTimer.isActive())
+        pendingTimer.start(wait);
+}
+
+void MapPreviewCache::replyFinished()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply *>(sender());
+    if (!reply)
+        return;
+
+    reply->deleteLater();
+
+    QString key = reply->property("mapPreviewKey").toString();
+    running.remove(key);
+
+    QByteArray image = reply->readAll();
+    QString contentType = reply->header(QNetworkRequest::ContentTypeHeader).toString();
+
+    // Some providers answer errors with a page instead of a status
+    if (reply->error() != QNetworkReply::NoError || image.isEmpty() ||
+        (!contentType.isEmpty() && !contentType.startsWith("image/")))
+    {
+        qDebug() << "MapPreviewCache: can't fetch" << reply->url() << reply->errorString();
+        emit previewError(key);
+        return;
+    }
+
+    memory.insert(key, new QByteArray(image), image.size());
+
+    QSaveFile file(cacheFile(key));
+    if (file.open(QIODevice::WriteOnly))
+    {
+        file.write(image);
+        file.commit();
+    }
+
+    emit previewReady(key, image);
+}
+
+TokenBucket *MapPreviewCache::bucketFor(const QString &provider)
+{
+    TokenBucket *bucket = buckets.value(provider);
+    if (!bucket)
+    {
+        bucket = new TokenBucket();
+        bucket->setRate(DEFAULT_PROVIDER_RATE);
+        bucket->setBurst(DEFAULT_PROVIDER_BURST);
+        buckets.insert(provider, bucket);
+    }
+
+    return bucket;
+}
+
+QString MapPreviewCache::cacheFile(const QString &key) const
+{
+    return cacheDir + "/" +
+            QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1).toHex() + ".img";
+}
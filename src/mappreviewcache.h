@@ -0,0 +1,95 @@
+#ifndef MAPPREVIEWCACHE_H
+#define MAPPREVIEWCACHE_H
+
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+#include <QSize>
+#include <QHash>
+#include <QList>
+#include <QCache>
+#include <QTimer>
+#include <QNetworkAccessManager>
+#include <QNetworkRequest>
+
+#include "util/tokenbucket.h"
+
+class QNetworkReply;
+
+/**
+    @class      MapPreviewCache
+
+    @brief      Static map images of the location messages.
+
+                Previews are cached in memory and on disk by provider, zoom,
+                size and coordinates rounded to about a pixel, so a location
+                shared in a group is fetched once.  Requests for a preview
+                that is being fetched wait for that fetch.  Expired files
+                are removed when they are found, and the disk cache is
+                pruned by age and size at startup.
+
+                Fetches go through one QNetworkAccessManager and are rate
+                limited per provider.
+*/
+
+class MapPreviewCache : public QObject
+{
+    Q_OBJECT
+public:
+    static MapPreviewCache *instance();
+
+    // Key of a preview, as carried by previewReady()
+    static QString keyFor(const QString &provider, double latitude, double longitude,
+                          int zoom, const QSize &size);
+
+    // Starts fetching a preview unless it's cached, returns its key
+    QString request(const QString &provider, const QNetworkRequest &request,
+                    double latitude, double longitude, int zoom, const QSize &size);
+
+    // Requests per second to a provider, 0 is unlimited
+    void setProviderRate(const QString &provider, int rate);
+
+    void setMemoryCacheSize(int bytes);
+
+    // Seconds a preview is kept on disk
+    void setMaxAge(int seconds);
+
+signals:
+    void previewReady(const QString &key, const QByteArray &image);
+    void previewError(const QString &key);
+
+private slots:
+    void pruneDisk();
+    void emitCached(const QString &key, const QByteArray &image);
+    void fetchPending();
+    void replyFinished();
+
+private:
+    struct Fetch
+    {
+        QString key;
+        QString provider;
+        QNetworkRequest request;
+    };
+
+    // Children, so they move with the cache
+    QNetworkAccessManager network;
+    QCache<QString, QByteArray> memory;
+    QString cacheDir;
+    int maxAge;
+
+    // Keys being fetched or waiting for their turn
+    QHash<QString, QNetworkReply *> running;
+    QList<Fetch> pending;
+
+    QHash<QString, TokenBucket *> buckets;
+    QTimer pendingTimer;
+
+    explicit MapPreviewCache(QObject *parent = 0);
+    ~MapPreviewCache();
+
+    TokenBucket *bucketFor(const QString &provider);
+    QString cacheFile(const QString &key) const;
+};
+
+#endif // MAPPREVIEWCACHE_H
@@ -1,14 +1,16 @@
 #include "maprequest.h"
+#include "mappreviewcache.h"
 
 MapRequest::MapRequest(const QString &source, const QString &latitude, const QString &longitude,
                        int zoom, int width, int height, const QStringList &jids, QObject *parent) :
     QObject(parent),
     _jids(jids),
+    _source(source),
     _latitude(latitude),
-    _longitude(longitude)
+    _longitude(longitude),
+    _zoom(zoom),
+    _size(width, height)
 {
-    _nam = new QNetworkAccessManager(this);
-
     if (source == "google") {
         QUrlQuery path;
         path.addQueryItem("maptype", "roadmap");
@@ -109,16 +111,28 @@ MapRequest::MapRequest(const QString &source, const QString &latitude, const QSt
 
 void MapRequest::doRequest()
 {
-    connect(_nam->get(_query), SIGNAL(finished()), this, SLOT(requestComplete()));
+    MapPreviewCache *cache = MapPreviewCache::instance();
+
+    connect(cache, SIGNAL(previewReady(QString,QByteArray)), this, SLOT(previewReady(QString,QByteArray)));
+    connect(cache, SIGNAL(previewError(QString)), this, SLOT(previewError(QString)));
+
+    _key = cache->request(_source, _query, _latitude.toDouble(), _longitude.toDouble(), _zoom, _size);
 }
 
-void MapRequest::requestComplete()
+void MapRequest::previewReady(const QString &key, const QByteArray &image)
 {
-    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
-    if (reply && reply->error() == QNetworkReply::NoError) {
-        Q_EMIT mapAvailable(reply->readAll(), _latitude, _longitude, _jids, this);
-    }
-    else {
-        Q_EMIT requestError(this);
-    }
+    if (key != _key)
+        return;
+
+    disconnect(MapPreviewCache::instance(), 0, this, 0);
+    Q_EMIT mapAvailable(image, _latitude, _longitude, _jids, this);
+}
+
+void MapRequest::previewError(const QString &key)
+{
+    if (key != _key)
+        return;
+
+    disconnect(MapPreviewCache::instance(), 0, this, 0);
+    Q_EMIT requestError(this);
 }
@@ -5,6 +5,7 @@
 #include <QNetworkReply>
 #include <QNetworkRequest>
 #include <QStringList>
+#include <QSize>
 #include <QUrl>
 #include <QUrlQuery>
 #include <QNetworkAccessManager>
@@ -19,11 +20,14 @@ public:
                         int zoom, int width, int height, const QStringList &jids, QObject *parent = 0);
 
 private:
-    QNetworkAccessManager *_nam;
     QNetworkRequest _query;
     QStringList _jids;
+    QString _source;
     QString _latitude;
     QString _longitude;
+    int _zoom;
+    QSize _size;
+    QString _key;
 
 signals:
     void mapAvailable(const QByteArray &mapData, const QString &latitude, const QString &longitude, const QStringList &jids, MapRequest* sender);
@@ -33,7 +37,8 @@ public slots:
     void doRequest();
 
 private slots:
-    void requestComplete();
+    void previewReady(const QString &key, const QByteArray &image);
+    void previewError(const QString &key);
 
 };
 
@@ -0,0 +1,339 @@
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QDebug>
+
+#include "mediacache.h"
+
+// 30 days
+#define DEFAULT_MAX_AGE     (30LL * 24 * 3600 * 1000)
+
+// Changes are written together, this long after the first one
+#define SAVE_DELAY          5000
+
+MediaCacheEntry::MediaCacheEntry()
+{
+    size = 0;
+    width = 0;
+    height = 0;
+    duration = 0;
+    created = 0;
+}
+
+MediaCache::MediaCache() : saveTimer(this)
+{
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    QDir().mkpath(dir);
+
+    fileName = dir + "/mediacache.json";
+    loaded = false;
+    dirty = false;
+    maxAge = DEFAULT_MAX_AGE;
+
+    saveTimer.setSingleShot(true);
+    connect(&saveTimer, SIGNAL(timeout()), this, SLOT(sync()));
+}
+
+MediaCache *MediaCache::instance()
+{
+    static MediaCache *cache = 0;
+    static QBasicMutex mutex;
+
+    QMutexLocker locker(&mutex);
+    if (!cache)
+    {
+        cache = new MediaCache();
+
+        // The timer runs in the main thread, files are hashed anywhere.
+        // Nothing pending is lost on exit.
+        if (QCoreApplication::instance())
+        {
+            cache->moveToThread(QCoreApplication::instance()->thread());
+            connect(QCoreApplication::instance(), SIGNAL(aboutToQuit()), cache, SLOT(sync()));
+        }
+    }
+
+    return cache;
+}
+
+bool MediaCache::lookup(const QByteArray &hash, MediaCacheEntry *entry)
+{
+    QMutexLocker locker(&mutex);
+    load();
+
+    QHash<QByteArray, MediaCacheEntry>::const_iterator i = entries.constFind(hash);
+    if (i == entries.constEnd())
+        return false;
+
+    if (i.value().created < QDateTime::currentMSecsSinceEpoch() - maxAge)
+        return false;
+
+    *entry = i.value();
+    return true;
+}
+
+void MediaCache::insert(const MediaCacheEntry &entry)
+{
+    if (entry.hash.isEmpty() || entry.url.isEmpty())
+        return;
+
+    QMutexLocker locker(&mutex);
+    load();
+
+    MediaCacheEntry value = entry;
+    if (value.created == 0)
+        value.created = QDateTime::currentMSecsSinceEpoch();
+
+    entries.insert(value.hash, value);
+    markDirty();
+}
+
+void MediaCache::remove(const QByteArray &hash)
+{
+    QMutexLocker locker(&mutex);
+    load();
+
+    if (entries.remove(hash))
+        markDirty();
+}
+
+/**
+    Returns the hash recorded for a file.
+
+    @param path     Local file.
+    @return         Base64 SHA-256, or empty if the file was not hashed
+                    before or its size or modification time changed.
+*/
+QByteArray MediaCache::hashForPath(const QString &path)
+{
+    QByteArray stamp = fileStamp(path);
+    if (stamp.isEmpty())
+        return QByteArray();
+
+    QMutexLocker locker(&mutex);
+    load();
+
+    QByteArray record = paths.value(path);
+    if (!record.startsWith(stamp))
+        return QByteArray();
+
+    return record.mid(stamp.size());
+}
+
+void MediaCache::insertPath(const QString &path, const QByteArray &hash)
+{
+    QByteArray stamp = fileStamp(path);
+    if (stamp.isEmpty() || hash.isEmpty())
+        return;
+
+    QMutexLocker locker(&mutex);
+    load();
+
+    QByteArray record = stamp + hash;
+    if (paths.value(path) != record)
+    {
+        paths.insert(path, record);
+        pathTimes.insert(path, QDateTime::currentMSecsSinceEpoch());
+        markDirty();
+    }
+}
+
+QByteArray MediaCache::hashFile(const QString &path)
+{
+    QByteArray hash = hashForPath(path);
+    if (!hash.isEmpty())
+        return hash;
+
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+
+    QCryptographicHash sha256(QCryptographicHash::Sha256);
+    sha256.addData(&file);
+
+    hash = hashDigest(sha256.result());
+    insertPath(path, hash);
+
+    return hash;
+}
+
+void MediaCache::setMaxAge(qint64 msecs)
+{
+    maxAge = msecs;
+}
+
+/**
+    Encodes a SHA-256 digest as the upload request expects it.
+*/
+QByteArray MediaCache::hashDigest(const QByteArray &sha256)
+{
+    return sha256.toBase64();
+}
+
+QByteArray MediaCache::fileStamp(const QString &path)
+{
+    QFileInfo info(path);
+    if (!info.exists())
+        return QByteArray();
+
+    return QByteArray::number(info.size()) + ':' +
+           QByteArray::number(info.lastModified().toMSecsSinceEpoch()) + ':';
+}
+
+void MediaCache::load()
+{
+    if (loaded)
+        return;
+    loaded = true;
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+        return;
+
+    QJsonParseError error;
+    QJsonObject root = QJsonDocument::fromJson(file.readAll(), &error).object();
+    if (error.error != QJsonParseError::NoError)
+    {
+        qDebug() << "MediaCache: ignoring invalid" << fileName;
+        return;
+    }
+
+    foreach (const QJsonValue &value, root.value("media").toArray())
+    {
+        QJsonObject object = value.toObject();
+
+        MediaCacheEntry entry;
+        entry.hash = object.value("hash").toString().toLatin1();
+        entry.url = object.value("url").toString();
+        entry.mimeType = object.value("mimetype").toString();
+        entry.name = object.value("name").toString();
+        entry.size = (qint64) object.value("size").toDouble();
+        entry.width = object.value("width").toInt();
+        entry.height = object.value("height").toInt();
+        entry.duration = object.value("duration").toInt();
+        entry.created = (qint64) object.value("created").toDouble();
+
+        if (!entry.hash.isEmpty())
+            entries.insert(entry.hash, entry);
+    }
+
+    // Records of older files have no time, they age from now
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QJsonObject files = root.value("files").toObject();
+    QJsonObject times = root.value("filetimes").toObject();
+    foreach (const QString &path, files.keys())
+    {
+        paths.insert(path, files.value(path).toString().toLatin1());
+        pathTimes.insert(path, (qint64) times.value(path).toDouble(now));
+    }
+}
+
+/*
+ * Called with the mutex locked, from any thread
+ */
+void MediaCache::markDirty()
+{
+    if (dirty)
+        return;
+    dirty = true;
+
+    QMetaObject::invokeMethod(this, "scheduleSave", Qt::QueuedConnection);
+}
+
+void MediaCache::scheduleSave()
+{
+    if (!saveTimer.isActive())
+        saveTimer.start(SAVE_DELAY);
+}
+
+void MediaCache::sync()
+{
+    QMutexLocker locker(&mutex);
+
+    if (!dirty)
+        return;
+    dirty = false;
+
+    prune();
+    save();
+}
+
+/**
+    Drops the expired media, and the path records of files that were
+    removed or changed, or that were hashed too long ago.
+*/
+void MediaCache::prune()
+{
+    qint64 oldest = QDateTime::currentMSecsSinceEpoch() - maxAge;
+
+    QMutableHashIterator<QByteArray, MediaCacheEntry> i(entries);
+    while (i.hasNext())
+    {
+        if (i.next().value().created < oldest)
+            i.remove();
+    }
+
+    QMutableHashIterator<QString, QByteArray> j(paths);
+    while (j.hasNext())
+    {
+        j.next();
+
+        QByteArray stamp = fileStamp(j.key());
+        if (stamp.isEmpty() || !j.value().startsWith(stamp) ||
+            pathTimes.value(j.key()) < oldest)
+        {
+            pathTimes.remove(j.key());
+            j.remove();
+        }
+    }
+}
+
+void MediaCache::save()
+{
+    QJsonArray media;
+    foreach (const MediaCacheEntry &entry, entries)
+    {
+        QJsonObject object;
+        object.insert("hash", QString::fromLatin1(entry.hash));
+        object.insert("url", entry.url);
+        object.insert("mimetype", entry.mimeType);
+        object.insert("name", entry.name);
+        object.insert("size", (double) entry.size);
+        object.insert("width", entry.width);
+        object.insert("height", entry.height);
+        object.insert("duration", entry.duration);
+        object.insert("created", (double) entry.created);
+        media.append(object);
+    }
+
+    QJsonObject files;
+    QJsonObject times;
+    foreach (const QString &path, paths.keys())
+    {
+        files.insert(path, QString::fromLatin1(paths.value(path)));
+        times.insert(path, (double) pathTimes.value(path));
+    }
+
+    QJsonObject root;
+    root.insert("media", media);
+    root.insert("files", files);
+    root.insert("filetimes", times);
+
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        qDebug() << "MediaCache: can't write" << fileName;
+        return;
+    }
+
+    file.write(QJsonDocument(root).toJson(QJsonDocument::Compact));
+    file.commit();
+}
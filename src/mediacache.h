@@ -0,0 +1,98 @@
+#ifndef MEDIACACHE_H
+#define MEDIACACHE_H
+
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+#include <QTimer>
+
+// An uploaded media, known by the hash of its content
+struct MediaCacheEntry
+{
+    QByteArray hash;        // base64 SHA-256, as sent in the upload request
+    QString url;
+    QString mimeType;
+    QString name;
+    qint64 size;
+    int width;
+    int height;
+    int duration;
+    qint64 created;         // ms since epoch
+
+    MediaCacheEntry();
+};
+
+/**
+    @class      MediaCache
+
+    @brief      Content addressed index of the uploaded media.
+
+                Maps the SHA-256 of a file to the URL where it was uploaded,
+                so sending it again needs neither the upload nor the request
+                to the server.  A second index maps path, size and
+                modification time to the hash, so a file sent before is not
+                hashed again.
+
+                Both are kept in a JSON file in the cache directory.  Changes
+                are written a few seconds later, together, and the records
+                of files that are gone or too old are pruned then.
+*/
+
+class MediaCache : public QObject
+{
+    Q_OBJECT
+
+public:
+    static MediaCache *instance();
+
+    // Entry of a hash, false if unknown or expired
+    bool lookup(const QByteArray &hash, MediaCacheEntry *entry);
+
+    void insert(const MediaCacheEntry &entry);
+    void remove(const QByteArray &hash);
+
+    // Hash recorded for a file, empty if unknown or the file changed
+    QByteArray hashForPath(const QString &path);
+    void insertPath(const QString &path, const QByteArray &hash);
+
+    // Hash of a file, only computed if it's not known
+    QByteArray hashFile(const QString &path);
+
+    // Entries older than this are ignored, the server forgets the media
+    void setMaxAge(qint64 msecs);
+
+    static QByteArray hashDigest(const QByteArray &sha256);
+
+public slots:
+    // Writes the pending changes now
+    void sync();
+
+private slots:
+    void scheduleSave();
+
+private:
+    QMutex mutex;
+    QString fileName;
+    bool loaded;
+    bool dirty;
+    qint64 maxAge;
+    QTimer saveTimer;
+
+    QHash<QByteArray, MediaCacheEntry> entries;
+
+    // path -> size:mtime:hash, and when it was recorded
+    QHash<QString, QByteArray> paths;
+    QHash<QString, qint64> pathTimes;
+
+    MediaCache();
+
+    static QByteArray fileStamp(const QString &path);
+    void load();
+    void markDirty();
+    void prune();
+    void save();
+};
+
+#endif // MEDIACACHE_H
@@ -3,13 +3,19 @@
 #include "util/utilities.h"
 #include "globalconstants.h"
 
+// Files from this size are written with O_DIRECT, they would only push
+// other data out of the page cache
+#define DIRECT_WRITE_SIZE   (16 * 1024 * 1024)
+
 MediaDownload::MediaDownload(FMessage message, QString &useragent, bool downloadToGallery, QObject *parent) :
     HttpRequestv2(useragent, parent)
 {
     this->message = message;
 
-    fileName = Utilities::getSaveNameFor(message.media_name, message.media_wa_type, downloadToGallery);
+    fileName = Utilities::getSaveNameFor(message.media().media_name, message.media_wa_type, downloadToGallery);
     file.setFileName(fileName);
+
+    setSizeHint(message.media().media_size);
 }
 
 void MediaDownload::backgroundTransfer()
@@ -17,8 +23,8 @@ void MediaDownload::backgroundTransfer()
     connect(this,SIGNAL(finished()),
             this,SLOT(onResponse()));
 
-    qDebug() << "Download media:" << message.media_url << "to" << fileName;
-    get(message.media_url);
+    qDebug() << "Download media:" << message.media().media_url << "to" << fileName;
+    get(message.media().media_url);
 
     emit progress(message, 0.01);
 }
@@ -31,7 +37,7 @@ void MediaDownload::onSocketError(const QString &errorString)
 
 void MediaDownload::onResponse()
 {
-    qDebug() << "HTTP Response. Bytes available:" << QString::number(socket->bytesAvailable());
+    qDebug() << "HTTP Response. Code:" << QString::number(errorCode);
 
     if (errorCode != 200)
     {
@@ -39,55 +45,71 @@ void MediaDownload::onResponse()
         return;
     }
 
-    totalLength = getHeader("Content-Length").toLongLong();
-    bytesWritten = 0;
-
-    if (!file.open(QIODevice::WriteOnly))
+    // An empty body still creates the file
+    if ((!file.isOpen() && !file.open(true)) || !file.flush())
     {
-        // An error has occurred
-        qDebug() << "MediaDownload: Error while trying to opening file:" << fileName;
-        socket->close();
+        qDebug() << "MediaDownload: Error while writing file:" << fileName;
+        QString errorString = file.errorString();
+        file.close();
+        emit httpError(this, message, errorString);
+        return;
     }
 
-    if (socket->bytesAvailable())
-        writeToFile();
+    file.close();
+
+    qDebug() << "MediaDownload: Downloading finished.";
+
+    message.mutableMedia().local_file_uri = fileName;
 
-    connect(socket, SIGNAL(readyRead()), this, SLOT(writeToFile()));
+    emit downloadFinished(this, message);
 }
 
-void MediaDownload::writeToFile()
+/**
+    Writes the body to the file as it arrives.
+*/
+void MediaDownload::bodyDataReceived(const char *data, qint64 size)
 {
-    qint64 bytesToRead = socket->bytesAvailable();
-
-    QByteArray buffer;
-    buffer.resize(bytesToRead);
+    // Error pages are not saved
+    if (errorCode != 200)
+        return;
 
-    if (bytesToRead + bytesWritten > totalLength)
-        bytesToRead = totalLength - bytesWritten;
+    if (!file.isOpen())
+    {
+        totalLength = getResponse().getContentLength();
+        bytesWritten = 0;
+
+        file.setMode(totalLength >= DIRECT_WRITE_SIZE ? MediaFileWriter::Direct
+                                                      : MediaFileWriter::Buffered);
+
+        if (!file.open(true) || !file.preallocate(totalLength))
+        {
+            // An error has occurred
+            qDebug() << "MediaDownload: Error while trying to opening file:" << fileName;
+            QString errorString = file.errorString();
+            file.close();
+            releaseConnection(false);
+            emit httpError(this, message, errorString);
+            return;
+        }
+    }
 
-    if (file.write(socket->read(bytesToRead)) != bytesToRead)
+    if (!file.append(data, size))
     {
         // An error has occurred
-        qDebug() << "MediaDownload: Error while trying to opening file";
+        QString errorString = file.errorString();
+        qDebug() << "MediaDownload: Error while writing file:" << fileName << errorString;
         file.close();
-        socket->close();
+        releaseConnection(false);
+        emit httpError(this, message, errorString);
+        return;
     }
 
-    bytesWritten += bytesToRead;
-
-    float p = ((float)((bytesWritten) * 100.0)) / ((float)totalLength);
+    bytesWritten += size;
 
-    emit progress(message,p);
-
-    if (bytesWritten == totalLength)
+    // Chunked responses have no length
+    if (totalLength > 0 && progressThrottle.ready(bytesWritten >= totalLength))
     {
-        file.close();
-        socket->close();
-
-        qDebug() << "MediaDownload: Downloading finished.";
-
-        message.local_file_uri = fileName;
-
-        emit downloadFinished(this, message);
+        float p = ((float)((bytesWritten) * 100.0)) / ((float)totalLength);
+        emit progress(message,p);
     }
 }
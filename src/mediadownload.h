@@ -1,10 +1,9 @@
 #ifndef MEDIADOWNLOAD_H
 #define MEDIADOWNLOAD_H
 
-#include <QFile>
-
 #include "fmessage.h"
 #include "httprequestv2.h"
+#include "mediafilewriter.h"
 
 #include "libqtwa.h"
 
@@ -17,7 +16,6 @@ public:
 private slots:
     void onSocketError(const QString &errorString);
     void onResponse();
-    void writeToFile();
 
 signals:
     void progress(FMessage msg, float p);
@@ -27,10 +25,13 @@ signals:
 public slots:
     void backgroundTransfer();
 
+protected:
+    void bodyDataReceived(const char *data, qint64 size);
+
 private:
     FMessage message;
     QString fileName;
-    QFile file;
+    MediaFileWriter file;
     qint64 totalLength;
     qint64 bytesWritten;
 };
@@ -0,0 +1,332 @@
+#include <QFile>
+#include <QDebug>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mediafilewriter.h"
+
+// Pieces are written to the file in chunks of up to WRITER_BUFFER bytes
+#define WRITER_BUFFER       0x100000
+
+// Alignment of the staging buffer, offsets and sizes for O_DIRECT
+#define WRITER_ALIGN        4096
+
+MediaFileWriter::MediaFileWriter()
+{
+    mode = Buffered;
+    fd = -1;
+    direct = false;
+    staging = 0;
+    stagingOffset = 0;
+    stagingSize = 0;
+    map = 0;
+    mapSize = 0;
+    allocated = 0;
+    position = 0;
+}
+
+MediaFileWriter::~MediaFileWriter()
+{
+    close();
+}
+
+void MediaFileWriter::setFileName(const QString &fileName)
+{
+    this->fileName = fileName;
+}
+
+QString MediaFileWriter::getFileName() const
+{
+    return fileName;
+}
+
+void MediaFileWriter::setMode(Mode mode)
+{
+    this->mode = mode;
+}
+
+MediaFileWriter::Mode MediaFileWriter::getMode() const
+{
+    return mode;
+}
+
+bool MediaFileWriter::open(bool truncate)
+{
+    close();
+    error.clear();
+
+    int flags = O_RDWR | O_CREAT | O_CLOEXEC;
+    if (truncate)
+        flags |= O_TRUNC;
+
+    fd = ::open(QFile::encodeName(fileName).constData(), flags, 0666);
+    if (fd < 0)
+        return setError("Can't open " + fileName);
+
+    if (mode == Direct && !setDirect(true))
+        qDebug() << "MediaFileWriter: O_DIRECT not available for" << fileName;
+
+    return true;
+}
+
+bool MediaFileWriter::isOpen() const
+{
+    return fd >= 0;
+}
+
+/**
+    Allocates the blocks of the file.  Where fallocate isn't supported the
+    file is just extended.  In Mapped mode the file is mapped here, it's only
+    safe once the blocks are reserved: writing to a mapped hole on a full disk
+    would crash with SIGBUS.
+
+    @param size     Length of the file.
+    @return         False if there is no space.
+*/
+bool MediaFileWriter::preallocate(qint64 size)
+{
+    if (fd < 0 || size <= 0)
+        return fd >= 0;
+
+    int result = posix_fallocate(fd, 0, size);
+    if (result != 0)
+    {
+        errno = result;
+        if (result != EOPNOTSUPP && result != EINVAL)
+            return setError("Can't allocate " + fileName);
+
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size < size && ftruncate(fd, size) != 0)
+            return setError("Can't resize " + fileName);
+    }
+    else
+        allocated = size;
+
+    if (mode == Mapped && allocated >= size && !map)
+    {
+        void *address = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (address != MAP_FAILED)
+        {
+            map = (uchar *) address;
+            mapSize = size;
+        }
+        else
+            qDebug() << "MediaFileWriter: can't map" << fileName << qt_error_string(errno);
+    }
+
+    return true;
+}
+
+/**
+    Writes data at an offset.  Consecutive writes are gathered and written
+    together, except large pieces when nothing is pending, which go to the
+    file directly.
+*/
+bool MediaFileWriter::write(qint64 offset, const char *data, qint64 size)
+{
+    if (fd < 0)
+    {
+        error = "File not open";
+        return false;
+    }
+
+    if (size <= 0)
+        return true;
+
+    position = offset + size;
+
+    if (map && offset + size <= mapSize)
+    {
+        memcpy(map + offset, data, size);
+        return true;
+    }
+
+    // Allocated on the first unmapped write
+    if (!staging)
+    {
+        void *buffer = 0;
+        if (posix_memalign(&buffer, WRITER_ALIGN, WRITER_BUFFER) != 0)
+        {
+            error = "Out of memory";
+            return false;
+        }
+
+        staging = (char *) buffer;
+    }
+
+    if (stagingSize > 0 && offset != stagingOffset + stagingSize && !writeStaging())
+        return false;
+
+    while (size > 0)
+    {
+        if (stagingSize == 0)
+        {
+            stagingOffset = offset;
+
+            if (!direct && size >= WRITER_BUFFER)
+            {
+                qint64 written = pwrite(fd, data, size, offset);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0)
+                    return setError("Can't write " + fileName);
+
+                data += written;
+                offset += written;
+                size -= written;
+                continue;
+            }
+        }
+
+        qint64 count = qMin(size, (qint64) WRITER_BUFFER - stagingSize);
+        memcpy(staging + stagingSize, data, count);
+        stagingSize += count;
+        data += count;
+        offset += count;
+        size -= count;
+
+        if (stagingSize == WRITER_BUFFER && !writeStaging())
+            return false;
+    }
+
+    return true;
+}
+
+bool MediaFileWriter::append(const char *data, qint64 size)
+{
+    return write(position, data, size);
+}
+
+qint64 MediaFileWriter::pos() const
+{
+    return position;
+}
+
+/**
+    Writes the staging buffer.  In Mapped mode the data is also synced to the
+    disk: ranges are recorded as done once flushed, and the dirty pages of a
+    mapping could otherwise be lost with the record already saying they are
+    there.
+*/
+bool MediaFileWriter::flush()
+{
+    if (fd < 0)
+        return true;
+
+    if (!writeStaging())
+        return false;
+
+    if (mode != Mapped)
+        return true;
+
+    if (map && msync(map, mapSize, MS_SYNC) != 0)
+        return setError("Can't sync " + fileName);
+
+    if (!map && fdatasync(fd) != 0)
+        return setError("Can't sync " + fileName);
+
+    return true;
+}
+
+void MediaFileWriter::close()
+{
+    if (fd >= 0)
+    {
+        if (!writeStaging())
+            qDebug() << "MediaFileWriter:" << error;
+    }
+
+    if (map)
+    {
+        munmap(map, mapSize);
+        map = 0;
+        mapSize = 0;
+    }
+
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+
+    free(staging);
+    staging = 0;
+    stagingSize = 0;
+    direct = false;
+    allocated = 0;
+    position = 0;
+}
+
+QString MediaFileWriter::errorString() const
+{
+    return error;
+}
+
+bool MediaFileWriter::setDirect(bool enable)
+{
+#ifdef O_DIRECT
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0)
+        return false;
+
+    flags = enable ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+    if (fcntl(fd, F_SETFL, flags) != 0)
+        return false;
+
+    direct = enable;
+    return true;
+#else
+    Q_UNUSED(enable);
+    return false;
+#endif
+}
+
+/**
+    Writes the staging buffer.  O_DIRECT needs aligned offsets and sizes, an
+    unaligned buffer (the end of the file, or a write after a seek) goes
+    through the page cache.
+*/
+bool MediaFileWriter::writeStaging()
+{
+    if (stagingSize == 0)
+        return true;
+
+    bool unaligned = direct && ((stagingOffset | stagingSize) & (WRITER_ALIGN - 1));
+    if (unaligned)
+        setDirect(false);
+
+    qint64 done = 0;
+    while (done < stagingSize)
+    {
+        qint64 written = pwrite(fd, staging + done, stagingSize - done, stagingOffset + done);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+        {
+            stagingSize = 0;
+            return setError("Can't write " + fileName);
+        }
+
+        done += written;
+    }
+
+    if (unaligned)
+        setDirect(true);
+
+    stagingSize = 0;
+    return true;
+}
+
+bool MediaFileWriter::setError(const QString &context)
+{
+    error = context + ": " + qt_error_string(errno);
+    qDebug() << "MediaFileWriter:" << error;
+
+    return false;
+}
@@ -0,0 +1,89 @@
+#ifndef MEDIAFILEWRITER_H
+#define MEDIAFILEWRITER_H
+
+#include <QtGlobal>
+#include <QString>
+
+/**
+    @class      MediaFileWriter
+
+    @brief      Sink for downloaded media.
+
+                The file is preallocated with fallocate when the size is known,
+                so it doesn't fragment and a full disk fails at the start.
+
+                Pieces written one after the other are gathered in an aligned
+                staging buffer and written in large chunks.  The data doesn't
+                go through another buffer like the one of QFile.
+
+                Direct mode writes the staging buffer with O_DIRECT, skipping
+                the page cache for large files.  Mapped mode maps the
+                preallocated file and copies the data straight into it, which
+                suits writes at scattered offsets.  When a mode isn't possible
+                (file system, platform, unknown size) Buffered is used.
+*/
+
+class MediaFileWriter
+{
+public:
+    enum Mode {
+        Buffered = 0,
+        Direct,
+        Mapped
+    };
+
+    MediaFileWriter();
+    ~MediaFileWriter();
+
+    void setFileName(const QString &fileName);
+    QString getFileName() const;
+
+    // Mode wanted, set before open()
+    void setMode(Mode mode);
+    Mode getMode() const;
+
+    bool open(bool truncate = false);
+    bool isOpen() const;
+
+    // Reserves size bytes on disk, the file is at least that long after it
+    bool preallocate(qint64 size);
+
+    // Writes at an offset, or after the last write
+    bool write(qint64 offset, const char *data, qint64 size);
+    bool append(const char *data, qint64 size);
+
+    // End of the last write
+    qint64 pos() const;
+
+    // Writes the staging buffer to the file, and syncs it in Mapped mode
+    bool flush();
+    void close();
+
+    QString errorString() const;
+
+private:
+    QString fileName;
+    Mode mode;
+    int fd;
+    bool direct;
+
+    // Staging buffer and the file offset where it goes
+    char *staging;
+    qint64 stagingOffset;
+    qint64 stagingSize;
+
+    uchar *map;
+    qint64 mapSize;
+
+    qint64 allocated;
+    qint64 position;
+    QString error;
+
+    bool setDirect(bool enable);
+    bool writeStaging();
+    bool setError(const QString &context);
+
+    Q_DISABLE_COPY(MediaFileWriter)
+};
+
+#endif // MEDIAFILEWRITER_H
@@ -27,20 +27,15 @@
  */
 
 #include <QCryptographicHash>
-#include <QImageReader>
-#include <QImage>
-#include <QBuffer>
 
 #include "mediaupload.h"
 #include "formdata.h"
+#include "mediacache.h"
+#include "thumbnailservice.h"
 #include "src/client.h"
 
 #include "util/utilities.h"
 
-#include <QLibrary>
-
-typedef QImage (*CreateThumbnailFunc)(const QString &fileName, const QSize &requestedSize, bool crop);
-
 MediaUpload::MediaUpload(const FMessage &message, QObject *parent) :
     QObject(parent)
 {
@@ -60,71 +55,46 @@ QString MediaUpload::generateMediaFilename(QString extension)
     return QString::fromUtf8(hashed);
 }
 
-QImage MediaUpload::generateThumbnail(const QString &fileName, const QSize &requestedSize, bool crop)
+void MediaUpload::sendPicture(QStringList jids, MediaDescriptor descriptor)
 {
-    QImage image;
-
-    static CreateThumbnailFunc createThumbnail = (CreateThumbnailFunc)QLibrary::resolve(
-                QLatin1String("/usr/lib/qt5/qml/org/nemomobile/thumbnailer/thumbnailers/libvideothumbnailer.so"), "createThumbnail");
-
-    if (createThumbnail) {
-        image = createThumbnail(fileName, requestedSize, crop);
-    } else {
-        qWarning("Cannot generate video thumbnail, thumbnailer function not available.");
-    }
-
-    return image;
+    qDebug() << "loading image:" << descriptor.localFileUri;
+    requestThumbnail(jids, descriptor);
 }
 
 
-void MediaUpload::sendPicture(QStringList jids, MediaDescriptor descriptor)
+void MediaUpload::sendVideo(QStringList jids, MediaDescriptor descriptor)
 {
-    qDebug() << "loading image:" << descriptor.localFileUri;
-    QImageReader reader(descriptor.localFileUri);
-    QRect clip;
-    if (reader.size().width() > reader.size().height()) {
-        clip.setTop(0);
-        clip.setLeft((reader.size().width() - reader.size().height()) / 2);
-        clip.setWidth(reader.size().height());
-        clip.setHeight(reader.size().height());
-    }
-    else {
-        clip.setLeft(0);
-        clip.setTop((reader.size().height() - reader.size().width()) / 2);
-        clip.setWidth(reader.size().width());
-        clip.setHeight(reader.size().width());
-    }
-    reader.setClipRect(clip);
-    reader.setScaledSize(QSize(100, 100));
-    qDebug() << "creating preview";
+    qDebug() << "loading video:" << descriptor.localFileUri;
+    requestThumbnail(jids, descriptor);
+}
 
-    QImage picture = reader.read();
+/**
+    Asks the thumbnail service for the preview.  The media is sent when
+    it's ready, without blocking the caller.
+*/
+void MediaUpload::requestThumbnail(QStringList jids, MediaDescriptor descriptor)
+{
+    pendingJids = jids;
+    pendingDescriptor = descriptor;
 
-    descriptor.data.clear();
-    QBuffer out(&descriptor.data);
-    out.open(QIODevice::WriteOnly);
-    qDebug() << "saving preview";
-    picture.save(&out, "JPG");
+    ThumbnailService *service = ThumbnailService::instance();
+    connect(service, SIGNAL(thumbnailReady(QString,QByteArray)),
+            this, SLOT(thumbnailReady(QString,QByteArray)), Qt::UniqueConnection);
 
-    sendMedia(jids, descriptor);
+    thumbnailKey = service->request(descriptor.localFileUri, descriptor.waType, QSize(100, 100));
 }
 
-
-void MediaUpload::sendVideo(QStringList jids, MediaDescriptor descriptor)
+void MediaUpload::thumbnailReady(const QString &key, const QByteArray &jpeg)
 {
-    qDebug() << "loading video:" << descriptor.localFileUri;
-    QImage picture = generateThumbnail(descriptor.localFileUri, QSize(100, 100), true);
-    if (picture.isNull()) {
-        QString thumbnail = "/usr/share/harbour-mitakuuluu2/images/thumbnail-video.jpg";
-        picture.load(thumbnail);
-        picture = picture.scaled(64, 64, Qt::KeepAspectRatio);
-    }
-    descriptor.data.clear();
-    QBuffer out(&descriptor.data);
-    out.open(QIODevice::WriteOnly);
-    picture.save(&out, "JPG");
+    if (key != thumbnailKey)
+        return;
 
-    sendMedia(jids, descriptor);
+    disconnect(ThumbnailService::instance(), SIGNAL(thumbnailReady(QString,QByteArray)),
+               this, SLOT(thumbnailReady(QString,QByteArray)));
+    thumbnailKey.clear();
+
+    pendingDescriptor.data = jpeg;
+    sendMedia(pendingJids, pendingDescriptor);
 }
 
 void MediaUpload::sendMedia(QStringList jids, FMessage message)
@@ -136,15 +106,15 @@ void MediaUpload::sendMedia(QStringList jids, FMessage message)
         vjids << message.remote_resource;
 
     descriptor.waType = (FMessage::MediaWAType) message.media_wa_type;
-    descriptor.extension = Utilities::getExtension(message.media_name);
-    descriptor.duration = message.media_duration_seconds;
+    descriptor.extension = Utilities::getExtension(message.media().media_name);
+    descriptor.duration = message.media().media_duration_seconds;
     descriptor.contentType =
-            message.media_mime_type.isEmpty() ?
-                Utilities::guessMimeType(message.media_name) :
-                message.media_mime_type;
-    descriptor.localFileUri = message.media_name;
-    descriptor.fileName = message.local_file_uri;
-    descriptor.url = message.media_url;
+            message.media().media_mime_type.isEmpty() ?
+                Utilities::guessMimeType(message.media().media_name) :
+                message.media().media_mime_type;
+    descriptor.localFileUri = message.media().media_name;
+    descriptor.fileName = message.media().local_file_uri;
+    descriptor.url = message.media().media_url;
     descriptor.upload = (message.status == FMessage::Uploading);
     descriptor.live = message.live;
 
@@ -174,17 +144,20 @@ void MediaUpload::sendMedia(QStringList jids, MediaDescriptor descriptor)
 
     QFile file(descriptor.localFileUri);
 
+    // Media details are shared with the copies emitted below, so they
+    // are all filled in before the first one
+    FMessageMedia &media = msg.mutableMedia();
+
     msg.type = FMessage::MediaMessage;
     msg.data = descriptor.data;
-    msg.thumb_image = QString::fromLatin1(msg.data.toBase64());
-    msg.media_size =  file.size();
+    media.media_size =  file.size();
     msg.media_wa_type = descriptor.waType;
-    msg.media_mime_type = descriptor.contentType;
+    media.media_mime_type = descriptor.contentType;
     msg.remote_resource = jid;
-    msg.key.remote_jid = jid;
-    msg.local_file_uri = descriptor.fileName;
-    msg.media_name = generateMediaFilename(descriptor.extension);
-    msg.media_duration_seconds = descriptor.duration;
+    msg.key.setRemoteJid(jid);
+    media.local_file_uri = descriptor.fileName;
+    media.media_name = generateMediaFilename(descriptor.extension);
+    media.media_duration_seconds = descriptor.duration;
     msg.live = descriptor.live;
     if (jids.size() > 1) {
         msg.broadcast = true;
@@ -193,14 +166,12 @@ void MediaUpload::sendMedia(QStringList jids, MediaDescriptor descriptor)
 
     // This will be overwritten if a media upload is required with
     // the final URL
-    msg.media_url = descriptor.url;
+    media.media_url = descriptor.url;
 
     // ToDo: Save tmp file for persistence sending.
 
     msg.status = FMessage::Uploading;
-    msg.data = msg.data.toBase64();
     emit readyToSendMessage(this,msg);
-    msg.data = QByteArray::fromBase64(msg.data);
 
     if (descriptor.upload)
     {
@@ -231,13 +202,13 @@ void MediaUpload::uploadMedia()
 
     FormDataFile *file = new FormDataFile();
     file->name = "file";
-    file->fileName = msg.media_name;
-    QString scaled = QString("/var/tmp/%1").arg(msg.local_file_uri.split("/").last());
+    file->fileName = msg.media().media_name;
+    QString scaled = QString("/var/tmp/%1").arg(msg.media().local_file_uri.split("/").last());
     if (QFile(scaled).exists())
         file->uri = scaled;
     else
-        file->uri = msg.local_file_uri;
-    file->contentType = msg.media_mime_type;
+        file->uri = msg.media().local_file_uri;
+    file->contentType = msg.media().media_mime_type;
 
     qDebug() << "Uploading media:" << file->fileName << file->uri;
 
@@ -258,7 +229,7 @@ void MediaUpload::uploadMedia()
 
 
     // uploader->open("https://mms.whatsapp.net/client/iphone/upload.php", formData);
-    uploader->open(msg.media_url, formData);
+    uploader->open(msg.media().media_url, formData);
 }
 
 void MediaUpload::finished(MultiPartUploader *uploader, QVariantMap dictionary)
@@ -268,15 +239,34 @@ void MediaUpload::finished(MultiPartUploader *uploader, QVariantMap dictionary)
 
     if (dictionary.contains("url"))
     {
-        msg.media_mime_type = dictionary.value("mimetype").toString();
-        msg.media_name = dictionary.value("name").toString();
-        msg.media_size = dictionary.value("size").toLongLong();
-        msg.media_url = dictionary.value("url").toString();
-        msg.media_duration_seconds = dictionary.value("duration").toInt();
+        FMessageMedia &media = msg.mutableMedia();
+        media.media_mime_type = dictionary.value("mimetype").toString();
+        media.media_name = dictionary.value("name").toString();
+        media.media_size = dictionary.value("size").toLongLong();
+        media.media_url = dictionary.value("url").toString();
+        media.media_duration_seconds = dictionary.value("duration").toInt();
         msg.status = FMessage::Uploaded;
 
-        qDebug() << "Upload finished:" << msg.media_name << "size:" << QString::number(msg.media_size);
-        qDebug() << "Url:" << msg.media_url;
+        qDebug() << "Upload finished:" << msg.media().media_name << "size:" << QString::number(msg.media().media_size);
+        qDebug() << "Url:" << msg.media().media_url;
+
+        // Sending the same content again won't need another upload.  The
+        // hash is the one of the upload request, the file is not hashed
+        // again here.
+        if (!msg.data.isEmpty())
+        {
+            MediaCacheEntry entry;
+            entry.hash = msg.data;
+            entry.url = msg.media().media_url;
+            entry.mimeType = msg.media().media_mime_type;
+            entry.name = msg.media().media_name;
+            entry.size = msg.media().media_size;
+            entry.width = dictionary.value("width").toInt();
+            entry.height = dictionary.value("height").toInt();
+            entry.duration = msg.media().media_duration_seconds;
+
+            MediaCache::instance()->insert(entry);
+        }
 
         emit sendMessage(this, msg);
     }
@@ -82,13 +82,19 @@ private slots:
     void requestSentHandler(qint64 bytes);
     void headersReceivedHandler(qint64 bytes);
     void upload();
+    void thumbnailReady(const QString &key, const QByteArray &jpeg);
 
 private:
     FMessage msg;
     FMessage _pendingMsg;
 
+    // Media waiting for its thumbnail
+    QString thumbnailKey;
+    QStringList pendingJids;
+    MediaDescriptor pendingDescriptor;
+
     QString generateMediaFilename(QString extension);
-    QImage generateThumbnail(const QString &fileName, const QSize &requestedSize, bool crop);
+    void requestThumbnail(QStringList jids, MediaDescriptor descriptor);
 
 };
 
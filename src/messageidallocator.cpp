@@ -0,0 +1,90 @@
+#include <QDateTime>
+#include <QAtomicInteger>
+
+#include "messageidallocator.h"
+
+// Sequence numbers reserved for each allocator
+#define ALLOCATOR_BLOCK_BITS    32
+
+// Enough for a 64 bit timestamp, a dash and a 64 bit sequence
+#define MESSAGE_ID_BUFFER_SIZE  48
+
+static QAtomicInteger<quint32> allocators;
+
+Q_GLOBAL_STATIC(MessageIdAllocator, globalAllocator)
+
+/*
+ * Writes the decimal digits of value backwards ending at end.
+ * Returns the first character written.
+ */
+static char *writeDecimal(char *end, quint64 value)
+{
+    do {
+        *--end = '0' + (value % 10);
+        value /= 10;
+    } while (value);
+
+    return end;
+}
+
+static char *writeHex(char *end, quint64 value)
+{
+    do {
+        *--end = "0123456789abcdef"[value & 0xf];
+        value >>= 4;
+    } while (value);
+
+    return end;
+}
+
+MessageIdAllocator::MessageIdAllocator()
+{
+    quint64 block = allocators.fetchAndAddRelaxed(1);
+    sequence.store(block << ALLOCATOR_BLOCK_BITS);
+}
+
+/**
+    Allocates a message id.
+
+    @param timestamp    Message timestamp in seconds.
+*/
+QString MessageIdAllocator::nextMessageId(qint64 timestamp)
+{
+    char buffer[MESSAGE_ID_BUFFER_SIZE];
+    char *end = buffer + MESSAGE_ID_BUFFER_SIZE;
+
+    char *begin = writeDecimal(end, nextSequence());
+    *--begin = '-';
+    begin = writeDecimal(begin, (quint64) qMax(timestamp, (qint64) 0));
+
+    return QString::fromLatin1(begin, end - begin);
+}
+
+QString MessageIdAllocator::nextMessageId()
+{
+    return nextMessageId(QDateTime::currentMSecsSinceEpoch() / 1000);
+}
+
+/**
+    Allocates an id for an <iq> node.
+
+    @param prefix   String containing the prefix of the id.
+*/
+QString MessageIdAllocator::nextId(const QString &prefix)
+{
+    char buffer[MESSAGE_ID_BUFFER_SIZE];
+    char *end = buffer + MESSAGE_ID_BUFFER_SIZE;
+    char *begin = writeHex(end, nextSequence());
+
+    QString id;
+    id.reserve(prefix.size() + (end - begin));
+    id.append(prefix);
+    id.append(QLatin1String(begin, end - begin));
+
+    return id;
+}
+
+MessageIdAllocator *MessageIdAllocator::global()
+{
+    return globalAllocator();
+}
@@ -0,0 +1,55 @@
+#ifndef MESSAGEIDALLOCATOR_H
+#define MESSAGEIDALLOCATOR_H
+
+#include <QString>
+#include <QAtomicInteger>
+
+/**
+    @class      MessageIdAllocator
+
+    @brief      Lock-free generator of message and iq ids.
+
+                Message ids have the usual "timestamp-sequence" form.  The
+                sequence is a single atomic counter, so any number of threads
+                can allocate ids without a lock and without duplicates, and
+                the id is formatted in a stack buffer that is copied into the
+                returned string in one allocation.
+
+                The sequence is 64 bits.  Each allocator of the process
+                starts it in its own block of 2^32 numbers (the high half is
+                the allocator number), so ids from two allocators of the same
+                process don't collide unless one of them allocates 2^32 ids or
+                2^32 allocators are created.  Every Connection owns one;
+                global() is used by messages created without a connection.
+*/
+
+class MessageIdAllocator
+{
+public:
+    MessageIdAllocator();
+
+    // Next sequence number
+    inline quint64 nextSequence()
+    {
+        return sequence.fetchAndAddRelaxed(1);
+    }
+
+    // "timestamp-sequence" message id
+    QString nextMessageId(qint64 timestamp);
+
+    // Message id with the current time
+    QString nextMessageId();
+
+    // Prefix followed by the sequence in hex, used for <iq> ids
+    QString nextId(const QString &prefix);
+
+    // Allocator shared by the messages created without a connection
+    static MessageIdAllocator *global();
+
+private:
+    QAtomicInteger<quint64> sequence;
+
+    Q_DISABLE_COPY(MessageIdAllocator)
+};
+
+#endif // MESSAGEIDALLOCATOR_H
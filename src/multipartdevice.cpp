@@ -0,0 +1,178 @@
+#include <QDebug>
+
+#include "multipartdevice.h"
+
+MultiPartDevice::MultiPartDevice(const QString &boundary, const QList<FormData *> &parts,
+                                 QObject *parent) : QIODevice(parent)
+{
+    this->parts = parts;
+
+    totalLength = 0;
+    foreach (FormData *part, parts)
+    {
+        Segment header;
+        header.bytes = part->header(boundary);
+        header.part = 0;
+        header.length = header.bytes.size();
+        segments.append(header);
+
+        Segment content;
+        content.part = part;
+        content.length = part->length();
+        segments.append(content);
+
+        Segment end;
+        end.bytes = "\r\n";
+        end.part = 0;
+        end.length = end.bytes.size();
+        segments.append(end);
+
+        totalLength += header.length + content.length + end.length;
+    }
+
+    Segment last;
+    last.bytes = "--" + boundary.toUtf8() + "--\r\n";
+    last.part = 0;
+    last.length = last.bytes.size();
+    segments.append(last);
+
+    totalLength += last.length;
+
+    current = 0;
+    offset = 0;
+    partOpen = false;
+    position = 0;
+}
+
+MultiPartDevice::~MultiPartDevice()
+{
+    close();
+    qDeleteAll(parts);
+}
+
+bool MultiPartDevice::open(OpenMode mode)
+{
+    if (mode & WriteOnly)
+        return false;
+
+    current = 0;
+    offset = 0;
+    position = 0;
+
+    return QIODevice::open(mode | Unbuffered);
+}
+
+void MultiPartDevice::close()
+{
+    if (partOpen && current < segments.size())
+        segments.at(current).part->close();
+    partOpen = false;
+
+    QIODevice::close();
+}
+
+/**
+    Reopens the device, so QIODevice drops whatever it had buffered or
+    pushed back along with the read position.
+*/
+bool MultiPartDevice::reset()
+{
+    if (!isOpen())
+        return false;
+
+    OpenMode mode = openMode();
+    close();
+
+    return open(mode);
+}
+
+bool MultiPartDevice::isSequential() const
+{
+    return true;
+}
+
+qint64 MultiPartDevice::size() const
+{
+    return totalLength;
+}
+
+qint64 MultiPartDevice::bytesAvailable() const
+{
+    return (totalLength - position) + QIODevice::bytesAvailable();
+}
+
+bool MultiPartDevice::atEnd() const
+{
+    return position >= totalLength;
+}
+
+/**
+    Reads from the current segment, moving to the next ones until maxSize
+    bytes are read or the body ends.
+
+    A file that can't be read or is shorter than when the length was
+    computed is an error: the Content-Length already sent can't be honored.
+*/
+qint64 MultiPartDevice::readData(char *data, qint64 maxSize)
+{
+    qint64 read = 0;
+
+    while (read < maxSize && current < segments.size())
+    {
+        const Segment &segment = segments.at(current);
+        qint64 size = qMin(maxSize - read, segment.length - offset);
+
+        if (segment.part)
+        {
+            if (!partOpen)
+            {
+                if (!segment.part->open())
+                {
+                    setErrorString("Can't open part " + segment.part->name);
+                    return -1;
+                }
+                partOpen = true;
+            }
+
+            size = segment.part->read(data + read, size);
+            if (size <= 0 && offset < segment.length)
+            {
+                qDebug() << "MultiPartDevice: part" << segment.part->name << "ended early";
+                setErrorString("Part " + segment.part->name + " ended early");
+                return -1;
+            }
+        }
+        else
+            memcpy(data + read, segment.bytes.constData() + offset, size);
+
+        read += size;
+        offset += size;
+
+        if (offset >= segment.length)
+            nextSegment();
+    }
+
+    position += read;
+
+    return read;
+}
+
+qint64 MultiPartDevice::writeData(const char *data, qint64 maxSize)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(maxSize);
+
+    return -1;
+}
+
+void MultiPartDevice::nextSegment()
+{
+    if (partOpen)
+    {
+        segments.at(current).part->close();
+        partOpen = false;
+    }
+
+    current++;
+    offset = 0;
+}
@@ -0,0 +1,70 @@
+#ifndef MULTIPARTDEVICE_H
+#define MULTIPARTDEVICE_H
+
+#include <QIODevice>
+#include <QList>
+
+#include "formdata.h"
+
+/**
+    @class      MultiPartDevice
+
+    @brief      Sequential device that reads a multipart/form-data body.
+
+                The body is produced part by part while it's read: the part
+                headers, the content read from the FormData and the closing
+                boundary.  Files are opened when their turn comes and read
+                in the caller's chunks, so the memory used doesn't depend on
+                their size.
+
+                size() is known before the first read, to be sent as the
+                Content-Length.
+*/
+
+class MultiPartDevice : public QIODevice
+{
+    Q_OBJECT
+
+public:
+    // Takes ownership of the parts
+    explicit MultiPartDevice(const QString &boundary, const QList<FormData *> &parts,
+                             QObject *parent = 0);
+    ~MultiPartDevice();
+
+    bool open(OpenMode mode);
+    void close();
+
+    // Restarts from the first part, to send the body again
+    bool reset();
+
+    bool isSequential() const;
+    qint64 size() const;
+    qint64 bytesAvailable() const;
+    bool atEnd() const;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize);
+    qint64 writeData(const char *data, qint64 maxSize);
+
+private:
+    // Fixed bytes, or the content of a part
+    struct Segment
+    {
+        QByteArray bytes;
+        FormData *part;
+        qint64 length;
+    };
+
+    QList<FormData *> parts;
+    QList<Segment> segments;
+    qint64 totalLength;
+
+    int current;
+    qint64 offset;
+    bool partOpen;
+    qint64 position;
+
+    void nextSegment();
+};
+
+#endif // MULTIPARTDEVICE_H
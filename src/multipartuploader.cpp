@@ -28,7 +28,7 @@
 
 #include <QDateTime>
 #include "multipartuploader.h"
-#include "src/client.h"
+#include "messageidallocator.h"
 
 //#include "src/qt-json/json.h"
 #include <QJsonDocument>
@@ -39,12 +39,13 @@
 MultiPartUploader::MultiPartUploader(QObject *parent)
     : HttpRequestv2(parent)
 {
+    multipartBody = 0;
 }
 
 QString MultiPartUploader::generateBoundary()
 {
     QString boundary = QString::number(QDateTime::currentMSecsSinceEpoch()) +
-                       QString::number(Client::seq);
+                       QString::number(MessageIdAllocator::global()->nextSequence());
 
     return boundary;
 }
@@ -60,7 +61,7 @@ void MultiPartUploader::error(QNetworkReply::NetworkError error)
 
 void MultiPartUploader::onResponse()
 {
-    QByteArray json = socket->readAll();
+    QByteArray json = readAll();
     qDebug() << "Reply:" << json;
 
     QJsonParseError error;
@@ -80,70 +81,15 @@ void MultiPartUploader::open(QString url, QList<FormData*>& formData)
 {
     QString boundary = generateBoundary();
 
-    postData(boundary,formData);
-
-    // qDebug() << "Content Length:" << QString::number(writeBuffer.size());
-    // qDebug() << QString::fromLatin1(writeBuffer.data());
-
-    // get(QUrl(url), true, boundary);
+    // The body is read from the parts while it's sent
+    multipartBody = new MultiPartDevice(boundary, formData, this);
+    formData.clear();
+    multipartBody->open(QIODevice::ReadOnly);
 
     setHeader("Content-Type","multipart/form-data; boundary="+boundary);
 
     connect(this,SIGNAL(finished()),
             this,SLOT(onResponse()));
 
-    post(QUrl(url),writeBuffer.constData(),writeBuffer.length());
-}
-
-void MultiPartUploader::postData(QString boundary, QList<FormData*> &formData)
-{
-    qint64 totalLength = 0;
-
-    writeBuffer.clear();
-
-    for (int i = 0; i < formData.length(); i++)
-    {
-        // totalLength += formData.at(i).length();
-
-        FormData *data = formData.at(i);
-
-        totalLength += data->length();
-
-        writeBuffer.append("--");
-        writeBuffer.append(boundary);
-        writeBuffer.append("\r\n");
-        writeBuffer.append("Content-Disposition: ");
-        writeBuffer.append("form-data");
-        writeBuffer.append("; name=\"");
-        writeBuffer.append(data->name);
-        writeBuffer.append("\"");
-
-        if (!data->fileName.isEmpty())
-        {
-            writeBuffer.append("; filename=\"");
-            writeBuffer.append(data->fileName);
-            writeBuffer.append("\"");
-        }
-        writeBuffer.append("\r\n");
-
-        if (!data->contentType.isEmpty())
-        {
-            writeBuffer.append("Content-Type: ");
-            writeBuffer.append(data->contentType);
-            writeBuffer.append("\r\n");
-        }
-        writeBuffer.append("\r\n");
-
-        QBuffer dataBuffer;
-        dataBuffer.open(QBuffer::WriteOnly);
-        data->write(dataBuffer);
-
-        writeBuffer.append(dataBuffer.data());
-        writeBuffer.append("\r\n");
-
-        delete data;
-    }
-
-    writeBuffer.append("--" + boundary + "--\r\n");
+    post(QUrl(url), multipartBody, multipartBody->size());
 }
-
@@ -36,6 +36,7 @@
 
 #include "httprequestv2.h"
 #include "formdata.h"
+#include "multipartdevice.h"
 
 class MultiPartUploader : public HttpRequestv2
 {
@@ -44,6 +45,7 @@ class MultiPartUploader : public HttpRequestv2
 public:
     explicit MultiPartUploader(QObject *parent = 0);
 
+    // Takes ownership of the parts
     void open(QString url, QList<FormData*>& formData);
 
 public slots:
@@ -55,11 +57,9 @@ signals:
     void finished(MultiPartUploader *obj, QVariantMap dictionary);
 
 private:
-    QByteArray writeBuffer;
+    MultiPartDevice *multipartBody;
 
     QString generateBoundary();
-    //void get(QUrl url, bool post, QString boundary);
-    void postData(QString boundary, QList<FormData*>& formData);
 };
 
 #endif // MULTIPARTUPLOADER_H
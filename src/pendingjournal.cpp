@@ -0,0 +1,507 @@
+#include <QDebug>
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "pendingjournal.h"
+
+#define JOURNAL_MAGIC           "WAPJ"
+#define JOURNAL_VERSION         3
+
+// Version 2 stored FMessage::thumb_image as text, version 1 also had the
+// media fields inline.  Both are still recovered.
+#define JOURNAL_TEXT_THUMBS     2
+#define JOURNAL_INLINE_MEDIA    1
+#define JOURNAL_HEADER_SIZE     8
+
+// length (4), checksum (2), type (1), reserved (1)
+#define RECORD_HEADER_SIZE      8
+
+// The file grows in steps of this size
+#define JOURNAL_GROW_SIZE       (256 * 1024)
+
+// Compaction only pays off past this many acked records
+#define JOURNAL_COMPACT_MIN     1024
+
+#define JOURNAL_STREAM_VERSION  QDataStream::Qt_5_0
+
+static void writeUInt32(uchar *data, quint32 value)
+{
+    data[0] = value & 0xff;
+    data[1] = (value >> 8) & 0xff;
+    data[2] = (value >> 16) & 0xff;
+    data[3] = (value >> 24) & 0xff;
+}
+
+static quint32 readUInt32(const uchar *data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((quint32) data[3] << 24);
+}
+
+/*
+ * A message as version 1 wrote it, before FMessageMedia.  The text
+ * thumbnail is read as bytes like in version 2.
+ */
+static void readInlineMediaMessage(QDataStream &in, FMessage &message)
+{
+    qint32 status, type, width, height, waType;
+    double latitude, longitude;
+    qint32 duration;
+    QString mimeType, name, url, localFile;
+    qint64 size;
+
+    in >> message.key >> message.data >> message.thumb_image >> message.timestamp
+       >> status >> message.notify_name >> message.remote_resource
+       >> type >> latitude >> longitude
+       >> message.live >> message.broadcast >> message.offline >> message.broadcastJids
+       >> duration >> width >> height >> mimeType >> name
+       >> size >> url >> waType >> localFile;
+
+    message.status = (FMessage::Status) status;
+    message.type = (FMessage::ContentType) type;
+    message.media_wa_type = waType;
+
+    if (latitude != 0 || longitude != 0 || !url.isEmpty() || !localFile.isEmpty())
+    {
+        FMessageMedia &media = message.mutableMedia();
+        media.latitude = latitude;
+        media.longitude = longitude;
+        media.media_duration_seconds = duration;
+        media.media_width = width;
+        media.media_height = height;
+        media.media_mime_type = mimeType;
+        media.media_name = name;
+        media.media_size = size;
+        media.media_url = url;
+        media.local_file_uri = localFile;
+    }
+}
+
+static quint16 recordChecksum(quint8 type, const char *payload, int length)
+{
+    QByteArray data;
+    data.reserve(length + 1);
+    data.append((char) type);
+    data.append(payload, length);
+    return qChecksum(data.constData(), data.size());
+}
+
+PendingJournal::PendingJournal()
+{
+    map = 0;
+    mapSize = 0;
+    writeOffset = 0;
+    nextSequence = 0;
+    deadRecords = 0;
+}
+
+PendingJournal::~PendingJournal()
+{
+    close();
+}
+
+/**
+    Opens a journal file, creating it if it doesn't exist, and reloads the
+    messages still pending.
+
+    @param fileName     Path of the journal file.
+    @return             false if the file can't be opened or mapped.
+*/
+bool PendingJournal::open(const QString &fileName)
+{
+    QMutexLocker locker(&mutex);
+
+    if (file.isOpen())
+    {
+        unmapFile();
+        file.close();
+    }
+
+    this->fileName = fileName;
+    pendingSequence.clear();
+    pendingMessages.clear();
+    nextSequence = 0;
+    deadRecords = 0;
+
+    file.setFileName(fileName);
+    if (!file.open(QIODevice::ReadWrite))
+    {
+        qDebug() << "PendingJournal: can't open" << fileName << file.errorString();
+        return false;
+    }
+
+    if (file.size() < JOURNAL_HEADER_SIZE)
+    {
+        file.resize(0);
+        if (!writeHeader(file))
+            return false;
+    }
+
+    if (!mapFile(qMax(file.size(), (qint64) JOURNAL_GROW_SIZE)))
+        return false;
+
+    bool upgrade = (map[4] == JOURNAL_TEXT_THUMBS || map[4] == JOURNAL_INLINE_MEDIA);
+
+    if (!recover())
+    {
+        qDebug() << "PendingJournal:" << fileName << "is not a journal";
+        unmapFile();
+        file.close();
+        return false;
+    }
+
+    // Rewritten in the current format before anything is appended
+    if (upgrade && !compactLocked())
+        return false;
+
+    qDebug() << "PendingJournal: recovered" << pendingMessages.size() << "pending messages";
+
+    return true;
+}
+
+void PendingJournal::close()
+{
+    QMutexLocker locker(&mutex);
+
+    if (!file.isOpen())
+        return;
+
+    if (map)
+        msync(map, writeOffset, MS_SYNC);
+
+    unmapFile();
+    file.close();
+}
+
+bool PendingJournal::isOpen() const
+{
+    QMutexLocker locker(&mutex);
+    return file.isOpen();
+}
+
+bool PendingJournal::writeHeader(QFile &output)
+{
+    char header[JOURNAL_HEADER_SIZE];
+    memset(header, 0, JOURNAL_HEADER_SIZE);
+    memcpy(header, JOURNAL_MAGIC, 4);
+    header[4] = JOURNAL_VERSION;
+
+    return output.write(header, JOURNAL_HEADER_SIZE) == JOURNAL_HEADER_SIZE &&
+            output.flush();
+}
+
+/*
+ * Maps the whole file, growing it to size first if needed
+ */
+bool PendingJournal::mapFile(qint64 size)
+{
+    unmapFile();
+
+    if (file.size() < size && !file.resize(size))
+    {
+        qDebug() << "PendingJournal: can't grow" << fileName << file.errorString();
+        return false;
+    }
+
+    map = file.map(0, size);
+    if (!map)
+    {
+        qDebug() << "PendingJournal: can't map" << fileName << file.errorString();
+        return false;
+    }
+
+    mapSize = size;
+    return true;
+}
+
+void PendingJournal::unmapFile()
+{
+    if (map)
+        file.unmap(map);
+
+    map = 0;
+    mapSize = 0;
+}
+
+/*
+ * Replays the records of the mapped file
+ */
+bool PendingJournal::recover()
+{
+    if (memcmp(map, JOURNAL_MAGIC, 4) != 0 ||
+        (map[4] != JOURNAL_VERSION && map[4] != JOURNAL_TEXT_THUMBS &&
+         map[4] != JOURNAL_INLINE_MEDIA))
+        return false;
+
+    bool inlineMedia = (map[4] == JOURNAL_INLINE_MEDIA);
+    bool textThumbs = (map[4] == JOURNAL_TEXT_THUMBS) || inlineMedia;
+
+    qint64 offset = JOURNAL_HEADER_SIZE;
+
+    while (offset + RECORD_HEADER_SIZE <= mapSize)
+    {
+        const uchar *header = map + offset;
+        quint32 length = readUInt32(header);
+        if (length == 0)
+            break;
+
+        quint16 checksum = header[4] | (header[5] << 8);
+        quint8 type = header[6];
+
+        if (offset + RECORD_HEADER_SIZE + length > mapSize)
+        {
+            qDebug() << "PendingJournal: truncated record at" << offset;
+            break;
+        }
+
+        const char *payload = (const char *) header + RECORD_HEADER_SIZE;
+        if (recordChecksum(type, payload, length) != checksum)
+        {
+            qDebug() << "PendingJournal: bad record at" << offset;
+            break;
+        }
+
+        QByteArray data = QByteArray::fromRawData(payload, length);
+        QDataStream in(data);
+        in.setVersion(JOURNAL_STREAM_VERSION);
+
+        if (type == Put)
+        {
+            FMessage message;
+            if (inlineMedia)
+                readInlineMediaMessage(in, message);
+            else
+                in >> message;
+
+            // The UTF-16 base64 read as bytes.  The thumbnail of a media
+            // message is also in data, so it's just dropped.
+            if (textThumbs)
+                message.thumb_image.clear();
+
+            applyPut(message);
+        }
+        else if (type == Ack)
+        {
+            Key key;
+            in >> key;
+            applyAck(key);
+            deadRecords++;
+        }
+
+        offset += RECORD_HEADER_SIZE + length;
+    }
+
+    writeOffset = offset;
+
+    // Whatever follows a bad record is garbage
+    if (writeOffset < mapSize)
+        memset(map + writeOffset, 0, qMin((qint64) RECORD_HEADER_SIZE, mapSize - writeOffset));
+
+    return true;
+}
+
+void PendingJournal::applyPut(const FMessage &message)
+{
+    if (pendingSequence.contains(message.key))
+    {
+        pendingMessages.remove(pendingSequence.value(message.key));
+        deadRecords++;
+    }
+
+    qint64 sequence = nextSequence++;
+    pendingSequence.insert(message.key, sequence);
+    pendingMessages.insert(sequence, message);
+}
+
+bool PendingJournal::applyAck(const Key &key)
+{
+    QHash<Key, qint64>::iterator i = pendingSequence.find(key);
+    if (i == pendingSequence.end())
+        return false;
+
+    pendingMessages.remove(i.value());
+    pendingSequence.erase(i);
+    deadRecords++;
+
+    return true;
+}
+
+bool PendingJournal::append(RecordType type, const QByteArray &payload)
+{
+    if (!map)
+        return false;
+
+    qint64 needed = writeOffset + RECORD_HEADER_SIZE + payload.size();
+
+    // Keep a zeroed record header after the last record
+    if (needed + RECORD_HEADER_SIZE > mapSize)
+    {
+        qint64 size = mapSize;
+        while (needed + RECORD_HEADER_SIZE > size)
+            size += JOURNAL_GROW_SIZE;
+
+        if (!mapFile(size))
+            return false;
+    }
+
+    uchar *record = map + writeOffset;
+
+    // Payload first, header last: a crash in between leaves a zero length
+    memcpy(record + RECORD_HEADER_SIZE, payload.constData(), payload.size());
+
+    quint16 checksum = recordChecksum(type, payload.constData(), payload.size());
+    record[4] = checksum & 0xff;
+    record[5] = (checksum >> 8) & 0xff;
+    record[6] = type;
+    record[7] = 0;
+    writeUInt32(record, payload.size());
+
+    writeOffset = needed;
+
+    return true;
+}
+
+void PendingJournal::put(const FMessage &message)
+{
+    QByteArray payload;
+    QDataStream out(&payload, QIODevice::WriteOnly);
+    out.setVersion(JOURNAL_STREAM_VERSION);
+    out << message;
+
+    QMutexLocker locker(&mutex);
+
+    if (append(Put, payload))
+        applyPut(message);
+}
+
+void PendingJournal::ack(const Key &key)
+{
+    QMutexLocker locker(&mutex);
+
+    if (!pendingSequence.contains(key))
+        return;
+
+    QByteArray payload;
+    QDataStream out(&payload, QIODevice::WriteOnly);
+    out.setVersion(JOURNAL_STREAM_VERSION);
+    out << key;
+
+    if (!append(Ack, payload))
+        return;
+
+    applyAck(key);
+    deadRecords++;
+
+    if (deadRecords >= JOURNAL_COMPACT_MIN && deadRecords > pendingMessages.size() * 2)
+        compactLocked();
+}
+
+void PendingJournal::messageEvicted(const Key &key)
+{
+    ack(key);
+}
+
+bool PendingJournal::contains(const Key &key) const
+{
+    QMutexLocker locker(&mutex);
+    return pendingSequence.contains(key);
+}
+
+int PendingJournal::pendingCount() const
+{
+    QMutexLocker locker(&mutex);
+    return pendingMessages.size();
+}
+
+QList<FMessage> PendingJournal::pending() const
+{
+    QMutexLocker locker(&mutex);
+    return pendingMessages.values();
+}
+
+void PendingJournal::sync(bool wait)
+{
+    QMutexLocker locker(&mutex);
+
+    if (map && writeOffset > 0)
+        msync(map, writeOffset, wait ? MS_SYNC : MS_ASYNC);
+}
+
+bool PendingJournal::compact()
+{
+    QMutexLocker locker(&mutex);
+    return compactLocked();
+}
+
+/*
+ * Writes the pending messages to a new file and puts it in place
+ * of the journal.  The old journal stays valid until the rename.
+ */
+bool PendingJournal::compactLocked()
+{
+    if (!file.isOpen())
+        return false;
+
+    QString compactName = fileName + ".compact";
+    QFile output(compactName);
+    if (!output.open(QIODevice::WriteOnly | QIODevice::Truncate) || !writeHeader(output))
+    {
+        qDebug() << "PendingJournal: can't write" << compactName << output.errorString();
+        return false;
+    }
+
+    QByteArray records;
+    foreach (const FMessage &message, pendingMessages)
+    {
+        QByteArray payload;
+        QDataStream out(&payload, QIODevice::WriteOnly);
+        out.setVersion(JOURNAL_STREAM_VERSION);
+        out << message;
+
+        char header[RECORD_HEADER_SIZE];
+        quint16 checksum = recordChecksum(Put, payload.constData(), payload.size());
+        writeUInt32((uchar *) header, payload.size());
+        header[4] = checksum & 0xff;
+        header[5] = (checksum >> 8) & 0xff;
+        header[6] = Put;
+        header[7] = 0;
+
+        records.append(header, RECORD_HEADER_SIZE);
+        records.append(payload);
+    }
+
+    if (output.write(records) != records.size() || !output.flush() ||
+        fsync(output.handle()) != 0)
+    {
+        qDebug() << "PendingJournal: can't write" << compactName << output.errorString();
+        output.close();
+        QFile::remove(compactName);
+        return false;
+    }
+    output.close();
+
+    unmapFile();
+    file.close();
+
+    if (::rename(QFile::encodeName(compactName).constData(),
+                 QFile::encodeName(fileName).constData()) != 0)
+    {
+        qDebug() << "PendingJournal: can't replace" << fileName;
+        QFile::remove(compactName);
+    }
+
+    // Reopen whichever file is in place and replay it
+    file.setFileName(fileName);
+    if (!file.open(QIODevice::ReadWrite) ||
+        !mapFile(qMax(file.size() + JOURNAL_GROW_SIZE, (qint64) JOURNAL_GROW_SIZE)))
+        return false;
+
+    pendingSequence.clear();
+    pendingMessages.clear();
+    nextSequence = 0;
+    deadRecords = 0;
+
+    return recover();
+}
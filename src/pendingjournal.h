@@ -0,0 +1,94 @@
+#ifndef PENDINGJOURNAL_H
+#define PENDINGJOURNAL_H
+
+#include <QFile>
+#include <QHash>
+#include <QMap>
+#include <QList>
+#include <QMutex>
+
+#include "fmessage.h"
+#include "funstore.h"
+
+/**
+    @class      PendingJournal
+
+    @brief      Write-ahead log of the outbound messages not yet acked.
+
+                An append-only, memory-mapped file of records: a message put
+                when it's sent and an ack when the server or the target
+                confirms it.  Opening the journal replays it and keeps the
+                messages still pending, so they can be resent after a restart
+                or a reconnection.
+
+                Each record is written payload first and header last over the
+                zero-filled tail of the file, so a record torn by a crash reads
+                as the end of the journal.  A record with a bad checksum also
+                ends the replay.
+
+                When acked records outnumber the pending ones the journal is
+                compacted into a new file that replaces the old one.
+*/
+
+class PendingJournal : public FunStoreListener
+{
+public:
+    PendingJournal();
+    ~PendingJournal();
+
+    // Opens (or creates) the journal and recovers the pending messages
+    bool open(const QString &fileName);
+    void close();
+    bool isOpen() const;
+
+    // Records a message as pending
+    void put(const FMessage &message);
+
+    // Records a message as acked.  Unknown keys are ignored.
+    void ack(const Key &key);
+
+    // A message dropped from the store is not pending anymore
+    void messageEvicted(const Key &key);
+
+    bool contains(const Key &key) const;
+    int pendingCount() const;
+
+    // Pending messages in the order they were put
+    QList<FMessage> pending() const;
+
+    // Schedules the written records to be flushed to disk.
+    // If wait is true it returns once they are.
+    void sync(bool wait = false);
+
+    // Rewrites the journal with the pending messages only
+    bool compact();
+
+private:
+    enum RecordType {
+        Put = 1,
+        Ack = 2
+    };
+
+    mutable QMutex mutex;
+    QString fileName;
+    QFile file;
+    uchar *map;
+    qint64 mapSize;
+    qint64 writeOffset;
+
+    QHash<Key, qint64> pendingSequence;
+    QMap<qint64, FMessage> pendingMessages;
+    qint64 nextSequence;
+    int deadRecords;
+
+    bool mapFile(qint64 size);
+    void unmapFile();
+    bool recover();
+    bool append(RecordType type, const QByteArray &payload);
+    bool writeHeader(QFile &output);
+    void applyPut(const FMessage &message);
+    bool applyAck(const Key &key);
+    bool compactLocked();
+};
+
+#endif // PENDINGJOURNAL_H
@@ -0,0 +1,21 @@
+#ifndef PROTOCOLDICTIONARY_H
+#define PROTOCOLDICTIONARY_H
+
+#include <QStringList>
+
+/**
+    @class      ProtocolDictionary
+
+    @brief      Token dictionary of the binary stanza encoding.
+
+                Shared by Connection and anything else that needs to encode or
+                decode trees without a Connection (replay, tools, benchmarks).
+*/
+
+class ProtocolDictionary
+{
+public:
+    static const QStringList &tokens();
+};
+
+#endif // PROTOCOLDICTIONARY_H
@@ -0,0 +1,336 @@
+#include <QMutex>
+#include <QMutexLocker>
+#include <QThread>
+#include <QThreadStorage>
+#include <QDateTime>
+#include <QStringList>
+#include <QVector>
+#include <QList>
+#include <QDebug>
+
+#include <algorithm>
+
+#include "protocoltrace.h"
+#include "protocoldictionary.h"
+#include "protocoltreenode.h"
+#include "bintreenodereader.h"
+
+#define DEFAULT_RING_SIZE       1024
+
+static const char *categoryNames[ProtocolTrace::TotalCategories] = {
+    "stanza", "http", "crypto", "session"
+};
+
+static const char *levelNames[] = {
+    "off", "error", "warning", "info", "debug", "verbose"
+};
+
+struct TraceRecord
+{
+    enum Kind {
+        Empty = 0,
+        Stanza,
+        Payload,
+        Value
+    };
+
+    TraceRecord() : timestamp(0), category(0), level(0), kind(Empty), event(0), value(0) {}
+
+    qint64 timestamp;
+    quint8 category;
+    quint8 level;
+    quint8 kind;
+    const char *event;
+    qint64 value;
+    QByteArray payload;
+};
+
+class TraceRing
+{
+public:
+    TraceRing(int size);
+    ~TraceRing();
+
+    void append(const TraceRecord &record);
+    void copyTo(QList<QPair<TraceRecord, QString> > &list);
+    void clear();
+
+    QString threadName;
+
+private:
+    QMutex mutex;
+    QVector<TraceRecord> records;
+    int next;
+    int count;
+};
+
+struct TraceRegistry
+{
+    TraceRegistry() : ringSize(DEFAULT_RING_SIZE), echo(0) {}
+
+    QMutex mutex;
+    QList<TraceRing *> rings;
+    int ringSize;
+
+    // Read on every record without the lock
+    QAtomicInt echo;
+};
+
+Q_GLOBAL_STATIC(TraceRegistry, registry)
+
+static QThreadStorage<TraceRing *> localRing;
+
+QAtomicInt ProtocolTrace::levels[ProtocolTrace::TotalCategories];
+
+/*
+ * Ring buffer
+ */
+
+TraceRing::TraceRing(int size)
+{
+    records.resize(size);
+    next = 0;
+    count = 0;
+
+    QThread *thread = QThread::currentThread();
+    threadName = thread->objectName();
+    if (threadName.isEmpty())
+        threadName = "0x" + QString::number((quintptr) thread, 16);
+
+    QMutexLocker locker(&registry()->mutex);
+    registry()->rings.append(this);
+}
+
+TraceRing::~TraceRing()
+{
+    if (registry.isDestroyed())
+        return;
+
+    QMutexLocker locker(&registry()->mutex);
+    registry()->rings.removeOne(this);
+}
+
+void TraceRing::append(const TraceRecord &record)
+{
+    QMutexLocker locker(&mutex);
+
+    records[next] = record;
+    next = (next + 1) % records.size();
+    if (count < records.size())
+        count++;
+}
+
+void TraceRing::copyTo(QList<QPair<TraceRecord, QString> > &list)
+{
+    QMutexLocker locker(&mutex);
+
+    int first = (next - count + records.size()) % records.size();
+    for (int i = 0; i < count; i++)
+        list.append(qMakePair(records.at((first + i) % records.size()), threadName));
+}
+
+void TraceRing::clear()
+{
+    QMutexLocker locker(&mutex);
+
+    for (int i = 0; i < records.size(); i++)
+        records[i] = TraceRecord();
+    next = 0;
+    count = 0;
+}
+
+/*
+ * Helpers
+ */
+
+static TraceRing *currentRing()
+{
+    if (!localRing.hasLocalData())
+    {
+        int size;
+        {
+            QMutexLocker locker(&registry()->mutex);
+            size = registry()->ringSize;
+        }
+        localRing.setLocalData(new TraceRing(size));
+    }
+
+    return localRing.localData();
+}
+
+static QString formatStanza(const QByteArray &payload)
+{
+    QStringList dictionary = ProtocolDictionary::tokens();
+    BinTreeNodeReader reader(0, dictionary);
+
+    ProtocolTreeNode node;
+    if (!reader.parseTree(payload, node))
+        return " <undecodable " + QString::fromLatin1(payload.toHex()) + ">";
+
+    return node.toString();
+}
+
+static QString formatRecord(const TraceRecord &record, const QString &threadName)
+{
+    QString line = QString("%1 [%2] %3 %4 %5")
+            .arg(QDateTime::fromMSecsSinceEpoch(record.timestamp).toString("HH:mm:ss.zzz"))
+            .arg(threadName)
+            .arg(categoryNames[record.category])
+            .arg(levelNames[record.level])
+            .arg(record.event);
+
+    switch (record.kind)
+    {
+        case TraceRecord::Stanza:
+            line += formatStanza(record.payload);
+            break;
+
+        case TraceRecord::Payload:
+            line += " " + QString::fromUtf8(record.payload);
+            break;
+
+        case TraceRecord::Value:
+            line += " " + QString::number(record.value);
+            break;
+    }
+
+    return line;
+}
+
+static void appendRecord(TraceRecord &record, ProtocolTrace::Category category,
+                         ProtocolTrace::Level level, const char *event)
+{
+    record.timestamp = QDateTime::currentMSecsSinceEpoch();
+    record.category = category;
+    record.level = level;
+    record.event = event;
+
+    TraceRing *ring = currentRing();
+
+    if (registry()->echo.load())
+        qDebug() << qPrintable(formatRecord(record, ring->threadName));
+
+    ring->append(record);
+}
+
+static bool recordTime(const QPair<TraceRecord, QString> &a, const QPair<TraceRecord, QString> &b)
+{
+    return a.first.timestamp < b.first.timestamp;
+}
+
+/*
+ * Levels from the LIBQTWA_TRACE environment variable
+ */
+
+static void initTraceLevels()
+{
+    for (int i = 0; i < ProtocolTrace::TotalCategories; i++)
+        ProtocolTrace::setLevel((ProtocolTrace::Category) i, ProtocolTrace::Warning);
+
+    QString config = QString::fromLocal8Bit(qgetenv("LIBQTWA_TRACE"));
+    foreach (const QString &item, config.split(',', QString::SkipEmptyParts))
+    {
+        QStringList pair = item.trimmed().toLower().split('=');
+        if (pair.size() != 2)
+            continue;
+
+        int level = -1;
+        for (int i = 0; i <= ProtocolTrace::Verbose; i++)
+            if (pair.at(1) == levelNames[i])
+                level = i;
+
+        if (level < 0)
+            continue;
+
+        for (int i = 0; i < ProtocolTrace::TotalCategories; i++)
+            if (pair.at(0) == "all" || pair.at(0) == categoryNames[i])
+                ProtocolTrace::setLevel((ProtocolTrace::Category) i, (ProtocolTrace::Level) level);
+    }
+}
+
+Q_CONSTRUCTOR_FUNCTION(initTraceLevels)
+
+/*
+ * ProtocolTrace
+ */
+
+void ProtocolTrace::setLevel(Category category, Level level)
+{
+    levels[category].fetchAndStoreRelaxed(level);
+}
+
+ProtocolTrace::Level ProtocolTrace::getLevel(Category category)
+{
+    return (Level) levels[category].load();
+}
+
+void ProtocolTrace::setRingSize(int records)
+{
+    QMutexLocker locker(&registry()->mutex);
+    registry()->ringSize = qMax(records, 1);
+}
+
+void ProtocolTrace::setEcho(bool echo)
+{
+    registry()->echo.store(echo ? 1 : 0);
+}
+
+void ProtocolTrace::record(Category category, Level level, const char *event,
+                           const QByteArray &payload)
+{
+    TraceRecord record;
+    record.kind = TraceRecord::Payload;
+    record.payload = payload;
+    appendRecord(record, category, level, event);
+}
+
+void ProtocolTrace::record(Category category, Level level, const char *event,
+                           qint64 value)
+{
+    TraceRecord record;
+    record.kind = TraceRecord::Value;
+    record.value = value;
+    appendRecord(record, category, level, event);
+}
+
+void ProtocolTrace::recordStanza(Category category, Level level, const char *event,
+                                 const QByteArray &payload)
+{
+    TraceRecord record;
+    record.kind = TraceRecord::Stanza;
+    record.payload = payload;
+    appendRecord(record, category, level, event);
+}
+
+void ProtocolTrace::dump(QIODevice *device)
+{
+    QList<QPair<TraceRecord, QString> > list;
+
+    {
+        QMutexLocker locker(&registry()->mutex);
+        foreach (TraceRing *ring, registry()->rings)
+            ring->copyTo(list);
+    }
+
+    std::stable_sort(list.begin(), list.end(), recordTime);
+
+    for (int i = 0; i < list.size(); i++)
+    {
+        QString line = formatRecord(list.at(i).first, list.at(i).second);
+
+        if (device)
+        {
+            device->write(line.toUtf8());
+            device->write("\n");
+        }
+        else
+            qDebug() << qPrintable(line);
+    }
+}
+
+void ProtocolTrace::clear()
+{
+    QMutexLocker locker(&registry()->mutex);
+    foreach (TraceRing *ring, registry()->rings)
+        ring->clear();
+}
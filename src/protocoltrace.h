@@ -0,0 +1,105 @@
+#ifndef PROTOCOLTRACE_H
+#define PROTOCOLTRACE_H
+
+#include <QByteArray>
+#include <QAtomicInt>
+#include <QIODevice>
+
+/*
+ * Highest trace level compiled in.  Trace points above this level are
+ * removed by the compiler, arguments included.
+ *
+ *   DEFINES += LIBQTWA_TRACE_LEVEL=0     strips all tracing
+ */
+#ifndef LIBQTWA_TRACE_LEVEL
+#define LIBQTWA_TRACE_LEVEL     5
+#endif
+
+// true if a trace point is both compiled in and enabled at runtime
+#define WA_TRACE_ON(category, level) \
+    ((level) <= LIBQTWA_TRACE_LEVEL && ProtocolTrace::isEnabled((category), (level)))
+
+// Records a trace point. The arguments are only evaluated if it's enabled.
+#define WA_TRACE(category, level, event, arg) \
+    do { \
+        if (WA_TRACE_ON(category, level)) \
+            ProtocolTrace::record((category), (level), (event), (arg)); \
+    } while (0)
+
+// Records an encoded stanza, which is only decoded when the trace is dumped
+#define WA_TRACE_STANZA(category, level, event, payload) \
+    do { \
+        if (WA_TRACE_ON(category, level)) \
+            ProtocolTrace::recordStanza((category), (level), (event), (payload)); \
+    } while (0)
+
+/**
+    @class      ProtocolTrace
+
+    @brief      Level-gated protocol tracing.
+
+                Each thread records into its own fixed-size ring buffer. Records
+                keep the raw payload, stanzas in their binary encoding, and are
+                only decoded and formatted when the rings are dumped.  An
+                enabled trace costs a reference to an implicitly shared buffer
+                and a disabled one a single load.
+
+                Levels can be set with setLevel() or through the LIBQTWA_TRACE
+                environment variable, e.g. LIBQTWA_TRACE="stanza=debug,http=info".
+*/
+
+class ProtocolTrace
+{
+public:
+    enum Category {
+        Stanza = 0,
+        Http,
+        Crypto,
+        Session,
+        TotalCategories
+    };
+
+    enum Level {
+        Off = 0,
+        Error,
+        Warning,
+        Info,
+        Debug,
+        Verbose
+    };
+
+    static inline bool isEnabled(Category category, Level level)
+    {
+        return level <= levels[category].load();
+    }
+
+    static void setLevel(Category category, Level level);
+    static Level getLevel(Category category);
+
+    // Records per thread kept before the oldest ones are overwritten
+    static void setRingSize(int records);
+
+    // Also print every record with qDebug() as it is recorded
+    static void setEcho(bool echo);
+
+    static void record(Category category, Level level, const char *event,
+                       const QByteArray &payload);
+    static void record(Category category, Level level, const char *event,
+                       qint64 value);
+
+    // Plain frame payload of a stanza, as read or written
+    static void recordStanza(Category category, Level level, const char *event,
+                             const QByteArray &payload);
+
+    // Formats all the records of all threads in time order.
+    // If device is null they are printed with qDebug().
+    static void dump(QIODevice *device = 0);
+
+    // Empties all the rings
+    static void clear();
+
+private:
+    static QAtomicInt levels[TotalCategories];
+};
+
+#endif // PROTOCOLTRACE_H
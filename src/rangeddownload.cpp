@@ -0,0 +1,582 @@
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#include "rangeddownload.h"
+
+#include "util/utilities.h"
+
+#define DEFAULT_SEGMENT_SIZE        (1024 * 1024)
+#define DEFAULT_MAX_CONNECTIONS     4
+#define MAX_SEGMENT_RETRIES         3
+
+/*
+ * RangeRequest
+ */
+
+RangeRequest::RangeRequest(RangedDownload *download, int segment, const QString &useragent) :
+    HttpRequestv2(useragent, download)
+{
+    this->download = download;
+    this->segment = segment;
+}
+
+int RangeRequest::getSegment() const
+{
+    return segment;
+}
+
+int RangeRequest::getStatusCode() const
+{
+    return errorCode;
+}
+
+qint64 RangeRequest::getRangeStart() const
+{
+    // Content-Range: bytes 0-1048575/5000000
+    QByteArray range = getResponse().getHeader("Content-Range");
+    int space = range.indexOf(' ');
+    int dash = range.indexOf('-');
+    if (space < 0 || dash < space)
+        return -1;
+
+    bool ok;
+    qint64 start = range.mid(space + 1, dash - space - 1).toLongLong(&ok);
+
+    return ok ? start : -1;
+}
+
+qint64 RangeRequest::getTotalSize() const
+{
+    QByteArray range = getResponse().getHeader("Content-Range");
+    int slash = range.indexOf('/');
+    if (slash < 0)
+        return -1;
+
+    bool ok;
+    qint64 total = range.mid(slash + 1).toLongLong(&ok);
+
+    return ok ? total : -1;
+}
+
+qint64 RangeRequest::getContentLength() const
+{
+    return getResponse().getContentLength();
+}
+
+void RangeRequest::bodyDataReceived(const char *data, qint64 size)
+{
+    download->writeSegment(this, data, size);
+}
+
+/*
+ * RangedDownload
+ */
+
+RangedDownload::RangedDownload(FMessage message, const QString &useragent,
+                               bool downloadToGallery, QObject *parent) :
+    QObject(parent)
+{
+    this->message = message;
+    this->useragent = useragent;
+    this->downloadToGallery = downloadToGallery;
+
+    segmentSize = DEFAULT_SEGMENT_SIZE;
+    maxConnections = DEFAULT_MAX_CONNECTIONS;
+    priority = TransferScheduler::Normal;
+    totalSize = -1;
+    ranged = false;
+    failed = false;
+
+    // The partial file is named after the URL, so a new download of the
+    // same media finds it
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/partial";
+    QDir().mkpath(dir);
+
+    QString key = QCryptographicHash::hash(message.media().media_url.toUtf8(),
+                                           QCryptographicHash::Sha1).toHex();
+    partFileName = dir + "/" + key + ".part";
+    sidecarFileName = dir + "/" + key + ".json";
+
+    // Ranges arrive at scattered offsets, they are copied straight into
+    // the mapped file
+    file.setFileName(partFileName);
+    file.setMode(MediaFileWriter::Mapped);
+}
+
+RangedDownload::~RangedDownload()
+{
+    file.close();
+}
+
+void RangedDownload::setSegmentSize(qint64 bytes)
+{
+    segmentSize = bytes;
+}
+
+void RangedDownload::setPriority(int priority)
+{
+    this->priority = priority;
+}
+
+void RangedDownload::setMaxConnections(int count)
+{
+    maxConnections = count;
+}
+
+void RangedDownload::backgroundTransfer()
+{
+    if (loadSidecar())
+    {
+        qDebug() << "RangedDownload: resuming" << message.media().media_url;
+
+        if (!file.open() || !file.preallocate(totalSize))
+        {
+            fail(file.errorString());
+            return;
+        }
+
+        foreach (const Segment &segment, segments)
+        {
+            if (!segment.done)
+            {
+                startPending();
+                updateProgress();
+                return;
+            }
+        }
+
+        // Everything arrived before it was interrupted
+        finish();
+        return;
+    }
+
+    qDebug() << "RangedDownload: downloading" << message.media().media_url;
+
+    startFromScratch();
+}
+
+/**
+    Starts with an empty partial file.  Requests still running are dropped.
+*/
+void RangedDownload::startFromScratch()
+{
+    for (int i = 0; i < segments.size(); i++)
+    {
+        if (segments.at(i).request)
+        {
+            disconnect(segments.at(i).request, 0, this, 0);
+            segments.at(i).request->deleteLater();
+        }
+    }
+
+    segments.clear();
+    totalSize = -1;
+    ranged = false;
+
+    QFile::remove(sidecarFileName);
+    if (!file.open(true))
+    {
+        fail(file.errorString());
+        return;
+    }
+
+    // The first range also tells the size of the file
+    Segment first;
+    first.start = 0;
+    first.end = segmentSize - 1;
+    first.received = 0;
+    first.retries = 0;
+    first.done = false;
+    first.request = 0;
+    segments.append(first);
+
+    startSegment(0);
+
+    emit progress(message, 0.01);
+}
+
+void RangedDownload::startSegment(int index)
+{
+    Segment &segment = segments[index];
+    segment.received = 0;
+
+    RangeRequest *request = new RangeRequest(this, index, useragent);
+    if (segment.end >= 0)
+        request->setHeader("Range", QString("bytes=%1-%2").arg(segment.start).arg(segment.end));
+
+    connect(request, SIGNAL(headersReceived(qint64)), this, SLOT(rangeHeaders()));
+    connect(request, SIGNAL(finished()), this, SLOT(rangeFinished()));
+    connect(request, SIGNAL(socketError(QString)), this, SLOT(rangeError(QString)));
+
+    // Segments are scheduled by the size of the whole media
+    request->setPriority(priority);
+    request->setSizeHint(message.media().media_size);
+
+    segment.request = request;
+    request->get(QUrl(message.media().media_url));
+}
+
+void RangedDownload::startPending()
+{
+    int active = 0;
+    foreach (const Segment &segment, segments)
+        if (segment.request)
+            active++;
+
+    for (int i = 0; i < segments.size() && active < maxConnections; i++)
+    {
+        if (!segments.at(i).done && !segments.at(i).request)
+        {
+            startSegment(i);
+            active++;
+        }
+    }
+}
+
+/**
+    Splits the file in segments.  The first one keeps its running request.
+*/
+void RangedDownload::createSegments(qint64 total)
+{
+    Segment first;
+    first.received = 0;
+    first.retries = 0;
+    first.request = 0;
+    if (!segments.isEmpty())
+        first = segments.first();
+
+    totalSize = total;
+    segments.clear();
+
+    for (qint64 start = 0; start < total; start += segmentSize)
+    {
+        Segment segment;
+        segment.start = start;
+        segment.end = qMin(start + segmentSize, total) - 1;
+        segment.received = (start == 0) ? first.received : 0;
+        segment.retries = (start == 0) ? first.retries : 0;
+        segment.done = false;
+        segment.request = (start == 0) ? first.request : 0;
+
+        segments.append(segment);
+    }
+}
+
+void RangedDownload::rangeHeaders()
+{
+    RangeRequest *request = qobject_cast<RangeRequest *>(sender());
+    if (!request || failed)
+        return;
+
+    int index = request->getSegment();
+    int status = request->getStatusCode();
+
+    if (status == 206)
+    {
+        if (request->getRangeStart() != segments.at(index).start)
+        {
+            retrySegment(index, "Unexpected range");
+            return;
+        }
+
+        // A resumed file that changed on the server can't be completed
+        // with the old ranges
+        if (totalSize >= 0 && request->getTotalSize() > 0 &&
+            request->getTotalSize() != totalSize)
+        {
+            qDebug() << "RangedDownload: size changed, starting over" << message.media().media_url;
+            startFromScratch();
+            return;
+        }
+
+        if (totalSize < 0)
+        {
+            qint64 total = request->getTotalSize();
+            if (total <= 0)
+            {
+                fail("Unknown file size");
+                return;
+            }
+
+            // Allocate the whole file and fetch the rest in parallel
+            if (!file.preallocate(total))
+            {
+                fail(file.errorString());
+                return;
+            }
+
+            ranged = true;
+            createSegments(total);
+            saveSidecar();
+            startPending();
+        }
+    }
+    else if (status == 200 && index == 0 && !ranged)
+    {
+        // Ranges not supported, the whole file comes in this response
+        totalSize = request->getContentLength();
+        segments[0].end = (totalSize > 0) ? totalSize - 1 : -1;
+        if (totalSize > 0 && !file.preallocate(totalSize))
+            fail(file.errorString());
+    }
+    else if (status >= 400 && status < 500)
+        fail("HTTP error " + QString::number(status));
+    else
+        retrySegment(index, "HTTP error " + QString::number(status));
+}
+
+void RangedDownload::rangeFinished()
+{
+    RangeRequest *request = qobject_cast<RangeRequest *>(sender());
+    if (!request)
+        return;
+
+    int index = request->getSegment();
+    Segment &segment = segments[index];
+    if (segment.request != request || failed)
+        return;
+
+    // Status errors were handled with the headers
+    if (request->getStatusCode() != 200 && request->getStatusCode() != 206)
+    {
+        retrySegment(index, "Invalid response");
+        return;
+    }
+
+    qint64 expected = (segment.end >= 0) ? segment.end - segment.start + 1 : segment.received;
+    if (segment.received != expected)
+    {
+        retrySegment(index, "Incomplete range");
+        return;
+    }
+
+    disconnect(request, 0, this, 0);
+    request->deleteLater();
+    segment.request = 0;
+    segment.done = true;
+
+    // The sidecar must not claim data that is not in the file
+    if (!file.flush())
+    {
+        fail(file.errorString());
+        return;
+    }
+
+    if (ranged)
+        saveSidecar();
+
+    foreach (const Segment &other, segments)
+    {
+        if (!other.done)
+        {
+            startPending();
+            return;
+        }
+    }
+
+    finish();
+}
+
+void RangedDownload::rangeError(const QString &errorString)
+{
+    RangeRequest *request = qobject_cast<RangeRequest *>(sender());
+    if (!request)
+        return;
+
+    int index = request->getSegment();
+    if (segments.at(index).request == request)
+        retrySegment(index, errorString);
+}
+
+void RangedDownload::retrySegment(int index, const QString &errorString)
+{
+    Segment &segment = segments[index];
+
+    if (segment.request)
+    {
+        disconnect(segment.request, 0, this, 0);
+        segment.request->deleteLater();
+        segment.request = 0;
+    }
+
+    if (failed)
+        return;
+
+    if (++segment.retries > MAX_SEGMENT_RETRIES)
+    {
+        fail(errorString);
+        return;
+    }
+
+    qDebug() << "RangedDownload: retrying range" << segment.start << "after" << errorString;
+    startSegment(index);
+}
+
+void RangedDownload::writeSegment(RangeRequest *request, const char *data, qint64 size)
+{
+    Segment &segment = segments[request->getSegment()];
+    if (segment.request != request || failed)
+        return;
+
+    qint64 offset = segment.start + segment.received;
+    if (segment.end >= 0)
+        size = qMin(size, segment.end + 1 - offset);
+
+    if (size <= 0)
+        return;
+
+    if (!file.write(offset, data, size))
+    {
+        fail(file.errorString());
+        return;
+    }
+
+    segment.received += size;
+
+    updateProgress();
+}
+
+void RangedDownload::updateProgress()
+{
+    if (totalSize <= 0)
+        return;
+
+    qint64 received = 0;
+    foreach (const Segment &segment, segments)
+        received += segment.done ? segment.end - segment.start + 1 : segment.received;
+
+    if (!progressThrottle.ready(received >= totalSize))
+        return;
+
+    emit progress(message, ((float) received * 100.0) / ((float) totalSize));
+}
+
+bool RangedDownload::loadSidecar()
+{
+    QFile sidecar(sidecarFileName);
+    if (!sidecar.open(QIODevice::ReadOnly))
+        return false;
+
+    QJsonParseError error;
+    QJsonObject record = QJsonDocument::fromJson(sidecar.readAll(), &error).object();
+    if (error.error != QJsonParseError::NoError ||
+        record.value("url").toString() != message.media().media_url)
+        return false;
+
+    qint64 total = (qint64) record.value("size").toDouble();
+    qint64 size = (qint64) record.value("segmentSize").toDouble();
+
+    // The partial file must be the one the record describes
+    if (total <= 0 || size <= 0 || QFileInfo(partFileName).size() != total)
+        return false;
+
+    segmentSize = size;
+    segments.clear();
+    createSegments(total);
+
+    foreach (const QJsonValue &value, record.value("done").toArray())
+    {
+        int index = value.toInt(-1);
+        if (index >= 0 && index < segments.size())
+            segments[index].done = true;
+    }
+
+    ranged = true;
+
+    return true;
+}
+
+void RangedDownload::saveSidecar()
+{
+    QJsonArray done;
+    for (int i = 0; i < segments.size(); i++)
+        if (segments.at(i).done)
+            done.append(i);
+
+    QJsonObject record;
+    record.insert("url", message.media().media_url);
+    record.insert("size", (double) totalSize);
+    record.insert("segmentSize", (double) segmentSize);
+    record.insert("done", done);
+
+    QSaveFile sidecar(sidecarFileName);
+    if (!sidecar.open(QIODevice::WriteOnly))
+    {
+        qDebug() << "RangedDownload: can't write" << sidecarFileName;
+        return;
+    }
+
+    sidecar.write(QJsonDocument(record).toJson(QJsonDocument::Compact));
+    sidecar.commit();
+}
+
+/**
+    Stops all the ranges.  Ranged downloads keep the partial file and the
+    sidecar to be resumed later.
+*/
+void RangedDownload::fail(const QString &errorString)
+{
+    if (failed)
+        return;
+    failed = true;
+
+    qDebug() << "RangedDownload: failed:" << errorString;
+
+    for (int i = 0; i < segments.size(); i++)
+    {
+        if (segments.at(i).request)
+        {
+            disconnect(segments.at(i).request, 0, this, 0);
+            segments.at(i).request->deleteLater();
+            segments[i].request = 0;
+        }
+    }
+
+    file.close();
+
+    if (ranged)
+        saveSidecar();
+    else
+    {
+        QFile::remove(partFileName);
+        QFile::remove(sidecarFileName);
+    }
+
+    emit httpError(this, message, errorString);
+}
+
+void RangedDownload::finish()
+{
+    if (!file.flush())
+    {
+        fail(file.errorString());
+        return;
+    }
+
+    file.close();
+    QFile::remove(sidecarFileName);
+
+    QString fileName = Utilities::getSaveNameFor(message.media().media_name,
+                                                 message.media_wa_type, downloadToGallery);
+
+    // Copies if the cache is on another file system
+    if (!QFile::rename(partFileName, fileName))
+    {
+        qDebug() << "RangedDownload: can't move" << partFileName << "to" << fileName;
+        emit httpError(this, message, "Can't move the file to " + fileName);
+        return;
+    }
+
+    qDebug() << "RangedDownload: Downloading finished.";
+
+    message.mutableMedia().local_file_uri = fileName;
+
+    emit downloadFinished(this, message);
+}
@@ -0,0 +1,134 @@
+#ifndef RANGEDDOWNLOAD_H
+#define RANGEDDOWNLOAD_H
+
+#include <QObject>
+#include <QList>
+
+#include "fmessage.h"
+#include "httprequestv2.h"
+#include "mediafilewriter.h"
+
+#include "libqtwa.h"
+
+class RangedDownload;
+
+/**
+    @class      RangeRequest
+
+    @brief      GET of one byte range of a RangedDownload.
+*/
+
+class RangeRequest : public HttpRequestv2
+{
+    Q_OBJECT
+
+public:
+    RangeRequest(RangedDownload *download, int segment, const QString &useragent);
+
+    int getSegment() const;
+    int getStatusCode() const;
+
+    // Start and total size from the Content-Range header, -1 if missing
+    qint64 getRangeStart() const;
+    qint64 getTotalSize() const;
+
+    qint64 getContentLength() const;
+
+protected:
+    void bodyDataReceived(const char *data, qint64 size);
+
+private:
+    RangedDownload *download;
+    int segment;
+};
+
+/**
+    @class      RangedDownload
+
+    @brief      Media download split in byte ranges fetched in parallel.
+
+                The first range tells the size of the file.  It's allocated
+                in full and the other ranges are fetched over several pooled
+                connections, each written at its offset.
+
+                The file is built in the cache directory with a sidecar that
+                records the finished ranges.  A download of the same URL
+                started after a failure only fetches the missing ranges.
+
+                Servers that ignore ranges send the whole file in the first
+                response, which is then written sequentially.
+*/
+
+class LIBQTWA RangedDownload : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit RangedDownload(FMessage message, const QString &useragent,
+                            bool downloadToGallery = true, QObject *parent = 0);
+    ~RangedDownload();
+
+    void setSegmentSize(qint64 bytes);
+    void setMaxConnections(int count);
+
+    // TransferScheduler::Priority of the segments
+    void setPriority(int priority);
+
+signals:
+    void progress(FMessage msg, float p);
+    void downloadFinished(RangedDownload *, FMessage msg);
+    void httpError(RangedDownload *, FMessage msg, const QString &errorString);
+
+public slots:
+    void backgroundTransfer();
+
+private slots:
+    void rangeHeaders();
+    void rangeFinished();
+    void rangeError(const QString &errorString);
+
+private:
+    struct Segment
+    {
+        qint64 start;
+        qint64 end;         // inclusive, -1 if unknown
+        qint64 received;
+        int retries;
+        bool done;
+        RangeRequest *request;
+    };
+
+    FMessage message;
+    QString useragent;
+    bool downloadToGallery;
+    int priority;
+    ProgressThrottle progressThrottle;
+
+    qint64 segmentSize;
+    int maxConnections;
+
+    QString partFileName;
+    QString sidecarFileName;
+    MediaFileWriter file;
+
+    QList<Segment> segments;
+    qint64 totalSize;
+    bool ranged;
+    bool failed;
+
+    void startFromScratch();
+    void startSegment(int index);
+    void startPending();
+    void createSegments(qint64 total);
+    bool loadSidecar();
+    void saveSidecar();
+    void writeSegment(RangeRequest *request, const char *data, qint64 size);
+    void retrySegment(int index, const QString &errorString);
+    void fail(const QString &errorString);
+    void finish();
+    void updateProgress();
+
+    friend class RangeRequest;
+};
+
+#endif // RANGEDDOWNLOAD_H
@@ -0,0 +1,192 @@
+#include <string.h>
+
+#include <QDateTime>
+#include <QDebug>
+
+#include "stanzacapture.h"
+#include "util/latencyhistogram.h"
+
+#define CAPTURE_MAGIC       "WACP"
+#define CAPTURE_VERSION     1
+
+// Header: magic, version and start time
+#define CAPTURE_HEADER_SIZE 13
+
+static int writeVarint(char *buffer, quint64 value)
+{
+    int i = 0;
+    while (value >= 0x80)
+    {
+        buffer[i++] = (char) ((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    buffer[i++] = (char) value;
+    return i;
+}
+
+static bool readVarint(const char *&data, const char *end, quint64 &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64 && data < end; shift += 7)
+    {
+        quint8 b = (quint8) *data++;
+        value |= ((quint64) (b & 0x7f)) << shift;
+        if ((b & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+StanzaCapture::StanzaCapture()
+{
+    startTime = 0;
+    lastTime = 0;
+}
+
+StanzaCapture::~StanzaCapture()
+{
+    close();
+}
+
+/**
+    Creates a capture file.  An existing file is truncated.
+
+    @param fileName     Path of the capture file.
+    @return             true if the file could be opened.
+*/
+bool StanzaCapture::open(const QString &fileName)
+{
+    QMutexLocker locker(&mutex);
+
+    if (file.isOpen())
+        file.close();
+
+    file.setFileName(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        qDebug() << "StanzaCapture: can't open" << fileName << file.errorString();
+        return false;
+    }
+
+    char header[CAPTURE_HEADER_SIZE];
+    memcpy(header, CAPTURE_MAGIC, 4);
+    header[4] = CAPTURE_VERSION;
+    quint64 start = QDateTime::currentMSecsSinceEpoch();
+    for (int i = 0; i < 8; i++)
+        header[5 + i] = (char) ((start >> (i * 8)) & 0xff);
+    file.write(header, CAPTURE_HEADER_SIZE);
+
+    startTime = LatencyHistogram::now();
+    lastTime = 0;
+
+    return true;
+}
+
+void StanzaCapture::close()
+{
+    QMutexLocker locker(&mutex);
+
+    if (file.isOpen())
+        file.close();
+}
+
+bool StanzaCapture::isOpen() const
+{
+    return file.isOpen();
+}
+
+/**
+    Appends a frame payload to the capture.
+
+    @param direction    Inbound or Outbound.
+    @param payload      Plain frame payload, without the frame header.
+    @param time         LatencyHistogram::now() when the frame was read or
+                        written, or 0 for now.  Records are kept in the order
+                        they're appended, so a time before the previous
+                        record's is stored as no delay.
+*/
+void StanzaCapture::record(Direction direction, const QByteArray &payload, qint64 time)
+{
+    QMutexLocker locker(&mutex);
+
+    if (!file.isOpen())
+        return;
+
+    qint64 now = (time ? time : LatencyHistogram::now()) - startTime;
+    if (now < lastTime)
+        now = lastTime;
+
+    char header[21];
+    int size = 0;
+    header[size++] = (char) direction;
+    size += writeVarint(header + size, now - lastTime);
+    size += writeVarint(header + size, payload.size());
+
+    lastTime = now;
+
+    file.write(header, size);
+    file.write(payload);
+}
+
+/**
+    Reads all the records of a capture file.
+
+    @param fileName     Path of the capture file.
+    @param records      List to be filled with the records.
+    @param startTime    If not null, filled with the capture start time in
+                        milliseconds since the epoch.
+    @return             false if the file can't be read or is not a capture.
+                        A truncated last record is ignored.
+*/
+bool StanzaCapture::load(const QString &fileName, QList<Record> &records,
+                         qint64 *startTime)
+{
+    QFile input(fileName);
+    if (!input.open(QIODevice::ReadOnly))
+    {
+        qDebug() << "StanzaCapture: can't open" << fileName << input.errorString();
+        return false;
+    }
+
+    QByteArray contents = input.readAll();
+    if (contents.size() < CAPTURE_HEADER_SIZE || !contents.startsWith(CAPTURE_MAGIC) ||
+        contents.at(4) != CAPTURE_VERSION)
+    {
+        qDebug() << "StanzaCapture:" << fileName << "is not a capture file";
+        return false;
+    }
+
+    const char *data = contents.constData();
+    const char *end = data + contents.size();
+
+    if (startTime)
+    {
+        quint64 start = 0;
+        for (int i = 0; i < 8; i++)
+            start |= ((quint64) (quint8) data[5 + i]) << (i * 8);
+        *startTime = start;
+    }
+
+    data += CAPTURE_HEADER_SIZE;
+
+    while (data < end)
+    {
+        Record record;
+        quint64 length;
+
+        record.direction = (Direction) *data++;
+        if (!readVarint(data, end, record.delta) || !readVarint(data, end, length) ||
+            length > (quint64) (end - data))
+        {
+            qDebug() << "StanzaCapture: truncated record in" << fileName;
+            break;
+        }
+
+        record.payload = QByteArray(data, length);
+        data += length;
+
+        records.append(record);
+    }
+
+    return true;
+}
@@ -0,0 +1,69 @@
+#ifndef STANZACAPTURE_H
+#define STANZACAPTURE_H
+
+#include <QFile>
+#include <QMutex>
+#include <QByteArray>
+#include <QList>
+
+/**
+    @class      StanzaCapture
+
+    @brief      Records plain frame payloads to a compact binary file.
+
+                Inbound frames are recorded after decryption and outbound
+                frames before encryption, so a capture can be decoded without
+                the session keys.  StanzaReplay reads them back.
+                Inbound records are timed when the frame was read from the
+                socket, so the deltas don't include the time spent
+                decrypting and decoding.
+
+                File layout (integers are little endian, varints are LEB128):
+
+                  "WACP"  u8 version  u64 start time (ms since epoch)
+                  records until the end of the file:
+                  u8 direction  varint delta (us since previous record)
+                  varint length  payload
+*/
+
+class StanzaCapture
+{
+public:
+    enum Direction {
+        Inbound = 0,
+        Outbound
+    };
+
+    struct Record
+    {
+        Record() : direction(Inbound), delta(0) {}
+
+        Direction direction;
+        quint64 delta;
+        QByteArray payload;
+    };
+
+    StanzaCapture();
+    ~StanzaCapture();
+
+    // Creates (or truncates) a capture file
+    bool open(const QString &fileName);
+    void close();
+    bool isOpen() const;
+
+    // Appends a frame payload.  Can be called from any thread.
+    void record(Direction direction, const QByteArray &payload, qint64 time = 0);
+
+    // Reads a whole capture file
+    static bool load(const QString &fileName, QList<Record> &records,
+                     qint64 *startTime = 0);
+
+private:
+    QFile file;
+    QMutex mutex;
+    // LatencyHistogram::now() when the file was opened
+    qint64 startTime;
+    qint64 lastTime;
+};
+
+#endif // STANZACAPTURE_H
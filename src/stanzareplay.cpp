@@ -0,0 +1,182 @@
+#include <QDebug>
+
+#include "connection.h"
+#include "bintreenodereader.h"
+#include "stanzareplay.h"
+
+StanzaReplay::StanzaReplay(Connection *connection, QObject *parent) :
+    QObject(parent)
+{
+    this->connection = connection;
+    this->paced = false;
+    this->predecoded = false;
+    this->position = 0;
+    this->frames = 0;
+    this->due = 0;
+
+    timer.setSingleShot(true);
+    timer.setTimerType(Qt::PreciseTimer);
+    connect(&timer, SIGNAL(timeout()), this, SLOT(replayNext()));
+}
+
+/**
+    Loads a capture file.
+
+    @param fileName     Path of the capture file.
+    @return             false if the file couldn't be read.
+*/
+bool StanzaReplay::load(const QString &fileName)
+{
+    records.clear();
+    nodes.clear();
+    position = 0;
+
+    if (!StanzaCapture::load(fileName, records))
+        return false;
+
+    if (predecoded)
+        decodeRecords();
+
+    return true;
+}
+
+void StanzaReplay::setPaced(bool paced)
+{
+    this->paced = paced;
+}
+
+/**
+    Decodes the inbound records once, when they are loaded, so that a
+    replay only measures the dispatch.
+
+    Nodes share their data implicitly, so handing a copy to the
+    Connection on every replay is cheap.
+*/
+void StanzaReplay::setPredecoded(bool predecoded)
+{
+    this->predecoded = predecoded;
+
+    nodes.clear();
+    if (predecoded)
+        decodeRecords();
+}
+
+int StanzaReplay::inboundCount() const
+{
+    int count = 0;
+    foreach (const StanzaCapture::Record &record, records)
+        if (record.direction == StanzaCapture::Inbound)
+            count++;
+    return count;
+}
+
+int StanzaReplay::outboundCount() const
+{
+    return records.size() - inboundCount();
+}
+
+/**
+    Starts replaying the loaded records from the beginning.
+
+    At full speed all the records are dispatched before this method
+    returns.  When paced they are dispatched from the event loop.
+*/
+void StanzaReplay::start()
+{
+    timer.stop();
+    position = 0;
+    frames = 0;
+    due = 0;
+    clock.start();
+
+    if (!paced)
+    {
+        for (; position < records.size(); position++)
+            if (records.at(position).direction == StanzaCapture::Inbound)
+                dispatch(position);
+
+        complete();
+        return;
+    }
+
+    replayNext();
+}
+
+void StanzaReplay::stop()
+{
+    timer.stop();
+    position = records.size();
+}
+
+void StanzaReplay::replayNext()
+{
+    // Dispatch every record that is due
+    qint64 now = clock.nsecsElapsed() / 1000;
+
+    while (position < records.size())
+    {
+        const StanzaCapture::Record &record = records.at(position);
+
+        if (due + (qint64) record.delta > now)
+        {
+            timer.start((due + record.delta - now) / 1000);
+            return;
+        }
+
+        due += record.delta;
+
+        if (record.direction == StanzaCapture::Inbound)
+            dispatch(position);
+
+        position++;
+    }
+
+    complete();
+}
+
+void StanzaReplay::decodeRecords()
+{
+    nodes.clear();
+
+    foreach (const StanzaCapture::Record &record, records)
+    {
+        // Outbound records and frames that fail to decode keep an empty node
+        ProtocolTreeNode node;
+        if (record.direction == StanzaCapture::Inbound && !decode(record.payload, node))
+            node = ProtocolTreeNode();
+        nodes.append(node);
+    }
+}
+
+bool StanzaReplay::decode(const QByteArray &payload, ProtocolTreeNode &node)
+{
+    node.setSize(payload.size() + 3);
+
+    if (connection->in->decodeTree(payload, node))
+        return true;
+
+    qDebug() << "StanzaReplay: error reading tree";
+    return false;
+}
+
+void StanzaReplay::dispatch(int index)
+{
+    ProtocolTreeNode node;
+
+    connection->frameArrival = LatencyHistogram::now();
+    if (predecoded)
+    {
+        node = nodes.at(index);
+        if (!node.getTag().isEmpty())
+            connection->processNode(node);
+    }
+    else if (decode(records.at(index).payload, node))
+        connection->processNode(node);
+
+    frames++;
+}
+
+void StanzaReplay::complete()
+{
+    Q_EMIT finished(frames, clock.nsecsElapsed() / 1000);
+}
@@ -0,0 +1,80 @@
+#ifndef STANZAREPLAY_H
+#define STANZAREPLAY_H
+
+#include <QObject>
+#include <QTimer>
+#include <QElapsedTimer>
+
+#include "stanzacapture.h"
+#include "protocoltreenode.h"
+
+class Connection;
+
+/**
+    @class      StanzaReplay
+
+    @brief      Pushes a StanzaCapture through the decoder and the dispatch
+                of a Connection without a server.
+
+                The Connection must have been prepared with initOffline()
+                and needs DataCounters like a live one.
+                Inbound records are decoded and dispatched as if they had just
+                been read from the socket; nodes written in reply are encoded
+                and dropped.  Outbound records are skipped.
+
+                Records are replayed as fast as possible or, if paced, with the
+                delays they were captured with.  When predecoded, the inbound
+                records are decoded once up front and a replay only dispatches
+                them.
+*/
+
+class StanzaReplay : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit StanzaReplay(Connection *connection, QObject *parent = 0);
+
+    bool load(const QString &fileName);
+
+    // Replay with the recorded delays between frames
+    void setPaced(bool paced);
+
+    // Decode the inbound records once instead of on every replay
+    void setPredecoded(bool predecoded);
+
+    int inboundCount() const;
+    int outboundCount() const;
+
+public slots:
+    void start();
+    void stop();
+
+signals:
+    // Emitted when all the records have been replayed
+    void finished(int frames, qint64 elapsedUs);
+
+private slots:
+    void replayNext();
+
+private:
+    Connection *connection;
+    QList<StanzaCapture::Record> records;
+    QList<ProtocolTreeNode> nodes;
+    QTimer timer;
+    QElapsedTimer clock;
+    bool paced;
+    bool predecoded;
+    int position;
+    int frames;
+
+    // Capture time of the last dispatched record, in microseconds
+    qint64 due;
+
+    void decodeRecords();
+    bool decode(const QByteArray &payload, ProtocolTreeNode &node);
+    void dispatch(int index);
+    void complete();
+};
+
+#endif // STANZAREPLAY_H
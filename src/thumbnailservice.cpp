@@ -0,0 +1,295 @@
+#include <QBuffer>
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QImageReader>
+#include <QLibrary>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QDebug>
+
+#include <utime.h>
+
+#include "thumbnailservice.h"
+#include "fmessage.h"
+#include "util/utilities.h"
+
+#define DEFAULT_MAX_THREADS         2
+#define DEFAULT_MEMORY_CACHE_SIZE   (4 * 1024 * 1024)
+
+// Thumbnails on disk are pruned by age and size when the service starts
+#define DISK_CACHE_MAX_AGE          (30 * 24 * 3600)
+#define DISK_CACHE_MAX_SIZE         (32 * 1024 * 1024)
+
+#define VIDEO_THUMBNAILER   "/usr/lib/qt5/qml/org/nemomobile/thumbnailer/thumbnailers/libvideothumbnailer.so"
+#define VIDEO_PLACEHOLDER   "/usr/share/harbour-mitakuuluu2/images/thumbnail-video.jpg"
+
+/*
+ * Backends
+ */
+
+bool ImageThumbnailBackend::handles(int waType) const
+{
+    return waType == FMessage::Image;
+}
+
+QImage ImageThumbnailBackend::create(const QString &fileName, const QSize &size) const
+{
+    QImageReader reader(fileName);
+    QSize source = reader.size();
+    if (!source.isValid())
+        return QImage();
+
+    // The reader only decodes the clipped square, already scaled
+    QRect clip;
+    if (source.width() > source.height()) {
+        clip.setTop(0);
+        clip.setLeft((source.width() - source.height()) / 2);
+        clip.setWidth(source.height());
+        clip.setHeight(source.height());
+    }
+    else {
+        clip.setLeft(0);
+        clip.setTop((source.height() - source.width()) / 2);
+        clip.setWidth(source.width());
+        clip.setHeight(source.width());
+    }
+    reader.setClipRect(clip);
+    reader.setScaledSize(size);
+
+    return reader.read();
+}
+
+VideoThumbnailBackend::VideoThumbnailBackend()
+{
+    createThumbnail = (CreateThumbnailFunc) QLibrary::resolve(
+                QLatin1String(VIDEO_THUMBNAILER), "createThumbnail");
+
+    if (!createThumbnail)
+        qWarning("Cannot generate video thumbnail, thumbnailer function not available.");
+}
+
+bool VideoThumbnailBackend::handles(int waType) const
+{
+    return waType == FMessage::Video;
+}
+
+QImage VideoThumbnailBackend::create(const QString &fileName, const QSize &size) const
+{
+    QImage image;
+
+    // Nothing says the platform thumbnailer is reentrant, videos are made
+    // one at a time while images still go in parallel
+    static QBasicMutex mutex;
+
+    if (createThumbnail)
+    {
+        QMutexLocker locker(&mutex);
+        image = createThumbnail(fileName, size, true);
+    }
+
+    if (image.isNull()) {
+        image.load(VIDEO_PLACEHOLDER);
+        image = image.scaled(64, 64, Qt::KeepAspectRatio);
+    }
+
+    return image;
+}
+
+/*
+ * Task
+ */
+
+class ThumbnailTask : public QRunnable
+{
+public:
+    ThumbnailTask(ThumbnailService *service, const QString &key, const QString &fileName,
+                  int waType, const QSize &size)
+    {
+        this->service = service;
+        this->key = key;
+        this->fileName = fileName;
+        this->waType = waType;
+        this->size = size;
+    }
+
+    void run()
+    {
+        QByteArray jpeg;
+        QString cacheFile = service->cacheDir + "/" + key + ".jpg";
+
+        QFile cached(cacheFile);
+        if (cached.open(QIODevice::ReadOnly))
+        {
+            jpeg = cached.readAll();
+
+            // Pruning goes by modification time, a used thumbnail is new
+            utime(QFile::encodeName(cacheFile).constData(), 0);
+        }
+        else
+        {
+            ThumbnailBackend *backend = service->backendFor(waType);
+            QImage image = backend ? backend->create(fileName, size) : QImage();
+
+            if (!image.isNull())
+            {
+                QBuffer out(&jpeg);
+                out.open(QIODevice::WriteOnly);
+                image.save(&out, "JPG");
+
+                QSaveFile file(cacheFile);
+                if (file.open(QIODevice::WriteOnly))
+                {
+                    file.write(jpeg);
+                    file.commit();
+                }
+            }
+        }
+
+        QMetaObject::invokeMethod(service, "taskFinished", Qt::QueuedConnection,
+                                  Q_ARG(QString, key), Q_ARG(QByteArray, jpeg));
+    }
+
+private:
+    ThumbnailService *service;
+    QString key;
+    QString fileName;
+    int waType;
+    QSize size;
+};
+
+/*
+ * Prunes the disk cache in a worker
+ */
+
+class ThumbnailPruneTask : public QRunnable
+{
+public:
+    ThumbnailPruneTask(const QString &dir)
+    {
+        this->dir = dir;
+    }
+
+    void run()
+    {
+        Utilities::pruneCacheDir(dir, DISK_CACHE_MAX_AGE, DISK_CACHE_MAX_SIZE);
+    }
+
+private:
+    QString dir;
+};
+
+/*
+ * Service
+ */
+
+ThumbnailService::ThumbnailService(QObject *parent) : QObject(parent)
+{
+    pool.setMaxThreadCount(DEFAULT_MAX_THREADS);
+    memory.setMaxCost(DEFAULT_MEMORY_CACHE_SIZE);
+
+    cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/thumbnails";
+    QDir().mkpath(cacheDir);
+    pool.start(new ThumbnailPruneTask(cacheDir));
+
+    backends.append(new ImageThumbnailBackend());
+    backends.append(new VideoThumbnailBackend());
+}
+
+ThumbnailService *ThumbnailService::instance()
+{
+    static ThumbnailService *service = 0;
+    static QBasicMutex mutex;
+
+    QMutexLocker locker(&mutex);
+    if (!service)
+    {
+        service = new ThumbnailService();
+
+        // The results are delivered in the main thread even if another
+        // thread asks for it first
+        if (QCoreApplication::instance())
+            service->moveToThread(QCoreApplication::instance()->thread());
+    }
+
+    return service;
+}
+
+/**
+    Requests a thumbnail.
+
+    @param fileName     Source media.
+    @param waType       FMessage::MediaWAType of the source.
+    @param size         Size of the thumbnail.
+    @return             Key that thumbnailReady() will carry.
+*/
+QString ThumbnailService::request(const QString &fileName, int waType, const QSize &size)
+{
+    QFileInfo info(fileName);
+
+    QByteArray id = fileName.toUtf8() + '\n' +
+            QByteArray::number(info.size()) + ':' +
+            QByteArray::number(info.lastModified().toMSecsSinceEpoch()) + ':' +
+            QByteArray::number(waType) + ':' +
+            QByteArray::number(size.width()) + 'x' + QByteArray::number(size.height());
+
+    QString key = QCryptographicHash::hash(id, QCryptographicHash::Sha1).toHex();
+
+    QByteArray *jpeg = memory.object(key);
+    if (jpeg)
+    {
+        QMetaObject::invokeMethod(this, "taskFinished", Qt::QueuedConnection,
+                                  Q_ARG(QString, key), Q_ARG(QByteArray, *jpeg));
+        return key;
+    }
+
+    // The same source is only processed once
+    if (!running.contains(key))
+    {
+        running.insert(key);
+        pool.start(new ThumbnailTask(this, key, fileName, waType, size));
+    }
+
+    return key;
+}
+
+void ThumbnailService::addBackend(ThumbnailBackend *backend)
+{
+    QMutexLocker locker(&backendsMutex);
+    backends.prepend(backend);
+}
+
+void ThumbnailService::setMaxThreads(int count)
+{
+    pool.setMaxThreadCount(count);
+}
+
+void ThumbnailService::setMemoryCacheSize(int bytes)
+{
+    memory.setMaxCost(bytes);
+}
+
+ThumbnailBackend *ThumbnailService::backendFor(int waType)
+{
+    QMutexLocker locker(&backendsMutex);
+
+    foreach (ThumbnailBackend *backend, backends)
+        if (backend->handles(waType))
+            return backend;
+
+    return 0;
+}
+
+void ThumbnailService::taskFinished(const QString &key, const QByteArray &jpeg)
+{
+    running.remove(key);
+
+    if (!jpeg.isEmpty() && !memory.contains(key))
+        memory.insert(key, new QByteArray(jpeg), jpeg.size());
+
+    emit thumbnailReady(key, jpeg);
+}
@@ -0,0 +1,115 @@
+#ifndef THUMBNAILSERVICE_H
+#define THUMBNAILSERVICE_H
+
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+#include <QImage>
+#include <QSize>
+#include <QList>
+#include <QSet>
+#include <QCache>
+#include <QMutex>
+#include <QThreadPool>
+
+/**
+    @class      ThumbnailBackend
+
+    @brief      Creates thumbnails of one kind of media.
+
+                create() runs in the worker threads, it must not use any
+                state that isn't thread safe.
+*/
+
+class ThumbnailBackend
+{
+public:
+    virtual ~ThumbnailBackend() {}
+
+    // True if it makes thumbnails of this FMessage::MediaWAType
+    virtual bool handles(int waType) const = 0;
+
+    // Null image if it can't
+    virtual QImage create(const QString &fileName, const QSize &size) const = 0;
+};
+
+// Square center of the image, scaled while decoding
+class ImageThumbnailBackend : public ThumbnailBackend
+{
+public:
+    bool handles(int waType) const;
+    QImage create(const QString &fileName, const QSize &size) const;
+};
+
+// Platform video thumbnailer, resolved once, or a generic image
+class VideoThumbnailBackend : public ThumbnailBackend
+{
+public:
+    VideoThumbnailBackend();
+
+    bool handles(int waType) const;
+    QImage create(const QString &fileName, const QSize &size) const;
+
+private:
+    typedef QImage (*CreateThumbnailFunc)(const QString &fileName, const QSize &requestedSize, bool crop);
+
+    CreateThumbnailFunc createThumbnail;
+};
+
+/**
+    @class      ThumbnailService
+
+    @brief      Creates JPEG thumbnails in a pool of worker threads.
+
+                Results are cached in memory and on disk, keyed by the path,
+                size and modification time of the source and the requested
+                size, so a changed file gets a new thumbnail.  Requests for
+                a thumbnail that is already being made wait for the same
+                result.  The disk cache is pruned by age and size when the
+                service starts, a thumbnail read from it counts as new.
+
+                Every request is answered with thumbnailReady(), even when
+                the thumbnail was cached, always from the event loop.  The
+                JPEG is empty if it couldn't be made.
+*/
+
+class ThumbnailService : public QObject
+{
+    Q_OBJECT
+
+public:
+    static ThumbnailService *instance();
+
+    // Starts making a thumbnail and returns the key of thumbnailReady()
+    QString request(const QString &fileName, int waType, const QSize &size);
+
+    // Takes ownership.  Backends added later are tried first.
+    void addBackend(ThumbnailBackend *backend);
+
+    void setMaxThreads(int count);
+    void setMemoryCacheSize(int bytes);
+
+signals:
+    void thumbnailReady(const QString &key, const QByteArray &jpeg);
+
+private slots:
+    void taskFinished(const QString &key, const QByteArray &jpeg);
+
+private:
+    QThreadPool pool;
+    QCache<QString, QByteArray> memory;
+    QSet<QString> running;
+    QString cacheDir;
+
+    // Backends are read by the workers
+    QMutex backendsMutex;
+    QList<ThumbnailBackend *> backends;
+
+    explicit ThumbnailService(QObject *parent = 0);
+
+    ThumbnailBackend *backendFor(int waType);
+
+    friend class ThumbnailTask;
+};
+
+#endif // THUMBNAILSERVICE_H
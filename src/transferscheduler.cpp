@@ -0,0 +1,205 @@
+#include <QCoreApplication>
+#include <QMutex>
+#include <QDebug>
+
+#include "transferscheduler.h"
+#include "httprequestv2.h"
+
+#define DEFAULT_MAX_TRANSFERS           4
+#define DEFAULT_MAX_TRANSFERS_PER_HOST  2
+#define DEFAULT_PROGRESS_INTERVAL       250
+
+// Transfers of Normal priority below SMALL_TRANSFER bytes go first, those
+// above BULK_TRANSFER last
+#define SMALL_TRANSFER      (256 * 1024)
+#define BULK_TRANSFER       (8 * 1024 * 1024)
+
+TransferScheduler::TransferScheduler(QObject *parent) : QObject(parent)
+{
+    sequence = 0;
+    maxTransfers = DEFAULT_MAX_TRANSFERS;
+    maxTransfersPerHost = DEFAULT_MAX_TRANSFERS_PER_HOST;
+    progressInterval = DEFAULT_PROGRESS_INTERVAL;
+}
+
+TransferScheduler *TransferScheduler::instance()
+{
+    static TransferScheduler *scheduler = 0;
+    static QBasicMutex mutex;
+
+    QMutexLocker locker(&mutex);
+    if (!scheduler)
+    {
+        scheduler = new TransferScheduler();
+
+        // The requests it starts live in the main thread even if another
+        // thread asks for it first
+        if (QCoreApplication::instance())
+            scheduler->moveToThread(QCoreApplication::instance()->thread());
+    }
+
+    return scheduler;
+}
+
+void TransferScheduler::schedule(HttpRequestv2 *request)
+{
+    // Scheduled again, like a request object reused
+    finished(request);
+
+    Entry entry;
+    entry.request = request;
+    entry.host = request->getUrl().host().toLower() + ':' + QString::number(request->getUrl().port(443));
+    entry.priority = request->getPriority();
+    entry.size = request->getSizeHint();
+    entry.sequence = sequence++;
+
+    if (entry.priority == Normal && entry.size >= 0)
+    {
+        if (entry.size < SMALL_TRANSFER)
+            entry.priority = Small;
+        else if (entry.size > BULK_TRANSFER)
+            entry.priority = Bulk;
+    }
+
+    queue.append(entry);
+    dispatch();
+}
+
+void TransferScheduler::finished(HttpRequestv2 *request)
+{
+    for (int i = 0; i < active.size(); i++)
+    {
+        if (active.at(i).request == request)
+        {
+            if (--activePerHost[active.at(i).host] <= 0)
+                activePerHost.remove(active.at(i).host);
+            active.removeAt(i);
+
+            dispatch();
+            return;
+        }
+    }
+
+    for (int i = 0; i < queue.size(); i++)
+    {
+        if (queue.at(i).request == request)
+        {
+            queue.removeAt(i);
+            return;
+        }
+    }
+}
+
+bool TransferScheduler::before(const Entry &a, const Entry &b)
+{
+    if (a.priority != b.priority)
+        return a.priority < b.priority;
+
+    // Unknown sizes go after the known ones
+    if (a.size != b.size)
+    {
+        if (a.size < 0 || b.size < 0)
+            return b.size < 0;
+        return a.size < b.size;
+    }
+
+    return a.sequence < b.sequence;
+}
+
+/**
+    Starts the most urgent queued requests that fit in the limits.
+*/
+void TransferScheduler::dispatch()
+{
+    while (active.size() < maxTransfers)
+    {
+        int best = -1;
+        for (int i = 0; i < queue.size(); i++)
+        {
+            if (activePerHost.value(queue.at(i).host) >= maxTransfersPerHost)
+                continue;
+
+            if (best < 0 || before(queue.at(i), queue.at(best)))
+                best = i;
+        }
+
+        if (best < 0)
+            return;
+
+        Entry entry = queue.takeAt(best);
+        active.append(entry);
+        activePerHost[entry.host]++;
+
+        entry.request->start();
+    }
+}
+
+void TransferScheduler::setMaxTransfers(int count)
+{
+    maxTransfers = count;
+    dispatch();
+}
+
+void TransferScheduler::setMaxTransfersPerHost(int count)
+{
+    maxTransfersPerHost = count;
+    dispatch();
+}
+
+void TransferScheduler::setUploadLimit(qint64 rate)
+{
+    upload.setRate(rate);
+}
+
+void TransferScheduler::setDownloadLimit(qint64 rate)
+{
+    download.setRate(rate);
+}
+
+TokenBucket *TransferScheduler::getUploadBucket()
+{
+    return &upload;
+}
+
+TokenBucket *TransferScheduler::getDownloadBucket()
+{
+    return &download;
+}
+
+void TransferScheduler::setProgressInterval(int msecs)
+{
+    progressInterval = msecs;
+}
+
+int TransferScheduler::getProgressInterval() const
+{
+    return progressInterval;
+}
+
+int TransferScheduler::getQueued() const
+{
+    return queue.size();
+}
+
+int TransferScheduler::getActive() const
+{
+    return active.size();
+}
+
+/*
+ * ProgressThrottle
+ */
+
+ProgressThrottle::ProgressThrottle()
+{
+}
+
+bool ProgressThrottle::ready(bool last)
+{
+    if (!last && timer.isValid() &&
+        timer.elapsed() < TransferScheduler::instance()->getProgressInterval())
+        return false;
+
+    timer.start();
+    return true;
+}
@@ -0,0 +1,111 @@
+#ifndef TRANSFERSCHEDULER_H
+#define TRANSFERSCHEDULER_H
+
+#include <QObject>
+#include <QList>
+#include <QHash>
+#include <QElapsedTimer>
+
+#include "util/tokenbucket.h"
+
+class HttpRequestv2;
+
+/**
+    @class      TransferScheduler
+
+    @brief      Queue of the HTTP media transfers.
+
+                Requests are started when there is room under the global and
+                per host limits, the most urgent first: by priority, then the
+                smallest, then the oldest.  Transfers without an explicit
+                priority count as Small or Bulk by their size.
+
+                Uploads and downloads also share a token bucket each, which
+                caps the bandwidth they take from the XMPP connection.
+*/
+
+class TransferScheduler : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum Priority {
+        Visible = 0,        // the user is looking at it
+        Small,
+        Normal,
+        Bulk
+    };
+
+    static TransferScheduler *instance();
+
+    // Queues a request, it's started when possible
+    void schedule(HttpRequestv2 *request);
+
+    // The request ended or was deleted, its place goes to the next one
+    void finished(HttpRequestv2 *request);
+
+    void setMaxTransfers(int count);
+    void setMaxTransfersPerHost(int count);
+
+    // Bytes per second, 0 is unlimited.  A new limit starts with one
+    // second of bytes available, transfers don't stall when it's set.
+    void setUploadLimit(qint64 rate);
+    void setDownloadLimit(qint64 rate);
+
+    TokenBucket *getUploadBucket();
+    TokenBucket *getDownloadBucket();
+
+    // Minimum milliseconds between progress notifications of a transfer
+    void setProgressInterval(int msecs);
+    int getProgressInterval() const;
+
+    int getQueued() const;
+    int getActive() const;
+
+private:
+    struct Entry
+    {
+        HttpRequestv2 *request;
+        QString host;
+        int priority;
+        qint64 size;
+        quint64 sequence;
+    };
+
+    QList<Entry> queue;
+    QList<Entry> active;
+    QHash<QString, int> activePerHost;
+    quint64 sequence;
+
+    int maxTransfers;
+    int maxTransfersPerHost;
+    int progressInterval;
+
+    TokenBucket upload;
+    TokenBucket download;
+
+    explicit TransferScheduler(QObject *parent = 0);
+
+    static bool before(const Entry &a, const Entry &b);
+    void dispatch();
+};
+
+/**
+    @class      ProgressThrottle
+
+    @brief      Limits progress notifications to the scheduler interval.
+*/
+
+class ProgressThrottle
+{
+public:
+    ProgressThrottle();
+
+    // True if a notification can be sent now.  The last one always can.
+    bool ready(bool last = false);
+
+private:
+    QElapsedTimer timer;
+};
+
+#endif // TRANSFERSCHEDULER_H
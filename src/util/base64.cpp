@@ -0,0 +1,185 @@
+#include <string.h>
+
+#include "base64.h"
+
+static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Marks of the decoding table
+#define BASE64_INVALID      0xff
+#define BASE64_SPACE        0xfe
+
+/*
+ * Pairs of characters for every 12 bits of input
+ */
+struct EncodeTable
+{
+    char pairs[4096][2];
+
+    EncodeTable()
+    {
+        for (int i = 0; i < 4096; i++)
+        {
+            pairs[i][0] = alphabet[i >> 6];
+            pairs[i][1] = alphabet[i & 0x3f];
+        }
+    }
+};
+
+/*
+ * Value of every character, or one of the marks
+ */
+struct DecodeTable
+{
+    quint8 values[256];
+
+    DecodeTable()
+    {
+        memset(values, BASE64_INVALID, sizeof(values));
+
+        for (int i = 0; i < 64; i++)
+            values[(quint8) alphabet[i]] = i;
+
+        values[(quint8) ' '] = BASE64_SPACE;
+        values[(quint8) '\t'] = BASE64_SPACE;
+        values[(quint8) '\r'] = BASE64_SPACE;
+        values[(quint8) '\n'] = BASE64_SPACE;
+    }
+};
+
+static const EncodeTable encodeTable;
+static const DecodeTable decodeTable;
+
+QByteArray Base64::encode(const char *data, int size)
+{
+    if (size <= 0)
+        return QByteArray();
+
+    QByteArray result;
+    result.resize(((size + 2) / 3) * 4);
+
+    const quint8 *in = (const quint8 *) data;
+    char *out = result.data();
+
+    int i = 0;
+    for (; i + 3 <= size; i += 3)
+    {
+        quint32 bits = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+
+        memcpy(out, encodeTable.pairs[bits >> 12], 2);
+        memcpy(out + 2, encodeTable.pairs[bits & 0xfff], 2);
+        out += 4;
+    }
+
+    if (i < size)
+    {
+        quint32 bits = in[i] << 16;
+        if (i + 1 < size)
+            bits |= in[i + 1] << 8;
+
+        memcpy(out, encodeTable.pairs[bits >> 12], 2);
+        out[2] = (i + 1 < size) ? encodeTable.pairs[bits & 0xfff][0] : '=';
+        out[3] = '=';
+    }
+
+    return result;
+}
+
+QByteArray Base64::encode(const QByteArray &data)
+{
+    return encode(data.constData(), data.size());
+}
+
+QString Base64::toString(const QByteArray &data)
+{
+    QByteArray text = encode(data);
+    return QString::fromLatin1(text.constData(), text.size());
+}
+
+QByteArray Base64::decode(const char *text, int size)
+{
+    if (size <= 0)
+        return QByteArray();
+
+    QByteArray result;
+    result.resize((size / 4) * 3 + 3);
+
+    const quint8 *in = (const quint8 *) text;
+    const quint8 *end = in + size;
+    char *out = result.data();
+
+    quint32 bits = 0;
+    int count = 0;
+
+    while (in < end)
+    {
+        // Fast path: 4 valid characters in a row
+        if (count == 0 && end - in >= 4)
+        {
+            quint32 a = decodeTable.values[in[0]];
+            quint32 b = decodeTable.values[in[1]];
+            quint32 c = decodeTable.values[in[2]];
+            quint32 d = decodeTable.values[in[3]];
+
+            if ((a | b | c | d) < 64)
+            {
+                quint32 value = (a << 18) | (b << 12) | (c << 6) | d;
+                out[0] = value >> 16;
+                out[1] = value >> 8;
+                out[2] = value;
+                out += 3;
+                in += 4;
+                continue;
+            }
+        }
+
+        quint8 value = decodeTable.values[*in++];
+        if (value == BASE64_SPACE)
+            continue;
+
+        if (value == BASE64_INVALID)
+        {
+            // Only padding may follow the data
+            if (in[-1] != '=')
+                return QByteArray();
+
+            while (in < end && (*in == '=' || decodeTable.values[*in] == BASE64_SPACE))
+                in++;
+
+            if (in < end)
+                return QByteArray();
+
+            break;
+        }
+
+        bits = (bits << 6) | value;
+        if (++count == 4)
+        {
+            out[0] = bits >> 16;
+            out[1] = bits >> 8;
+            out[2] = bits;
+            out += 3;
+            bits = 0;
+            count = 0;
+        }
+    }
+
+    // 2 or 3 characters left are 1 or 2 bytes
+    if (count == 1)
+        return QByteArray();
+    if (count == 2)
+        *out++ = bits >> 4;
+    else if (count == 3)
+    {
+        *out++ = bits >> 10;
+        *out++ = bits >> 2;
+    }
+
+    result.truncate(out - result.constData());
+    return result;
+}
+
+QByteArray Base64::decode(const QByteArray &text)
+{
+    return decode(text.constData(), text.size());
+}
@@ -0,0 +1,36 @@
+#ifndef BASE64_H
+#define BASE64_H
+
+#include <QByteArray>
+#include <QString>
+
+/**
+    @class      Base64
+
+    @brief      Table driven base64 codec.
+
+                The encoder turns every 3 bytes into 4 characters with two
+                lookups in a table of character pairs, and writes straight
+                into the result.  The decoder looks up 4 characters at a time
+                and stops at the first invalid one.
+
+                Binary blobs of the messages (thumbnails, raw media data) are
+                kept as they are and only encoded when asked for.
+*/
+
+class Base64
+{
+public:
+    static QByteArray encode(const char *data, int size);
+    static QByteArray encode(const QByteArray &data);
+
+    // Same as encode(), as Latin-1 text
+    static QString toString(const QByteArray &data);
+
+    // Padding is optional, whitespace is skipped.  Returns an empty array
+    // if the text is not valid base64.
+    static QByteArray decode(const char *text, int size);
+    static QByteArray decode(const QByteArray &text);
+};
+
+#endif // BASE64_H
@@ -27,25 +27,130 @@
  */
 
 #include <QSettings>
+#include <QThread>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+#include <QVector>
 #include <QDebug>
 
 #include "datacounters.h"
 
 #include "globalconstants.h"
 
+/**
+    Thread writing the counters to the settings.  Snapshots handed to it
+    while it's busy are coalesced, only the latest one is written.
+*/
+class CountersWriter : public QThread
+{
+public:
+    CountersWriter();
+    ~CountersWriter();
+
+    void post(const QVector<qint64> &received, const QVector<qint64> &sent);
+
+protected:
+    void run();
+
+private:
+    QMutex mutex;
+    QWaitCondition pending;
+    QVector<qint64> received;
+    QVector<qint64> sent;
+    bool dirty;
+    bool stopping;
+};
+
+CountersWriter::CountersWriter()
+{
+    dirty = false;
+    stopping = false;
+    setObjectName("wa-counters");
+}
+
+CountersWriter::~CountersWriter()
+{
+    {
+        QMutexLocker locker(&mutex);
+        stopping = true;
+        pending.wakeOne();
+    }
+
+    // The last snapshot is written before the thread exits
+    wait();
+}
+
+void CountersWriter::post(const QVector<qint64> &received, const QVector<qint64> &sent)
+{
+    QMutexLocker locker(&mutex);
+
+    this->received = received;
+    this->sent = sent;
+    dirty = true;
+    pending.wakeOne();
+}
+
+void CountersWriter::run()
+{
+    QMutexLocker locker(&mutex);
+
+    while (true)
+    {
+        while (!dirty && !stopping)
+            pending.wait(&mutex);
+
+        if (!dirty)
+            break;
+
+        QVector<qint64> received = this->received;
+        QVector<qint64> sent = this->sent;
+        dirty = false;
+
+        locker.unlock();
+
+        QSettings settings(SETTINGS_ORGANIZATION,SETTINGS_COUNTERS);
+        for (int i = 0; i < TOTAL_COUNTERS; i++)
+        {
+            settings.setValue("received_" + QString::number(i), received.at(i));
+            settings.setValue("sent_" + QString::number(i), sent.at(i));
+        }
+        settings.sync();
+
+        locker.relock();
+    }
+}
+
 DataCounters::DataCounters()
 {
+    for (int i = 0; i < TOTAL_COUNTERS; i++)
+    {
+        received[i].store(0);
+        sent[i].store(0);
+    }
+
+    writer = new CountersWriter();
+    writer->start(QThread::LowPriority);
+}
+
+DataCounters::~DataCounters()
+{
+    delete writer;
 }
 
 void DataCounters::increaseCounter(int counter, qint64 receivedBytes, qint64 sentBytes)
 {
-    received[counter] += receivedBytes;
-    sent[counter] += sentBytes;
+    if (receivedBytes)
+        received[counter].fetchAndAddRelaxed(receivedBytes);
+    if (sentBytes)
+        sent[counter].fetchAndAddRelaxed(sentBytes);
 
     if (counter != Messages)
     {
-        received[Total] += receivedBytes;
-        sent[Total] += sentBytes;
+        if (receivedBytes)
+            received[Total].fetchAndAddRelaxed(receivedBytes);
+        if (sentBytes)
+            sent[Total].fetchAndAddRelaxed(sentBytes);
     }
 }
 
@@ -55,42 +160,47 @@ void DataCounters::readCounters()
 
     for (int i = 0; i < TOTAL_COUNTERS; i++)
     {
-        received[i] = settings.value("received_" + QString::number(i), 0).toLongLong();
-        sent[i] = settings.value("sent_" + QString::number(i), 0).toLongLong();
+        received[i].store(settings.value("received_" + QString::number(i), 0).toLongLong());
+        sent[i].store(settings.value("sent_" + QString::number(i), 0).toLongLong());
     }
 
 }
 
+/**
+    Schedules the counters to be written to the settings.  It doesn't wait
+    for the write.
+*/
 void DataCounters::writeCounters()
 {
-    QSettings settings(SETTINGS_ORGANIZATION,SETTINGS_COUNTERS);
+    QVector<qint64> receivedValues(TOTAL_COUNTERS);
+    QVector<qint64> sentValues(TOTAL_COUNTERS);
 
     for (int i = 0; i < TOTAL_COUNTERS; i++)
     {
-        settings.setValue("received_" + QString::number(i), received[i]);
-        settings.setValue("sent_" + QString::number(i), sent[i]);
+        receivedValues[i] = received[i].load();
+        sentValues[i] = sent[i].load();
     }
+
+    writer->post(receivedValues, sentValues);
 }
 
 qint64 DataCounters::getReceivedBytes(int counter)
 {
-    return received[counter];
+    return received[counter].load();
 }
 
 qint64 DataCounters::getSentBytes(int counter)
 {
-    return sent[counter];
+    return sent[counter].load();
 }
 
 void DataCounters::resetCounters()
 {
-    QSettings settings(SETTINGS_ORGANIZATION,SETTINGS_COUNTERS);
-
     for (int i = 0; i < TOTAL_COUNTERS; i++)
     {
-        received[i] = 0;
-        sent[i] = 0;
-        settings.setValue("received_" + QString::number(i), received[i]);
-        settings.setValue("sent_" + QString::number(i), sent[i]);
+        received[i].store(0);
+        sent[i].store(0);
     }
+
+    writeCounters();
 }
@@ -30,9 +30,22 @@
 #define DATACOUNTERS_H
 
 #include <QtGlobal>
+#include <QAtomicInteger>
 
 #define TOTAL_COUNTERS      9
 
+class CountersWriter;
+
+/**
+    @class      DataCounters
+
+    @brief      Traffic counters persisted in the settings.
+
+                Counters are atomic, so connections in different threads can
+                update them.  Writing them to the settings is done by a
+                background thread: writeCounters() only hands it a snapshot.
+*/
+
 class DataCounters
 {
 public:
@@ -49,6 +62,7 @@ public:
     };
 
     DataCounters();
+    ~DataCounters();
 
     void increaseCounter(int counter, qint64 receivedBytes, qint64 sentBytes);
     void readCounters();
@@ -58,8 +72,12 @@ public:
     qint64 getSentBytes(int counter);
 
 private:
-    qint64 received[TOTAL_COUNTERS];
-    qint64 sent[TOTAL_COUNTERS];
+    QAtomicInteger<qint64> received[TOTAL_COUNTERS];
+    QAtomicInteger<qint64> sent[TOTAL_COUNTERS];
+
+    CountersWriter *writer;
+
+    Q_DISABLE_COPY(DataCounters)
 };
 
 #endif // DATACOUNTERS_H
@@ -0,0 +1,165 @@
+#include <time.h>
+
+#include "latencyhistogram.h"
+
+LatencyHistogram::LatencyHistogram()
+{
+}
+
+LatencyHistogram::LatencyHistogram(const LatencyHistogram &other)
+{
+    add(other);
+}
+
+LatencyHistogram &LatencyHistogram::operator=(const LatencyHistogram &other)
+{
+    if (this != &other)
+    {
+        reset();
+        add(other);
+    }
+
+    return *this;
+}
+
+qint64 LatencyHistogram::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (qint64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Values below 2 * SUB_BUCKETS have a bucket each.  For larger ones the
+ * position of the highest bit selects a range [2^n, 2^(n+1)) split in
+ * SUB_BUCKETS buckets.
+ */
+int LatencyHistogram::bucketFor(qint64 us)
+{
+    if (us < 2 * LATENCY_SUB_BUCKETS)
+        return us < 0 ? 0 : (int) us;
+
+    int msb = 63 - __builtin_clzll((quint64) us);
+    if (msb >= LATENCY_MAX_BITS)
+        return LATENCY_BUCKETS - 1;
+
+    int shift = msb - LATENCY_SUB_BUCKET_BITS;
+    int sub = (int) (us >> shift) - LATENCY_SUB_BUCKETS;
+
+    return 2 * LATENCY_SUB_BUCKETS + (shift - 1) * LATENCY_SUB_BUCKETS + sub;
+}
+
+/*
+ * Highest value counted in a bucket
+ */
+qint64 LatencyHistogram::bucketValue(int bucket)
+{
+    if (bucket < 2 * LATENCY_SUB_BUCKETS)
+        return bucket;
+
+    int shift = (bucket - 2 * LATENCY_SUB_BUCKETS) / LATENCY_SUB_BUCKETS + 1;
+    qint64 sub = (bucket - 2 * LATENCY_SUB_BUCKETS) % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS;
+
+    return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(qint64 us)
+{
+    if (us < 0)
+        us = 0;
+
+    counts[bucketFor(us)].fetchAndAddRelaxed(1);
+    count.fetchAndAddRelaxed(1);
+    sum.fetchAndAddRelaxed(us);
+
+    qint64 current = max.load();
+    while (us > current && !max.testAndSetRelaxed(current, us))
+        current = max.load();
+}
+
+void LatencyHistogram::add(const LatencyHistogram &other)
+{
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        qint64 value = other.counts[i].load();
+        if (value)
+            counts[i].fetchAndAddRelaxed(value);
+    }
+
+    count.fetchAndAddRelaxed(other.count.load());
+    sum.fetchAndAddRelaxed(other.sum.load());
+
+    qint64 otherMax = other.max.load();
+    qint64 current = max.load();
+    while (otherMax > current && !max.testAndSetRelaxed(current, otherMax))
+        current = max.load();
+}
+
+void LatencyHistogram::reset()
+{
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+        counts[i].store(0);
+
+    count.store(0);
+    sum.store(0);
+    max.store(0);
+}
+
+qint64 LatencyHistogram::getCount() const
+{
+    return count.load();
+}
+
+qint64 LatencyHistogram::getMax() const
+{
+    return max.load();
+}
+
+double LatencyHistogram::getMean() const
+{
+    qint64 n = count.load();
+    return n ? (double) sum.load() / n : 0.0;
+}
+
+/**
+    Returns the value at a percentile.
+
+    @param percent      Percentile, from 0 to 100.
+    @return             Highest value of the bucket where the percentile falls,
+                        capped by the maximum recorded.  0 if empty.
+*/
+qint64 LatencyHistogram::getPercentile(double percent) const
+{
+    qint64 total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+        total += counts[i].load();
+
+    if (total == 0)
+        return 0;
+
+    percent = qBound(0.0, percent, 100.0);
+    qint64 target = qMax((qint64) 1, (qint64) (total * percent / 100.0 + 0.5));
+
+    qint64 seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += counts[i].load();
+        if (seen >= target)
+            return qMin(bucketValue(i), max.load());
+    }
+
+    return max.load();
+}
+
+QString LatencyHistogram::toString() const
+{
+    return QString("count=%1 mean=%2 p50=%3 p90=%4 p99=%5 p999=%6 max=%7")
+            .arg(getCount())
+            .arg((qint64) getMean())
+            .arg(getPercentile(50))
+            .arg(getPercentile(90))
+            .arg(getPercentile(99))
+            .arg(getPercentile(99.9))
+            .arg(getMax());
+}
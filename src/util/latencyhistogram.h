@@ -0,0 +1,69 @@
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <QtGlobal>
+#include <QString>
+#include <QAtomicInteger>
+
+// 16 sub-buckets per power of two, about 6% worst case error
+#define LATENCY_SUB_BUCKET_BITS     4
+#define LATENCY_SUB_BUCKETS         (1 << LATENCY_SUB_BUCKET_BITS)
+
+// Values up to 2^36 us (19 hours), larger ones count in the last bucket
+#define LATENCY_MAX_BITS            36
+#define LATENCY_BUCKETS             (2 * LATENCY_SUB_BUCKETS + \
+                                     (LATENCY_MAX_BITS - LATENCY_SUB_BUCKET_BITS - 1) * LATENCY_SUB_BUCKETS)
+
+/**
+    @class      LatencyHistogram
+
+    @brief      Log-linear (HDR style) histogram of latencies in microseconds.
+
+                Values below 2 * LATENCY_SUB_BUCKETS are counted exactly, larger
+                ones in buckets whose width doubles with every power of two, so
+                the relative error is bounded for any value while the histogram
+                stays a fixed array of ~4KB.
+
+                record() is a few shifts and one atomic add, so it can be called
+                from any thread.  Reads are not synchronized with the writers:
+                copying a histogram gives a consistent enough snapshot.
+*/
+
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+    LatencyHistogram(const LatencyHistogram &other);
+    LatencyHistogram &operator=(const LatencyHistogram &other);
+
+    // Monotonic clock in microseconds, for the timestamps passed to record()
+    static qint64 now();
+
+    void record(qint64 us);
+
+    // Adds all the values of another histogram
+    void add(const LatencyHistogram &other);
+
+    void reset();
+
+    qint64 getCount() const;
+    qint64 getMax() const;
+    double getMean() const;
+
+    // Value below which the given percent (0-100) of the values fall
+    qint64 getPercentile(double percent) const;
+
+    // "count=... mean=... p50=... p90=... p99=... p999=... max=..." in us
+    QString toString() const;
+
+private:
+    QAtomicInteger<qint64> counts[LATENCY_BUCKETS];
+    QAtomicInteger<qint64> count;
+    QAtomicInteger<qint64> sum;
+    QAtomicInteger<qint64> max;
+
+    static int bucketFor(qint64 us);
+    static qint64 bucketValue(int bucket);
+};
+
+#endif // LATENCYHISTOGRAM_H
@@ -0,0 +1,418 @@
+#include <QMutex>
+#include <QMutexLocker>
+#include <QThreadStorage>
+#include <QHash>
+#include <QVector>
+#include <QStringList>
+#include <QSaveFile>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QDebug>
+
+#include "metricsregistry.h"
+
+// Cells are allocated per thread in chunks of this many series
+#define METRICS_CHUNK_SIZE      256
+
+// Up to 65536 series
+#define METRICS_MAX_CHUNKS      256
+
+typedef QAtomicInteger<qint64> MetricCell;
+
+struct MetricSeries
+{
+    QString name;
+    QString help;
+    QString labels;
+    QString key;
+    int references;
+};
+
+/**
+    Counter cells of one thread.  Only the owner thread writes them, the
+    readers just load them.
+*/
+class MetricsCells
+{
+public:
+    MetricsCells();
+    ~MetricsCells();
+
+    inline MetricCell &cell(int id)
+    {
+        MetricCell *chunk = chunks[id / METRICS_CHUNK_SIZE].load();
+        if (!chunk)
+            chunk = allocate(id / METRICS_CHUNK_SIZE);
+
+        return chunk[id % METRICS_CHUNK_SIZE];
+    }
+
+    // Value of a series, from any thread
+    qint64 value(int id) const;
+
+private:
+    QAtomicPointer<MetricCell> chunks[METRICS_MAX_CHUNKS];
+
+    MetricCell *allocate(int chunk);
+};
+
+struct MetricsData
+{
+    QMutex mutex;
+    QVector<MetricSeries> series;
+    QHash<QString, int> ids;
+
+    // Released series, and whether the limit was already reported
+    QList<int> freeIds;
+    bool full;
+
+    MetricsData() : full(false) {}
+
+    // Live threads, and the values left by the finished ones
+    QList<MetricsCells *> cells;
+    QVector<qint64> retired;
+};
+
+Q_GLOBAL_STATIC(MetricsData, metrics)
+
+static QThreadStorage<MetricsCells *> localCells;
+
+/*
+ * Cells
+ */
+
+MetricsCells::MetricsCells()
+{
+    QMutexLocker locker(&metrics()->mutex);
+    metrics()->cells.append(this);
+}
+
+MetricsCells::~MetricsCells()
+{
+    if (!metrics.isDestroyed())
+    {
+        // Keep what this thread counted
+        QMutexLocker locker(&metrics()->mutex);
+
+        MetricsData *data = metrics();
+        data->cells.removeOne(this);
+        for (int id = 0; id < data->retired.size(); id++)
+            data->retired[id] += value(id);
+    }
+
+    for (int i = 0; i < METRICS_MAX_CHUNKS; i++)
+        delete[] chunks[i].load();
+}
+
+qint64 MetricsCells::value(int id) const
+{
+    MetricCell *chunk = chunks[id / METRICS_CHUNK_SIZE].load();
+    return chunk ? chunk[id % METRICS_CHUNK_SIZE].load() : 0;
+}
+
+MetricCell *MetricsCells::allocate(int chunk)
+{
+    // Only the owner thread allocates, readers see either 0 or the chunk
+    MetricCell *cells = new MetricCell[METRICS_CHUNK_SIZE];
+    chunks[chunk].storeRelease(cells);
+
+    return cells;
+}
+
+static inline MetricsCells *currentCells()
+{
+    if (!localCells.hasLocalData())
+        localCells.setLocalData(new MetricsCells());
+
+    return localCells.localData();
+}
+
+/*
+ * Label formatting
+ */
+
+static QString escapeLabelValue(QString value)
+{
+    return value.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', "\\n");
+}
+
+static QString formatLabels(const MetricLabels &labels)
+{
+    QString result;
+
+    for (int i = 0; i < labels.size(); i++)
+    {
+        if (i > 0)
+            result.append(',');
+        result.append(labels.at(i).first + "=\"" + escapeLabelValue(labels.at(i).second) + '"');
+    }
+
+    return result;
+}
+
+/*
+ * Registry
+ */
+
+MetricsRegistry::MetricsRegistry()
+{
+}
+
+MetricsRegistry *MetricsRegistry::instance()
+{
+    static MetricsRegistry registry;
+    return &registry;
+}
+
+/**
+    Registers a counter series.
+
+    @param name     Metric name, e.g. libqtwa_stanzas_received_total.
+    @param help     Description exported with the metric.
+    @param labels   Labels of this series.
+    @return         Id to pass to add() and value(), or -1 if the registry is full.
+*/
+int MetricsRegistry::counter(const QString &name, const QString &help,
+                             const MetricLabels &labels)
+{
+    MetricSeries series;
+    series.name = name;
+    series.help = help;
+    series.labels = formatLabels(labels);
+    series.key = name + '{' + series.labels + '}';
+    series.references = 1;
+
+    QMutexLocker locker(&metrics()->mutex);
+
+    MetricsData *data = metrics();
+    QHash<QString, int>::const_iterator i = data->ids.constFind(series.key);
+    if (i != data->ids.constEnd())
+    {
+        data->series[i.value()].references++;
+        return i.value();
+    }
+
+    int id;
+    if (!data->freeIds.isEmpty())
+    {
+        id = data->freeIds.takeLast();
+        data->series[id] = series;
+    }
+    else if (data->series.size() < METRICS_CHUNK_SIZE * METRICS_MAX_CHUNKS)
+    {
+        id = data->series.size();
+        data->series.append(series);
+        data->retired.append(0);
+    }
+    else
+    {
+        // Once, a full registry would flood the log with every new series
+        if (!data->full)
+            qWarning() << "MetricsRegistry: too many series, ignoring" << series.key
+                       << "and the next ones";
+        data->full = true;
+        return -1;
+    }
+
+    data->ids.insert(series.key, id);
+
+    return id;
+}
+
+/**
+    Drops a reference to a series.  When the last one goes, the series is
+    not exported anymore and its id is free for a new series.  The cells of
+    the threads can't be cleared from here, their values are subtracted
+    instead so a reused id starts at 0.
+*/
+void MetricsRegistry::release(int id)
+{
+    if (id < 0)
+        return;
+
+    QMutexLocker locker(&metrics()->mutex);
+
+    MetricsData *data = metrics();
+    if (id >= data->series.size() || data->series.at(id).references <= 0)
+        return;
+
+    if (--data->series[id].references > 0)
+        return;
+
+    qint64 total = data->retired.at(id);
+    foreach (MetricsCells *cells, data->cells)
+        total += cells->value(id);
+    data->retired[id] -= total;
+
+    data->ids.remove(data->series.at(id).key);
+    data->series[id] = MetricSeries();
+    data->series[id].references = 0;
+    data->freeIds.append(id);
+    data->full = false;
+}
+
+void MetricsRegistry::add(int id, qint64 value)
+{
+    if (id < 0)
+        return;
+
+    MetricCell &cell = currentCells()->cell(id);
+
+    // Single writer, no read-modify-write needed
+    cell.store(cell.load() + value);
+}
+
+qint64 MetricsRegistry::value(int id)
+{
+    if (id < 0)
+        return 0;
+
+    QMutexLocker locker(&metrics()->mutex);
+
+    MetricsData *data = metrics();
+    qint64 total = data->retired.value(id);
+    foreach (MetricsCells *cells, data->cells)
+        total += cells->value(id);
+
+    return total;
+}
+
+QByteArray MetricsRegistry::exportText()
+{
+    QVector<MetricSeries> series;
+    QVector<qint64> values;
+
+    {
+        QMutexLocker locker(&metrics()->mutex);
+
+        MetricsData *data = metrics();
+        series = data->series;
+        values = data->retired;
+        foreach (MetricsCells *cells, data->cells)
+            for (int id = 0; id < values.size(); id++)
+                values[id] += cells->value(id);
+    }
+
+    // Series of the same metric are grouped under one header
+    QHash<QString, QList<int> > byName;
+    QStringList names;
+    for (int id = 0; id < series.size(); id++)
+    {
+        // Released
+        if (series.at(id).references <= 0)
+            continue;
+
+        if (!byName.contains(series.at(id).name))
+            names.append(series.at(id).name);
+        byName[series.at(id).name].append(id);
+    }
+
+    QByteArray text;
+    foreach (const QString &name, names)
+    {
+        QList<int> ids = byName.value(name);
+
+        text.append("# HELP " + name.toUtf8() + ' ' + series.at(ids.first()).help.toUtf8() + '\n');
+        text.append("# TYPE " + name.toUtf8() + " counter\n");
+
+        foreach (int id, ids)
+        {
+            text.append(name.toUtf8());
+            if (!series.at(id).labels.isEmpty())
+                text.append('{' + series.at(id).labels.toUtf8() + '}');
+            text.append(' ' + QByteArray::number(values.at(id)) + '\n');
+        }
+    }
+
+    return text;
+}
+
+bool MetricsRegistry::exportToFile(const QString &fileName)
+{
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        qDebug() << "MetricsRegistry: can't open" << fileName;
+        return false;
+    }
+
+    file.write(exportText());
+    return file.commit();
+}
+
+/*
+ * Exporter
+ */
+
+MetricsExporter::MetricsExporter(QObject *parent) : QObject(parent)
+{
+    server = 0;
+    connect(&timer, SIGNAL(timeout()), this, SLOT(writeFile()));
+}
+
+MetricsExporter::~MetricsExporter()
+{
+    if (server)
+        server->close();
+}
+
+/**
+    Serves the metrics on a local socket.  Every client gets the current
+    metrics and the socket is closed.
+
+    @param socketName   Name or path of the socket.
+*/
+bool MetricsExporter::listen(const QString &socketName)
+{
+    if (!server)
+    {
+        server = new QLocalServer(this);
+        connect(server, SIGNAL(newConnection()), this, SLOT(newConnection()));
+    }
+
+    QLocalServer::removeServer(socketName);
+    if (!server->listen(socketName))
+    {
+        qDebug() << "MetricsExporter: can't listen on" << socketName << server->errorString();
+        return false;
+    }
+
+    return true;
+}
+
+/**
+    Periodically writes the metrics to a file.  An empty name stops it.
+
+    @param fileName     File to write.
+    @param interval     Milliseconds between writes.
+*/
+void MetricsExporter::setFile(const QString &fileName, int interval)
+{
+    this->fileName = fileName;
+
+    if (fileName.isEmpty())
+        timer.stop();
+    else
+    {
+        timer.start(interval);
+        writeFile();
+    }
+}
+
+void MetricsExporter::newConnection()
+{
+    while (server->hasPendingConnections())
+    {
+        QLocalSocket *socket = server->nextPendingConnection();
+        connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+
+        socket->write(MetricsRegistry::instance()->exportText());
+        socket->disconnectFromServer();
+    }
+}
+
+void MetricsExporter::writeFile()
+{
+    if (!fileName.isEmpty())
+        MetricsRegistry::instance()->exportToFile(fileName);
+}
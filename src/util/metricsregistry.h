@@ -0,0 +1,101 @@
+#ifndef METRICSREGISTRY_H
+#define METRICSREGISTRY_H
+
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+#include <QList>
+#include <QPair>
+#include <QTimer>
+#include <QAtomicInteger>
+
+class QLocalServer;
+
+// Label names and values of a series, e.g. (connection, 3), (type, iq)
+typedef QList<QPair<QString, QString> > MetricLabels;
+
+/**
+    @class      MetricsRegistry
+
+    @brief      Process wide registry of counters.
+
+                A counter series is a metric name plus a set of labels.  It is
+                registered once with counter(), which returns an id, and then
+                updated with add() from any thread.
+
+                Every thread adds into its own cells with a plain store, so
+                updates never contend or take a lock.  Reading a series sums the
+                cells of all the threads, plus the values left by the threads
+                that already finished.
+
+                Series are reference counted: every counter() call is paired
+                with a release(), and the id of a series released by all its
+                users is reused by the next new series.
+
+                exportText() formats all the series in the Prometheus text format.
+*/
+
+class MetricsRegistry
+{
+public:
+    static MetricsRegistry *instance();
+
+    // Registers a series, or returns the id of an already registered one
+    int counter(const QString &name, const QString &help,
+                const MetricLabels &labels = MetricLabels());
+
+    // Drops a reference to a series.  The last one unregisters it, no
+    // thread may add() to it anymore.
+    void release(int id);
+
+    // Adds to a series.  Safe from any thread, lock-free.
+    void add(int id, qint64 value = 1);
+
+    // Current value of a series
+    qint64 value(int id);
+
+    // Prometheus text format of all the series
+    QByteArray exportText();
+
+    // Writes exportText() to a file, replacing it atomically
+    bool exportToFile(const QString &fileName);
+
+private:
+    MetricsRegistry();
+};
+
+/**
+    @class      MetricsExporter
+
+    @brief      Publishes the metrics registry.
+
+                It can serve the Prometheus text to every client connecting to a
+                local (UNIX) socket, and periodically write it to a file that a
+                node exporter textfile collector can pick up.
+*/
+
+class MetricsExporter : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit MetricsExporter(QObject *parent = 0);
+    ~MetricsExporter();
+
+    // Serves the metrics on a local socket
+    bool listen(const QString &socketName);
+
+    // Writes the metrics to a file every interval milliseconds
+    void setFile(const QString &fileName, int interval = 15000);
+
+private slots:
+    void newConnection();
+    void writeFile();
+
+private:
+    QLocalServer *server;
+    QTimer timer;
+    QString fileName;
+};
+
+#endif // METRICSREGISTRY_H
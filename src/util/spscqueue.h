@@ -0,0 +1,113 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <QVector>
+#include <QSemaphore>
+#include <QAtomicInt>
+
+/**
+    @class      SpscQueue
+
+    @brief      Bounded single producer / single consumer ring buffer.
+
+                The producer blocks (or fails with tryPush()) while the queue is
+                full and the consumer blocks (or fails with tryPop()) while it is
+                empty.  Each index is only touched by one side; the semaphores
+                provide the ordering between them.
+
+                close() wakes up both sides and makes every further operation
+                fail, so stage threads can be torn down while blocked.
+*/
+
+template <typename T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(int capacity)
+        : buffer(capacity), freeSlots(capacity), usedSlots(0),
+          head(0), tail(0), closed(0)
+    {
+    }
+
+    // Blocks until there is room for the item.  Returns false if closed.
+    bool push(const T &item)
+    {
+        freeSlots.acquire();
+        if (closed.load())
+            return false;
+
+        enqueue(item);
+        return true;
+    }
+
+    // Returns false if the queue is full or closed
+    bool tryPush(const T &item)
+    {
+        if (closed.load() || !freeSlots.tryAcquire())
+            return false;
+
+        enqueue(item);
+        return true;
+    }
+
+    // Blocks until there is an item available.  Returns false if closed.
+    bool pop(T &item)
+    {
+        usedSlots.acquire();
+        if (closed.load())
+            return false;
+
+        dequeue(item);
+        return true;
+    }
+
+    // Returns false if the queue is empty or closed
+    bool tryPop(T &item)
+    {
+        if (closed.load() || !usedSlots.tryAcquire())
+            return false;
+
+        dequeue(item);
+        return true;
+    }
+
+    // Wakes up any blocked producer or consumer and disables the queue
+    void close()
+    {
+        if (closed.testAndSetOrdered(0, 1))
+        {
+            freeSlots.release(buffer.size());
+            usedSlots.release(buffer.size());
+        }
+    }
+
+    int capacity() const
+    {
+        return buffer.size();
+    }
+
+private:
+    QVector<T> buffer;
+    QSemaphore freeSlots;
+    QSemaphore usedSlots;
+    int head;
+    int tail;
+    QAtomicInt closed;
+
+    void enqueue(const T &item)
+    {
+        buffer[tail] = item;
+        tail = (tail + 1) % buffer.size();
+        usedSlots.release();
+    }
+
+    void dequeue(T &item)
+    {
+        item = buffer[head];
+        buffer[head] = T();
+        head = (head + 1) % buffer.size();
+        freeSlots.release();
+    }
+};
+
+#endif // SPSCQUEUE_H
@@ -0,0 +1,173 @@
+#include <QStringList>
+
+#include <time.h>
+
+#include "metricsregistry.h"
+#include "stageaccounting.h"
+
+static const char *stageNames[StageAccounting::TotalStages] = {
+    "read", "decrypt", "decode", "dispatch", "emit", "encode", "encrypt", "write"
+};
+
+// Innermost running timer of each thread
+static thread_local StageTimer *currentTimer = 0;
+
+static inline qint64 readClock(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+
+    return (qint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * StageAccounting
+ */
+
+/**
+    Creates the accounting of a connection.  Its metrics series are
+    registered here, once, so add() never sees them change.
+
+    @param connection   Value of the connection label, usually the user.
+                        Empty for no metrics.
+*/
+StageAccounting::StageAccounting(const QString &connection)
+{
+    MetricsRegistry *registry = MetricsRegistry::instance();
+
+    for (int i = 0; i < TotalStages; i++)
+    {
+        cpuMetrics[i] = -1;
+        wallMetrics[i] = -1;
+
+        if (connection.isEmpty())
+            continue;
+
+        MetricLabels labels;
+        labels.append(qMakePair(QString("connection"), connection));
+        labels.append(qMakePair(QString("stage"), QString(stageNames[i])));
+
+        cpuMetrics[i] = registry->counter("libqtwa_stage_cpu_nanoseconds_total",
+                                          "Thread CPU time spent in each stage", labels);
+        wallMetrics[i] = registry->counter("libqtwa_stage_wall_nanoseconds_total",
+                                           "Wall time spent in each stage", labels);
+    }
+}
+
+/*
+ * No stage may be running anymore
+ */
+StageAccounting::~StageAccounting()
+{
+    MetricsRegistry *registry = MetricsRegistry::instance();
+
+    for (int i = 0; i < TotalStages; i++)
+    {
+        registry->release(cpuMetrics[i]);
+        registry->release(wallMetrics[i]);
+    }
+}
+
+void StageAccounting::setMetricsEnabled(bool enabled)
+{
+    metricsEnabled.storeRelease(enabled ? 1 : 0);
+}
+
+void StageAccounting::add(Stage stage, qint64 cpuNs, qint64 wallNs)
+{
+    cpu[stage].fetchAndAddRelaxed(cpuNs);
+    wall[stage].fetchAndAddRelaxed(wallNs);
+    calls[stage].fetchAndAddRelaxed(1);
+
+    if (metricsEnabled.loadAcquire() && cpuMetrics[stage] >= 0)
+    {
+        MetricsRegistry *registry = MetricsRegistry::instance();
+        registry->add(cpuMetrics[stage], cpuNs);
+        registry->add(wallMetrics[stage], wallNs);
+    }
+}
+
+qint64 StageAccounting::getCpuTime(Stage stage) const
+{
+    return cpu[stage].load();
+}
+
+qint64 StageAccounting::getWallTime(Stage stage) const
+{
+    return wall[stage].load();
+}
+
+qint64 StageAccounting::getCalls(Stage stage) const
+{
+    return calls[stage].load();
+}
+
+const char *StageAccounting::stageName(Stage stage)
+{
+    return stageNames[stage];
+}
+
+QString StageAccounting::toString() const
+{
+    QStringList lines;
+
+    for (int i = 0; i < TotalStages; i++)
+    {
+        lines.append(QString("%1 calls=%2 cpu=%3us wall=%4us")
+                     .arg(stageNames[i])
+                     .arg(calls[i].load())
+                     .arg(cpu[i].load() / 1000)
+                     .arg(wall[i].load() / 1000));
+    }
+
+    return lines.join("\n");
+}
+
+/*
+ * StageTimer
+ */
+
+StageTimer::StageTimer(StageAccounting *accounting, StageAccounting::Stage stage)
+{
+    this->accounting = accounting;
+    this->stage = stage;
+
+    if (!accounting)
+        return;
+
+    parent = currentTimer;
+    currentTimer = this;
+
+    childCpu = 0;
+    childWall = 0;
+    cpuStart = threadCpuTime();
+    wallStart = wallTime();
+}
+
+StageTimer::~StageTimer()
+{
+    if (!accounting)
+        return;
+
+    qint64 cpu = threadCpuTime() - cpuStart;
+    qint64 wall = wallTime() - wallStart;
+
+    accounting->add(stage, cpu - childCpu, wall - childWall);
+
+    currentTimer = parent;
+    if (parent)
+    {
+        parent->childCpu += cpu;
+        parent->childWall += wall;
+    }
+}
+
+qint64 StageTimer::threadCpuTime()
+{
+    return readClock(CLOCK_THREAD_CPUTIME_ID);
+}
+
+qint64 StageTimer::wallTime()
+{
+    return readClock(CLOCK_MONOTONIC);
+}
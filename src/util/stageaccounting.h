@@ -0,0 +1,101 @@
+#ifndef STAGEACCOUNTING_H
+#define STAGEACCOUNTING_H
+
+#include <QtGlobal>
+#include <QString>
+#include <QAtomicInteger>
+
+/**
+    @class      StageAccounting
+
+    @brief      Cumulative thread CPU time and wall time per processing stage.
+
+                Times are exclusive: a stage running inside another one (like
+                the receipt encoded and written while a message is dispatched)
+                is only charged to the inner stage.
+
+                With a connection name the totals are also exported as
+                MetricsRegistry counters, while the metrics are enabled.
+*/
+
+class StageAccounting
+{
+public:
+    enum Stage {
+        Read = 0,       // socket reads
+        Decrypt,        // KeyStream verify and decrypt
+        Decode,         // tree decoding
+        Dispatch,       // Connection::processNode
+        Emit,           // signals to the application
+        Encode,         // tree encoding
+        Encrypt,        // KeyStream encrypt and MAC
+        Write,          // socket writes
+        TotalStages
+    };
+
+    // The metrics are labeled with the connection
+    explicit StageAccounting(const QString &connection = QString());
+    ~StageAccounting();
+
+    // Also export the totals as metrics, safe while stages run
+    void setMetricsEnabled(bool enabled);
+
+    void add(Stage stage, qint64 cpuNs, qint64 wallNs);
+
+    // Totals in nanoseconds, and number of times the stage ran
+    qint64 getCpuTime(Stage stage) const;
+    qint64 getWallTime(Stage stage) const;
+    qint64 getCalls(Stage stage) const;
+
+    static const char *stageName(Stage stage);
+
+    // One line per stage: name, calls, cpu and wall time in us
+    QString toString() const;
+
+private:
+    QAtomicInteger<qint64> cpu[TotalStages];
+    QAtomicInteger<qint64> wall[TotalStages];
+    QAtomicInteger<qint64> calls[TotalStages];
+
+    // Registered once, never change
+    int cpuMetrics[TotalStages];
+    int wallMetrics[TotalStages];
+    QAtomicInt metricsEnabled;
+
+    Q_DISABLE_COPY(StageAccounting)
+};
+
+/**
+    @class      StageTimer
+
+    @brief      Charges the time of its scope to a stage.
+
+                With a null StageAccounting it does nothing, not even read the
+                clocks.
+*/
+
+class StageTimer
+{
+public:
+    StageTimer(StageAccounting *accounting, StageAccounting::Stage stage);
+    ~StageTimer();
+
+    // Clocks in nanoseconds
+    static qint64 threadCpuTime();
+    static qint64 wallTime();
+
+private:
+    StageAccounting *accounting;
+    StageAccounting::Stage stage;
+    StageTimer *parent;
+    qint64 cpuStart;
+    qint64 wallStart;
+
+    // Time of the nested timers, not charged to this stage
+    qint64 childCpu;
+    qint64 childWall;
+
+    Q_DISABLE_COPY(StageTimer)
+};
+
+#endif // STAGEACCOUNTING_H
@@ -0,0 +1,65 @@
+#include "tokenbucket.h"
+
+TokenBucket::TokenBucket()
+{
+    rate = 0;
+    burst = 0;
+    tokens = 0;
+    clock.start();
+}
+
+void TokenBucket::setRate(qint64 rate)
+{
+    this->rate = rate;
+    burst = rate;
+    tokens = burst;
+    clock.restart();
+}
+
+qint64 TokenBucket::getRate() const
+{
+    return rate;
+}
+
+void TokenBucket::setBurst(qint64 burst)
+{
+    // A larger burst starts full, a smaller one keeps what fits
+    tokens = (burst > this->burst) ? burst : qMin(tokens, (double) burst);
+    this->burst = burst;
+}
+
+void TokenBucket::refill()
+{
+    qint64 elapsed = clock.nsecsElapsed();
+    clock.restart();
+
+    tokens = qMin((double) burst, tokens + (double) rate * elapsed / 1000000000.0);
+}
+
+qint64 TokenBucket::take(qint64 count)
+{
+    if (rate <= 0)
+        return count;
+
+    refill();
+
+    qint64 taken = qMin(count, (qint64) tokens);
+    tokens -= taken;
+
+    return taken;
+}
+
+int TokenBucket::delay(qint64 count)
+{
+    if (rate <= 0)
+        return 0;
+
+    refill();
+
+    // Never more than the burst can be waited for
+    double missing = qMin((double) count, (double) qMax(burst, (qint64) 1)) - tokens;
+    if (missing <= 0)
+        return 0;
+
+    return (int) (missing * 1000 / rate) + 1;
+}
@@ -0,0 +1,44 @@
+#ifndef TOKENBUCKET_H
+#define TOKENBUCKET_H
+
+#include <QtGlobal>
+#include <QElapsedTimer>
+
+/**
+    @class      TokenBucket
+
+    @brief      Rate limiter: tokens (bytes) are added at a fixed rate up to
+                a burst size, and a transfer takes them before moving data.
+
+                A rate of 0 means unlimited, take() then always gives all.
+*/
+
+class TokenBucket
+{
+public:
+    TokenBucket();
+
+    // Tokens per second, 0 is unlimited.  The bucket starts full.
+    void setRate(qint64 rate);
+    qint64 getRate() const;
+
+    // Most tokens kept, by default one second of rate.  Raising it fills
+    // the bucket.
+    void setBurst(qint64 burst);
+
+    // Takes up to count tokens, returns how many were taken
+    qint64 take(qint64 count);
+
+    // Milliseconds until count tokens are available
+    int delay(qint64 count);
+
+private:
+    qint64 rate;
+    qint64 burst;
+    double tokens;
+    QElapsedTimer clock;
+
+    void refill();
+};
+
+#endif // TOKENBUCKET_H
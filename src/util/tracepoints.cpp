@@ -0,0 +1,14 @@
+#include "tracepoints.h"
+
+#ifdef LIBQTWA_USDT
+
+// Tracers increment these when they attach to the probe
+#define WA_DEFINE_PROBE_SEMAPHORE(name) \
+    extern "C" { \
+        volatile unsigned short libqtwa_##name##_semaphore \
+            __attribute__((unused)) __attribute__((section(".probes"))) = 0; \
+    }
+
+WA_PROBES(WA_DEFINE_PROBE_SEMAPHORE)
+
+#endif // LIBQTWA_USDT
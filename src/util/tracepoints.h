@@ -0,0 +1,72 @@
+#ifndef TRACEPOINTS_H
+#define TRACEPOINTS_H
+
+/*
+ * USDT static tracepoints for bpftrace, perf and SystemTap.
+ *
+ * They are only compiled in when building with CONFIG += usdt, which
+ * defines LIBQTWA_USDT and needs <sys/sdt.h> (systemtap-sdt-dev).  Each
+ * probe is then a nop until a tracer attaches to it, and the arguments
+ * that cost something to compute are guarded by WA_PROBE_ENABLED().
+ * Without LIBQTWA_USDT the macros expand to nothing.
+ *
+ *   bpftrace -e 'usdt:./liblibqtwa.so:libqtwa:frame_received { @[arg1] = hist(arg0); }'
+ *
+ * Probes of the "libqtwa" provider:
+ *
+ *   frame_received(int size, int flags)      BinTreeNodeReader, before decryption
+ *   decrypt_failed(int size)                 frame too short or failed MAC
+ *   mac_failed(int seq)                      KeyStream MAC mismatch
+ *   stanza_decoded(char *tag, int size)      BinTreeNodeReader::decodeTree
+ *   dispatch_start(char *tag)                Connection::processNode
+ *   dispatch_end(char *tag)
+ *   frame_written(int size, int encrypted)   frame handed to the socket
+ *   login_phase(int phase)                   Connection::login, WaLoginPhase
+ */
+
+// Phases reported by the login_phase probe
+enum WaLoginPhase {
+    WA_LOGIN_STREAM_START = 1,
+    WA_LOGIN_AUTH_SENT,
+    WA_LOGIN_CHALLENGE,
+    WA_LOGIN_RESPONSE_SENT,
+    WA_LOGIN_SUCCESS,
+    WA_LOGIN_FAILED
+};
+
+#define WA_PROBES(PROBE) \
+    PROBE(frame_received) \
+    PROBE(decrypt_failed) \
+    PROBE(mac_failed) \
+    PROBE(stanza_decoded) \
+    PROBE(dispatch_start) \
+    PROBE(dispatch_end) \
+    PROBE(frame_written) \
+    PROBE(login_phase)
+
+#ifdef LIBQTWA_USDT
+
+// Semaphores let the probes tell whether a tracer is attached
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define WA_DECLARE_PROBE_SEMAPHORE(name) \
+    extern "C" volatile unsigned short libqtwa_##name##_semaphore;
+
+WA_PROBES(WA_DECLARE_PROBE_SEMAPHORE)
+
+#define WA_PROBE_ENABLED(name)          __builtin_expect(libqtwa_##name##_semaphore != 0, 0)
+
+#define WA_PROBE1(name, a)              DTRACE_PROBE1(libqtwa, name, a)
+#define WA_PROBE2(name, a, b)           DTRACE_PROBE2(libqtwa, name, a, b)
+
+#else
+
+#define WA_PROBE_ENABLED(name)          false
+
+#define WA_PROBE1(name, a)              do {} while (0)
+#define WA_PROBE2(name, a, b)           do {} while (0)
+
+#endif // LIBQTWA_USDT
+
+#endif // TRACEPOINTS_H
@@ -38,6 +38,7 @@
 
 #include <QRegExp>
 #include <QStringList>
+#include <QDateTime>
 #include <QDir>
 #include <QStandardPaths>
 
@@ -196,3 +197,42 @@ QString Utilities::getSaveNameFor(const QString &media, int media_wa_type, bool
 
     return file.fileName();
 }
+
+/**
+    Removes the files of a cache directory that were not modified for a
+    while, and then the oldest ones until it fits in a size.  Caches that
+    touch their files when they are used get LRU pruning.
+
+    @param dir          Cache directory, subdirectories are left alone.
+    @param maxAge       Seconds a file is kept, 0 for no limit.
+    @param maxBytes     Size of the directory, 0 for no limit.
+*/
+void Utilities::pruneCacheDir(const QString &dir, qint64 maxAge, qint64 maxBytes)
+{
+    // Oldest first
+    QFileInfoList files = QDir(dir).entryInfoList(QDir::Files | QDir::NoDotAndDotDot,
+                                                  QDir::Time | QDir::Reversed);
+
+    QDateTime now = QDateTime::currentDateTime();
+    qint64 total = 0;
+    foreach (const QFileInfo &info, files)
+        total += info.size();
+
+    int removed = 0;
+    foreach (const QFileInfo &info, files)
+    {
+        bool expired = maxAge > 0 && info.lastModified().secsTo(now) >= maxAge;
+        bool over = maxBytes > 0 && total > maxBytes;
+        if (!expired && !over)
+            break;
+
+        if (QFile::remove(info.filePath()))
+        {
+            total -= info.size();
+            removed++;
+        }
+    }
+
+    if (removed > 0)
+        qDebug() << "Utilities: pruned" << removed << "files from" << dir;
+}
@@ -47,6 +47,7 @@ public:
     static QString getExtension(const QString &filename);
     static QString getPathFor(int media_wa_type, bool gallery);
     static QString getSaveNameFor(const QString &media, int media_wa_type, bool gallery);
+    static void pruneCacheDir(const QString &dir, qint64 maxAge, qint64 maxBytes);
 };
 
 #endif // UTILITIES_H
@@ -0,0 +1,63 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QHostAddress>
+#include <QDateTime>
+#include <QDebug>
+
+#include "waserver.h"
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    app.setApplicationName("waserver");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Local stand-in for the WhatsApp servers, for load tests.");
+    parser.addHelpOption();
+
+    QCommandLineOption portOption("port", "Port to listen on.", "port", "5222");
+    QCommandLineOption passwordOption("password", "Account password (base64) all users log in with.",
+                                      "password", "AAAAAAAAAAAAAAAAAAAAAAAAAAA=");
+    QCommandLineOption messagesOption("messages", "Messages per second sent to each session.", "rate", "0");
+    QCommandLineOption receiptsOption("receipts", "Receipts per second for the messages a session sends "
+                                      "(0 sends them right away).", "rate", "0");
+    QCommandLineOption presencesOption("presences", "Presence updates per second sent to each session.", "rate", "0");
+    QCommandLineOption iqsOption("iqs", "Pings per second sent to each session.", "rate", "0");
+    QCommandLineOption offlineOption("offline", "Offline messages sent right after each login.", "count", "0");
+    QCommandLineOption contactsOption("contacts", "Number of different senders.", "count", "100");
+    QCommandLineOption bodyOption("body-size", "Message body size in bytes.", "bytes", "32");
+    QCommandLineOption statsOption("stats", "Print statistics every this many seconds.", "seconds", "5");
+
+    parser.addOption(portOption);
+    parser.addOption(passwordOption);
+    parser.addOption(messagesOption);
+    parser.addOption(receiptsOption);
+    parser.addOption(presencesOption);
+    parser.addOption(iqsOption);
+    parser.addOption(offlineOption);
+    parser.addOption(contactsOption);
+    parser.addOption(bodyOption);
+    parser.addOption(statsOption);
+    parser.process(app);
+
+    TrafficProfile profile;
+    profile.messagesPerSecond = parser.value(messagesOption).toDouble();
+    profile.receiptsPerSecond = parser.value(receiptsOption).toDouble();
+    profile.presencesPerSecond = parser.value(presencesOption).toDouble();
+    profile.iqsPerSecond = parser.value(iqsOption).toDouble();
+    profile.offlineBurst = parser.value(offlineOption).toInt();
+    profile.contacts = parser.value(contactsOption).toInt();
+    profile.bodySize = parser.value(bodyOption).toInt();
+
+    qsrand(QDateTime::currentMSecsSinceEpoch());
+
+    QByteArray password = QByteArray::fromBase64(parser.value(passwordOption).toLatin1());
+
+    WAServer server(password, profile);
+    if (!server.listen(QHostAddress::LocalHost, parser.value(portOption).toUShort()))
+        return 1;
+
+    server.setStatsInterval(parser.value(statsOption).toInt());
+
+    return app.exec();
+}
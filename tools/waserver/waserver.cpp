@@ -0,0 +1,102 @@
+#include <QTcpSocket>
+#include <QDebug>
+
+#include "waserversession.h"
+#include "waserver.h"
+
+WAServer::WAServer(const QByteArray &password, const TrafficProfile &profile,
+                   QObject *parent) : QObject(parent)
+{
+    this->serverPassword = password;
+    this->trafficProfile = profile;
+    this->sessions = 0;
+    this->logins = 0;
+    this->stanzasIn = 0;
+    this->stanzasOut = 0;
+    this->bytesIn = 0;
+    this->bytesOut = 0;
+
+    connect(&tcpServer, SIGNAL(newConnection()), this, SLOT(newConnection()));
+    connect(&statsTimer, SIGNAL(timeout()), this, SLOT(printStats()));
+}
+
+bool WAServer::listen(const QHostAddress &address, quint16 port)
+{
+    if (!tcpServer.listen(address, port))
+    {
+        qDebug() << "Can't listen on port" << port << tcpServer.errorString();
+        return false;
+    }
+
+    qDebug() << "Listening on" << tcpServer.serverAddress().toString()
+             << tcpServer.serverPort();
+    return true;
+}
+
+void WAServer::setStatsInterval(int seconds)
+{
+    if (seconds > 0)
+        statsTimer.start(seconds * 1000);
+    else
+        statsTimer.stop();
+}
+
+const TrafficProfile &WAServer::profile() const
+{
+    return trafficProfile;
+}
+
+QByteArray WAServer::password() const
+{
+    return serverPassword;
+}
+
+QByteArray WAServer::nextChallenge(const QString &user) const
+{
+    return challenges.value(user);
+}
+
+void WAServer::setNextChallenge(const QString &user, const QByteArray &challenge)
+{
+    challenges.insert(user, challenge);
+}
+
+void WAServer::countInbound(int bytes)
+{
+    stanzasIn++;
+    bytesIn += bytes;
+}
+
+void WAServer::countOutbound(int bytes)
+{
+    stanzasOut++;
+    bytesOut += bytes;
+}
+
+void WAServer::sessionAuthenticated()
+{
+    logins++;
+}
+
+void WAServer::newConnection()
+{
+    while (tcpServer.hasPendingConnections())
+    {
+        QTcpSocket *socket = tcpServer.nextPendingConnection();
+        WAServerSession *session = new WAServerSession(socket, this);
+        connect(session, SIGNAL(destroyed()), this, SLOT(sessionClosed()));
+        sessions++;
+    }
+}
+
+void WAServer::sessionClosed()
+{
+    sessions--;
+}
+
+void WAServer::printStats()
+{
+    qDebug() << "sessions:" << sessions << "logins:" << logins
+             << "stanzas in:" << stanzasIn << "out:" << stanzasOut
+             << "bytes in:" << bytesIn << "out:" << bytesOut;
+}
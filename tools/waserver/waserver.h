@@ -0,0 +1,97 @@
+#ifndef WASERVER_H
+#define WASERVER_H
+
+#include <QObject>
+#include <QTcpServer>
+#include <QHash>
+#include <QTimer>
+
+#define SERVER_DOMAIN   "s.whatsapp.net"
+
+/**
+    Scripted traffic sent to every authenticated session.
+    Rates are per second; 0 disables that kind of traffic.
+*/
+struct TrafficProfile
+{
+    TrafficProfile() : messagesPerSecond(0), receiptsPerSecond(0),
+        presencesPerSecond(0), iqsPerSecond(0), offlineBurst(0),
+        contacts(100), bodySize(32) {}
+
+    double messagesPerSecond;
+
+    // Receipts for the messages the client sends.  0 sends them right away.
+    double receiptsPerSecond;
+
+    double presencesPerSecond;
+
+    // Server pings the client has to answer
+    double iqsPerSecond;
+
+    // Offline messages sent right after the login
+    int offlineBurst;
+
+    // Number of different senders
+    int contacts;
+
+    // Message body size in bytes
+    int bodySize;
+};
+
+/**
+    @class      WAServer
+
+    @brief      Local server speaking the stream protocol Connection expects.
+
+                It accepts any user that authenticates with the configured
+                password (WAUTH-2 challenge/response, or the next challenge of
+                a previous login on this server) and then plays the scripted
+                traffic of a TrafficProfile to each session.
+*/
+
+class WAServer : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit WAServer(const QByteArray &password, const TrafficProfile &profile,
+                      QObject *parent = 0);
+
+    bool listen(const QHostAddress &address, quint16 port);
+
+    // Print statistics every interval seconds (0 disables them)
+    void setStatsInterval(int seconds);
+
+    const TrafficProfile &profile() const;
+    QByteArray password() const;
+
+    // Next challenge handed to a user on its last login
+    QByteArray nextChallenge(const QString &user) const;
+    void setNextChallenge(const QString &user, const QByteArray &challenge);
+
+    // Statistics
+    void countInbound(int bytes);
+    void countOutbound(int bytes);
+    void sessionAuthenticated();
+
+private slots:
+    void newConnection();
+    void sessionClosed();
+    void printStats();
+
+private:
+    QTcpServer tcpServer;
+    QByteArray serverPassword;
+    TrafficProfile trafficProfile;
+    QHash<QString, QByteArray> challenges;
+    QTimer statsTimer;
+
+    int sessions;
+    qint64 logins;
+    qint64 stanzasIn;
+    qint64 stanzasOut;
+    qint64 bytesIn;
+    qint64 bytesOut;
+};
+
+#endif // WASERVER_H
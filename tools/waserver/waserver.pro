@@ -0,0 +1,32 @@
+# Local stand-in for the WhatsApp servers, for end to end load tests.
+# Links against the library built two directories up, or in the one
+# given to qmake for a shadow build:
+#
+#   qmake LIBQTWA_LIBDIR=/path/to/libqtwa-build
+
+TEMPLATE = app
+TARGET = waserver
+
+QT += network
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+INCLUDEPATH += $$PWD/../../src
+
+isEmpty(LIBQTWA_LIBDIR): LIBQTWA_LIBDIR = $$OUT_PWD/../..
+
+!exists($$LIBQTWA_LIBDIR/liblibqtwa.*) {
+    warning("libqtwa not found in $$LIBQTWA_LIBDIR, build it first or set LIBQTWA_LIBDIR")
+}
+
+LIBS += -L$$LIBQTWA_LIBDIR -llibqtwa
+QMAKE_RPATHDIR += $$LIBQTWA_LIBDIR
+
+SOURCES += \
+    main.cpp \
+    waserver.cpp \
+    waserversession.cpp
+
+HEADERS += \
+    waserver.h \
+    waserversession.h
@@ -0,0 +1,458 @@
+#include <QDateTime>
+#include <QDebug>
+
+#include "protocoldictionary.h"
+#include "protocoltreenodelistiterator.h"
+#include "waserver.h"
+#include "waserversession.h"
+
+// Traffic is generated in slices of this many milliseconds
+#define TRAFFIC_TICK            10
+
+// Traffic generation pauses while the client has this much to read
+#define MAX_PENDING_BYTES       (1024 * 1024)
+
+#define CHALLENGE_SIZE          20
+
+WAServerSession::WAServerSession(QTcpSocket *socket, WAServer *server) :
+    QObject(server)
+{
+    this->server = server;
+    this->socket = socket;
+    this->inputKey = 0;
+    this->outputKey = 0;
+    this->state = WaitingHeader;
+    this->messagesSent = 0;
+    this->receiptsSent = 0;
+    this->presencesSent = 0;
+    this->iqsSent = 0;
+    this->nextId = 0;
+
+    socket->setParent(this);
+
+    dictionary = ProtocolDictionary::tokens();
+    in = new BinTreeNodeReader(socket, dictionary, this);
+    out = new BinTreeNodeWriter(socket, dictionary, this);
+
+    connect(in, SIGNAL(socketBroken()), this, SLOT(close()));
+    connect(out, SIGNAL(socketBroken()), this, SLOT(close()));
+    connect(socket, SIGNAL(readyRead()), this, SLOT(readData()));
+    connect(socket, SIGNAL(disconnected()), this, SLOT(close()));
+    connect(&trafficTimer, SIGNAL(timeout()), this, SLOT(generateTraffic()));
+
+    readData();
+}
+
+void WAServerSession::readData()
+{
+    if (state == WaitingHeader)
+    {
+        if (socket->bytesAvailable() < 4)
+            return;
+
+        QByteArray header = socket->read(4);
+        if (!header.startsWith("WA"))
+        {
+            qDebug() << "Invalid stream header" << header.toHex();
+            close();
+            return;
+        }
+
+        state = WaitingStreamStart;
+    }
+
+    QByteArray frame;
+    qint8 flags;
+
+    while (in->nextFrame(frame, flags))
+    {
+        int size = frame.size() + 3;
+        server->countInbound(size);
+
+        if (state == WaitingStreamStart)
+        {
+            // Its contents don't matter
+            out->streamStartReply(SERVER_DOMAIN);
+            state = WaitingAuth;
+            continue;
+        }
+
+        if (!in->decryptFrame(flags, frame))
+        {
+            qDebug() << "Invalid frame from" << user;
+            close();
+            return;
+        }
+
+        ProtocolTreeNode node;
+        node.setSize(size);
+        if (in->decodeTree(frame, node))
+            handleNode(node);
+    }
+}
+
+void WAServerSession::handleNode(ProtocolTreeNode &node)
+{
+    switch (state)
+    {
+        case WaitingAuth:
+            if (node.getTag() == "auth")
+                handleAuth(node);
+            break;
+
+        case WaitingResponse:
+            if (node.getTag() == "response")
+                handleResponse(node);
+            break;
+
+        case Authenticated:
+            handleStanza(node);
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*
+ * Authentication
+ */
+
+void WAServerSession::handleAuth(ProtocolTreeNode &node)
+{
+    user = node.getAttributeValue("user");
+
+    // Reconnection with the challenge of the previous login
+    if (node.getData().size() > 0)
+    {
+        QByteArray nonce = server->nextChallenge(user);
+        if (nonce.isEmpty() || !verifyAuthBlob(node.getData(), nonce))
+            sendFailure();
+        else
+            sendSuccess();
+        return;
+    }
+
+    sendChallenge();
+}
+
+void WAServerSession::handleResponse(ProtocolTreeNode &node)
+{
+    if (verifyAuthBlob(node.getData(), challenge))
+        sendSuccess();
+    else
+        sendFailure();
+}
+
+/**
+    Verifies a WAUTH-2 authentication blob and sets up the session keys.
+
+    The client encrypts the blob with its output key and puts the MAC
+    in front of it instead of at the end.
+
+    @param blob     Authentication blob sent by the client.
+    @param nonce    Challenge it was built with.
+    @return         true if the MAC matches and the blob is for this user.
+*/
+bool WAServerSession::verifyAuthBlob(const QByteArray &blob, const QByteArray &nonce)
+{
+    if (blob.size() < 8)
+        return false;
+
+    QByteArray password = server->password();
+    QByteArray salt = nonce;
+    QList<QByteArray> keys = KeyStream::keyFromPasswordAndNonce(password, salt);
+
+    KeyStream *clientKey = new KeyStream(keys.at(0), keys.at(1), this);
+
+    QByteArray buffer = blob.mid(4) + blob.left(4);
+    if (!clientKey->decodeMessage(buffer, 0, 0, buffer.size() - 4) ||
+        !buffer.startsWith(user.toUtf8() + nonce))
+    {
+        qDebug() << "Authentication failed for" << user;
+        delete clientKey;
+        return false;
+    }
+
+    delete inputKey;
+    delete outputKey;
+    inputKey = clientKey;
+    outputKey = new KeyStream(keys.at(2), keys.at(3), this);
+
+    in->setInputKey(inputKey);
+    out->setOutputKey(outputKey);
+
+    return true;
+}
+
+QByteArray WAServerSession::makeChallenge()
+{
+    QByteArray nonce(CHALLENGE_SIZE, 0);
+    for (int i = 0; i < CHALLENGE_SIZE; i++)
+        nonce[i] = (char) (qrand() & 0xff);
+    return nonce;
+}
+
+void WAServerSession::sendChallenge()
+{
+    challenge = makeChallenge();
+
+    ProtocolTreeNode features("stream:features");
+    write(features);
+
+    ProtocolTreeNode node("challenge", challenge);
+    write(node);
+
+    state = WaitingResponse;
+}
+
+void WAServerSession::sendSuccess()
+{
+    uint now = QDateTime::currentDateTime().toTime_t();
+    QByteArray next = makeChallenge();
+    server->setNextChallenge(user, next);
+
+    AttributeList attrs;
+    attrs.insert("status", "active");
+    attrs.insert("kind", "free");
+    attrs.insert("creation", QString::number(now - 86400 * 365));
+    attrs.insert("expiration", QString::number(now + 86400 * 365));
+    attrs.insert("t", QString::number(now));
+
+    ProtocolTreeNode node("success", next);
+    node.setAttributes(attrs);
+
+    out->setCrypto(true);
+    write(node);
+
+    state = Authenticated;
+    server->sessionAuthenticated();
+
+    sendOfflineBurst();
+
+    trafficClock.start();
+    trafficTimer.start(TRAFFIC_TICK);
+}
+
+void WAServerSession::sendFailure()
+{
+    ProtocolTreeNode node("failure");
+    node.addChild(ProtocolTreeNode("not-authorized"));
+    write(node);
+
+    socket->disconnectFromHost();
+}
+
+/*
+ * Client stanzas
+ */
+
+void WAServerSession::handleStanza(ProtocolTreeNode &node)
+{
+    QString tag = node.getTag();
+    QString id = node.getAttributeValue("id");
+    QString now = QString::number(QDateTime::currentDateTime().toTime_t());
+
+    if (tag == "message")
+    {
+        QString to = node.getAttributeValue("to");
+        bool chat = false;
+
+        ProtocolTreeNodeListIterator i(node.getChildren());
+        while (i.hasNext())
+        {
+            QString child = i.next().value().getTag();
+            if (child == "body" || child == "media")
+                chat = true;
+        }
+
+        if (!chat)
+            return;
+
+        AttributeList attrs;
+        attrs.insert("class", "message");
+        attrs.insert("from", to);
+        attrs.insert("id", id);
+        attrs.insert("t", now);
+
+        ProtocolTreeNode ack("ack");
+        ack.setAttributes(attrs);
+        write(ack);
+
+        if (server->profile().receiptsPerSecond > 0)
+            pendingReceipts.enqueue(qMakePair(to, id));
+        else
+            sendReceipt(to, id);
+    }
+    else if (tag == "receipt")
+    {
+        AttributeList attrs;
+        attrs.insert("class", "receipt");
+        attrs.insert("id", id);
+        if (!node.getAttributeValue("type").isEmpty())
+            attrs.insert("type", node.getAttributeValue("type"));
+
+        ProtocolTreeNode ack("ack");
+        ack.setAttributes(attrs);
+        write(ack);
+    }
+    else if (tag == "iq")
+    {
+        if (node.getAttributeValue("type") == "result")
+            return;
+
+        AttributeList attrs;
+        attrs.insert("from", SERVER_DOMAIN);
+        attrs.insert("id", id);
+        attrs.insert("type", "result");
+
+        ProtocolTreeNode result("iq");
+        result.setAttributes(attrs);
+        write(result);
+    }
+}
+
+/*
+ * Scripted traffic
+ */
+
+void WAServerSession::generateTraffic()
+{
+    // Let a slow client catch up instead of buffering without limit
+    if (socket->bytesToWrite() > MAX_PENDING_BYTES)
+        return;
+
+    const TrafficProfile &profile = server->profile();
+    double seconds = trafficClock.elapsed() / 1000.0;
+
+    while (messagesSent < profile.messagesPerSecond * seconds)
+    {
+        sendMessage(false);
+        messagesSent++;
+    }
+
+    while (!pendingReceipts.isEmpty() && receiptsSent < profile.receiptsPerSecond * seconds)
+    {
+        QPair<QString, QString> receipt = pendingReceipts.dequeue();
+        sendReceipt(receipt.first, receipt.second);
+    }
+
+    while (presencesSent < profile.presencesPerSecond * seconds)
+    {
+        sendPresence();
+        presencesSent++;
+    }
+
+    while (iqsSent < profile.iqsPerSecond * seconds)
+    {
+        sendPing();
+        iqsSent++;
+    }
+}
+
+void WAServerSession::sendOfflineBurst()
+{
+    int count = server->profile().offlineBurst;
+    if (count <= 0)
+        return;
+
+    for (int i = 0; i < count; i++)
+        sendMessage(true);
+
+    AttributeList attrs;
+    attrs.insert("count", QString::number(count));
+
+    ProtocolTreeNode offline("offline");
+    offline.setAttributes(attrs);
+
+    ProtocolTreeNode node("ib");
+    node.addChild(offline);
+    write(node);
+}
+
+void WAServerSession::sendMessage(bool offline)
+{
+    const TrafficProfile &profile = server->profile();
+    QString from = contactJid();
+
+    AttributeList attrs;
+    attrs.insert("from", from);
+    attrs.insert("id", makeId("msg_"));
+    attrs.insert("type", "text");
+    attrs.insert("t", QString::number(QDateTime::currentDateTime().toTime_t()));
+    attrs.insert("notify", from.left(from.indexOf('@')));
+    if (offline)
+        attrs.insert("offline", "1");
+
+    ProtocolTreeNode body("body", QByteArray(profile.bodySize, 'x'));
+
+    ProtocolTreeNode node("message");
+    node.setAttributes(attrs);
+    node.addChild(body);
+    write(node);
+}
+
+void WAServerSession::sendReceipt(const QString &from, const QString &id)
+{
+    AttributeList attrs;
+    attrs.insert("from", from);
+    attrs.insert("id", id);
+    attrs.insert("t", QString::number(QDateTime::currentDateTime().toTime_t()));
+
+    ProtocolTreeNode node("receipt");
+    node.setAttributes(attrs);
+    write(node);
+
+    receiptsSent++;
+}
+
+void WAServerSession::sendPresence()
+{
+    AttributeList attrs;
+    attrs.insert("from", contactJid());
+    attrs.insert("type", (presencesSent % 2) ? "unavailable" : "available");
+
+    ProtocolTreeNode node("presence");
+    node.setAttributes(attrs);
+    write(node);
+}
+
+void WAServerSession::sendPing()
+{
+    AttributeList attrs;
+    attrs.insert("from", SERVER_DOMAIN);
+    attrs.insert("id", makeId("ping_"));
+    attrs.insert("type", "get");
+    attrs.insert("xmlns", "urn:xmpp:ping");
+
+    ProtocolTreeNode node("iq");
+    node.setAttributes(attrs);
+    write(node);
+}
+
+void WAServerSession::write(ProtocolTreeNode &node)
+{
+    server->countOutbound(out->write(node));
+}
+
+QString WAServerSession::makeId(const QString &prefix)
+{
+    return prefix + QString::number(QDateTime::currentDateTime().toTime_t()) +
+            "-" + QString::number(nextId++);
+}
+
+QString WAServerSession::contactJid()
+{
+    int contact = qrand() % qMax(server->profile().contacts, 1);
+    return QString("1555%1@" SERVER_DOMAIN).arg(contact, 7, 10, QChar('0'));
+}
+
+void WAServerSession::close()
+{
+    if (state == Authenticated)
+        trafficTimer.stop();
+
+    disconnect(socket, 0, 0, 0);
+    socket->abort();
+    deleteLater();
+}
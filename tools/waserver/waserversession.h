@@ -0,0 +1,94 @@
+#ifndef WASERVERSESSION_H
+#define WASERVERSESSION_H
+
+#include <QObject>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QPair>
+#include <QQueue>
+
+#include "bintreenodereader.h"
+#include "bintreenodewriter.h"
+#include "keystream.h"
+
+class WAServer;
+
+/**
+    @class      WAServerSession
+
+    @brief      One client connection to the WAServer.
+
+                Goes through the stream header, the stream start and the
+                authentication, and then answers the client stanzas and plays
+                the scripted traffic.  It deletes itself when the socket is
+                closed.
+*/
+
+class WAServerSession : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit WAServerSession(QTcpSocket *socket, WAServer *server);
+
+private slots:
+    void readData();
+    void generateTraffic();
+    void close();
+
+private:
+    enum State {
+        WaitingHeader,
+        WaitingStreamStart,
+        WaitingAuth,
+        WaitingResponse,
+        Authenticated
+    };
+
+    WAServer *server;
+    QTcpSocket *socket;
+    QStringList dictionary;
+    BinTreeNodeReader *in;
+    BinTreeNodeWriter *out;
+    KeyStream *inputKey;
+    KeyStream *outputKey;
+    State state;
+
+    QString user;
+    QByteArray challenge;
+
+    // Scripted traffic
+    QTimer trafficTimer;
+    QElapsedTimer trafficClock;
+    qint64 messagesSent;
+    qint64 receiptsSent;
+    qint64 presencesSent;
+    qint64 iqsSent;
+    QQueue<QPair<QString, QString> > pendingReceipts;
+    int nextId;
+
+    void handleNode(ProtocolTreeNode &node);
+    void handleAuth(ProtocolTreeNode &node);
+    void handleResponse(ProtocolTreeNode &node);
+    void handleStanza(ProtocolTreeNode &node);
+
+    bool verifyAuthBlob(const QByteArray &blob, const QByteArray &nonce);
+    QByteArray makeChallenge();
+
+    void sendChallenge();
+    void sendSuccess();
+    void sendFailure();
+    void sendOfflineBurst();
+    void sendMessage(bool offline);
+    void sendReceipt(const QString &from, const QString &id);
+    void sendPresence();
+    void sendPing();
+    void write(ProtocolTreeNode &node);
+
+    QString makeId(const QString &prefix);
+    QString contactJid();
+};
+
+#endif // WASERVERSESSION_H